@@ -0,0 +1,380 @@
+#include "viewinterp.h"
+
+#include "common.h"
+
+#include "main/stereo_matcher.h"
+
+#include "render/render.h"
+
+#include <algorithm>
+
+struct vi_context {
+    StereoMatcher matcher;
+
+    string error;
+
+    /**
+     * Planar copies of inputs which cannot be used in place.
+     */
+    CImg<uint8_t> leftScratch, rightScratch;
+
+    CImg<float> dispLeftScratch, dispRightScratch;
+
+    /**
+     * Output of the matcher or renderer when the caller's buffer cannot
+     * be written directly.
+     */
+    CImg<float> resultScratch;
+
+    vi_context(
+            StereoAlgorithm algorithm,
+            int minDisp,
+            int maxDisp) :
+        matcher(algorithm, minDisp, maxDisp) {
+    }
+};
+
+/**
+ * Number of color channels of a format, ignoring alpha.
+ */
+static int colorChannels(
+        vi_format format) {
+    switch (format) {
+        case VI_FORMAT_GRAY8:
+        case VI_FORMAT_FLOAT32:
+            return 1;
+        default:
+            return 3;
+    }
+}
+
+static int bytesPerPixel(
+        vi_format format) {
+    switch (format) {
+        case VI_FORMAT_GRAY8:
+            return 1;
+        case VI_FORMAT_RGB8:
+        case VI_FORMAT_BGR8:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+static bool isReversed(
+        vi_format format) {
+    return format == VI_FORMAT_BGR8 || format == VI_FORMAT_BGRA8;
+}
+
+static bool hasAlpha(
+        vi_format format) {
+    return format == VI_FORMAT_RGBA8 || format == VI_FORMAT_BGRA8;
+}
+
+static int rowStride(
+        const vi_image& img) {
+    return (img.stride == 0) ? img.width * bytesPerPixel(img.format) :
+        img.stride;
+}
+
+static bool isPacked(
+        const vi_image& img) {
+    return rowStride(img) == img.width * bytesPerPixel(img.format);
+}
+
+static bool checkImage(
+        vi_context* context,
+        const vi_image* img,
+        const char* name,
+        bool isFloat) {
+    if (img == nullptr || img->data == nullptr ||
+            img->width <= 0 || img->height <= 0) {
+        context->error = string(name) + " is empty";
+        return false;
+    }
+
+    if ((img->format == VI_FORMAT_FLOAT32) != isFloat) {
+        context->error = string(name) + (isFloat ?
+                " must be VI_FORMAT_FLOAT32" : " must have 8-bit pixels");
+        return false;
+    }
+
+    if (rowStride(*img) < img->width * bytesPerPixel(img->format)) {
+        context->error = string(name) + " has a stride shorter than its rows";
+        return false;
+    }
+
+    return true;
+}
+
+static bool checkSameSize(
+        vi_context* context,
+        const vi_image* a,
+        const vi_image* b,
+        const char* name) {
+    if (a->width != b->width || a->height != b->height) {
+        context->error = string(name) + " differs in size from left";
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Returns a planar image sharing the pixels of img if it is packed
+ * grayscale, or sharing scratch after converting img into it.
+ */
+static CImg<uint8_t> bindColor(
+        const vi_image& img,
+        CImg<uint8_t>& scratch) {
+    if (img.format == VI_FORMAT_GRAY8 && isPacked(img)) {
+        return CImg<uint8_t>((const uint8_t*) img.data,
+                img.width, img.height, 1, 1, true);
+    }
+
+    int channels = colorChannels(img.format);
+    int step = bytesPerPixel(img.format);
+    int stride = rowStride(img);
+
+    scratch.assign(img.width, img.height, 1, channels);
+
+    #pragma omp parallel for
+    for (int y = 0; y < img.height; y++) {
+        const uint8_t* src = (const uint8_t*) img.data + (size_t) y * stride;
+
+        for (int c = 0; c < channels; c++) {
+            int srcC = isReversed(img.format) ? channels - 1 - c : c;
+
+            uint8_t* dst = scratch.data(0, y, 0, c);
+
+            for (int x = 0; x < img.width; x++) {
+                dst[x] = src[x * step + srcC];
+            }
+        }
+    }
+
+    return CImg<uint8_t>(scratch, true);
+}
+
+/**
+ * Same as bindColor for disparities.
+ */
+static CImg<float> bindFloat(
+        const vi_image& img,
+        CImg<float>& scratch) {
+    if (isPacked(img)) {
+        return CImg<float>((const float*) img.data,
+                img.width, img.height, 1, 1, true);
+    }
+
+    int stride = rowStride(img);
+
+    scratch.assign(img.width, img.height);
+
+    for (int y = 0; y < img.height; y++) {
+        const float* src = (const float*) ((const uint8_t*) img.data +
+                (size_t) y * stride);
+
+        copy(src, src + img.width, scratch.data(0, y));
+    }
+
+    return CImg<float>(scratch, true);
+}
+
+static void writeFloat(
+        const CImg<float>& src,
+        vi_image& img) {
+    int stride = rowStride(img);
+
+    for (int y = 0; y < img.height; y++) {
+        float* dst = (float*) ((uint8_t*) img.data + (size_t) y * stride);
+
+        copy(src.data(0, y), src.data(0, y) + img.width, dst);
+    }
+}
+
+static void writeColor(
+        const CImg<float>& src,
+        vi_image& img) {
+    int channels = colorChannels(img.format);
+    int step = bytesPerPixel(img.format);
+    int stride = rowStride(img);
+
+    #pragma omp parallel for
+    for (int y = 0; y < img.height; y++) {
+        uint8_t* dst = (uint8_t*) img.data + (size_t) y * stride;
+
+        for (int c = 0; c < channels; c++) {
+            int dstC = isReversed(img.format) ? channels - 1 - c : c;
+
+            const float* row = src.data(0, y, 0, c);
+
+            for (int x = 0; x < img.width; x++) {
+                dst[x * step + dstC] =
+                    (uint8_t) min(max(row[x] + 0.5f, 0.0f), 255.0f);
+            }
+        }
+
+        if (hasAlpha(img.format)) {
+            for (int x = 0; x < img.width; x++) {
+                dst[x * step + 3] = 255;
+            }
+        }
+    }
+}
+
+vi_context* vi_create(
+        const char* algorithm,
+        int minDisp,
+        int maxDisp) {
+    StereoAlgorithm parsed;
+
+    if (algorithm == nullptr || !parseStereoAlgorithm(algorithm, parsed) ||
+            minDisp > maxDisp) {
+        return nullptr;
+    }
+
+    try {
+        return new vi_context(parsed, minDisp, maxDisp);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void vi_destroy(
+        vi_context* context) {
+    delete context;
+}
+
+vi_status vi_compute_disparity(
+        vi_context* context,
+        const vi_image* left,
+        const vi_image* right,
+        vi_image* disp) {
+    if (context == nullptr) {
+        return VI_ERROR_ARGUMENT;
+    }
+
+    context->error.clear();
+
+    if (!checkImage(context, left, "left", false) ||
+            !checkImage(context, right, "right", false) ||
+            !checkImage(context, disp, "disp", true) ||
+            !checkSameSize(context, left, right, "right") ||
+            !checkSameSize(context, left, disp, "disp")) {
+        return VI_ERROR_ARGUMENT;
+    }
+
+    if (colorChannels(left->format) != colorChannels(right->format)) {
+        context->error = "left and right have different channels";
+        return VI_ERROR_ARGUMENT;
+    }
+
+    try {
+        CImg<uint8_t> leftImg = bindColor(*left, context->leftScratch);
+        CImg<uint8_t> rightImg = bindColor(*right, context->rightScratch);
+
+        // The matcher writes straight into packed outputs
+        CImg<float> out;
+
+        if (isPacked(*disp)) {
+            out.assign((float*) disp->data, disp->width, disp->height, 1, 1,
+                    true);
+        } else {
+            context->resultScratch.assign(disp->width, disp->height);
+
+            out.assign(context->resultScratch, true);
+        }
+
+        if (!context->matcher.compute(leftImg, rightImg, out,
+                    context->error)) {
+            return VI_ERROR_MATCH;
+        }
+
+        if (out.data() != disp->data) {
+            writeFloat(out, *disp);
+        }
+    } catch (const exception& e) {
+        // No exception may unwind into a C caller
+        context->error = e.what();
+        return VI_ERROR_INTERNAL;
+    } catch (...) {
+        context->error = "unknown exception";
+        return VI_ERROR_INTERNAL;
+    }
+
+    return VI_OK;
+}
+
+vi_status vi_render(
+        vi_context* context,
+        const vi_image* left,
+        const vi_image* right,
+        const vi_image* dispLeft,
+        const vi_image* dispRight,
+        float t,
+        vi_image* result) {
+    if (context == nullptr) {
+        return VI_ERROR_ARGUMENT;
+    }
+
+    context->error.clear();
+
+    if (!checkImage(context, left, "left", false) ||
+            !checkImage(context, right, "right", false) ||
+            !checkImage(context, dispLeft, "dispLeft", true) ||
+            (dispRight != nullptr &&
+             !checkImage(context, dispRight, "dispRight", true)) ||
+            !checkImage(context, result, "result", false) ||
+            !checkSameSize(context, left, right, "right") ||
+            !checkSameSize(context, left, dispLeft, "dispLeft") ||
+            (dispRight != nullptr &&
+             !checkSameSize(context, left, dispRight, "dispRight")) ||
+            !checkSameSize(context, left, result, "result")) {
+        return VI_ERROR_ARGUMENT;
+    }
+
+    int channels = colorChannels(left->format);
+
+    if (colorChannels(right->format) != channels ||
+            colorChannels(result->format) != channels) {
+        context->error = "left, right and result have different channels";
+        return VI_ERROR_ARGUMENT;
+    }
+
+    try {
+        CImg<uint8_t> leftImg = bindColor(*left, context->leftScratch);
+        CImg<uint8_t> rightImg = bindColor(*right, context->rightScratch);
+
+        CImg<float> dispLeftImg = bindFloat(*dispLeft,
+                context->dispLeftScratch);
+
+        CImg<float> dispRightImg;
+
+        if (dispRight != nullptr) {
+            dispRightImg.assign(bindFloat(*dispRight,
+                        context->dispRightScratch), true);
+        }
+
+        DenseWarpRenderer<uint8_t> renderer(&leftImg, &rightImg,
+                &dispLeftImg, &dispRightImg);
+
+        renderer.render(t, context->resultScratch);
+
+        writeColor(context->resultScratch, *result);
+    } catch (const exception& e) {
+        // No exception may unwind into a C caller
+        context->error = e.what();
+        return VI_ERROR_INTERNAL;
+    } catch (...) {
+        context->error = "unknown exception";
+        return VI_ERROR_INTERNAL;
+    }
+
+    return VI_OK;
+}
+
+const char* vi_last_error(
+        const vi_context* context) {
+    return (context == nullptr) ? "no context" : context->error.c_str();
+}
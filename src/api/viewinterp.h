@@ -0,0 +1,119 @@
+#pragma once
+
+/**
+ * C interface to the stereo matchers and the dense view renderer, for
+ * linking libviewinterp.so into other programs.
+ *
+ * Pixels are exchanged through caller-owned buffers described by a
+ * vi_image; the library never takes ownership of them and does not keep
+ * pointers to them after a call returns.  Grayscale inputs and float
+ * outputs whose rows are packed are used in place.  Other layouts are
+ * converted through scratch buffers owned by the context, which are only
+ * reallocated when the image size changes.
+ *
+ * A context keeps the state of its matcher (rectification maps, particle
+ * stores...) from one call to the next, so it should be reused for a
+ * stream of pairs of the same size.  A context must not be used by several
+ * threads at once; create one per thread instead.
+ *
+ * No C++ exception escapes these functions; failures are reported as
+ * VI_ERROR_INTERNAL with a message from vi_last_error().  CImg's global
+ * exception mode is left as the host program set it, so CImg may also
+ * print its errors on stderr.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    VI_FORMAT_GRAY8,
+    VI_FORMAT_RGB8,
+    VI_FORMAT_BGR8,
+    VI_FORMAT_RGBA8,
+    VI_FORMAT_BGRA8,
+
+    /**
+     * One float per pixel.  Only valid for disparities.
+     */
+    VI_FORMAT_FLOAT32
+} vi_format;
+
+typedef struct {
+    void* data;
+
+    int width;
+
+    int height;
+
+    /**
+     * Distance in bytes between the starts of consecutive rows.  0 means
+     * the rows are packed.
+     */
+    int stride;
+
+    vi_format format;
+} vi_image;
+
+typedef enum {
+    VI_OK = 0,
+    VI_ERROR_ARGUMENT = -1,
+    VI_ERROR_MATCH = -2,
+    VI_ERROR_INTERNAL = -3
+} vi_status;
+
+typedef struct vi_context vi_context;
+
+/**
+ * Creates a context which matches with algorithm ("cvstereo",
+ * "patchmatch", "dp" or "polar") over disparities [minDisp, maxDisp].
+ * Returns NULL if the algorithm is unknown, the range is empty or memory
+ * runs out.
+ */
+vi_context* vi_create(
+        const char* algorithm,
+        int minDisp,
+        int maxDisp);
+
+void vi_destroy(
+        vi_context* context);
+
+/**
+ * Matches a pair of 8-bit images of the same size into disp, which must be
+ * VI_FORMAT_FLOAT32 and of the same size.  Disparities follow the
+ * convention of vi_render: left pixel x matches right pixel x - disp(x).
+ * Pixels without a match are set to FLT_MAX.
+ */
+vi_status vi_compute_disparity(
+        vi_context* context,
+        const vi_image* left,
+        const vi_image* right,
+        vi_image* disp);
+
+/**
+ * Renders the view at t in [0, 1] between a rectified pair, t = 0 being
+ * the left view, by forward-warping with dense disparities.  dispRight may
+ * be NULL to warp the left view only.  result must have the size of the
+ * inputs and as many color channels; alpha, if any, is set to opaque.
+ */
+vi_status vi_render(
+        vi_context* context,
+        const vi_image* left,
+        const vi_image* right,
+        const vi_image* dispLeft,
+        const vi_image* dispRight,
+        float t,
+        vi_image* result);
+
+/**
+ * Describes the last error of the context, or returns an empty string.
+ * The string stays valid until the next call with the context.
+ */
+const char* vi_last_error(
+        const vi_context* context);
+
+#ifdef __cplusplus
+}
+#endif
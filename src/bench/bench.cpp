@@ -0,0 +1,209 @@
+#include "bench.h"
+
+#include <chrono>
+#include <random>
+
+double timeCalls(
+        function<void()> fn,
+        double minMs,
+        int& iterations) {
+    fn();
+
+    auto start = chrono::steady_clock::now();
+
+    double elapsedMs = 0.0;
+
+    iterations = 0;
+
+    do {
+        fn();
+
+        iterations++;
+
+        elapsedMs = chrono::duration<double, milli>(
+                chrono::steady_clock::now() - start).count();
+    } while (elapsedMs < minMs);
+
+    return elapsedMs * 1e6 / iterations;
+}
+
+void printMicroResult(
+        const string& name,
+        const string& params,
+        int iterations,
+        double nsPerCall,
+        double itemsPerCall) {
+    printf("{\"bench\":\"micro\",\"name\":\"%s\",%s,\"iterations\":%d"
+            ",\"ns_per_call\":%.1f,\"ns_per_item\":%.3f}\n",
+            name.c_str(), params.c_str(), iterations, nsPerCall,
+            nsPerCall / itemsPerCall);
+    fflush(stdout);
+}
+
+/**
+ * Blurred random colors, so that matching windows are distinctive but
+ * resampling is still meaningful.
+ */
+static void makeTexture(
+        int width,
+        int height,
+        mt19937& rng,
+        CImg<float>& texture) {
+    uniform_real_distribution<float> value(0.0f, 255.0f);
+
+    texture.assign(width, height, 1, 3);
+
+    cimg_for(texture, v, float) {
+        *v = value(rng);
+    }
+
+    texture.blur(1.0f);
+    texture.normalize(0.0f, 255.0f);
+}
+
+void makeRandomDotPair(
+        int width,
+        int height,
+        int minDisp,
+        int maxDisp,
+        unsigned int seed,
+        BenchPair& pair) {
+    assert(maxDisp - minDisp > 4);
+
+    mt19937 rng(seed);
+
+    CImg<float> background, foreground;
+
+    makeTexture(width, height, rng, background);
+    makeTexture(width, height, rng, foreground);
+
+    // Background disparity is a + b * x
+    float a = minDisp;
+    float b = ((minDisp + maxDisp) / 2 - minDisp) / (float) width;
+
+    int squareDisp = maxDisp - 2;
+
+    int x0 = width * 35 / 100;
+    int x1 = width * 65 / 100;
+    int y0 = height * 30 / 100;
+    int y1 = height * 70 / 100;
+
+    pair.name = "synthetic_" + to_string(width) + "x" + to_string(height);
+    pair.minDisp = minDisp;
+    pair.maxDisp = maxDisp;
+
+    pair.left.assign(width, height, 1, 3);
+    pair.right.assign(width, height, 1, 3);
+    pair.disp.assign(width, height);
+
+    const float unknown = numeric_limits<float>::infinity();
+
+    for (int y = 0; y < height; y++) {
+        bool squareRow = y >= y0 && y < y1;
+
+        for (int x = 0; x < width; x++) {
+            bool inSquare = squareRow && x >= x0 && x < x1;
+
+            cimg_forC(pair.left, c) {
+                pair.left(x, y, 0, c) = (uint8_t) (inSquare ?
+                        foreground(x, y, 0, c) : background(x, y, 0, c));
+            }
+
+            float d = inSquare ? squareDisp : a + b * x;
+
+            // Background behind the square in the right view is occluded
+            float xr = x - d;
+
+            bool occluded = !inSquare && squareRow &&
+                xr + squareDisp >= x0 && xr + squareDisp < x1;
+
+            pair.disp(x, y) = (xr < 0.0f || occluded) ? unknown : d;
+
+            // The right pixel x sees the square, or the background point
+            // xl with xl - (a + b * xl) = x
+            int xs = x + squareDisp;
+
+            if (squareRow && xs >= x0 && xs < x1) {
+                cimg_forC(pair.right, c) {
+                    pair.right(x, y, 0, c) = (uint8_t) foreground(xs, y, 0, c);
+                }
+            } else {
+                float xl = (x + a) / (1.0f - b);
+
+                cimg_forC(pair.right, c) {
+                    pair.right(x, y, 0, c) = (uint8_t) (0.5f +
+                            background.linear_atXY(xl, y, 0, c));
+                }
+            }
+        }
+    }
+}
+
+double badPixelPercent(
+        const CImg<float>& disp,
+        const CImg<float>& groundTruth,
+        float threshold) {
+    long numKnown = 0;
+    long numBad = 0;
+
+    cimg_forXY(groundTruth, x, y) {
+        float gt = groundTruth(x, y);
+
+        if (!std::isfinite(gt)) {
+            continue;
+        }
+
+        numKnown++;
+
+        float d = disp(x, y);
+
+        if (d == numeric_limits<float>::max() || !std::isfinite(d) ||
+                fabs(d - gt) > threshold) {
+            numBad++;
+        }
+    }
+
+    return (numKnown > 0) ? 100.0 * numBad / numKnown : 0.0;
+}
+
+static void printUsage(
+        const char* program) {
+    fprintf(stderr,
+            "Usage: %s [micro|macro|all [SAMPLES_DIR [MIN_MS]]]\n"
+            "\n"
+            "Prints one JSON line per result.  Macro benchmarks run on the\n"
+            "pairs in SAMPLES_DIR (default samples): NAME0.EXT and NAME1.EXT\n"
+            "files with optional NAMEdisp0.pfm ground truth, and Middlebury\n"
+            "2014 directories (im0.png, im1.png, disp0GT.pfm).  Synthetic\n"
+            "pairs are used if there are none.  Each measurement repeats\n"
+            "for at least MIN_MS (default 200) milliseconds.  Exits with 1\n"
+            "if a check made by a micro benchmark fails.\n",
+            program);
+}
+
+int main(
+        int argc,
+        char** argv) {
+    string which = (argc > 1) ? argv[1] : "all";
+    string samplesDir = (argc > 2) ? argv[2] : "samples";
+    double minMs = (argc > 3) ? atof(argv[3]) : 200.0;
+
+    if (which != "micro" && which != "macro" && which != "all") {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    cimg::exception_mode(0);
+
+    bool ok = true;
+
+    if (which != "macro") {
+        ok = runMicroBenchmarks(minMs);
+    }
+
+    if (which != "micro") {
+        runMacroBenchmarks(samplesDir, minMs);
+    }
+
+    return ok ? 0 : 1;
+}
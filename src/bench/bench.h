@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+/**
+ * A rectified pair with known disparities, following the convention of
+ * StereoMatcher: left pixel x matches right pixel x - disp(x).  Pixels
+ * whose disparity is unknown, such as occlusions, are infinite in disp.
+ */
+struct BenchPair {
+    string name;
+
+    CImg<uint8_t> left, right;
+
+    CImg<float> disp;
+
+    int minDisp;
+
+    int maxDisp;
+};
+
+/**
+ * Calls fn once to warm up, then repeatedly until at least minMs have
+ * passed.  Returns the mean wall time of a call in nanoseconds, and the
+ * number of timed calls in iterations.
+ */
+double timeCalls(
+        function<void()> fn,
+        double minMs,
+        int& iterations);
+
+/**
+ * Prints the result of a micro-benchmark as one line of JSON.  params is
+ * a JSON object body (without braces) describing the input size.
+ */
+void printMicroResult(
+        const string& name,
+        const string& params,
+        int iterations,
+        double nsPerCall,
+        double itemsPerCall);
+
+/**
+ * Builds a random-dot pair: a slanted background plane with disparities
+ * in [minDisp, (minDisp + maxDisp) / 2] and a fronto-parallel square in
+ * front of it at maxDisp - 2.  Both are textured with blurred random
+ * colors, resampled linearly into the right view.  The same seed always
+ * gives the same pair.
+ */
+void makeRandomDotPair(
+        int width,
+        int height,
+        int minDisp,
+        int maxDisp,
+        unsigned int seed,
+        BenchPair& pair);
+
+/**
+ * Percentage of pixels with a known disparity whose estimate is invalid
+ * or off by more than threshold.
+ */
+double badPixelPercent(
+        const CImg<float>& disp,
+        const CImg<float>& groundTruth,
+        float threshold);
+
+/**
+ * Returns false if a benchmark's correctness check failed.
+ */
+bool runMicroBenchmarks(
+        double minMs);
+
+/**
+ * Runs every algorithm on the pairs found in samplesDir, or on synthetic
+ * pairs if there are none.
+ */
+void runMacroBenchmarks(
+        const string& samplesDir,
+        double minMs);
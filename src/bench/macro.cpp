@@ -0,0 +1,305 @@
+#include "bench.h"
+
+#include "main/batch.h"
+#include "main/stereo_matcher.h"
+
+#include "old/adaptbp.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <dirent.h>
+
+static bool fileExists(
+        const string& path) {
+    return ifstream(path).good();
+}
+
+/**
+ * Reads ndisp from a Middlebury calib.txt, or returns defaultValue.
+ */
+static int readNumDisparities(
+        const string& path,
+        int defaultValue) {
+    ifstream calib(path);
+
+    string line;
+
+    while (getline(calib, line)) {
+        if (line.compare(0, 6, "ndisp=") == 0) {
+            return atoi(line.c_str() + 6);
+        }
+    }
+
+    return defaultValue;
+}
+
+/**
+ * Lists the entries of dir which do not start with a dot, sorted.
+ */
+static void listDirectory(
+        const string& dirPath,
+        vector<string>& names) {
+    DIR* dir = opendir(dirPath.c_str());
+
+    if (dir == nullptr) {
+        return;
+    }
+
+    while (dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+
+        if (name[0] != '.') {
+            names.push_back(name);
+        }
+    }
+
+    closedir(dir);
+
+    sort(names.begin(), names.end());
+}
+
+/**
+ * The largest known disparity of a ground truth map, rounded up, or
+ * defaultValue if it has none.
+ */
+static int groundTruthMaxDisparity(
+        const CImg<float>& disp,
+        int defaultValue) {
+    float maxD = -1.0f;
+
+    cimg_for(disp, d, float) {
+        if (std::isfinite(*d)) {
+            maxD = max(maxD, *d);
+        }
+    }
+
+    return (maxD >= 0) ? (int) ceil(maxD) : defaultValue;
+}
+
+/**
+ * Loads the pairs stored flat in samplesDir as NAME0.EXT and NAME1.EXT,
+ * the layout of the pairs listed by the test script (books, art, cones...),
+ * with EXT one of png, ppm or jpg.  NAMEdisp0.pfm, if present, is the
+ * ground truth of the left view, with unknown pixels set to inf.
+ */
+static void loadFlatPairs(
+        const string& samplesDir,
+        const vector<string>& names,
+        vector<BenchPair>& pairs) {
+    const int defaultMaxDisp = 64;
+
+    const char* extensions[] = {".png", ".ppm", ".jpg"};
+
+    for (const string& file : names) {
+        for (const char* ext : extensions) {
+            size_t extLen = strlen(ext);
+
+            if (file.size() <= extLen + 1 ||
+                    file.compare(file.size() - extLen, extLen, ext) != 0 ||
+                    file[file.size() - extLen - 1] != '0') {
+                continue;
+            }
+
+            string name = file.substr(0, file.size() - extLen - 1);
+
+            string base = samplesDir + "/" + name;
+
+            if (!fileExists(base + "1" + ext)) {
+                continue;
+            }
+
+            BenchPair pair;
+
+            pair.name = name;
+            pair.minDisp = 0;
+            pair.maxDisp = defaultMaxDisp;
+
+            try {
+                pair.left.load((base + "0" + ext).c_str());
+                pair.right.load((base + "1" + ext).c_str());
+
+                if (fileExists(base + "disp0.pfm")) {
+                    pair.disp.load_pfm((base + "disp0.pfm").c_str());
+
+                    pair.maxDisp = groundTruthMaxDisparity(pair.disp,
+                            defaultMaxDisp);
+                }
+            } catch (const CImgException& e) {
+                fprintf(stderr, "Skipping %s: %s\n", name.c_str(), e.what());
+                continue;
+            }
+
+            pairs.push_back(pair);
+        }
+    }
+}
+
+/**
+ * Loads each subdirectory of samplesDir laid out like the Middlebury 2014
+ * pairs: im0.png, im1.png, and optionally disp0GT.pfm or disp0.pfm and
+ * calib.txt.
+ */
+static void loadMiddlebury2014Pairs(
+        const string& samplesDir,
+        const vector<string>& names,
+        vector<BenchPair>& pairs) {
+    for (const string& name : names) {
+        string base = samplesDir + "/" + name + "/";
+
+        if (!fileExists(base + "im0.png") || !fileExists(base + "im1.png")) {
+            continue;
+        }
+
+        BenchPair pair;
+
+        pair.name = name;
+        pair.minDisp = 0;
+        pair.maxDisp = readNumDisparities(base + "calib.txt", 64) - 1;
+
+        try {
+            pair.left.load_png((base + "im0.png").c_str());
+            pair.right.load_png((base + "im1.png").c_str());
+
+            if (fileExists(base + "disp0GT.pfm")) {
+                pair.disp.load_pfm((base + "disp0GT.pfm").c_str());
+            } else if (fileExists(base + "disp0.pfm")) {
+                pair.disp.load_pfm((base + "disp0.pfm").c_str());
+            }
+        } catch (const CImgException& e) {
+            fprintf(stderr, "Skipping %s: %s\n", name.c_str(), e.what());
+            continue;
+        }
+
+        pairs.push_back(pair);
+    }
+}
+
+static void loadSamplePairs(
+        const string& samplesDir,
+        vector<BenchPair>& pairs) {
+    vector<string> names;
+
+    listDirectory(samplesDir, names);
+
+    loadFlatPairs(samplesDir, names, pairs);
+
+    loadMiddlebury2014Pairs(samplesDir, names, pairs);
+}
+
+/**
+ * Prints the result of one algorithm on one pair as a line of JSON.
+ */
+static void printMacroResult(
+        const BenchPair& pair,
+        const char* algorithm,
+        int iterations,
+        bool ok,
+        const string& error,
+        double ns,
+        const CImg<float>& disp,
+        float threshold) {
+    printf("{\"bench\":\"macro\",\"pair\":\"%s\",\"algorithm\":\"%s\""
+            ",\"width\":%d,\"height\":%d,\"iterations\":%d",
+            escapeJson(pair.name).c_str(), algorithm,
+            pair.left.width(), pair.left.height(), iterations);
+
+    if (!ok) {
+        printf(",\"ok\":false,\"error\":\"%s\"}\n",
+                escapeJson(error).c_str());
+        fflush(stdout);
+        return;
+    }
+
+    printf(",\"ok\":true,\"wall_ms\":%.3f", ns * 1e-6);
+
+    if (pair.disp.is_sameXY(disp)) {
+        printf(",\"bad_pixel_pct\":%.3f,\"bad_threshold\":%.1f",
+                badPixelPercent(disp, pair.disp, threshold),
+                threshold);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * Runs AdaptBPStereo, which keeps no state between pairs, from scratch on
+ * every call.
+ */
+static void benchAdaptBP(
+        const BenchPair& pair,
+        double minMs,
+        float threshold) {
+    CImg<int16_t> left(pair.left);
+    CImg<int16_t> right(pair.right);
+
+    CImg<float> disp;
+
+    int iterations;
+
+    double ns = timeCalls([&]() {
+        // AdaptBP maps x to x + disp
+        AdaptBPStereo stereo(left, right, -pair.maxDisp, -pair.minDisp);
+
+        stereo.computeStereo();
+        stereo.getDisparity(disp);
+    }, minMs, iterations);
+
+    disp *= -1.0f;
+
+    printMacroResult(pair, "adaptbp", iterations, true, "", ns, disp,
+            threshold);
+}
+
+void runMacroBenchmarks(
+        const string& samplesDir,
+        double minMs) {
+    const float threshold = 1.0f;
+
+    vector<BenchPair> pairs;
+
+    loadSamplePairs(samplesDir, pairs);
+
+    if (pairs.empty()) {
+        fprintf(stderr, "No pairs in %s, using synthetic pairs\n",
+                samplesDir.c_str());
+
+        pairs.resize(2);
+
+        makeRandomDotPair(320, 240, 0, 32, 1, pairs[0]);
+        makeRandomDotPair(640, 480, 0, 64, 2, pairs[1]);
+    }
+
+    // Polar disparities are radial and cannot be compared with rectified
+    // ground truth, so only the rectified algorithms are measured
+    const StereoAlgorithm algorithms[] = {
+        StereoAlgorithm::CVSTEREO,
+        StereoAlgorithm::PATCHMATCH,
+        StereoAlgorithm::DP
+    };
+
+    for (const BenchPair& pair : pairs) {
+        for (StereoAlgorithm algorithm : algorithms) {
+            StereoMatcher matcher(algorithm, pair.minDisp, pair.maxDisp);
+
+            CImg<float> disp;
+
+            string error;
+
+            bool ok = true;
+
+            int iterations;
+
+            double ns = timeCalls([&]() {
+                ok = ok && matcher.compute(pair.left, pair.right, disp, error);
+            }, minMs, iterations);
+
+            printMacroResult(pair, stereoAlgorithmName(algorithm),
+                    iterations, ok, error, ns, disp, threshold);
+        }
+
+        benchAdaptBP(pair, minMs, threshold);
+    }
+}
@@ -0,0 +1,646 @@
+#include "bench.h"
+
+#include "cvutil/cvutil.h"
+
+#include "old/dpstereo.h"
+#include "old/polar_stereo.h"
+
+#include "pmstereo/pmstereo.h"
+
+#include "QPBO.h"
+
+#include <array>
+#include <random>
+
+/**
+ * Keeps results alive so the compiler cannot drop benchmarked work.
+ */
+static volatile float sink;
+
+static string sizeParams(
+        int width,
+        int height) {
+    return "\"width\":" + to_string(width) + ",\"height\":" + to_string(height);
+}
+
+static void toLab(
+        const CImg<uint8_t>& img,
+        CImg<float>& lab) {
+    lab = img;
+    lab.RGBtoLab();
+}
+
+/**
+ * Pixels sampled by the patch distance benchmarks, away from the borders
+ * so that every window is evaluated in full.
+ */
+static void samplePositions(
+        int width,
+        int height,
+        int margin,
+        int count,
+        vector<array<int, 2>>& positions) {
+    mt19937 rng(1);
+
+    uniform_int_distribution<int> xDist(margin, width - 1 - margin);
+    uniform_int_distribution<int> yDist(margin, height - 1 - margin);
+
+    positions.resize(count);
+
+    for (auto& p : positions) {
+        p[0] = xDist(rng);
+        p[1] = yDist(rng);
+    }
+}
+
+static void benchPatchDistances(
+        const BenchPair& pair,
+        double minMs) {
+    const int wndSize = 7;
+    const int numPositions = 1024;
+
+    CImg<float> lab1, lab2;
+
+    toLab(pair.left, lab1);
+    toLab(pair.right, lab2);
+
+    CImg<float> grad1 = lab1.get_gradient("x")[0];
+    CImg<float> grad2 = lab2.get_gradient("x")[0];
+
+    vector<array<int, 2>> positions;
+
+    samplePositions(lab1.width(), lab1.height(), pair.maxDisp + wndSize,
+            numPositions, positions);
+
+    string params = sizeParams(lab1.width(), lab1.height()) +
+        ",\"wnd_size\":" + to_string(wndSize);
+
+    int iterations;
+
+    auto translational = translationalPatchDist(lab1, lab2, grad1, grad2,
+            wndSize);
+
+    double ns = timeCalls([&]() {
+        float total = 0.0f;
+
+        for (const auto& p : positions) {
+            float value[1] = { (float) -((p[0] + p[1]) % pair.maxDisp) };
+
+            total += translational(p[0], p[1], value);
+        }
+
+        sink = total;
+    }, minMs, iterations);
+
+    printMicroResult("translationalPatchDist", params, iterations, ns,
+            numPositions);
+
+    auto affine = affinePatchDist(lab1, lab2, wndSize);
+
+    ns = timeCalls([&]() {
+        float total = 0.0f;
+
+        for (const auto& p : positions) {
+            float value[3] = {
+                (float) -((p[0] + p[1]) % pair.maxDisp), 0.01f, -0.01f };
+
+            total += affine(p[0], p[1], value);
+        }
+
+        sink = total;
+    }, minMs, iterations);
+
+    printMicroResult("affinePatchDist", params, iterations, ns,
+            numPositions);
+}
+
+/**
+ * One iteration of translational PatchMatch over both views.
+ */
+static void benchPatchMatch(
+        const BenchPair& pair,
+        double minMs) {
+    const int numParticles = 2;
+    const int wndSize = 7;
+
+    CImg<float> lab1, lab2;
+
+    toLab(pair.left, lab1);
+    toLab(pair.right, lab2);
+
+    CImg<float> grad1 = lab1.get_gradient("x")[0];
+    CImg<float> grad2 = lab2.get_gradient("x")[0];
+
+    int width = lab1.width();
+    int height = lab1.height();
+
+    CImg<float> fieldLeft(width, height, numParticles, 1);
+    CImg<float> fieldRight(width, height, numParticles, 1);
+    CImg<float> distLeft(width, height, numParticles, 1);
+    CImg<float> distRight(width, height, numParticles, 1);
+    CImg<int> sortedLeft(width, height, numParticles, 1);
+    CImg<int> sortedRight(width, height, numParticles, 1);
+
+    int iterations;
+
+    double ns = timeCalls([&]() {
+        fieldLeft.rand(-pair.maxDisp, -pair.minDisp);
+        fieldRight.rand(pair.minDisp, pair.maxDisp);
+
+        distLeft = numeric_limits<float>::infinity();
+        distRight = numeric_limits<float>::infinity();
+
+        cimg_forXYZ(sortedLeft, x, y, z) {
+            sortedLeft(x, y, z) = z;
+            sortedRight(x, y, z) = z;
+        }
+
+        patchMatchTranslationalCorrespondence(lab1, lab2, grad1, grad2,
+                fieldLeft, fieldRight, distLeft, distRight,
+                sortedLeft, sortedRight, wndSize, 1, 1.0f, 1);
+    }, minMs, iterations);
+
+    printMicroResult("patchMatch",
+            sizeParams(width, height) +
+            ",\"particles\":" + to_string(numParticles) +
+            ",\"wnd_size\":" + to_string(wndSize),
+            iterations, ns, 2.0 * width * height);
+}
+
+/**
+ * Isolates the K-best insertion of patchMatch(): candidates and their
+ * costs are precomputed, so the sweep only sorts particles.
+ */
+static void benchKBestInsertion(
+        double minMs) {
+    const int width = 128;
+    const int height = 128;
+    const int numCandidates = 8;
+
+    vector<float> costs(width * height * numCandidates);
+
+    mt19937 rng(2);
+
+    uniform_real_distribution<float> costDist(0.0f, 1.0f);
+
+    for (float& c : costs) {
+        c = costDist(rng);
+    }
+
+    auto candidate = [&](int x, int y, int pNum, float value[]) -> bool {
+        if (pNum >= numCandidates) {
+            return false;
+        }
+
+        value[0] = (float) pNum;
+
+        return true;
+    };
+
+    auto cost = [&](int x, int y, float value[]) -> float {
+        return costs[(y * width + x) * numCandidates + (int) value[0]];
+    };
+
+    for (int K : { 1, 2, 4, 8 }) {
+        CImg<float> field(width, height, K, 1);
+        CImg<float> totCost(width, height, K, 1);
+        CImg<int> sorted(width, height, K, 1);
+
+        int iterations;
+
+        double ns = timeCalls([&]() {
+            field = 0.0f;
+            totCost = numeric_limits<float>::infinity();
+
+            cimg_forXYZ(sorted, x, y, z) {
+                sorted(x, y, z) = z;
+            }
+
+            patchMatch(field, totCost, sorted, candidate, cost, false);
+        }, minMs, iterations);
+
+        printMicroResult("kBestInsertion",
+                sizeParams(width, height) +
+                ",\"particles\":" + to_string(K) +
+                ",\"candidates\":" + to_string(numCandidates),
+                iterations, ns, (double) width * height * numCandidates);
+    }
+}
+
+static void benchConvertCImgToMat(
+        const BenchPair& pair,
+        double minMs) {
+    CImg<float> img = pair.left;
+
+    cv::Mat mat;
+
+    int iterations;
+
+    double ns = timeCalls([&]() {
+        convertCImgToMat(img, mat);
+    }, minMs, iterations);
+
+    printMicroResult("convertCImgToMat",
+            sizeParams(img.width(), img.height()),
+            iterations, ns, (double) img.width() * img.height());
+}
+
+/**
+ * Rectifies a forward-moving camera, whose epipoles lie inside the
+ * images.
+ */
+static void benchRectificationTransform(
+        double minMs) {
+    const int width = 320;
+    const int height = 240;
+
+    Eigen::Matrix3d K;
+
+    K << 300, 0, width / 2.0,
+      0, 300, height / 2.0,
+      0, 0, 1;
+
+    Eigen::Vector3d t(1.0, 0.2, 0.3);
+
+    Eigen::Matrix3d tCross;
+
+    tCross << 0, -t.z(), t.y(),
+           t.z(), 0, -t.x(),
+           -t.y(), t.x(), 0;
+
+    Eigen::Matrix3d F = K.inverse().transpose() * tCross * K.inverse();
+
+    Eigen::Vector3d point(0.2, 0.1, 5.0);
+
+    array<Eigen::Vector2d, 2> match = {{
+        (K * point).hnormalized(),
+        (K * (point + t)).hnormalized()
+    }};
+
+    PolarFundamentalMatrix polarF;
+    PolarRectification rectification;
+
+    if (!polarF.init(F, match) ||
+            !rectification.init(width, height, polarF)) {
+        fprintf(stderr, "evaluateRectificationTransform: "
+                "rectification failed\n");
+        return;
+    }
+
+    int numRows;
+    int maximumWidth;
+    double disparityFactor;
+    double disparityOffset;
+
+    rectification.maximalRectificationRange(numeric_limits<int>::max(), 0,
+            numRows, maximumWidth, disparityFactor, disparityOffset);
+
+    long numSamples = 0;
+
+    int iterations;
+
+    double ns = timeCalls([&]() {
+        double total = 0.0;
+
+        numSamples = 0;
+
+        rectification.evaluateRectificationTransform(0, 0, numRows,
+                [&](const Eigen::Vector2i&, const Eigen::Vector2d&,
+                    const Eigen::Vector2d& range) {
+            total += range.x();
+            numSamples++;
+        });
+
+        sink = total;
+    }, minMs, iterations);
+
+    printMicroResult("evaluateRectificationTransform",
+            sizeParams(width, height) + ",\"rows\":" + to_string(numRows),
+            iterations, ns, numSamples);
+}
+
+static void benchDPStereoRows(
+        const BenchPair& pair,
+        double minMs) {
+    const int numRows = 16;
+
+    CImg<int16_t> left = pair.left.get_rows(0, numRows - 1);
+    CImg<int16_t> right = pair.right.get_rows(0, numRows - 1);
+
+    DPStereo dp(nullptr, 1, 100.0f, 100.0f);
+
+    // Built once, so that only the DP rows are timed and not the Lab
+    // conversion done by the constructor
+    StereoProblem problem(left, right, -pair.maxDisp, -pair.minDisp);
+
+    int iterations;
+
+    double ns = timeCalls([&]() {
+        problem.disp.assign();
+
+        dp.computeStereoFast(problem);
+    }, minMs, iterations);
+
+    printMicroResult("DPStereo.computeStereoFast",
+            sizeParams(left.width(), numRows) +
+            ",\"disparities\":" + to_string(pair.maxDisp - pair.minDisp + 1),
+            iterations, ns, numRows);
+}
+
+/**
+ * Smooths the same segment-plane labeling with moves applied one at a
+ * time and in parallel batches, starting from planes fitted to the ground
+ * truth and then copied onto random neighbors.  Returns false unless both
+ * schedules reach energies within a relative tolerance of each other.
+ */
+static bool benchPlanarSmoothing(
+        const BenchPair& pair,
+        double minMs) {
+    const int numSegments = 300;
+    const float perturbedFraction = 0.3f;
+    const double tolerance = 0.02;
+
+    int width = pair.left.width();
+    int height = pair.left.height();
+
+    // StereoProblem maps x to x + disp
+    StereoProblem problem(pair.left, pair.right, -pair.maxDisp,
+            -pair.minDisp);
+
+    problem.disp.assign(width, height);
+
+    cimg_forXY(problem.disp, x, y) {
+        float d = pair.disp(x, y);
+
+        problem.disp(x, y) = std::isfinite(d) ? -d :
+            numeric_limits<float>::max();
+    }
+
+    CImg<float> lab;
+
+    toLab(pair.left, lab);
+
+    Segmentation segmentation;
+
+    segmentation.createSlicSuperpixels(lab, numSegments, 10);
+
+    Connectivity connectivity;
+
+    segmentation.getConnectivity(connectivity);
+
+    PlanarDepth depth(&problem, &segmentation);
+
+    depth.fitPlanesMedian();
+
+    PlanarDepthSmoothingProblem smoothing(&depth, &problem, &segmentation,
+            &connectivity);
+
+    smoothing.computeInlierStats();
+
+    vector<planeH_t> initial = depth.getSegmentPlaneMap();
+
+    mt19937 rng(1);
+
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    vector<segmentH_t> neighbors;
+
+    for (segmentH_t segI = 0; segI < segmentation.size(); segI++) {
+        neighbors.clear();
+
+        connectivity.forEachNeighbor(segI,
+                [&](segmentH_t nI, int conn) {
+                    neighbors.push_back(nI);
+                });
+
+        if (!neighbors.empty() && uniform(rng) < perturbedFraction) {
+            initial[segI] = initial[neighbors[rng() % neighbors.size()]];
+        }
+    }
+
+    double energies[2];
+
+    for (int parallel = 0; parallel < 2; parallel++) {
+        smoothing.setParallelMoves(parallel == 1);
+
+        int iterations;
+
+        double ns = timeCalls([&]() {
+            depth.getSegmentPlaneMap() = initial;
+
+            smoothing.solve();
+        }, minMs, iterations);
+
+        energies[parallel] = smoothing.computeEnergy();
+
+        printMicroResult(parallel ?
+                "PlanarDepthSmoothingProblem.solve.parallel" :
+                "PlanarDepthSmoothingProblem.solve.serial",
+                sizeParams(width, height) +
+                ",\"segments\":" + to_string(segmentation.size()) +
+                ",\"energy\":" + to_string(energies[parallel]),
+                iterations, ns, segmentation.size());
+    }
+
+    if (fabs(energies[1] - energies[0]) > tolerance * fabs(energies[0])) {
+        fprintf(stderr, "PlanarDepthSmoothingProblem: parallel energy %f "
+                "differs from serial energy %f\n", energies[1], energies[0]);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * A binary energy with unary costs u0/u1 and pairwise terms over
+ * (i[k], j[k]) with costs e[k][x_i * 2 + x_j].
+ */
+struct BinaryEnergy {
+    vector<float> u0, u1;
+
+    vector<int> i, j;
+
+    vector<array<float, 4>> e;
+
+    void randomize(
+            int numNodes,
+            int numTerms,
+            mt19937& rng) {
+        // Small integers keep the brute-force comparison exact
+        uniform_int_distribution<int> cost(0, 20);
+        uniform_int_distribution<int> node(0, numNodes - 1);
+
+        u0.resize(numNodes);
+        u1.resize(numNodes);
+
+        for (int p = 0; p < numNodes; p++) {
+            u0[p] = cost(rng);
+            u1[p] = cost(rng);
+        }
+
+        i.clear();
+        j.clear();
+        e.clear();
+
+        for (int k = 0; k < numTerms; k++) {
+            int a = node(rng);
+            int b = node(rng);
+
+            if (a == b) {
+                continue;
+            }
+
+            i.push_back(a);
+            j.push_back(b);
+            e.push_back({(float) cost(rng), (float) cost(rng),
+                    (float) cost(rng), (float) cost(rng)});
+        }
+    }
+
+    void build(
+            QPBO<float>& qpbo) const {
+        qpbo.Reset();
+        qpbo.AddNode(u0.size());
+
+        for (size_t p = 0; p < u0.size(); p++) {
+            qpbo.AddUnaryTerm(p, u0[p], u1[p]);
+        }
+
+        for (size_t k = 0; k < e.size(); k++) {
+            qpbo.AddPairwiseTerm(i[k], j[k], e[k][0], e[k][1], e[k][2],
+                    e[k][3]);
+        }
+    }
+
+    /**
+     * Energy of the labeling given by the bits of x.
+     */
+    float energy(
+            unsigned int x) const {
+        float total = 0;
+
+        for (size_t p = 0; p < u0.size(); p++) {
+            total += ((x >> p) & 1) ? u1[p] : u0[p];
+        }
+
+        for (size_t k = 0; k < e.size(); k++) {
+            total += e[k][((x >> i[k]) & 1) * 2 + ((x >> j[k]) & 1)];
+        }
+
+        return total;
+    }
+};
+
+/**
+ * Checks a partial labeling against brute force: fixing the labeled
+ * variables in any labeling must not increase its energy (which also
+ * makes the labeled subset part of a global minimum).
+ */
+static bool checkPersistency(
+        const BinaryEnergy& energy,
+        const QPBO<float>& qpbo) {
+    int numNodes = energy.u0.size();
+
+    unsigned int mask = 0;
+    unsigned int fixed = 0;
+
+    for (int p = 0; p < numNodes; p++) {
+        int label = qpbo.GetLabel(p);
+
+        if (label >= 0) {
+            mask |= 1u << p;
+            fixed |= (unsigned int) label << p;
+        }
+    }
+
+    for (unsigned int x = 0; x < (1u << numNodes); x++) {
+        unsigned int y = (x & ~mask) | fixed;
+
+        if (energy.energy(y) > energy.energy(x)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Times QPBO on a random sparse energy the size of a local-expansion move,
+ * after checking its strong and weak persistencies against brute force on
+ * small random energies, submodular or not.  Returns false if any check
+ * fails.
+ */
+static bool benchQPBO(
+        double minMs) {
+    const int numChecks = 2000;
+    const int maxCheckNodes = 10;
+
+    mt19937 rng(1);
+
+    BinaryEnergy energy;
+
+    QPBO<float> qpbo(maxCheckNodes, 4 * maxCheckNodes);
+
+    for (int check = 0; check < numChecks; check++) {
+        int numNodes = 1 + rng() % maxCheckNodes;
+
+        energy.randomize(numNodes, rng() % (3 * numNodes + 1), rng);
+        energy.build(qpbo);
+
+        qpbo.Solve();
+
+        bool strongOk = checkPersistency(energy, qpbo);
+
+        qpbo.ComputeWeakPersistencies();
+
+        if (!strongOk || !checkPersistency(energy, qpbo)) {
+            fprintf(stderr, "QPBO: %s persistencies of random energy #%d "
+                    "are not optimal\n", strongOk ? "weak" : "strong",
+                    check);
+            return false;
+        }
+    }
+
+    const int numNodes = 500;
+    const int numTerms = 4 * numNodes;
+
+    energy.randomize(numNodes, numTerms, rng);
+
+    QPBO<float> graph(numNodes, numTerms);
+
+    int iterations;
+
+    double ns = timeCalls([&]() {
+        energy.build(graph);
+
+        graph.Solve();
+        graph.ComputeWeakPersistencies();
+
+        sink = graph.GetLabel(0);
+    }, minMs, iterations);
+
+    printMicroResult("QPBO.solve",
+            "\"nodes\":" + to_string(numNodes) +
+            ",\"terms\":" + to_string(energy.e.size()),
+            iterations, ns, numNodes);
+
+    return true;
+}
+
+bool runMicroBenchmarks(
+        double minMs) {
+    BenchPair pair;
+
+    makeRandomDotPair(320, 240, 0, 32, 1, pair);
+
+    benchPatchDistances(pair, minMs);
+    benchPatchMatch(pair, minMs);
+    benchKBestInsertion(minMs);
+    benchConvertCImgToMat(pair, minMs);
+    benchRectificationTransform(minMs);
+    benchDPStereoRows(pair, minMs);
+
+    bool ok = benchQPBO(minMs);
+
+    return benchPlanarSmoothing(pair, minMs) && ok;
+}
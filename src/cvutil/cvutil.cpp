@@ -7,8 +7,6 @@
 #include <opencv2/core/eigen.hpp>
 #include <opencv2/video/tracking.hpp>
 
-#include "slic.h"
-
 void convertCImgToMat(
         const CImg<float>& in,
         cv::Mat& out) {
@@ -52,34 +50,6 @@ void convertMatToCImg(
     }
 }
 
-void slicSuperpixels(
-        const CImg<float>& labIn,
-        int numSuperpixels,
-        int nc,
-        CImg<uint16_t>& result) {
-    int w = labIn.width();
-    int h = labIn.height();
-
-    double step = sqrt((w * h) / (double) numSuperpixels);
-
-    cv::Mat labInCV;
-
-    convertCImgToMat(labIn, labInCV);
-
-    Slic slic;
-    IplImage labInCVIpl = labInCV;
-    slic.generate_superpixels(&labInCVIpl, step, nc);
-    slic.create_connectivity(&labInCVIpl);
-    
-    vector<vector<int>>& clusters = slic.getClusters();
-
-    result = CImg<uint16_t>(labIn.width(), labIn.height());
-
-    cimg_forXY(result, x, y) {
-        result(x, y) = clusters[x][y];
-    }
-}
-
 void CVDenseOpticalFlow::compute(
         const CImg<uint8_t>& img0Gray,
         const CImg<uint8_t>& img1Gray,
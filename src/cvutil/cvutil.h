@@ -16,12 +16,6 @@ void convertMatToCImg(
         const cv::Mat& in,
         CImg<float>& out);
 
-void slicSuperpixels(
-        const CImg<float>& labIn,
-        int numSuperpixels,
-        int nc,
-        CImg<uint16_t>& result);
-
 inline void decomposeProjectionMatrix(
         const Eigen::Matrix<double, 3, 4>& P,
         Eigen::Matrix3d R,
@@ -241,6 +235,26 @@ class CVStereo {
                 const uint8_t* rightGray,
                 int16_t* resultBuf);
 
+        /**
+         * Creates the semi-global matcher used by stereo().  A matcher
+         * keeps its scratch buffer between pairs, so one should be reused
+         * for pairs of the same size.
+         */
+        static cv::StereoSGBM createSGBM(
+                int minDisparity,
+                int numDisparities);
+
+        /**
+         * Same as above, with a matcher from createSGBM().
+         */
+        static void stereo(
+                cv::StereoSGBM& sgbm,
+                int width,
+                int height,
+                const uint8_t* leftGray,
+                const uint8_t* rightGray,
+                int16_t* resultBuf);
+
         CVStereo(
                 const CImg<float>& left,
                 const CImg<float>& right,
@@ -12,13 +12,14 @@ void CVStereo::stereo(
         const uint8_t* leftGray,
         const uint8_t* rightGray,
         int16_t* resultBuf) {
-    int rows = height;
-    int cols = width;
+    cv::StereoSGBM sgbm = createSGBM(minDisparity, numDisparities);
 
-    const cv::Mat left(rows, cols, CV_8U, (void*) leftGray);
-    const cv::Mat right(rows, cols, CV_8U, (void*) rightGray);
-    cv::Mat result(rows, cols, CV_16S, (void*) resultBuf);
+    stereo(sgbm, width, height, leftGray, rightGray, resultBuf);
+}
 
+cv::StereoSGBM CVStereo::createSGBM(
+        int minDisparity,
+        int numDisparities) {
     int SADWindowSize = 3; // 3 to 11 is recommended
     float smoothnessScale = 1.0f;
     int P1=8 * 3 * sqr(SADWindowSize) * smoothnessScale;
@@ -30,9 +31,24 @@ void CVStereo::stereo(
     int speckleRange=0;
     bool fullDP=false;
 
-    cv::StereoSGBM sgbm(minDisparity, numDisparities, SADWindowSize,
+    return cv::StereoSGBM(minDisparity, numDisparities, SADWindowSize,
             P1, P2, disp12MaxDiff, preFilterCap, uniquenessRatio, speckleWindowSize,
             speckleRange, fullDP);
+}
+
+void CVStereo::stereo(
+        cv::StereoSGBM& sgbm,
+        int width,
+        int height,
+        const uint8_t* leftGray,
+        const uint8_t* rightGray,
+        int16_t* resultBuf) {
+    int rows = height;
+    int cols = width;
+
+    const cv::Mat left(rows, cols, CV_8U, (void*) leftGray);
+    const cv::Mat right(rows, cols, CV_8U, (void*) rightGray);
+    cv::Mat result(rows, cols, CV_16S, (void*) resultBuf);
 
     sgbm(left, right, result);
 }
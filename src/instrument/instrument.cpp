@@ -0,0 +1,241 @@
+#include "instrument.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+thread_local InstrumentThread* instrumentLocalThread = nullptr;
+
+/**
+ * Every thread which has recorded anything, in order of registration.
+ */
+static vector<unique_ptr<InstrumentThread>> threads;
+
+static mutex threadsMutex;
+
+static const chrono::steady_clock::time_point epoch =
+    chrono::steady_clock::now();
+
+const char* instrumentCounterName(
+        InstrumentCounter counter) {
+    switch (counter) {
+        case InstrumentCounter::CANDIDATES_EVALUATED:
+            return "candidates_evaluated";
+        case InstrumentCounter::CANDIDATES_ACCEPTED:
+            return "candidates_accepted";
+        case InstrumentCounter::QPBO_MOVES:
+            return "qpbo_moves";
+        case InstrumentCounter::QPBO_CHANGES:
+            return "qpbo_changes";
+        case InstrumentCounter::QPBO_LABELED:
+            return "qpbo_labeled";
+        case InstrumentCounter::BP_SWEEPS:
+            return "bp_sweeps";
+        default:
+            return "unknown";
+    }
+}
+
+InstrumentThread* instrumentRegisterThread() {
+    unique_ptr<InstrumentThread> thread(new InstrumentThread());
+
+    thread->oldestEvent = 0;
+    thread->numOverwritten = 0;
+    thread->depth = 0;
+
+    for (auto& counter : thread->counters) {
+        counter.store(0, memory_order_relaxed);
+    }
+
+    lock_guard<mutex> lock(threadsMutex);
+
+    thread->id = threads.size();
+
+    threads.push_back(move(thread));
+
+    return threads.back().get();
+}
+
+double instrumentNowUs() {
+    return chrono::duration<double, micro>(
+            chrono::steady_clock::now() - epoch).count();
+}
+
+void instrumentCounterTotals(
+        array<uint64_t, (size_t) InstrumentCounter::NUM_COUNTERS>& totals) {
+    totals.fill(0);
+
+    lock_guard<mutex> lock(threadsMutex);
+
+    for (const auto& thread : threads) {
+        for (size_t i = 0; i < totals.size(); i++) {
+            totals[i] += thread->counters[i].load(memory_order_relaxed);
+        }
+    }
+}
+
+bool instrumentWriteChromeTrace(
+        const string& path) {
+    ofstream trace(path);
+
+    if (!trace) {
+        return false;
+    }
+
+    trace << "{\"traceEvents\":[";
+
+    bool first = true;
+
+    double endUs = 0.0;
+
+    uint64_t numOverwritten = 0;
+
+    {
+        lock_guard<mutex> lock(threadsMutex);
+
+        for (const auto& thread : threads) {
+            numOverwritten += thread->numOverwritten;
+
+            for (const InstrumentEvent& event : thread->events) {
+                trace << (first ? "" : ",") << "\n" <<
+                    "{\"name\":\"" << event.name << "\",\"ph\":\"X\"" <<
+                    ",\"pid\":1,\"tid\":" << thread->id <<
+                    ",\"ts\":" << event.startUs <<
+                    ",\"dur\":" << event.durationUs << "}";
+
+                first = false;
+
+                endUs = max(endUs, event.startUs + event.durationUs);
+            }
+        }
+    }
+
+    array<uint64_t, (size_t) InstrumentCounter::NUM_COUNTERS> totals;
+
+    instrumentCounterTotals(totals);
+
+    // Counters only have totals, shown at the end of the trace
+    for (size_t i = 0; i < totals.size(); i++) {
+        trace << (first ? "" : ",") << "\n" <<
+            "{\"name\":\"" << instrumentCounterName((InstrumentCounter) i) <<
+            "\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":" << endUs <<
+            ",\"args\":{\"total\":" << totals[i] << "}}";
+
+        first = false;
+    }
+
+    trace << (first ? "" : ",") << "\n" <<
+        "{\"name\":\"scopes_overwritten\",\"ph\":\"C\",\"pid\":1" <<
+        ",\"tid\":0,\"ts\":" << endUs <<
+        ",\"args\":{\"total\":" << numOverwritten << "}}";
+
+    trace << "\n]}\n";
+
+    return trace.good();
+}
+
+/**
+ * Per-path totals of the summary table.
+ */
+struct ScopeTotals {
+    long calls;
+
+    double totalUs;
+};
+
+void instrumentPrintSummary(
+        FILE* out) {
+    map<string, ScopeTotals> scopes;
+
+    uint64_t numOverwritten = 0;
+
+    {
+        lock_guard<mutex> lock(threadsMutex);
+
+        for (const auto& thread : threads) {
+            numOverwritten += thread->numOverwritten;
+
+            // Scopes are recorded as they end, so children come before
+            // their parents.  Sorting by start time, outer scopes first,
+            // restores the nesting.
+            vector<InstrumentEvent> events = thread->events;
+
+            sort(events.begin(), events.end(),
+                    [](const InstrumentEvent& a, const InstrumentEvent& b) {
+                return (a.startUs != b.startUs) ? a.startUs < b.startUs :
+                    a.depth < b.depth;
+            });
+
+            vector<string> path;
+
+            for (const InstrumentEvent& event : events) {
+                path.resize(event.depth);
+
+                string fullPath = path.empty() ? event.name :
+                    path.back() + "/" + event.name;
+
+                path.push_back(fullPath);
+
+                ScopeTotals& totals = scopes[fullPath];
+
+                totals.calls++;
+                totals.totalUs += event.durationUs;
+            }
+        }
+    }
+
+    fprintf(out, "%-60s %10s %12s %12s\n", "scope", "calls", "total ms",
+            "mean ms");
+
+    for (const auto& scope : scopes) {
+        fprintf(out, "%-60s %10ld %12.3f %12.3f\n", scope.first.c_str(),
+                scope.second.calls, scope.second.totalUs / 1000.0,
+                scope.second.totalUs / 1000.0 / scope.second.calls);
+    }
+
+    array<uint64_t, (size_t) InstrumentCounter::NUM_COUNTERS> totals;
+
+    instrumentCounterTotals(totals);
+
+    fprintf(out, "\n%-60s %10s\n", "counter", "total");
+
+    for (size_t i = 0; i < totals.size(); i++) {
+        fprintf(out, "%-60s %10llu\n",
+                instrumentCounterName((InstrumentCounter) i),
+                (unsigned long long) totals[i]);
+    }
+
+    if (numOverwritten > 0) {
+        fprintf(out, "\n%llu older scopes were overwritten and are not "
+                "shown\n", (unsigned long long) numOverwritten);
+    }
+}
+
+void instrumentReportFromEnvironment() {
+    const char* path = getenv("VIEWINTERP_TRACE");
+
+    if (path == nullptr || *path == '\0') {
+        return;
+    }
+
+    if (!instrumentWriteChromeTrace(path)) {
+        fprintf(stderr, "Could not write trace %s\n", path);
+    }
+
+    instrumentPrintSummary(stderr);
+}
+
+void instrumentReset() {
+    lock_guard<mutex> lock(threadsMutex);
+
+    for (const auto& thread : threads) {
+        thread->events.clear();
+        thread->oldestEvent = 0;
+        thread->numOverwritten = 0;
+
+        for (auto& counter : thread->counters) {
+            counter.store(0, memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+
+/**
+ * Scoped timers and event counters, compiled in only when
+ * ENABLE_INSTRUMENTATION is defined (make INSTRUMENT=1).  Otherwise the
+ * INSTRUMENT_* macros expand to nothing, and reports are empty.
+ *
+ * Each thread records into its own buffers, so recording never takes a
+ * lock.  Reports must be produced while no instrumented code runs, e.g.
+ * once the work of a program is done.
+ *
+ * A thread keeps only its latest instrumentMaxEvents scopes, so that long
+ * running programs such as the server use bounded memory.  Older scopes
+ * are overwritten; reports say how many.
+ *
+ *   void solve() {
+ *       INSTRUMENT_SCOPE("solve");
+ *       ...
+ *       INSTRUMENT_COUNT(InstrumentCounter::QPBO_MOVES, 1);
+ *   }
+ */
+
+enum class InstrumentCounter {
+    /**
+     * Candidate values costed by patchMatch().
+     */
+    CANDIDATES_EVALUATED,
+
+    /**
+     * Candidates which entered the K best particles of their pixel.
+     */
+    CANDIDATES_ACCEPTED,
+
+    /**
+     * QPBO expansion moves solved.
+     */
+    QPBO_MOVES,
+
+    /**
+     * Labels changed by QPBO moves.
+     */
+    QPBO_CHANGES,
+
+    /**
+     * Variables QPBO moves labeled with partial optimality.
+     */
+    QPBO_LABELED,
+
+    /**
+     * Belief propagation sweeps run by SegmentPlaneBP.
+     */
+    BP_SWEEPS,
+
+    NUM_COUNTERS
+};
+
+const char* instrumentCounterName(
+        InstrumentCounter counter);
+
+/**
+ * A completed scope.  Times are in microseconds since the first recorded
+ * event of the process.
+ */
+struct InstrumentEvent {
+    const char* name;
+
+    double startUs;
+
+    double durationUs;
+
+    /**
+     * Number of enclosing scopes on the same thread.
+     */
+    int depth;
+};
+
+/**
+ * Scopes kept per thread (32 bytes each).
+ */
+const size_t instrumentMaxEvents = 1 << 18;
+
+/**
+ * What one thread has recorded.  Only its own thread writes to it.
+ */
+struct InstrumentThread {
+    int id;
+
+    /**
+     * Once full, a ring buffer whose oldest scope is events[oldestEvent].
+     */
+    vector<InstrumentEvent> events;
+
+    size_t oldestEvent;
+
+    uint64_t numOverwritten;
+
+    int depth;
+
+    /**
+     * Written with relaxed atomics by the owning thread only, so they can
+     * be read while the thread is alive.
+     */
+    array<atomic<uint64_t>, (size_t) InstrumentCounter::NUM_COUNTERS> counters;
+};
+
+extern thread_local InstrumentThread* instrumentLocalThread;
+
+/**
+ * Creates the record of the calling thread.  Records outlive their
+ * threads, so pools which exit early are still reported.
+ */
+InstrumentThread* instrumentRegisterThread();
+
+inline InstrumentThread& instrumentThread() {
+    if (instrumentLocalThread == nullptr) {
+        instrumentLocalThread = instrumentRegisterThread();
+    }
+
+    return *instrumentLocalThread;
+}
+
+double instrumentNowUs();
+
+/**
+ * Times the enclosing scope.  name must outlive the report, as string
+ * literals do.
+ */
+class InstrumentScope {
+    private:
+        InstrumentThread& thread;
+
+        const char* name;
+
+        double startUs;
+
+    public:
+        inline InstrumentScope(
+                const char* _name) :
+            thread(instrumentThread()),
+            name(_name),
+            startUs(instrumentNowUs()) {
+            thread.depth++;
+        }
+
+        inline ~InstrumentScope() {
+            thread.depth--;
+
+            InstrumentEvent event = {
+                name, startUs, instrumentNowUs() - startUs, thread.depth };
+
+            if (thread.events.size() < instrumentMaxEvents) {
+                thread.events.push_back(event);
+            } else {
+                thread.events[thread.oldestEvent] = event;
+
+                thread.oldestEvent = (thread.oldestEvent + 1) %
+                    instrumentMaxEvents;
+                thread.numOverwritten++;
+            }
+        }
+};
+
+inline void instrumentCount(
+        InstrumentCounter counter,
+        uint64_t n) {
+    atomic<uint64_t>& value = instrumentThread().counters[(size_t) counter];
+
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Totals of each counter over all threads.
+ */
+void instrumentCounterTotals(
+        array<uint64_t, (size_t) InstrumentCounter::NUM_COUNTERS>& totals);
+
+/**
+ * Writes every recorded scope, and the counter totals, in the Chrome trace
+ * event format (chrome://tracing, Perfetto).  Returns false if the file
+ * cannot be written.
+ */
+bool instrumentWriteChromeTrace(
+        const string& path);
+
+/**
+ * Prints the calls, total and mean time of each scope, aggregated by its
+ * path of enclosing scopes, followed by the counter totals.  Overwritten
+ * scopes are missing from the table.
+ */
+void instrumentPrintSummary(
+        FILE* out);
+
+/**
+ * When the environment variable VIEWINTERP_TRACE names a file, writes the
+ * Chrome trace there and prints the summary to stderr.  Called by the
+ * programs once their work is done.
+ */
+void instrumentReportFromEnvironment();
+
+/**
+ * Discards everything recorded so far.
+ */
+void instrumentReset();
+
+#define INSTRUMENT_CONCAT_(a, b) a##b
+#define INSTRUMENT_CONCAT(a, b) INSTRUMENT_CONCAT_(a, b)
+
+#ifdef ENABLE_INSTRUMENTATION
+
+#define INSTRUMENT_SCOPE(name) \
+    InstrumentScope INSTRUMENT_CONCAT(instrumentScope, __LINE__)(name)
+
+#define INSTRUMENT_COUNT(counter, n) instrumentCount(counter, n)
+
+#else
+
+#define INSTRUMENT_SCOPE(name)
+
+// sizeof keeps the operands referenced without evaluating them
+#define INSTRUMENT_COUNT(counter, n) ((void) sizeof(n))
+
+#endif
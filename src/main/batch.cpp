@@ -0,0 +1,186 @@
+#include "batch.h"
+
+#include <fstream>
+#include <sstream>
+
+bool loadManifest(
+        const string& path,
+        int defaultMinDisp,
+        int defaultMaxDisp,
+        vector<StereoJob>& jobs,
+        string& error) {
+    ifstream manifest(path);
+
+    if (!manifest) {
+        error = "cannot read manifest " + path;
+        return false;
+    }
+
+    string line;
+
+    int lineNumber = 0;
+
+    while (getline(manifest, line)) {
+        lineNumber++;
+
+        istringstream fields(line);
+
+        string algorithmName;
+
+        if (!(fields >> algorithmName) || algorithmName[0] == '#') {
+            continue;
+        }
+
+        StereoJob job;
+
+        job.id = jobs.size();
+        job.minDisp = defaultMinDisp;
+        job.maxDisp = defaultMaxDisp;
+
+        string lineError = path + ":" + to_string(lineNumber) + ": ";
+
+        if (!parseStereoAlgorithm(algorithmName, job.algorithm)) {
+            error = lineError + "unknown algorithm " + algorithmName;
+            return false;
+        }
+
+        if (!(fields >> job.leftPath >> job.rightPath >> job.outputPath)) {
+            error = lineError + "expected algorithm left right output";
+            return false;
+        }
+
+        int minDisp, maxDisp;
+
+        if (fields >> minDisp) {
+            if (!(fields >> maxDisp) || minDisp > maxDisp) {
+                error = lineError + "expected minDisp <= maxDisp";
+                return false;
+            }
+
+            job.minDisp = minDisp;
+            job.maxDisp = maxDisp;
+        }
+
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+void runStereoJob(
+        const StereoJob& job,
+        StereoMatcher& matcher,
+        StereoJobReport& report) {
+    StageTimer timer;
+
+    report.ok = false;
+
+    CImg<uint8_t> left, right;
+
+    CImg<float> disp;
+
+    try {
+        timer.start("load");
+
+        left.load(job.leftPath.c_str());
+        right.load(job.rightPath.c_str());
+
+        timer.start("match");
+
+        if (matcher.compute(left, right, disp, report.error)) {
+            if (!job.outputPath.empty()) {
+                timer.start("write");
+
+                disp.save(job.outputPath.c_str());
+            }
+
+            report.ok = true;
+        }
+    } catch (const exception& e) {
+        // CImgException, cv::Exception and bad_alloc alike only fail this
+        // job, not the rest of the batch
+        report.error = e.what();
+    } catch (...) {
+        report.error = "unknown exception";
+    }
+
+    timer.stop();
+
+    report.stages = timer.getStages();
+}
+
+string formatJobReport(
+        const StereoJob& job,
+        const StereoJobReport& report) {
+    ostringstream json;
+
+    json << "{\"job\":" << job.id <<
+        ",\"algorithm\":\"" << stereoAlgorithmName(job.algorithm) << "\"" <<
+        ",\"left\":\"" << escapeJson(job.leftPath) << "\"" <<
+        ",\"right\":\"" << escapeJson(job.rightPath) << "\"" <<
+        ",\"ok\":" << (report.ok ? "true" : "false");
+
+    if (!report.ok) {
+        json << ",\"error\":\"" << escapeJson(report.error) << "\"";
+    }
+
+    json << ",\"stages\":" << formatStages(report.stages) << "}";
+
+    return json.str();
+}
+
+string formatStages(
+        const vector<StageTiming>& stages) {
+    ostringstream json;
+
+    json << "[";
+
+    for (size_t i = 0; i < stages.size(); i++) {
+        const StageTiming& stage = stages[i];
+
+        if (i > 0) {
+            json << ",";
+        }
+
+        json << "{\"name\":\"" << stage.name << "\"" <<
+            ",\"wall_ms\":" << stage.wallMs <<
+            ",\"cpu_ms\":" << stage.cpuMs <<
+            ",\"peak_rss_kb\":" << stage.peakRssKb << "}";
+    }
+
+    json << "]";
+
+    return json.str();
+}
+
+string escapeJson(
+        const string& str) {
+    string escaped;
+
+    for (char c : str) {
+        switch (c) {
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            case '\t':
+                escaped += "\\t";
+                break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    escaped += buf;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+
+    return escaped;
+}
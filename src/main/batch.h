@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+
+#include "stage_timer.h"
+#include "stereo_matcher.h"
+
+struct StereoJob {
+    int id;
+
+    StereoAlgorithm algorithm;
+
+    string leftPath;
+
+    string rightPath;
+
+    /**
+     * Where the disparity is saved, in any format CImg writes from its
+     * extension (.cimg, .pfm...).  Empty to skip writing.
+     */
+    string outputPath;
+
+    int minDisp;
+
+    int maxDisp;
+};
+
+struct StereoJobReport {
+    bool ok;
+
+    string error;
+
+    /**
+     * "load", "match" and "write", as far as the job got.
+     */
+    vector<StageTiming> stages;
+};
+
+/**
+ * Reads a manifest of stereo jobs, one per line:
+ *
+ *   algorithm left right output [minDisp maxDisp]
+ *
+ * Jobs without a disparity range use the default one.  Blank lines and
+ * lines starting with '#' are skipped.  Returns false, with a message in
+ * error, if the file cannot be read or a line is malformed.
+ */
+bool loadManifest(
+        const string& path,
+        int defaultMinDisp,
+        int defaultMaxDisp,
+        vector<StereoJob>& jobs,
+        string& error);
+
+/**
+ * Loads, matches and saves one job with the given matcher, which must be
+ * for the job's algorithm and range.
+ */
+void runStereoJob(
+        const StereoJob& job,
+        StereoMatcher& matcher,
+        StereoJobReport& report);
+
+/**
+ * Formats the report of a job as a single line of JSON.
+ */
+string formatJobReport(
+        const StereoJob& job,
+        const StereoJobReport& report);
+
+/**
+ * Formats stage timings as a JSON array.
+ */
+string formatStages(
+        const vector<StageTiming>& stages);
+
+/**
+ * Escapes a string for use inside a JSON string literal.
+ */
+string escapeJson(
+        const string& str);
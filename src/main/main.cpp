@@ -1,7 +1,153 @@
 #include "common.h"
 
+#include "batch.h"
+#include "server.h"
+#include "thread_pool.h"
+
+#include "instrument/instrument.h"
+
+#include <mutex>
+
+#include <unistd.h>
+
+static void printUsage(
+        const char* program) {
+    fprintf(stderr,
+            "Usage:\n"
+            "  %s ALGORITHM LEFT RIGHT [OUTPUT [MIN_DISP MAX_DISP]]\n"
+            "  %s batch MANIFEST [THREADS [MIN_DISP MAX_DISP]]\n"
+            "  %s serve SOCKET [THREADS]\n"
+            "\n"
+            "ALGORITHM is one of cvstereo, patchmatch, dp or polar.\n"
+            "Each line of MANIFEST is: ALGORITHM LEFT RIGHT OUTPUT "
+            "[MIN_DISP MAX_DISP]\n"
+            "Disparities default to [0, 64].  A JSON report is printed for "
+            "every pair.\n"
+            "serve answers requests on the Unix socket SOCKET, or on "
+            "stdin and stdout if\n"
+            "SOCKET is -.  See src/main/server.h for the protocol.\n",
+            program, program, program);
+}
+
 int main(
         int argc,
         char** argv) {
-    return 0;
+    if (argc < 3) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Headless: report errors through exceptions only, never in a dialog
+    cimg::exception_mode(0);
+
+    int defaultMinDisp = 0;
+    int defaultMaxDisp = 64;
+
+    vector<StereoJob> jobs;
+
+    int numThreads = 1;
+
+    string mode = argv[1];
+
+    if (mode == "serve") {
+        StereoServer server((argc > 3) ? atoi(argv[3]) : 0);
+
+        string socketPath = argv[2];
+
+        if (socketPath == "-") {
+            // Replies own stdout; any other output goes to stderr
+            int outFd = dup(STDOUT_FILENO);
+
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+
+            server.serve(STDIN_FILENO, outFd);
+
+            instrumentReportFromEnvironment();
+
+            return 0;
+        }
+
+        string error;
+
+        server.listen(socketPath, error);
+
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    if (mode == "batch") {
+        if (argc > 3) {
+            numThreads = atoi(argv[3]);
+        }
+
+        if (argc > 5) {
+            defaultMinDisp = atoi(argv[4]);
+            defaultMaxDisp = atoi(argv[5]);
+        }
+
+        string error;
+
+        if (!loadManifest(argv[2], defaultMinDisp, defaultMaxDisp, jobs,
+                    error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+    } else {
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+
+        StereoJob job;
+
+        job.id = 0;
+
+        if (!parseStereoAlgorithm(mode, job.algorithm)) {
+            fprintf(stderr, "Unknown algorithm %s\n", mode.c_str());
+            return 1;
+        }
+
+        job.leftPath = argv[2];
+        job.rightPath = argv[3];
+        job.outputPath = (argc > 4) ? argv[4] : "";
+        job.minDisp = (argc > 6) ? atoi(argv[5]) : defaultMinDisp;
+        job.maxDisp = (argc > 6) ? atoi(argv[6]) : defaultMaxDisp;
+
+        jobs.push_back(job);
+    }
+
+    mutex outputMutex;
+
+    int numFailed = 0;
+
+    {
+        ThreadPool pool(numThreads);
+
+        for (const StereoJob& job : jobs) {
+            pool.enqueue([&, job]() {
+                StereoMatcher matcher(job.algorithm, job.minDisp, job.maxDisp);
+
+                StereoJobReport report;
+
+                runStereoJob(job, matcher, report);
+
+                string line = formatJobReport(job, report);
+
+                lock_guard<mutex> lock(outputMutex);
+
+                printf("%s\n", line.c_str());
+                fflush(stdout);
+
+                if (!report.ok) {
+                    numFailed++;
+                }
+            });
+        }
+
+        pool.wait();
+    }
+
+    instrumentReportFromEnvironment();
+
+    return (numFailed == 0) ? 0 : 1;
 }
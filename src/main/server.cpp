@@ -0,0 +1,560 @@
+#include "server.h"
+
+#include "batch.h"
+
+#include "render/render.h"
+
+#include <cstring>
+#include <sstream>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+unique_ptr<StereoMatcher> MatcherCache::acquire(
+        StereoAlgorithm algorithm,
+        int minDisp,
+        int maxDisp) {
+    Key key((int) algorithm, minDisp, maxDisp);
+
+    {
+        lock_guard<mutex> lock(idleMutex);
+
+        vector<unique_ptr<StereoMatcher>>& matchers = idle[key];
+
+        if (!matchers.empty()) {
+            unique_ptr<StereoMatcher> matcher = move(matchers.back());
+
+            matchers.pop_back();
+
+            return matcher;
+        }
+    }
+
+    return unique_ptr<StereoMatcher>(
+            new StereoMatcher(algorithm, minDisp, maxDisp));
+}
+
+void MatcherCache::release(
+        unique_ptr<StereoMatcher> matcher) {
+    Key key((int) matcher->getAlgorithm(), matcher->getMinDisp(),
+            matcher->getMaxDisp());
+
+    lock_guard<mutex> lock(idleMutex);
+
+    idle[key].push_back(move(matcher));
+}
+
+static bool readFully(
+        int fd,
+        void* data,
+        size_t size) {
+    uint8_t* dst = (uint8_t*) data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, dst, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        dst += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool writeFully(
+        int fd,
+        const void* data,
+        size_t size) {
+    const uint8_t* src = (const uint8_t*) data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, src, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        src += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool readFrame(
+        int fd,
+        string& frame,
+        size_t maxSize) {
+    uint8_t header[4];
+
+    if (!readFully(fd, header, 4)) {
+        return false;
+    }
+
+    size_t size = header[0] | (header[1] << 8) | (header[2] << 16) |
+        ((size_t) header[3] << 24);
+
+    if (size > maxSize) {
+        return false;
+    }
+
+    frame.resize(size);
+
+    return size == 0 || readFully(fd, &frame[0], size);
+}
+
+bool writeFrame(
+        int fd,
+        const void* data,
+        size_t size) {
+    uint8_t header[4] = {
+        (uint8_t) size,
+        (uint8_t) (size >> 8),
+        (uint8_t) (size >> 16),
+        (uint8_t) (size >> 24)
+    };
+
+    return writeFully(fd, header, 4) && writeFully(fd, data, size);
+}
+
+void fillInvalidDisparities(
+        CImg<float>& disp) {
+    const float invalid = numeric_limits<float>::max();
+
+    #pragma omp parallel for
+    for (int y = 0; y < disp.height(); y++) {
+        float* row = disp.data(0, y);
+
+        int width = disp.width();
+
+        int x = 0;
+
+        while (x < width) {
+            if (row[x] != invalid) {
+                x++;
+                continue;
+            }
+
+            int holeStart = x;
+
+            while (x < width && row[x] == invalid) {
+                x++;
+            }
+
+            // Smaller disparities are farther away
+            float fill;
+
+            if (holeStart == 0 && x == width) {
+                fill = 0.0f;
+            } else if (holeStart == 0) {
+                fill = row[x];
+            } else if (x == width) {
+                fill = row[holeStart - 1];
+            } else {
+                fill = min(row[holeStart - 1], row[x]);
+            }
+
+            std::fill(row + holeStart, row + x, fill);
+        }
+    }
+}
+
+/**
+ * Decodes a PNG or JPEG image held in memory.
+ */
+static bool decodeImage(
+        const string& data,
+        CImg<uint8_t>& img,
+        string& error) {
+    bool isPng = data.size() >= 8 && data.compare(0, 4, "\x89PNG") == 0;
+    bool isJpeg = data.size() >= 3 && data.compare(0, 2, "\xff\xd8") == 0;
+
+    if (!isPng && !isJpeg) {
+        error = "images must be PNG or JPEG";
+        return false;
+    }
+
+    FILE* file = fmemopen((void*) data.data(), data.size(), "rb");
+
+    if (file == nullptr) {
+        error = "cannot open image buffer";
+        return false;
+    }
+
+    try {
+        if (isPng) {
+            img.load_png(file);
+        } else {
+            img.load_jpeg(file);
+        }
+    } catch (const exception& e) {
+        error = e.what();
+    } catch (...) {
+        error = "unknown exception";
+    }
+
+    fclose(file);
+
+    return error.empty();
+}
+
+static bool parseRequest(
+        const string& header,
+        ServerJob& job,
+        string& error) {
+    istringstream fields(header);
+
+    string kind;
+    string algorithm;
+
+    fields >> kind >> job.id;
+
+    if (kind == "stereo") {
+        job.kind = ServerJobKind::STEREO;
+    } else if (kind == "interpolate") {
+        job.kind = ServerJobKind::INTERPOLATE;
+    } else {
+        error = "unknown request " + kind;
+        return false;
+    }
+
+    if (!(fields >> algorithm >> job.minDisp >> job.maxDisp) ||
+            (job.kind == ServerJobKind::INTERPOLATE && !(fields >> job.t))) {
+        error = "malformed request header";
+        return false;
+    }
+
+    if (!parseStereoAlgorithm(algorithm, job.algorithm)) {
+        error = "unknown algorithm " + algorithm;
+        return false;
+    }
+
+    if (job.minDisp > job.maxDisp) {
+        error = "expected MIN_DISP <= MAX_DISP";
+        return false;
+    }
+
+    if (job.kind == ServerJobKind::INTERPOLATE &&
+            job.algorithm == StereoAlgorithm::POLAR) {
+        error = "polar disparities cannot be rendered";
+        return false;
+    }
+
+    return true;
+}
+
+StereoServer::StereoServer(
+        int numThreads) :
+    decodePool((numThreads > 0) ? numThreads : defaultPoolThreads),
+    computePool((numThreads > 0) ? numThreads : defaultPoolThreads),
+    encodePool((numThreads > 0) ? numThreads : defaultPoolThreads),
+    inFlight(0),
+    maxInFlight(2 * computePool.size()) {
+}
+
+void StereoServer::decode(
+        ServerJob& job) {
+    job.timer.start("decode");
+
+    job.ok = decodeImage(job.leftData, job.left, job.error) &&
+        decodeImage(job.rightData, job.right, job.error);
+
+    // The encoded images are no longer needed
+    string().swap(job.leftData);
+    string().swap(job.rightData);
+
+    if (job.ok && !job.left.is_sameXY(job.right)) {
+        job.error = "images differ in size";
+        job.ok = false;
+    }
+
+    if (job.ok && job.left.spectrum() != job.right.spectrum()) {
+        try {
+            job.left = toRGB(job.left);
+            job.right = toRGB(job.right);
+        } catch (const exception& e) {
+            job.error = e.what();
+            job.ok = false;
+        }
+    }
+
+    job.timer.stop();
+}
+
+void StereoServer::compute(
+        ServerJob& job) {
+    job.timer.start("match");
+
+    unique_ptr<StereoMatcher> matcher = matchers.acquire(job.algorithm,
+            job.minDisp, job.maxDisp);
+
+    try {
+        job.ok = matcher->compute(job.left, job.right, job.disp, job.error);
+
+        if (job.ok && job.kind == ServerJobKind::INTERPOLATE) {
+            // Matching the mirrored pair with the views swapped gives the
+            // disparity of the right view
+            CImg<float> dispRight;
+
+            job.ok = matcher->compute(job.right.get_mirror('x'),
+                    job.left.get_mirror('x'), dispRight, job.error);
+
+            if (job.ok) {
+                dispRight.mirror('x');
+
+                fillInvalidDisparities(job.disp);
+                fillInvalidDisparities(dispRight);
+
+                job.timer.start("render");
+
+                DenseWarpRenderer<uint8_t> renderer(&job.left, &job.right,
+                        &job.disp, &dispRight);
+
+                CImg<float> view;
+
+                renderer.render(job.t, view);
+
+                job.view = view.cut(0.0f, 255.0f).round();
+            }
+        }
+    } catch (const CImgException& e) {
+        job.error = e.what();
+        job.ok = false;
+    } catch (const exception& e) {
+        // Anything else, such as cv::Exception or bad_alloc, may have left
+        // the matcher half-updated, so it is not reused
+        job.error = e.what();
+        job.ok = false;
+
+        matcher.reset();
+    } catch (...) {
+        job.error = "unknown exception";
+        job.ok = false;
+
+        matcher.reset();
+    }
+
+    if (matcher) {
+        matchers.release(move(matcher));
+    }
+
+    job.left.assign();
+    job.right.assign();
+
+    job.timer.stop();
+}
+
+void StereoServer::encode(
+        ServerJob& job) {
+    job.timer.start("encode");
+
+    if (job.kind == ServerJobKind::STEREO) {
+        // Frames are little-endian, as are the hosts we build for
+        try {
+            job.payload.assign((const char*) job.disp.data(),
+                    job.disp.size() * sizeof(float));
+        } catch (const exception& e) {
+            job.error = e.what();
+            job.ok = false;
+        }
+    } else {
+        char* buf = nullptr;
+        size_t size = 0;
+
+        FILE* file = open_memstream(&buf, &size);
+
+        try {
+            job.view.save_png(file);
+        } catch (const exception& e) {
+            job.error = e.what();
+            job.ok = false;
+        } catch (...) {
+            job.error = "unknown exception";
+            job.ok = false;
+        }
+
+        fclose(file);
+
+        if (job.ok) {
+            try {
+                job.payload.assign(buf, size);
+            } catch (const exception& e) {
+                job.error = e.what();
+                job.ok = false;
+            }
+        }
+
+        free(buf);
+    }
+
+    job.timer.stop();
+}
+
+void StereoServer::reply(
+        ServerJob& job) {
+    const CImg<float>& disp = job.disp;
+
+    ostringstream json;
+
+    json << "{\"id\":\"" << escapeJson(job.id) << "\"" <<
+        ",\"ok\":" << (job.ok ? "true" : "false");
+
+    if (job.ok) {
+        json << ",\"width\":" << disp.width() <<
+            ",\"height\":" << disp.height() <<
+            ",\"spectrum\":" << ((job.kind == ServerJobKind::STEREO) ?
+                    1 : job.view.spectrum());
+    } else {
+        json << ",\"error\":\"" << escapeJson(job.error) << "\"";
+    }
+
+    json << ",\"stages\":" << formatStages(job.timer.getStages()) << "}";
+
+    string header = json.str();
+
+    lock_guard<mutex> lock(replyMutex);
+
+    // A client which went away only loses its own replies
+    if (writeFrame(job.outFd, header.data(), header.size()) && job.ok) {
+        writeFrame(job.outFd, job.payload.data(), job.payload.size());
+    }
+}
+
+void StereoServer::finishJob(
+        const shared_ptr<ServerJob>& job) {
+    reply(*job);
+
+    {
+        lock_guard<mutex> lock(inFlightMutex);
+
+        inFlight--;
+    }
+
+    inFlightChanged.notify_all();
+}
+
+void StereoServer::serve(
+        int inFd,
+        int outFd) {
+    while (true) {
+        string header;
+
+        shared_ptr<ServerJob> job(new ServerJob());
+
+        // Images follow every header, even one which cannot be parsed, so
+        // they are read before anything else to stay in step with frames
+        if (!readFrame(inFd, header, 4096) ||
+                !readFrame(inFd, job->leftData, maxImageFrameSize) ||
+                !readFrame(inFd, job->rightData, maxImageFrameSize)) {
+            break;
+        }
+
+        job->outFd = outFd;
+        job->ok = parseRequest(header, *job, job->error);
+
+        {
+            unique_lock<mutex> lock(inFlightMutex);
+
+            inFlightChanged.wait(lock, [this]() {
+                return inFlight < maxInFlight;
+            });
+
+            inFlight++;
+        }
+
+        if (!job->ok) {
+            finishJob(job);
+            continue;
+        }
+
+        decodePool.enqueue([this, job]() {
+            decode(*job);
+
+            computePool.enqueue([this, job]() {
+                if (job->ok) {
+                    compute(*job);
+                }
+
+                encodePool.enqueue([this, job]() {
+                    if (job->ok) {
+                        encode(*job);
+                    }
+
+                    finishJob(job);
+                });
+            });
+        });
+    }
+
+    unique_lock<mutex> lock(inFlightMutex);
+
+    inFlightChanged.wait(lock, [this]() {
+        return inFlight == 0;
+    });
+}
+
+bool StereoServer::listen(
+        const string& path,
+        string& error) {
+    // Writing to a closed connection fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        error = "socket path too long";
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        error = "cannot create socket";
+        return false;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    unlink(path.c_str());
+
+    if (bind(fd, (sockaddr*) &address, sizeof(address)) < 0 ||
+            ::listen(fd, 4) < 0) {
+        error = "cannot listen on " + path;
+        close(fd);
+        return false;
+    }
+
+    while (true) {
+        int connection = accept(fd, nullptr, nullptr);
+
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            error = "accept failed";
+            close(fd);
+            return false;
+        }
+
+        serve(connection, connection);
+
+        close(connection);
+    }
+}
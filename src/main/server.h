@@ -0,0 +1,218 @@
+#pragma once
+
+#include "common.h"
+
+#include "stage_timer.h"
+#include "stereo_matcher.h"
+#include "thread_pool.h"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+/**
+ * Idle matchers, keyed by algorithm and disparity range, so that a job
+ * reuses the warm state of an earlier job with the same settings.
+ */
+class MatcherCache {
+    private:
+        typedef tuple<int, int, int> Key;
+
+        map<Key, vector<unique_ptr<StereoMatcher>>> idle;
+
+        mutex idleMutex;
+
+    public:
+        /**
+         * Takes an idle matcher with these settings, or creates one.
+         */
+        unique_ptr<StereoMatcher> acquire(
+                StereoAlgorithm algorithm,
+                int minDisp,
+                int maxDisp);
+
+        /**
+         * Returns a matcher for later jobs.
+         */
+        void release(
+                unique_ptr<StereoMatcher> matcher);
+};
+
+enum class ServerJobKind {
+    STEREO,
+    INTERPOLATE
+};
+
+/**
+ * Largest encoded image accepted in a request frame.  A larger frame ends
+ * the connection, since its contents cannot be skipped safely.
+ */
+const size_t maxImageFrameSize = 64 << 20;
+
+/**
+ * Workers of each StereoServer pool unless told otherwise.  Matching
+ * parallelizes internally, so two jobs in flight keep the CPU busy while
+ * the next one is decoded.
+ */
+const int defaultPoolThreads = 2;
+
+/**
+ * One request and its progress through the pipeline.
+ */
+struct ServerJob {
+    string id;
+
+    ServerJobKind kind;
+
+    StereoAlgorithm algorithm;
+
+    int minDisp;
+
+    int maxDisp;
+
+    /**
+     * Position of the view to render between left (0) and right (1).
+     */
+    float t;
+
+    /**
+     * Encoded images as received.
+     */
+    string leftData, rightData;
+
+    CImg<uint8_t> left, right;
+
+    CImg<float> disp;
+
+    CImg<uint8_t> view;
+
+    /**
+     * Encoded result sent after the reply header.
+     */
+    string payload;
+
+    bool ok;
+
+    string error;
+
+    StageTimer timer;
+
+    int outFd;
+};
+
+/**
+ * Serves stereo and interpolation jobs from a stream of length-prefixed
+ * frames, keeping thread pools and matchers warm from one job to the
+ * next.
+ *
+ * Every frame is a 4-byte little-endian length followed by that many
+ * bytes.  A request is three frames: a text header, then the left and
+ * right images encoded as PNG or JPEG.  Headers are either
+ *
+ *   stereo ID ALGORITHM MIN_DISP MAX_DISP
+ *   interpolate ID ALGORITHM MIN_DISP MAX_DISP T
+ *
+ * where ID is any token echoed in the reply.  Each reply starts with a
+ * JSON header frame holding the id, status, error or result size, and
+ * stage timings.  Successful replies are followed by a payload frame:
+ * the disparity as row-major little-endian floats for stereo (same
+ * convention as StereoMatcher), or the view at T encoded as PNG for
+ * interpolate.
+ *
+ * Any exception raised while decoding, matching or encoding fails only
+ * its own job, which gets an error reply.
+ *
+ * Decoding, matching and encoding run in separate pools, so consecutive
+ * jobs overlap.  Replies are sent as jobs finish, which may differ from
+ * the order of the requests.
+ */
+class StereoServer {
+    private:
+        MatcherCache matchers;
+
+        ThreadPool decodePool;
+
+        ThreadPool computePool;
+
+        ThreadPool encodePool;
+
+        /**
+         * Serializes replies on the output.
+         */
+        mutex replyMutex;
+
+        /**
+         * Jobs read but not yet replied to, bounded to limit the memory
+         * held by queued images.
+         */
+        int inFlight;
+
+        int maxInFlight;
+
+        mutex inFlightMutex;
+
+        condition_variable inFlightChanged;
+
+        void decode(
+                ServerJob& job);
+
+        void compute(
+                ServerJob& job);
+
+        void encode(
+                ServerJob& job);
+
+        void reply(
+                ServerJob& job);
+
+        void finishJob(
+                const shared_ptr<ServerJob>& job);
+
+    public:
+        /**
+         * Runs numThreads workers in each pool, or defaultPoolThreads if
+         * numThreads <= 0.  Each matching job uses an equal share of the
+         * OpenMP threads (see ThreadPool).
+         */
+        StereoServer(
+                int numThreads);
+
+        /**
+         * Serves requests read from inFd, replying on outFd, until inFd
+         * is closed.  Returns once every reply has been sent.
+         */
+        void serve(
+                int inFd,
+                int outFd);
+
+        /**
+         * Listens on a Unix domain socket and serves its connections one
+         * after another.  Only returns if the socket cannot be set up.
+         */
+        bool listen(
+                const string& path,
+                string& error);
+};
+
+/**
+ * Reads one frame.  Returns false at the end of the stream, on errors,
+ * or if the frame is larger than maxSize.
+ */
+bool readFrame(
+        int fd,
+        string& frame,
+        size_t maxSize = 1 << 30);
+
+bool writeFrame(
+        int fd,
+        const void* data,
+        size_t size);
+
+/**
+ * Replaces invalid (FLT_MAX) disparities by the farther of the nearest
+ * valid disparities on their row, since they are mostly occlusions.
+ * Rows without any valid disparity are set to 0.
+ */
+void fillInvalidDisparities(
+        CImg<float>& disp);
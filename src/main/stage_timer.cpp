@@ -0,0 +1,60 @@
+#include "stage_timer.h"
+
+#include <sys/resource.h>
+
+double processCpuMs() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+long peakRssKb() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Linux reports kilobytes
+    return usage.ru_maxrss;
+}
+
+StageTimer::StageTimer() :
+    running(false),
+    cpuStart(0.0) {
+}
+
+void StageTimer::start(
+        const string& name) {
+    stop();
+
+    StageTiming stage;
+
+    stage.name = name;
+    stage.wallMs = 0.0;
+    stage.cpuMs = 0.0;
+    stage.peakRssKb = 0;
+
+    stages.push_back(stage);
+
+    running = true;
+
+    wallStart = chrono::steady_clock::now();
+    cpuStart = processCpuMs();
+}
+
+void StageTimer::stop() {
+    if (!running) {
+        return;
+    }
+
+    StageTiming& stage = stages.back();
+
+    stage.wallMs = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - wallStart).count();
+    stage.cpuMs = processCpuMs() - cpuStart;
+    stage.peakRssKb = peakRssKb();
+
+    running = false;
+}
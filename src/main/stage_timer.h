@@ -0,0 +1,60 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+
+/**
+ * Resources used by one stage of a job.
+ */
+struct StageTiming {
+    string name;
+
+    double wallMs;
+
+    /**
+     * CPU time of the whole process over the stage, so that OpenMP
+     * threads are included.  When several jobs run at once it includes
+     * their work too.
+     */
+    double cpuMs;
+
+    /**
+     * Peak resident set size of the process at the end of the stage.
+     */
+    long peakRssKb;
+};
+
+/**
+ * Records the wall time, CPU time and peak RSS of consecutive stages.
+ * Starting a stage ends the previous one.
+ */
+class StageTimer {
+    private:
+        vector<StageTiming> stages;
+
+        bool running;
+
+        chrono::steady_clock::time_point wallStart;
+
+        double cpuStart;
+
+    public:
+        StageTimer();
+
+        void start(
+                const string& name);
+
+        void stop();
+
+        inline const vector<StageTiming>& getStages() const {
+            return stages;
+        }
+};
+
+/**
+ * CPU time (user + system) used by the process so far.
+ */
+double processCpuMs();
+
+long peakRssKb();
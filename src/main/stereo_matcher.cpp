@@ -0,0 +1,338 @@
+#include "stereo_matcher.h"
+
+#include "instrument/instrument.h"
+
+#include "old/dpstereo.h"
+
+#include "pmstereo/pmstereo.h"
+
+bool parseStereoAlgorithm(
+        const string& name,
+        StereoAlgorithm& algorithm) {
+    if (name == "cvstereo") {
+        algorithm = StereoAlgorithm::CVSTEREO;
+    } else if (name == "patchmatch") {
+        algorithm = StereoAlgorithm::PATCHMATCH;
+    } else if (name == "dp") {
+        algorithm = StereoAlgorithm::DP;
+    } else if (name == "polar") {
+        algorithm = StereoAlgorithm::POLAR;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+const char* stereoAlgorithmName(
+        StereoAlgorithm algorithm) {
+    switch (algorithm) {
+        case StereoAlgorithm::CVSTEREO:
+            return "cvstereo";
+        case StereoAlgorithm::PATCHMATCH:
+            return "patchmatch";
+        case StereoAlgorithm::DP:
+            return "dp";
+        case StereoAlgorithm::POLAR:
+            return "polar";
+    }
+
+    return "unknown";
+}
+
+/**
+ * SGBM needs a multiple of 16 disparities.
+ */
+static int sgbmNumDisparities(
+        int minDisp,
+        int maxDisp) {
+    return ((maxDisp - minDisp + 16) / 16) * 16;
+}
+
+CImg<uint8_t> toGray(
+        const CImg<uint8_t>& img) {
+    if (img.spectrum() == 1) {
+        return CImg<uint8_t>(img, true);
+    }
+
+    return img.get_RGBtoYCbCr().channel(0);
+}
+
+CImg<uint8_t> toRGB(
+        const CImg<uint8_t>& img) {
+    if (img.spectrum() == 3) {
+        return CImg<uint8_t>(img, true);
+    }
+
+    // 1 indicates nearest-neighbor resampling, which replicates the channel
+    return img.get_resize(-100, -100, -100, 3, 1);
+}
+
+StereoMatcher::StereoMatcher(
+        StereoAlgorithm _algorithm,
+        int _minDisp,
+        int _maxDisp) :
+    algorithm(_algorithm),
+    minDisp(_minDisp),
+    maxDisp(_maxDisp),
+    sgbm(CVStereo::createSGBM(minDisp,
+                sgbmNumDisparities(minDisp, maxDisp))),
+    hasPolarF(false),
+    polarWidth(0),
+    polarHeight(0) {
+    polar.setCoarseToFine(true);
+}
+
+bool StereoMatcher::compute(
+        const CImg<uint8_t>& left,
+        const CImg<uint8_t>& right,
+        CImg<float>& disp,
+        string& error) {
+    INSTRUMENT_SCOPE(stereoAlgorithmName(algorithm));
+
+    if (!left.is_sameXYZC(right)) {
+        error = "images differ in size";
+        return false;
+    }
+
+    switch (algorithm) {
+        case StereoAlgorithm::CVSTEREO:
+            return computeCVStereo(left, right, disp);
+        case StereoAlgorithm::PATCHMATCH:
+            return computePatchMatch(left, right, disp);
+        case StereoAlgorithm::DP:
+            return computeDP(left, right, disp);
+        case StereoAlgorithm::POLAR:
+            return computePolar(left, right, disp, error);
+    }
+
+    error = "unknown algorithm";
+    return false;
+}
+
+bool StereoMatcher::computeCVStereo(
+        const CImg<uint8_t>& left,
+        const CImg<uint8_t>& right,
+        CImg<float>& disp) {
+    CImg<uint8_t> leftGray = toGray(left);
+    CImg<uint8_t> rightGray = toGray(right);
+
+    raw.assign(left.width(), left.height());
+
+    CVStereo::stereo(
+            sgbm,
+            left.width(),
+            left.height(),
+            leftGray.data(),
+            rightGray.data(),
+            raw.data());
+
+    disp.assign(left.width(), left.height());
+
+    cimg_forXY(disp, x, y) {
+        float d = raw(x, y) / 16.0f;
+
+        if (d < minDisp || d > maxDisp) {
+            disp(x, y) = std::numeric_limits<float>::max();
+        } else {
+            disp(x, y) = d;
+        }
+    }
+
+    return true;
+}
+
+bool StereoMatcher::computePatchMatch(
+        const CImg<uint8_t>& left,
+        const CImg<uint8_t>& right,
+        CImg<float>& disp) {
+    const int numParticles = 2;
+    const int wndSize = 7;
+    const int iterations = 4;
+    const float randomSearchFactor = 1.0f;
+
+    CImg<float> lab1 = toRGB(left);
+    CImg<float> lab2 = toRGB(right);
+
+    lab1.RGBtoLab();
+    lab2.RGBtoLab();
+
+    CImg<float> grad1 = lab1.get_gradient("x")[0];
+    CImg<float> grad2 = lab2.get_gradient("x")[0];
+
+    int width = left.width();
+    int height = left.height();
+
+    // The particle stores are only reallocated when the size changes
+    fieldLeft.assign(width, height, numParticles, 1);
+    fieldRight.assign(width, height, numParticles, 1);
+    distLeft.assign(width, height, numParticles, 1);
+    distRight.assign(width, height, numParticles, 1);
+    sortedLeft.assign(width, height, numParticles, 1);
+    sortedRight.assign(width, height, numParticles, 1);
+
+    // Translational fields map x to x + field(x), hence the negated range
+    // on the left
+    fieldLeft.rand(-maxDisp, -minDisp);
+    fieldRight.rand(minDisp, maxDisp);
+
+    distLeft = std::numeric_limits<float>::infinity();
+    distRight = std::numeric_limits<float>::infinity();
+
+    cimg_forXYZ(sortedLeft, x, y, z) {
+        sortedLeft(x, y, z) = z;
+        sortedRight(x, y, z) = z;
+    }
+
+    patchMatchTranslationalCorrespondence(lab1, lab2, grad1, grad2,
+            fieldLeft, fieldRight, distLeft, distRight,
+            sortedLeft, sortedRight,
+            wndSize, iterations, randomSearchFactor, 1);
+
+    disp.assign(width, height);
+
+    cimg_forXY(disp, x, y) {
+        int best = sortedLeft(x, y, 0);
+
+        float d = -fieldLeft(x, y, best);
+
+        if (distLeft(x, y, best) == std::numeric_limits<float>::infinity() ||
+                d < minDisp || d > maxDisp) {
+            disp(x, y) = std::numeric_limits<float>::max();
+        } else {
+            disp(x, y) = d;
+        }
+    }
+
+    return true;
+}
+
+bool StereoMatcher::computeDP(
+        const CImg<uint8_t>& left,
+        const CImg<uint8_t>& right,
+        CImg<float>& disp) {
+    const int smallDisp = 1;
+    const float costLargeDisp = 100.0f;
+
+    // StereoProblem maps x to x + disp
+    StereoProblem problem(toRGB(left), toRGB(right), -maxDisp, -minDisp);
+
+    DPStereo dp(nullptr, smallDisp, costLargeDisp, costLargeDisp);
+
+    dp.computeStereoFast(problem);
+
+    disp = problem.disp;
+
+    cimg_for(disp, d, float) {
+        if (*d != std::numeric_limits<float>::max()) {
+            *d = -*d;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Root mean square distance of the inlier matches of estimator to their
+ * epipolar lines under F, in pixels, over both images.  F maps left
+ * points to lines in the right image, as estimated by OpenCV.
+ */
+static double epipolarResidual(
+        CVFundamentalMatrixEstimator& estimator,
+        const Eigen::Matrix3d& F) {
+    double sumSq = 0.0;
+    int count = 0;
+
+    Eigen::Vector2d left, right;
+
+    for (int i = 0; i < estimator.getMatchCount(); i++) {
+        if (!estimator.getMatch(i, left, right)) {
+            continue;
+        }
+
+        Eigen::Vector3d lineRight = F * left.homogeneous();
+        Eigen::Vector3d lineLeft = F.transpose() * right.homogeneous();
+
+        double e = right.homogeneous().dot(lineRight);
+
+        sumSq += e * e / lineRight.head<2>().squaredNorm() +
+            e * e / lineLeft.head<2>().squaredNorm();
+        count += 2;
+    }
+
+    return (count == 0) ? numeric_limits<double>::infinity() :
+        sqrt(sumSq / count);
+}
+
+bool StereoMatcher::computePolar(
+        const CImg<uint8_t>& left,
+        const CImg<uint8_t>& right,
+        CImg<float>& disp,
+        string& error) {
+    const int maxFeatures = 2000;
+    const int patchSize = 31;
+    const int numScales = 3;
+    const float scaleStep = 0.5f;
+
+    // The previous geometry is kept while its epipolar lines are at most
+    // this much farther from the matches than those of the new estimate
+    const double reuseTolerance = 0.5;
+
+    CImg<uint8_t> leftGray = toGray(left);
+    CImg<uint8_t> rightGray = toGray(right);
+
+    // Estimate the epipolar geometry from ORB matches
+    CVFeatureMatcher leftFeatures(maxFeatures, patchSize);
+    CVFeatureMatcher rightFeatures(maxFeatures, patchSize);
+
+    leftFeatures.detectFeatures(leftGray);
+    rightFeatures.detectFeatures(rightGray);
+
+    CVFundamentalMatrixEstimator estimator;
+
+    estimator.init(leftFeatures, rightFeatures);
+
+    Eigen::Matrix3d F;
+
+    estimator.estimateFundamentalMatrix(F);
+
+    // Any inlier fixes the orientation of the epipolar lines
+    array<Eigen::Vector2d, 2> match;
+
+    bool hasMatch = false;
+
+    for (int i = 0; i < estimator.getMatchCount() && !hasMatch; i++) {
+        hasMatch = estimator.getMatch(i, match[0], match[1]);
+    }
+
+    if (!hasMatch) {
+        error = "polar rectification is not possible for this pair";
+        return false;
+    }
+
+    bool reuseF = hasPolarF &&
+        polarWidth == left.width() &&
+        polarHeight == left.height() &&
+        epipolarResidual(estimator, polarF.getMatrix()) <=
+            epipolarResidual(estimator, F) + reuseTolerance;
+
+    if (!reuseF) {
+        PolarFundamentalMatrix newF;
+
+        if (!newF.init(F, match)) {
+            error = "polar rectification is not possible for this pair";
+            return false;
+        }
+
+        polarF = newF;
+        hasPolarF = true;
+        polarWidth = left.width();
+        polarHeight = left.height();
+    }
+
+    polar.computeStereo(numScales, scaleStep, polarF, leftGray, rightGray);
+
+    disp = polar.getDisparityAtScale(0);
+
+    return true;
+}
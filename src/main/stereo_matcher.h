@@ -0,0 +1,152 @@
+#pragma once
+
+#include "common.h"
+
+#include "cvutil/cvutil.h"
+
+#include "old/polar_stereo.h"
+
+enum class StereoAlgorithm {
+    CVSTEREO,
+    PATCHMATCH,
+    DP,
+    POLAR
+};
+
+/**
+ * Parses "cvstereo", "patchmatch", "dp" or "polar".  Returns false for any
+ * other name.
+ */
+bool parseStereoAlgorithm(
+        const string& name,
+        StereoAlgorithm& algorithm);
+
+const char* stereoAlgorithmName(
+        StereoAlgorithm algorithm);
+
+/**
+ * Computes dense disparity for pairs of images with one algorithm, without
+ * ever displaying anything.  State which does not depend on the images
+ * (SGBM scratch, PatchMatch particle stores, polar rectification maps) is kept from one
+ * pair to the next, so a matcher should be reused for pairs of the same
+ * size.  Polar rectification maps are only kept while the epipolar
+ * geometry stays the same, as with a fixed camera rig.  A matcher must
+ * not be used by several threads at once.
+ *
+ * Images are 8-bit RGB or grayscale, with the same size.  Disparities
+ * follow the convention of DenseWarpRenderer: left pixel x matches right
+ * pixel x - disp(x), and disparities lie in [minDisp, maxDisp].  Pixels
+ * without a valid match are set to FLT_MAX.  The polar algorithm is the
+ * exception: it handles unrectified pairs, and its disparities are
+ * differences of distances to the epipoles.
+ */
+class StereoMatcher {
+    private:
+        StereoAlgorithm algorithm;
+
+        int minDisp;
+
+        int maxDisp;
+
+        /**
+         * Keeps its scratch buffer between pairs.
+         */
+        cv::StereoSGBM sgbm;
+
+        /**
+         * SGBM output, in sixteenths of a pixel.
+         */
+        CImg<int16_t> raw;
+
+        /**
+         * PatchMatch particles of each view.
+         */
+        CImg<float> fieldLeft, fieldRight;
+
+        CImg<float> distLeft, distRight;
+
+        CImg<int> sortedLeft, sortedRight;
+
+        /**
+         * Keeps its rectification maps while the fundamental matrix and
+         * image size do not change.
+         */
+        PolarStereo polar;
+
+        /**
+         * Epipolar geometry of the previous polar pair, kept for the next
+         * pair of the same size if it still fits that pair's matches.  F
+         * is estimated again for every pair, and noise alone would
+         * otherwise rebuild the rectification maps each time.
+         */
+        PolarFundamentalMatrix polarF;
+
+        bool hasPolarF;
+
+        int polarWidth;
+
+        int polarHeight;
+
+        bool computeCVStereo(
+                const CImg<uint8_t>& left,
+                const CImg<uint8_t>& right,
+                CImg<float>& disp);
+
+        bool computePatchMatch(
+                const CImg<uint8_t>& left,
+                const CImg<uint8_t>& right,
+                CImg<float>& disp);
+
+        bool computeDP(
+                const CImg<uint8_t>& left,
+                const CImg<uint8_t>& right,
+                CImg<float>& disp);
+
+        bool computePolar(
+                const CImg<uint8_t>& left,
+                const CImg<uint8_t>& right,
+                CImg<float>& disp,
+                string& error);
+
+    public:
+        StereoMatcher(
+                StereoAlgorithm _algorithm,
+                int _minDisp,
+                int _maxDisp);
+
+        inline StereoAlgorithm getAlgorithm() const {
+            return algorithm;
+        }
+
+        inline int getMinDisp() const {
+            return minDisp;
+        }
+
+        inline int getMaxDisp() const {
+            return maxDisp;
+        }
+
+        /**
+         * Returns false, with a message in error, if the pair cannot be
+         * matched.
+         */
+        bool compute(
+                const CImg<uint8_t>& left,
+                const CImg<uint8_t>& right,
+                CImg<float>& disp,
+                string& error);
+};
+
+/**
+ * Converts an RGB image to 8-bit luma.  A grayscale image is returned as a
+ * shared view of itself rather than copied.
+ */
+CImg<uint8_t> toGray(
+        const CImg<uint8_t>& img);
+
+/**
+ * Replicates the channel of a grayscale image into RGB.  An RGB image is
+ * returned as a shared view of itself rather than copied.
+ */
+CImg<uint8_t> toRGB(
+        const CImg<uint8_t>& img);
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <omp.h>
+
+/**
+ * A fixed set of worker threads which run queued tasks in FIFO order.
+ *
+ * Tasks may use OpenMP internally.  Each worker gets its own OpenMP team,
+ * limited to an equal share of the OpenMP threads (OMP_NUM_THREADS or one
+ * per hardware thread), so that busy workers do not oversubscribe the CPU.
+ */
+class ThreadPool {
+    private:
+        vector<thread> workers;
+
+        deque<function<void()>> tasks;
+
+        mutex tasksMutex;
+
+        condition_variable tasksChanged;
+
+        /**
+         * Number of tasks which are queued or running.
+         */
+        int pending;
+
+        bool stopping;
+
+        inline void workerLoop(
+                int ompThreads) {
+            omp_set_num_threads(ompThreads);
+
+            while (true) {
+                function<void()> task;
+
+                {
+                    unique_lock<mutex> lock(tasksMutex);
+
+                    tasksChanged.wait(lock, [this]() {
+                        return stopping || !tasks.empty();
+                    });
+
+                    if (tasks.empty()) {
+                        return;
+                    }
+
+                    task = move(tasks.front());
+                    tasks.pop_front();
+                }
+
+                task();
+
+                {
+                    unique_lock<mutex> lock(tasksMutex);
+
+                    pending--;
+                }
+
+                tasksChanged.notify_all();
+            }
+        }
+
+    public:
+        /**
+         * numThreads <= 0 uses one worker per hardware thread.
+         */
+        inline ThreadPool(
+                int numThreads) :
+            pending(0),
+            stopping(false) {
+            if (numThreads <= 0) {
+                numThreads = max(1u, thread::hardware_concurrency());
+            }
+
+            int ompThreads = max(1, omp_get_max_threads() / numThreads);
+
+            for (int i = 0; i < numThreads; i++) {
+                workers.push_back(thread(&ThreadPool::workerLoop, this,
+                            ompThreads));
+            }
+        }
+
+        /**
+         * Finishes every queued task, then joins the workers.
+         */
+        inline ~ThreadPool() {
+            {
+                unique_lock<mutex> lock(tasksMutex);
+
+                stopping = true;
+            }
+
+            tasksChanged.notify_all();
+
+            for (thread& worker : workers) {
+                worker.join();
+            }
+        }
+
+        inline int size() const {
+            return workers.size();
+        }
+
+        inline void enqueue(
+                function<void()> task) {
+            {
+                unique_lock<mutex> lock(tasksMutex);
+
+                tasks.push_back(move(task));
+
+                pending++;
+            }
+
+            tasksChanged.notify_all();
+        }
+
+        /**
+         * Blocks until every task enqueued so far has finished.
+         */
+        inline void wait() {
+            unique_lock<mutex> lock(tasksMutex);
+
+            tasksChanged.wait(lock, [this]() {
+                return pending == 0;
+            });
+        }
+};
@@ -1,9 +1,12 @@
 #include "adaptbp.h"
 
-#include "Halide.h"
+#include "planefit.h"
 
-#include "cvutil/cvutil.h"
+#include "adaptbp_cost.h"
 
+#include "instrument/instrument.h"
+
+#include <algorithm>
 #include <tuple>
 #include <vector>
 #include <list>
@@ -11,8 +14,6 @@
 
 using namespace std;
 
-namespace ogm = opengm;
-
 AdaptBPStereo::AdaptBPStereo(
         const CImg<int16_t>& _left,
         const CImg<int16_t>& _right,
@@ -24,501 +25,309 @@ AdaptBPStereo::AdaptBPStereo(
     maxDisp(_maxDisp),
     omega(0.5f),
     smoothFactor(10.0f),
-    numSuperpixels(2048) {
+    numSuperpixels(2048),
+    candidateHops(2),
+    numGlobalPlanes(16),
+    costSubsample(2) {
 }
 
 void AdaptBPStereo::computeGreedyDisp() {
-    assert(left.is_sameXYZC(right));
-    
-    Halide::Buffer leftBuf(
-            Halide::Int(16),
-            left.width(), left.height(),
-            1, left.spectrum(),
-            (uint8_t*) left.data(), string("leftBuf"));
-
-    Halide::Buffer rightBuf(
-            Halide::Int(16),
-            right.width(), right.height(),
-            1, right.spectrum(),
-            (uint8_t*) right.data(), string("rightBuf"));
-
-    // Inputs
-    Halide::Image<int16_t> leftImg(leftBuf.raw_buffer(), string("leftImg"));
-    Halide::Image<int16_t> rightImg(rightBuf.raw_buffer(), string("rightImg"));
-
-    Halide::Param<float> omegaParam;
-    Halide::Param<int> minDispParam;
-    Halide::Param<int> maxDispParam;
-
-    // TODO omega should be dynamically chosen
-    omegaParam.set(omega);
-    minDispParam.set(minDisp);
-    maxDispParam.set(maxDisp);
-
-    // Variables
-    
-    Halide::Var x("x"), y("y"), c("c"), d("d");
-    
-    Halide::RDom rDisp(minDispParam, maxDispParam);
-    Halide::RDom rC(0, 2);
-
-    int wndRad = 1;
-    Halide::RDom r3x3(-wndRad, wndRad, -wndRad, wndRad);
-    Halide::RDom r3x2(-wndRad, 0, -wndRad, wndRad);
-    Halide::RDom r2x3(-wndRad, wndRad, -wndRad, 0);
-
-    // Helper expressions to clamp to image bounds
-    
-    Halide::Expr cx = clamp(x,
-            max(-minDispParam, 1),
-            min(left.width() - maxDispParam, left.width() - 2));
-
-    Halide::Expr cy = clamp(y, 1, left.height() - 2);
-
-    Halide::Func leftC("leftC");
-    Halide::Func rightC("rightC");
-    // TODO what's the overhead of this?  check compiler output...
-    leftC(x, y, c) = leftImg(cx, cy, 0, c);
-    rightC(x, y, c) = rightImg(cx, cy, 0, c);
-    
-    // C_SAD(x, y, c, d) ...
-    Halide::Func absDiff("absDiff"), cSAD("cSAD");
-
-    absDiff(x, y, c, d) = Halide::abs(leftC(x, y, c) - rightC(x + d, y, c));
-
-    cSAD(x, y, c, d) += absDiff(x + r3x3.x, y + r3x3.y, c, d);
-
-    // C_GRAD(x, y, c, d)...
-    Halide::Func gradX1("gradX1"), gradX2("gradX2");
-    Halide::Func gradY1("gradY1"), gradY2("gradY2");
-    Halide::Func absGradX("absGradX"), absGradY("absGradY");
-    Halide::Func cGrad("cGrad");
-    
-    gradX1(x, y, c) = leftC(x + 1, y, c) - leftC(x, y, c);
-    gradX2(x, y, c) = rightC(x + 1, y, c) - rightC(x, y, c);
-
-    gradY1(x, y, c) = leftC(x, y + 1, c) - leftC(x, y, c);
-    gradY2(x, y, c) = rightC(x, y + 1, c) - rightC(x, y, c);
-
-    absGradX(x, y, c, d) = Halide::abs(gradX1(x, y, c) - gradX2(x + d, y, c));
-
-    absGradY(x, y, c, d) = Halide::abs(gradY1(x, y, c) - gradY2(x + d, y, c));
+    // Use the ahead-of-time compiled pipeline when it was linked in, and
+    // otherwise JIT compile it, once per process.  The JIT serializes its
+    // callers.
+    if (computeGreedyDispAOT(left, right, minDisp, maxDisp, omega, disp)) {
+        return;
+    }
 
-    cGrad(x, y, c, d) +=
-        absGradX(x + r3x2.x, y + r3x2.y, c, d) +
-        absGradY(x + r3x2.x, y + r3x2.y, c, d);
+    static GreedyDispJIT jit;
 
-    // C(x, y, d)...
-    Halide::Func cost("cost");
-    // TODO Robustify cSAD and cGrad with a max distance learned from optimization
-    cost(x, y, d) += 
-        (1.0f - omegaParam) * Halide::cast(Halide::Float(32), cSAD(x, y, rC, d)) +
-        omegaParam * Halide::cast(Halide::Float(32), cGrad(x, y, rC, d));
+    // TODO omega should be dynamically chosen
+    jit.compute(left, right, minDisp, maxDisp, omega, disp);
+}
 
-    // Argmin_d(x, y)...
-    Halide::Func minCostDisparity("minCostDisparity");
+void AdaptBPStereo::fitPlanes(
+        bool assignSegmentsToPlanes) {
+    SegmentPlaneFitter fitter(&segmentation);
 
-    minCostDisparity(x, y) = Halide::cast(Halide::Int(16), 0);
+    vector<Plane> segmentPlanes;
 
-    Halide::Expr bestDisparitySoFar =
-        cost(x, y, clamp(minCostDisparity(x, y), minDispParam, maxDispParam));
+    fitter.fit(disp, minDisp, maxDisp, segmentPlanes);
 
-    minCostDisparity(x, y) = select(
-            cost(x, y, rDisp) < bestDisparitySoFar,
-            Halide::cast(Halide::Int(16), rDisp),
-            minCostDisparity(x, y));
-    
-    // Argmin_d_reverse(x, y)...
-    Halide::Func costRev("costRev");
+    planes.clear();
+    planeSegments.clear();
 
-    costRev(x, y, d) = cost(x + d, y, -d);
+    for (int segI = 0; segI < (int) segmentPlanes.size(); segI++) {
+        // Create a plane for each superpixel, or only for those which
+        // could be fitted
+        if (assignSegmentsToPlanes || segmentPlanes[segI].isValid()) {
+            planes.push_back(segmentPlanes[segI]);
+            planeSegments.push_back(segI);
+        }
+    }
 
-    Halide::Func minCostDisparityRev("minCostDisparityRev");
+    if (assignSegmentsToPlanes) {
+        int numSegments = segmentation.size();
 
-    minCostDisparityRev(x, y) = Halide::cast(Halide::Int(16), 0);
+        superpixelPlaneMap = vector<size_t>(numSegments);
 
-    Halide::Expr bestDisparitySoFarRev =
-        costRev(x, y, clamp(minCostDisparityRev(x, y), -maxDispParam, -minDispParam));
+        for (int segI = 0; segI < numSegments; segI++) {
+            superpixelPlaneMap[segI] = segI;
+        }
+    }
+}
 
-    minCostDisparityRev(x, y) = select(
-            costRev(x, y, -rDisp) < bestDisparitySoFarRev,
-            Halide::cast(Halide::Int(16), -rDisp),
-            minCostDisparityRev(x, y));
+void AdaptBPStereo::getDisparity(
+        CImg<float>& disp) {
+    disp = CImg<float>(left.width(), left.height());
 
-    // Holes(x, y)...
-    Halide::Expr revX = minCostDisparity(x, y) + x;
-    Halide::Expr revXC = Halide::clamp(revX, 0, left.width() - 1);
+    disp = 0.0f;
 
-    Halide::Expr consistent = Halide::select(revXC == revX,
-            Halide::abs(
-                minCostDisparityRev(revXC, y) + minCostDisparity(x, y)
-                ) < 2.0f,
-            false);
+    for (int superpixelI = 0; superpixelI < (int) segmentation.size(); superpixelI++) {
+        size_t planeI = superpixelPlaneMap[superpixelI];
 
-    // Result(x, y)...
-    Halide::Func result("result");
+        if (planeI < planes.size() && planes[planeI].isValid()) {
+            const Plane& plane = planes[planeI];
 
-    // TODO Only compute over valid range of x values (ignore left & right border)
-    Halide::Expr validX = Halide::clamp(
-            x,
-            Halide::max(0, -minDispParam),
-            Halide::min(left.width() - 1, left.width() - maxDispParam));
-    
-    result(x, y) =
-        Halide::select(consistent,
-                Halide::cast(Halide::Float(32),
-                    Halide::select(x == validX,
-                        minCostDisparity(validX, y),
-                        Halide::Float(32).max()
-                        )
-                    ),
-                Halide::Float(32).max());
-
-    // Schedule...
-    absDiff
-        .reorder(x, c, d, y)
-        .compute_at(cSAD, x)
-        .store_at(cSAD, d)
-        .bound(c, 0, 2);
-
-    cSAD
-        .reorder(x, c, d, y)
-        .compute_at(cost, x)
-        .store_root()
-        .reorder_storage(x, c, d, y)
-        .bound(c, 0, 2);
-
-    gradX1
-        .reorder(x, c, y)
-        .compute_at(absGradX, x)
-        .store_root()
-        .bound(c, 0, 2);
-
-    gradX2
-        .reorder(x, c, y)
-        .compute_at(absGradX, x)
-        .store_root()
-        .bound(c, 0, 2);
-
-    gradY1
-        .reorder(x, c, y)
-        .compute_at(absGradY, x)
-        .store_root()
-        .bound(c, 0, 2);
-
-    gradY2
-        .reorder(x, c, y)
-        .compute_at(absGradY, x)
-        .store_root()
-        .bound(c, 0, 2);
-
-    absGradX
-        .reorder(x, c, y)
-        .compute_at(cGrad, x)
-        .store_root()
-        .bound(c, 0, 2);
-
-    absGradY
-        .reorder(x, c, y)
-        .compute_at(cGrad, x)
-        .store_root()
-        .bound(c, 0, 2);
-
-    cGrad
-        .reorder(x, c, d, y)
-        .compute_at(cost, x)
-        .reorder_storage(x, c, d, y)
-        .bound(c, 0, 2)
-        .store_root();
-
-    cost
-        .reorder(x, y)
-        .compute_at(result, y)
-        .store_root();
-
-    minCostDisparity
-        .reorder(x, y)
-        .compute_at(result, y)
-        .store_root()
-        .bound(x, 0, left.width())
-        .bound(y, 0, left.height());
-
-    minCostDisparityRev
-        .reorder(x, y)
-        .compute_at(result, y)
-        .store_root()
-        .bound(x, 0, left.width())
-        .bound(y, 0, left.height());
-
-    result.compute_inline()
-        .reorder(x, y);
-
-    vector<Halide::Argument> args;
-    args.push_back(leftImg);
-    args.push_back(rightImg);
-    args.push_back(minDispParam);
-    args.push_back(maxDispParam);
-    args.push_back(omegaParam);
-
-    printf("Compiling...\n");
-    // result.compile_to_c("result.cpp", args);
-    result.compile_jit();
-    printf("Done\n");
-
-    printf("Running...\n");
-    Halide::Realization r = result.realize(leftImg.width(), leftImg.height());
-    printf("Done...\n");
-
-    // Copy out the results from buffer to CImg
-    {
-        Halide::Buffer disparityBuf = r[0];
-        Halide::Image<int16_t> disparityImg(disparityBuf);
+            // Iterate over all pixels within the superpixel
+            for (const SegmentRun& run : segmentation.getRuns(superpixelI)) {
+                float* row = disp.data(0, run.y);
 
-        disp = CImg<int16_t>(left.width(), left.height());
-        cimg_forXY(disp, x, y) {
-            disp(x, y) = disparityImg(x, y);
+                for (int x = run.x0; x < run.x1; x++) {
+                    row[x] = plane.dispAt(x, run.y);
+                }
+            }
         }
-
     }
 }
 
-/**
- * Estimates slant (dD/dt) from a set of samples of (D, t)
- * samples for which all non-t dimensions are constant.
- *
- * For example, if dSamples contains a set of (D, x) samples
- * from the same horizontal scan-line (fixed y-coordinate),
- * it will estimate dD/dx.
- *
- * Returns true upon success, false if not enough samples were provided.
- */
-inline bool AdaptBPStereo::estimateSlant(
-        const map<uint16_t, vector<tuple<uint16_t, float>>>& dSamples,
-        float& result) {
-    int totalSamplePairs = 0;
-    for (const auto& samples : dSamples) {
-        int n = samples.second.size() - 1;
-        totalSamplePairs += n * (n + 1) / 2;
-    }
-
-    if (totalSamplePairs < 1) {
+bool AdaptBPStereo::isInBounds(
+        segmentH_t segH,
+        const Plane& plane) const {
+    if (!plane.isValid()) {
         return false;
     }
 
-    // Store all possible samples of dt, each consisting of a finite difference
-    // between elements in the same scanline, as given by dSamples.
-    CImg<float> dtSamples(totalSamplePairs);
+    int minX, minY, maxX, maxY;
 
-    // Index into dtSamples at which to insert new samples
-    int dtSamplesI = 0;
+    segmentation[segH].getBounds(minX, minY, maxX, maxY);
 
-    for (const auto& samplesPair: dSamples) {
-        const vector<tuple<uint16_t, float>>& samples = samplesPair.second;
+    for (int i = 0; i < 4; i++) {
+        int x = ((i & 0x01) == 0) ? minX : maxX;
+        int y = ((i & 0x02) == 0) ? minY : maxY;
 
-        for (int i = 0; i < samples.size(); i++) {
-            for (int j = i + 1; j < samples.size(); j++) {
-                assert(dtSamplesI < dtSamples.width());
-                dtSamples(dtSamplesI) = 
-                    ((float) get<1>(samples[j]) - get<1>(samples[i])) /
-                    ((float) get<0>(samples[j]) - get<0>(samples[i]));
-                dtSamplesI++;
-            }
-        }
-    }
-
-    dtSamples.sort();
+        float disp = plane.dispAt(x, y);
 
-    // TODO The paper doesn't specify blur kernel size!
-    // dtSamples.blur(min(1.0f, dtSamples.size() / 16.0f));
+        int rx = (int) (x + disp + 0.5f);
 
-    result = dtSamples(dtSamples.size() / 2);
+        if (disp > maxDisp ||
+                disp < minDisp ||
+                rx < 0 ||
+                rx > right.width() - 2) {
+            return false;
+        }
+    }
 
     return true;
 }
 
+float AdaptBPStereo::getPlaneCost(
+        segmentH_t segH,
+        const Plane& plane,
+        const CImgList<int16_t>& leftGrad,
+        const CImgList<int16_t>& rightGrad) const {
+    // Small segments are evaluated at every pixel
+    int step = costSubsample;
 
-void AdaptBPStereo::fitPlanes(
-        bool assignSegmentsToPlanes) {
-    if (assignSegmentsToPlanes) {
-        // Create a plane for each superpixel
-        planes = vector<Plane>(segmentation.size());
-    } else {
-        planes.clear();
+    if ((int) segmentation[segH].size() < 4 * step * step) {
+        step = 1;
     }
 
-    // A map from y-index to (x, disparity) tuples to store
-    // valid disparities for each scan-line in a superpixel.
-    map<uint16_t, vector<tuple<uint16_t, float>>> xDSamples;
-    
-    // A map from x-index to (y, disparity) tuples to store
-    // valid disparities for each vertical-line in a superpixel.
-    map<uint16_t, vector<tuple<uint16_t, float>>> yDSamples;
-
-    for (int superpixelI = 0; superpixelI < segmentation.size(); superpixelI++) {
-        const auto& superpixel = segmentation[superpixelI];
-
-        xDSamples.clear();
-        yDSamples.clear();
-
-        int numValidD = 0;
+    float cost = 0.0f;
 
-        // Iterate over all pixels within the superpixel
-        for (const auto& p : superpixel.getPixels()) {
-            uint16_t x = get<0>(p);
-            uint16_t y = get<1>(p);
+    int samples = 0;
 
-            // If this pixel has a valid disparity, add it
-            if (disp(x, y) >= minDisp && disp(x, y) <= maxDisp) {
-                xDSamples[y].push_back(make_tuple(x, disp(x, y)));
-                yDSamples[x].push_back(make_tuple(y, disp(x, y)));
+    for (const SegmentRun& run : segmentation.getRuns(segH)) {
+        int y = run.y;
 
-                numValidD++;
-            }
-        }
-        
-        float cx, cy;
-
-        if (!estimateSlant(xDSamples, cx)) {
+        if (y % step != 0) {
             continue;
         }
 
-        if (!estimateSlant(yDSamples, cy)) {
+        // First lattice column within the run
+        int xStart = (run.x0 + step - 1) / step * step;
+
+        if (xStart >= run.x1) {
             continue;
         }
 
-        CImg<float> cSamples(numValidD);
+        samples += (run.x1 - xStart + step - 1) / step;
 
-        int cSamplesI = 0;
+        cimg_forZC(left, z, c) {
+            const int16_t* l = left.data(0, y, z, c);
+            const int16_t* r = right.data(0, y, z, c);
+            const int16_t* lgx = leftGrad(0).data(0, y, z, c);
+            const int16_t* lgy = leftGrad(1).data(0, y, z, c);
+            const int16_t* rgx = rightGrad(0).data(0, y, z, c);
+            const int16_t* rgy = rightGrad(1).data(0, y, z, c);
 
-        // Iterate again, collecting samples with which to estimate
-        // the 'c' value for the plane
-        for (const auto& p : superpixel.getPixels()) {
-            uint16_t x = get<0>(p);
-            uint16_t y = get<1>(p);
+            float rowCost = 0.0f;
 
-            if (disp(x, y) >= minDisp && disp(x, y) <= maxDisp) {
-                float c = disp(x, y) - (cx * x + cy * y);
+            // isInBounds() guarantees rx lies within the right image
+            #pragma omp simd reduction(+:rowCost)
+            for (int x = xStart; x < run.x1; x += step) {
+                int rx = (int) (x + plane.dispAt(x, y) + 0.5f);
 
-                cSamples(cSamplesI) = c;
-                cSamplesI++;
-            }
-        }
+                float sad = abs(r[rx] - l[x]);
+
+                float grad = abs(lgx[x] - rgx[rx]) + abs(lgy[x] - rgy[rx]);
 
-        cSamples.sort();
-        
-        // TODO Paper doesn't specify how much to blur
-        // cSamples.blur(min(1.0f, cSamples.width() / 16.0f));
+                // TODO Robustify this by truncating against value
+                //      determined by the mean & sd of these for reliable
+                //      disparities found in the first step.
 
-        float c = cSamples(cSamples.width() / 2);
+                rowCost += (1.0f - omega) * sad + omega * grad;
+            }
 
-        if (assignSegmentsToPlanes) {
-            planes[superpixelI] = Plane(cx, cy, c);
-        } else {
-            planes.push_back(Plane(cx, cy, c));
+            cost += rowCost;
         }
     }
 
-    if (assignSegmentsToPlanes) {
-        int numSegments = segmentation.size();
-
-        superpixelPlaneMap = vector<size_t>(numSegments);
-
-        for (int segI = 0; segI < numSegments; segI++) {
-            superpixelPlaneMap[segI] = segI;
-        }
+    if (samples == 0) {
+        return numeric_limits<float>::max();
     }
+
+    return cost * segmentation[segH].size() / samples;
 }
 
-void AdaptBPStereo::getDisparity(
-        CImg<float>& disp) {
-    disp = CImg<float>(left.width(), left.height());
+void AdaptBPStereo::computeSegmentPlaneCost() {
+    int numPlanes = planes.size();
+    int numSeg = segmentation.size();
 
-    disp = 0.0f;
+    // '1' specifies forward finite differences
+    CImgList<int16_t> leftGrad = left.get_gradient(0, 1);
+    CImgList<int16_t> rightGrad = right.get_gradient(0, 1);
 
-    for (int superpixelI = 0; superpixelI < segmentation.size(); superpixelI++) {
-        const auto& superpixel = segmentation[superpixelI];
+    segmentation.getConnectivity(connectivity);
 
-        const Plane& plane = planes[superpixelPlaneMap[superpixelI]];
+    // Planes fitted to each segment, in CSR layout
+    vector<unsigned int> segPlaneOffsets(numSeg + 1, 0);
+    vector<int> segPlanes(numPlanes);
 
-        if (plane.isValid()) {
-            // Iterate over all pixels within the superpixel
-            for (const auto& p : superpixel.getPixels()) {
-                uint16_t x = get<0>(p);
-                uint16_t y = get<1>(p);
+    for (int planeI = 0; planeI < numPlanes; planeI++) {
+        segPlaneOffsets[planeSegments[planeI] + 1]++;
+    }
 
-                disp(x, y) = plane.dispAt(x, y);
-            }
-        }
+    for (int segI = 0; segI < numSeg; segI++) {
+        segPlaneOffsets[segI + 1] += segPlaneOffsets[segI];
     }
-}
 
-void AdaptBPStereo::computeSegmentPlaneCost() {
-    int numPlanes = planes.size();
-    int numSeg = segmentation.size();
+    {
+        vector<unsigned int> next(segPlaneOffsets.begin(), segPlaneOffsets.end() - 1);
 
-    segmentPlaneCost = CImg<float>(numSeg, numPlanes);
+        for (int planeI = 0; planeI < numPlanes; planeI++) {
+            segPlanes[next[planeSegments[planeI]]++] = planeI;
+        }
+    }
 
-    segmentPlaneCost = 0.0f;
+    // The planes with the most support, i.e. fitted to the largest segments
+    vector<int> globalPlanes;
 
-    // '1' specifies forward finite differences
-    CImgList<int16_t> leftGrad = left.get_gradient(0, 1);
-    CImgList<int16_t> rightGrad = right.get_gradient(0, 1);
+    for (int planeI = 0; planeI < numPlanes; planeI++) {
+        if (planes[planeI].isValid()) {
+            globalPlanes.push_back(planeI);
+        }
+    }
 
-    // TODO Sort valid planes by the number of reliable samples used to compute them
+    int numGlobal = min((int) globalPlanes.size(), numGlobalPlanes);
 
-    // TODO Optimize - Store bounding-box for superpixel, create early-out if
-    //                 a plane transforms the bounding-box outside of valid range.
-    for (int superpixelI = 0; superpixelI < numSeg; superpixelI++) {
-        const auto& superpixel = segmentation[superpixelI];
+    partial_sort(globalPlanes.begin(), globalPlanes.begin() + numGlobal,
+            globalPlanes.end(), [&](int a, int b) {
+        return segmentation[planeSegments[a]].size() >
+            segmentation[planeSegments[b]].size();
+    });
 
-        for (int planeI = 0; planeI < planes.size(); planeI++) {
-            const Plane& plane = planes[planeI];
+    globalPlanes.resize(numGlobal);
 
-            // Iterate over all pixels within the superpixel
-            for (const auto& p : superpixel.getPixels()) {
-                uint16_t x = get<0>(p);
-                uint16_t y = get<1>(p);
+    vector<vector<pair<int, float>>> segCandidates(numSeg);
 
-                float disp = plane.dispAt(x, y);
+    #pragma omp parallel
+    {
+        // visited[s] == segI marks segment s as found by the search from
+        // segI, and likewise for planes
+        vector<int> visitedSeg(numSeg, -1);
+        vector<int> visitedPlane(numPlanes, -1);
 
-                if (disp > maxDisp || disp < minDisp) {
-                    segmentPlaneCost(superpixelI, planeI) = minDisp - 1;
-                    break;
-                }
+        vector<segmentH_t> frontier, nextFrontier;
 
-                int rx = (int) (x + plane.dispAt(x, y) + 0.5f);
-                int ry = y;
+        vector<int> planeList;
 
-                if (rx < 0 || rx > right.width() - 2) {
-                    segmentPlaneCost(superpixelI, planeI) = minDisp - 1;
-                    break;
-                }
+        #pragma omp for schedule(dynamic, 16)
+        for (int segI = 0; segI < numSeg; segI++) {
+            planeList.clear();
 
-                float cost = 0;
+            auto addPlane = [&](int planeI) {
+                if (visitedPlane[planeI] != segI) {
+                    visitedPlane[planeI] = segI;
+                    planeList.push_back(planeI);
+                }
+            };
 
-                cimg_forZC(left, z, c) {
-                    int16_t sad = abs(right(rx, ry, z, c) -
-                            left(x, y, z, c));
+            auto addSegment = [&](segmentH_t s) {
+                for (unsigned int i = segPlaneOffsets[s]; i < segPlaneOffsets[s + 1]; i++) {
+                    addPlane(segPlanes[i]);
+                }
+            };
+
+            // Breadth-first search out to candidateHops
+            frontier.assign(1, segI);
+            visitedSeg[segI] = segI;
+            addSegment(segI);
+
+            for (int hop = 0; hop < candidateHops && !frontier.empty(); hop++) {
+                nextFrontier.clear();
+
+                for (segmentH_t s : frontier) {
+                    connectivity.forEachNeighbor(s, [&](segmentH_t n, int) {
+                        if (visitedSeg[n] != segI) {
+                            visitedSeg[n] = segI;
+                            nextFrontier.push_back(n);
+                            addSegment(n);
+                        }
+                    });
+                }
 
-                    int16_t grad = 0;
+                swap(frontier, nextFrontier);
+            }
 
-                    grad += abs(leftGrad(0)(x, y, z, c) -
-                            rightGrad(0)(rx, ry, z, c));
+            for (int planeI : globalPlanes) {
+                addPlane(planeI);
+            }
 
-                    grad += abs(leftGrad(1)(x, y, z, c) -
-                            rightGrad(1)(rx, ry, z, c));
+            sort(planeList.begin(), planeList.end());
 
-                    // TODO Robustify this by truncating against value
-                    //      determined by the mean & sd of these for reliable
-                    //      disparities found in the first step.
+            for (int planeI : planeList) {
+                const Plane& plane = planes[planeI];
 
-                    cost += (1.0f - omega) * sad + omega * grad;
+                if (isInBounds(segI, plane)) {
+                    segCandidates[segI].push_back(make_pair(planeI,
+                                getPlaneCost(segI, plane, leftGrad, rightGrad)));
                 }
-
-                segmentPlaneCost(superpixelI, planeI) += cost;
             }
         }
     }
+
+    candidateOffsets.assign(numSeg + 1, 0);
+    candidatePlanes.clear();
+    candidateCosts.clear();
+
+    for (int segI = 0; segI < numSeg; segI++) {
+        for (const auto& candidate : segCandidates[segI]) {
+            candidatePlanes.push_back(candidate.first);
+            candidateCosts.push_back(candidate.second);
+        }
+
+        candidateOffsets[segI + 1] = candidatePlanes.size();
+    }
 }
 
 void AdaptBPStereo::mergeSegmentsByPlane() {
@@ -570,42 +379,37 @@ void AdaptBPStereo::mergeSegmentsByPlane() {
 }
 
 void AdaptBPStereo::computeGreedySuperpixelPlaneMap() {
-    int numPlanes = planes.size();
     int numSeg = segmentation.size();
 
-    superpixelPlaneMap.clear();
-    superpixelPlaneMap.reserve(numSeg);
+    // Segments without candidates keep their current plane, if any
+    superpixelPlaneMap.resize(numSeg, planes.size());
 
     for (int segmentI = 0; segmentI < numSeg; segmentI++) {
-        int optimalPlaneI = 0;
-        float optimalPlaneCost = std::numeric_limits<float>::max();
+        unsigned int first = candidateOffsets[segmentI];
+        unsigned int last = candidateOffsets[segmentI + 1];
 
-        for (int planeI = 0; planeI < numPlanes; planeI++) {
-            float cost = segmentPlaneCost(segmentI, planeI);
-            
-            if (cost < optimalPlaneCost) {
-                optimalPlaneCost = cost;
-                optimalPlaneI = planeI;
-            }
+        if (first == last) {
+            continue;
         }
 
-        superpixelPlaneMap[segmentI] = optimalPlaneI;
+        unsigned int best = min_element(candidateCosts.begin() + first,
+                candidateCosts.begin() + last) - candidateCosts.begin();
+
+        superpixelPlaneMap[segmentI] = candidatePlanes[best];
     }
 }
 
 void AdaptBPStereo::createMRF() {
+    INSTRUMENT_SCOPE("AdaptBPStereo::createMRF");
+
     int numSegments = segmentation.size();
-    int numPlanes = segmentPlaneCost.height();
-    
+
     CImg<float> segTotCol(numSegments);
 
     segTotCol = 0.0f;
 
-    // Lower-trianglular matrix containing the length of the border
-    // between segments.
-    CImg<int> borderLength(numSegments, numSegments);
-
-    borderLength = 0;
+    // Lengths of the borders between adjacent segments
+    segmentation.getConnectivity(connectivity);
 
     cimg_forXY(left, x, y) {
         cimg_forC(left, c) {
@@ -613,105 +417,44 @@ void AdaptBPStereo::createMRF() {
         }
     }
 
-    for (int y = 1; y < left.height(); y++) {
-        for (int x = 1; x < left.width(); x++) {
-            int segA, segB;
-
-            segA = segmentation(x - 1, y);
-            segB = segmentation(x, y);
-
-            borderLength(min(segA, segB), max(segA, segB))++;
-
-            segA = segmentation(x, y - 1);
-            segB = segmentation(x, y);
-
-            borderLength(min(segA, segB), max(segA, segB))++;
-        }
-    }
-
-    // 'numSegments' variables, each can take 'numPlanes' labels
-    printf("Constructing MRF with %d variables and %d labels\n", numSegments, numPlanes);
+    mrf = unique_ptr<SegmentPlaneBP>(new SegmentPlaneBP(&connectivity));
 
-    Space space(numSegments, numPlanes);
-    mrf = GModel(space);
+    // Data Term...
+    mrf->setUnaries(candidateOffsets, candidatePlanes, candidateCosts);
 
+    // Pairwise terms...
     for (int segI = 0; segI < numSegments; segI++) {
-        // Pairwise terms...
-        for (int segI2 = segI + 1; segI2 < numSegments; segI2++) {
-            if (segI2 == segI) {
-                continue;
-            }
+        float meanCol1 = segTotCol(segI) / segmentation[segI].size();
 
-            int blength = borderLength(segI, segI2);
+        connectivity.forEachEdge(segI,
+                [&](segmentH_t segI2, int blength, unsigned int edgeI) {
+            float meanCol2 = segTotCol(segI2) / segmentation[segI2].size();
 
-            if (blength > 0) {
-                float meanCol1 = segTotCol(segI) / segmentation[segI].size();
-                float meanCol2 = segTotCol(segI2) / segmentation[segI2].size();
+            float colorSim = (1.0f - min(abs(meanCol1 - meanCol2), 255.0f) / 255.0f) * 0.5f
+                + 0.5f;
 
-                float colorSim = (1.0f - min(abs(meanCol1 - meanCol2), 255.0f) / 255.0f) * 0.5f
-                    + 0.5f;
-
-                // TODO double check this
-                float pair = colorSim * blength * smoothFactor;
-
-                ogm::PottsFunction<float> pairTerm(numPlanes, numPlanes, 0, pair);
-
-                // vars[segI], vars[segI2], pair);
-                GModel::FunctionIdentifier fid = mrf.addFunction(pairTerm);
-
-                size_t vars[] = {(size_t) segI, (size_t) segI2};
-                mrf.addFactor(fid, vars, vars + 2);
-            }
-        }
+            // TODO double check this
+            float pair = colorSim * blength * smoothFactor;
 
-        // Data Term...
-
-        size_t shape[] = {(size_t) numPlanes};
-
-        ogm::ExplicitFunction<float> dataTerm(shape, shape + 1);
-
-        for (int planeI = 0; planeI < numPlanes; planeI++) {
-            dataTerm(planeI) = segmentPlaneCost(segI, planeI);
-        }
-
-        GModel::FunctionIdentifier fid = mrf.addFunction(dataTerm);
-
-        size_t vars[] = {(size_t) segI};
-        mrf.addFactor(fid, vars, vars + 1);
+            mrf->setEdgeWeight(edgeI, pair);
+        });
     }
 } 
 
 void AdaptBPStereo::solveMRF() {
+    INSTRUMENT_SCOPE("AdaptBPStereo::solveMRF");
 
-    typedef ogm::MinSTCutBoost<size_t, float, ogm::PUSH_RELABEL> MinCutType;
-    typedef ogm::GraphCut<GModel, ogm::Minimizer, MinCutType> MinGraphCut;
-    typedef ogm::AlphaExpansion<GModel, MinGraphCut> MinAlphaExpansion;
-    
-    MinAlphaExpansion ae(mrf);
-    
-    ae.infer();
+    mrf->setParameters(50, 0.5f, 1e-3f);
 
-    superpixelPlaneMap = vector<size_t>(segmentation.size());
-    ae.arg(superpixelPlaneMap);
+    int sweeps = mrf->solve(superpixelPlaneMap);
 
-    /*
-    typedef ogm::BeliefPropagationUpdateRules<GModel, ogm::Minimizer> UpdateRules;
-    typedef ogm::MessagePassing<GModel, ogm::Minimizer, UpdateRules,
-            ogm::MaxDistance> BeliefPropagation;
-    const size_t maxNumberOfIterations = 1;
-    const double convergenceBound = 1e-7;
-    const double damping = 0.0;
-    BeliefPropagation::Parameter parameter(maxNumberOfIterations, convergenceBound, damping);
-    BeliefPropagation bp(mrf, parameter);
-
-    bp.setStartingPoint(superpixelPlaneMap.begin());
-
-    BeliefPropagation::VerboseVisitorType visitor;
-    bp.infer(visitor);
-
-    superpixelPlaneMap = vector<size_t>(superpixels.size());
-    bp.arg(superpixelPlaneMap);
-    */
+    INSTRUMENT_COUNT(InstrumentCounter::BP_SWEEPS, sweeps);
+
+    for (int segI = 0; segI < (int) segmentation.size(); segI++) {
+        if (candidateOffsets[segI] == candidateOffsets[segI + 1]) {
+            superpixelPlaneMap[segI] = planes.size();
+        }
+    }
 }
 
 /**
@@ -724,6 +467,8 @@ void AdaptBPStereo::solveMRF() {
  *
  */
 void AdaptBPStereo::computeStereo() {
+    INSTRUMENT_SCOPE("AdaptBPStereo::computeStereo");
+
     assert(left.is_sameXYZC(right));
 
     /**
@@ -732,22 +477,33 @@ void AdaptBPStereo::computeStereo() {
      * Note that this differs from the original paper, which used
      * Mean-shift color segmentation (Comaniciu and Meer)
      */
-    printf("Computing superpixels for Left\n");
-    segmentation.createSlicSuperpixels(left.get_RGBtoLab(), numSuperpixels, 10);
-
-    printf("Computing disparity\n");
-    // computeGreedyDisp();
-    CVStereo stereo(left, right, true);
-    stereo.matchStereo(minDisp, maxDisp, 3, 1.0f);
-    stereo.getStereo(disp);
-    
-    printf("Fitting planes...\n");
-    fitPlanes(true);
+    {
+        INSTRUMENT_SCOPE("superpixels");
+
+        segmentation.createSlicSuperpixels(left.get_RGBtoLab(), numSuperpixels, 10);
+    }
+
+    {
+        INSTRUMENT_SCOPE("disparity");
+
+        computeGreedyDisp();
+    }
+
+    {
+        INSTRUMENT_SCOPE("fitPlanes");
+
+        fitPlanes(true);
+    }
 
     // fitPlanes(false);
 
-    // printf("Computing segment-plane cost...\n");
-    // computeSegmentPlaneCost();
+    {
+        INSTRUMENT_SCOPE("segmentPlaneCost");
+
+        computeSegmentPlaneCost();
+
+        computeGreedySuperpixelPlaneMap();
+    }
 
     // printf("Merging segments by plane\n");
     // mergeSegmentsByPlane();
@@ -759,21 +515,12 @@ void AdaptBPStereo::computeStereo() {
 
     // computeGreedySuperpixelPlaneMap();
 
-    // createMRF();
-
-    // solveMRF();
+    {
+        INSTRUMENT_SCOPE("MRF");
 
-    CImg<float> finalDisp;
-    getDisparity(finalDisp);
+        createMRF();
 
-    // Use planar disparity to fill holes in original disparity
-    CImg<float> filledDisp = disp;
-    cimg_forXY(filledDisp, x, y) {
-        if (filledDisp(x, y) < minDisp || filledDisp(x, y) > maxDisp) {
-            filledDisp(x, y) = finalDisp(x, y);
-        }
+        solveMRF();
     }
-
-    (disp, finalDisp, filledDisp).display();
 }
 
@@ -1,37 +1,10 @@
 #pragma once
 
-// OpenGM and Halide MUST be included before CImg, which includes
-// X11 headers with conflicting/stupid definitions (i.e. `#define BOOL`).
-#include "opengm/graphicalmodel/graphicalmodel.hxx"
-#include "opengm/graphicalmodel/space/simplediscretespace.hxx"
-#include "opengm/functions/explicit_function.hxx"
-#include "opengm/functions/potts.hxx"
-#include "opengm/functions/sparsemarray.hxx"
-#include "opengm/inference/messagepassing/messagepassing.hxx"
-#include "opengm/inference/messagepassing/messagepassing_bp.hxx"
-#include "opengm/inference/messagepassing/messagepassing_trbp.hxx"
-#include "opengm/operations/adder.hxx"
-#include "opengm/operations/minimizer.hxx"
-#include "opengm/inference/mqpbo.hxx"
-#include "opengm/inference/graphcut.hxx"
-#include "opengm/inference/alphaexpansion.hxx"
-#include "opengm/inference/alphabetaswap.hxx"
-#include "opengm/inference/auxiliary/minstcutboost.hxx"
-
 #include "common.h"
 
 #include "segment.h"
 
-namespace ogm = opengm;
-
-typedef ogm::SimpleDiscreteSpace<> Space;
-
-typedef ogm::meta::TypeListGenerator<
-    ogm::ExplicitFunction<float>,
-    ogm::PottsFunction<float>
->::type FunctionTypeList;
-
-typedef ogm::GraphicalModel<float, ogm::Adder, FunctionTypeList, Space> GModel;
+#include "segmentbp.h"
 
 class AdaptBPStereo {
     private:
@@ -53,21 +26,68 @@ class AdaptBPStereo {
 
         vector<Plane> planes;
 
-        CImg<float> segmentPlaneCost;
+        /**
+         * The segment each plane was fitted to.
+         */
+        vector<segmentH_t> planeSegments;
+
+        /**
+         * Sparse segment-plane costs.  The candidate planes of segment s
+         * are candidatePlanes[candidateOffsets[s], candidateOffsets[s + 1]),
+         * sorted, with their costs in candidateCosts.
+         */
+        vector<unsigned int> candidateOffsets;
+
+        vector<int> candidatePlanes;
+
+        vector<float> candidateCosts;
 
-        GModel mrf;
+        /**
+         * Candidates of a segment are the planes fitted to segments at most
+         * candidateHops away, plus the numGlobalPlanes planes fitted to the
+         * largest segments.
+         */
+        int candidateHops;
+
+        int numGlobalPlanes;
+
+        /**
+         * Costs are evaluated on a lattice of every costSubsample'th pixel
+         * in x and y.
+         */
+        int costSubsample;
+
+        Connectivity connectivity;
+
+        unique_ptr<SegmentPlaneBP> mrf;
 
         vector<size_t> superpixelPlaneMap;
 
         void computeGreedyDisp();
 
-        bool estimateSlant(
-            const map<uint16_t, vector<tuple<uint16_t, float>>>& dSamples,
-            float& result);
-
         void fitPlanes(
             bool assignSegmentsToPlanes);
 
+        /**
+         * True if the plane keeps the bounding box of the segment within
+         * the disparity range and maps it inside the right image.  The
+         * disparity is affine, so testing the corners of the box is enough
+         * to cover every pixel of the segment.
+         */
+        bool isInBounds(
+                segmentH_t segH,
+                const Plane& plane) const;
+
+        /**
+         * Computes the cost of a plane over a segment, scaled up to the
+         * full size of the segment.  The plane must be in bounds.
+         */
+        float getPlaneCost(
+                segmentH_t segH,
+                const Plane& plane,
+                const CImgList<int16_t>& leftGrad,
+                const CImgList<int16_t>& rightGrad) const;
+
         void computeSegmentPlaneCost();
 
         void mergeSegmentsByPlane();
@@ -85,8 +105,17 @@ class AdaptBPStereo {
                 int minDisp,
                 int maxDisp);
 
+        /**
+         * Segments the left view, fits a plane to each segment and assigns
+         * planes to segments with belief propagation.
+         */
         void computeStereo();
 
+        /**
+         * Writes the disparity of the planes assigned by computeStereo(),
+         * with the convention that left pixel x matches right pixel
+         * x + disp(x).  Segments without a plane are 0.
+         */
         void getDisparity(
                 CImg<float>& disp);
 };
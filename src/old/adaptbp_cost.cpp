@@ -0,0 +1,373 @@
+#include "adaptbp_cost.h"
+
+#include <cstring>
+
+#ifdef ADAPTBP_COST_AOT
+
+// Generated by `make halide_aot`
+#include "adaptbp_cost_small.h"
+#include "adaptbp_cost_medium.h"
+#include "adaptbp_cost_large.h"
+
+typedef int (*GreedyDispAOTFunc)(
+        buffer_t* leftImg,
+        buffer_t* rightImg,
+        int32_t minDisp,
+        int32_t maxDisp,
+        float omega,
+        buffer_t* result);
+
+/**
+ * Indexed like greedyDispSchedules.
+ */
+static const GreedyDispAOTFunc greedyDispAOTFuncs[] = {
+    adaptbp_cost_small,
+    adaptbp_cost_medium,
+    adaptbp_cost_large,
+};
+
+static_assert(sizeof(greedyDispAOTFuncs) / sizeof(greedyDispAOTFuncs[0]) ==
+        sizeof(greedyDispSchedules) / sizeof(greedyDispSchedules[0]),
+        "Every schedule variant needs an AOT function");
+
+/**
+ * Wraps a CImg in a buffer_t without copying.  Only the first `dims`
+ * dimensions are described.
+ */
+template<class T>
+static buffer_t wrapImage(
+        const CImg<T>& img,
+        int dims) {
+    buffer_t buf;
+
+    memset(&buf, 0, sizeof(buf));
+
+    buf.host = (uint8_t*) img.data();
+    buf.elem_size = sizeof(T);
+
+    int extents[4] = {img.width(), img.height(), img.depth(), img.spectrum()};
+
+    int stride = 1;
+
+    for (int i = 0; i < dims; i++) {
+        buf.extent[i] = extents[i];
+        buf.stride[i] = stride;
+
+        stride *= extents[i];
+    }
+
+    return buf;
+}
+
+#endif
+
+int chooseGreedyDispSchedule(
+        int width,
+        int height) {
+    int pixels = width * height;
+
+    for (int i = 0; i < numGreedyDispSchedules - 1; i++) {
+        if (pixels <= greedyDispSchedules[i].maxPixels) {
+            return i;
+        }
+    }
+
+    return numGreedyDispSchedules - 1;
+}
+
+Halide::Func defineGreedyDisp(
+        Halide::ImageParam leftImg,
+        Halide::ImageParam rightImg,
+        Halide::Param<int> minDispParam,
+        Halide::Param<int> maxDispParam,
+        Halide::Param<float> omegaParam,
+        const GreedyDispSchedule& schedule) {
+    Halide::Expr width = leftImg.width();
+    Halide::Expr height = leftImg.height();
+
+    // Variables
+
+    Halide::Var x("x"), y("y"), c("c"), d("d");
+
+    // RDoms take (min, extent) for each dimension
+    Halide::RDom rDisp(minDispParam, maxDispParam - minDispParam + 1);
+
+    // Images are laid out as CImg (x, y, z, c), so the channels are the
+    // fourth dimension
+    Halide::RDom rC(0, leftImg.extent(3));
+
+    int wndRad = 1;
+    Halide::RDom r3x3(-wndRad, 2 * wndRad + 1, -wndRad, 2 * wndRad + 1);
+    Halide::RDom r3x2(-wndRad, 2 * wndRad + 1, -wndRad, 2 * wndRad);
+
+    // Helper expressions to clamp to image bounds
+
+    Halide::Expr cx = clamp(x,
+            max(-minDispParam, 1),
+            min(width - maxDispParam, width - 2));
+
+    Halide::Expr cy = clamp(y, 1, height - 2);
+
+    Halide::Func leftC("leftC");
+    Halide::Func rightC("rightC");
+    leftC(x, y, c) = leftImg(cx, cy, 0, c);
+    rightC(x, y, c) = rightImg(cx, cy, 0, c);
+
+    // C_SAD(x, y, c, d) ...
+    Halide::Func absDiff("absDiff"), cSAD("cSAD");
+
+    absDiff(x, y, c, d) = Halide::abs(leftC(x, y, c) - rightC(x + d, y, c));
+
+    cSAD(x, y, c, d) += absDiff(x + r3x3.x, y + r3x3.y, c, d);
+
+    // C_GRAD(x, y, c, d)...
+    Halide::Func gradX1("gradX1"), gradX2("gradX2");
+    Halide::Func gradY1("gradY1"), gradY2("gradY2");
+    Halide::Func absGradX("absGradX"), absGradY("absGradY");
+    Halide::Func cGrad("cGrad");
+
+    gradX1(x, y, c) = leftC(x + 1, y, c) - leftC(x, y, c);
+    gradX2(x, y, c) = rightC(x + 1, y, c) - rightC(x, y, c);
+
+    gradY1(x, y, c) = leftC(x, y + 1, c) - leftC(x, y, c);
+    gradY2(x, y, c) = rightC(x, y + 1, c) - rightC(x, y, c);
+
+    absGradX(x, y, c, d) = Halide::abs(gradX1(x, y, c) - gradX2(x + d, y, c));
+
+    absGradY(x, y, c, d) = Halide::abs(gradY1(x, y, c) - gradY2(x + d, y, c));
+
+    cGrad(x, y, c, d) +=
+        absGradX(x + r3x2.x, y + r3x2.y, c, d) +
+        absGradY(x + r3x2.x, y + r3x2.y, c, d);
+
+    // C(x, y, d)...
+    Halide::Func cost("cost");
+    // TODO Robustify cSAD and cGrad with a max distance learned from optimization
+    cost(x, y, d) +=
+        (1.0f - omegaParam) * Halide::cast(Halide::Float(32), cSAD(x, y, rC, d)) +
+        omegaParam * Halide::cast(Halide::Float(32), cGrad(x, y, rC, d));
+
+    // Argmin_d(x, y)...
+    Halide::Func minCostDisparity("minCostDisparity");
+
+    minCostDisparity(x, y) = Halide::cast(Halide::Int(16), 0);
+
+    Halide::Expr bestDisparitySoFar =
+        cost(x, y, clamp(minCostDisparity(x, y), minDispParam, maxDispParam));
+
+    minCostDisparity(x, y) = select(
+            cost(x, y, rDisp) < bestDisparitySoFar,
+            Halide::cast(Halide::Int(16), rDisp),
+            minCostDisparity(x, y));
+
+    // Argmin_d_reverse(x, y)...
+    Halide::Func costRev("costRev");
+
+    costRev(x, y, d) = cost(x + d, y, -d);
+
+    Halide::Func minCostDisparityRev("minCostDisparityRev");
+
+    minCostDisparityRev(x, y) = Halide::cast(Halide::Int(16), 0);
+
+    Halide::Expr bestDisparitySoFarRev =
+        costRev(x, y, clamp(minCostDisparityRev(x, y), -maxDispParam, -minDispParam));
+
+    minCostDisparityRev(x, y) = select(
+            costRev(x, y, -rDisp) < bestDisparitySoFarRev,
+            Halide::cast(Halide::Int(16), -rDisp),
+            minCostDisparityRev(x, y));
+
+    // Holes(x, y)...
+    Halide::Expr revX = minCostDisparity(x, y) + x;
+    Halide::Expr revXC = Halide::clamp(revX, 0, width - 1);
+
+    Halide::Expr consistent = Halide::select(revXC == revX,
+            Halide::abs(
+                minCostDisparityRev(revXC, y) + minCostDisparity(x, y)
+                ) < 2.0f,
+            false);
+
+    // Result(x, y)...
+    Halide::Func result("result");
+
+    Halide::Expr validX = Halide::clamp(
+            x,
+            Halide::max(0, -minDispParam),
+            Halide::min(width - 1, width - maxDispParam));
+
+    result(x, y) =
+        Halide::select(consistent,
+                Halide::cast(Halide::Float(32),
+                    Halide::select(x == validX,
+                        minCostDisparity(validX, y),
+                        Halide::Float(32).max()
+                        )
+                    ),
+                Halide::Float(32).max());
+
+    // Schedule...
+    //
+    // Strips of rows are independent apart from the vertical overlap of the
+    // 3x3 windows, so each strip computes its own slice of the cost volume
+    // and both argmins, and strips run in parallel.  Everything cheaper
+    // than a reduction (differences, gradients, clamped loads) is inlined.
+    int vw = schedule.vectorWidth;
+
+    Halide::Var yo("yo"), yi("yi");
+
+    result
+        .split(y, yo, yi, schedule.rowsPerTask)
+        .parallel(yo)
+        .vectorize(x, vw);
+
+    cost
+        .compute_at(result, yo)
+        .vectorize(x, vw);
+
+    cost.update()
+        .reorder(x, rC.x)
+        .vectorize(x, vw);
+
+    cSAD
+        .compute_at(cost, d)
+        .vectorize(x, vw);
+
+    cSAD.update()
+        .reorder(x, r3x3.x, r3x3.y)
+        .vectorize(x, vw);
+
+    cGrad
+        .compute_at(cost, d)
+        .vectorize(x, vw);
+
+    cGrad.update()
+        .reorder(x, r3x2.x, r3x2.y)
+        .vectorize(x, vw);
+
+    minCostDisparity
+        .compute_at(result, yo)
+        .vectorize(x, vw);
+
+    minCostDisparity.update()
+        .reorder(x, rDisp.x)
+        .vectorize(x, vw);
+
+    minCostDisparityRev
+        .compute_at(result, yo)
+        .vectorize(x, vw);
+
+    minCostDisparityRev.update()
+        .reorder(x, rDisp.x)
+        .vectorize(x, vw);
+
+    return result;
+}
+
+GreedyDispJIT::GreedyDispJIT() :
+    leftImg(Halide::Int(16), 4, "leftImg"),
+    rightImg(Halide::Int(16), 4, "rightImg"),
+    minDispParam("minDisp"),
+    maxDispParam("maxDisp"),
+    omegaParam("omega"),
+    compiled(numGreedyDispSchedules, false) {
+    for (int i = 0; i < numGreedyDispSchedules; i++) {
+        pipelines.push_back(defineGreedyDisp(leftImg, rightImg,
+                    minDispParam, maxDispParam, omegaParam,
+                    greedyDispSchedules[i]));
+    }
+}
+
+void GreedyDispJIT::compile(
+        int variant) {
+    lock_guard<mutex> lock(jitMutex);
+
+    compileLocked(variant);
+}
+
+void GreedyDispJIT::compileLocked(
+        int variant) {
+    if (!compiled[variant]) {
+        pipelines[variant].compile_jit();
+
+        compiled[variant] = true;
+    }
+}
+
+void GreedyDispJIT::compute(
+        const CImg<int16_t>& left,
+        const CImg<int16_t>& right,
+        int minDisp,
+        int maxDisp,
+        float omega,
+        CImg<float>& disp,
+        int variant) {
+    assert(left.is_sameXYZC(right));
+
+    if (variant < 0) {
+        variant = chooseGreedyDispSchedule(left.width(), left.height());
+    }
+
+    lock_guard<mutex> lock(jitMutex);
+
+    compileLocked(variant);
+
+    Halide::Buffer leftBuf(
+            Halide::Int(16),
+            left.width(), left.height(),
+            1, left.spectrum(),
+            (uint8_t*) left.data(), string("leftBuf"));
+
+    Halide::Buffer rightBuf(
+            Halide::Int(16),
+            right.width(), right.height(),
+            1, right.spectrum(),
+            (uint8_t*) right.data(), string("rightBuf"));
+
+    leftImg.set(leftBuf);
+    rightImg.set(rightBuf);
+
+    minDispParam.set(minDisp);
+    maxDispParam.set(maxDisp);
+    omegaParam.set(omega);
+
+    disp.assign(left.width(), left.height());
+
+    // Realize straight into disp
+    Halide::Buffer dispBuf(
+            Halide::Float(32),
+            disp.width(), disp.height(),
+            0, 0,
+            (uint8_t*) disp.data(), string("dispBuf"));
+
+    pipelines[variant].realize(dispBuf);
+}
+
+bool computeGreedyDispAOT(
+        const CImg<int16_t>& left,
+        const CImg<int16_t>& right,
+        int minDisp,
+        int maxDisp,
+        float omega,
+        CImg<float>& disp,
+        int variant) {
+#ifdef ADAPTBP_COST_AOT
+    assert(left.is_sameXYZC(right));
+
+    if (variant < 0) {
+        variant = chooseGreedyDispSchedule(left.width(), left.height());
+    }
+
+    disp.assign(left.width(), left.height());
+
+    buffer_t leftBuf = wrapImage(left, 4);
+    buffer_t rightBuf = wrapImage(right, 4);
+    buffer_t dispBuf = wrapImage(disp, 2);
+
+    int error = greedyDispAOTFuncs[variant](&leftBuf, &rightBuf,
+            minDisp, maxDisp, omega, &dispBuf);
+
+    return error == 0;
+#else
+    return false;
+#endif
+}
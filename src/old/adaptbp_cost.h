@@ -0,0 +1,142 @@
+#pragma once
+
+// Halide MUST be included before CImg, which includes X11 headers with
+// conflicting definitions.
+#include "Halide.h"
+
+#include "common.h"
+
+#include <mutex>
+
+/**
+ * The greedy disparity pipeline of AdaptBPStereo: a 3x3 SAD + gradient
+ * matching cost, its argmin over disparities in both directions and a
+ * left-right consistency check.  Inconsistent pixels and pixels whose
+ * match falls outside the right image are set to FLT_MAX.
+ *
+ * The same definition is compiled ahead of time by adaptbp_cost_gen.cpp
+ * (`make halide_aot`) and JIT compiled as a fallback, so both paths
+ * produce identical results.
+ */
+
+/**
+ * One schedule of the pipeline.  Rows are split into strips of rowsPerTask
+ * which are processed in parallel, and every stage is vectorized along x.
+ * Each strip holds its slice of the cost volume, rowsPerTask * width *
+ * disparities floats.
+ */
+struct GreedyDispSchedule {
+    /**
+     * Name of the AOT-compiled function using this schedule.
+     */
+    const char* name;
+
+    /**
+     * The schedule is used for images with at most this many pixels.
+     */
+    int maxPixels;
+
+    int vectorWidth;
+
+    int rowsPerTask;
+};
+
+/**
+ * Schedule variants, ordered by maxPixels.  The AOT build emits one
+ * function per entry; keep the list in sync with HALIDE_AOT_VARIANTS in the
+ * Makefile.
+ */
+static const GreedyDispSchedule greedyDispSchedules[] = {
+    // Small images: short strips so that every core gets work
+    {"adaptbp_cost_small", 640 * 480, 8, 4},
+    // Up to 1080p: longer strips amortize the overlap of the 3x3 windows
+    {"adaptbp_cost_medium", 1920 * 1080, 8, 8},
+    // Larger images: wider vectors.  Strips are kept short to bound their
+    // memory, but a strip's cost volume does not fit in cache here (8 rows
+    // of 3840 pixels over 256 disparities is about 31 MB)
+    {"adaptbp_cost_large", numeric_limits<int>::max(), 16, 8},
+};
+
+static const int numGreedyDispSchedules =
+    sizeof(greedyDispSchedules) / sizeof(greedyDispSchedules[0]);
+
+/**
+ * Returns the index of the schedule variant to use for an image of the
+ * given size.
+ */
+int chooseGreedyDispSchedule(
+        int width,
+        int height);
+
+/**
+ * Defines and schedules the pipeline over its parameters.  left and right
+ * are 4-dimensional int16 images laid out like CImg (x, y, z, c).
+ */
+Halide::Func defineGreedyDisp(
+        Halide::ImageParam leftImg,
+        Halide::ImageParam rightImg,
+        Halide::Param<int> minDispParam,
+        Halide::Param<int> maxDispParam,
+        Halide::Param<float> omegaParam,
+        const GreedyDispSchedule& schedule);
+
+/**
+ * JIT compiles the pipeline once per schedule variant and reuses the
+ * compiled code for every later image.
+ *
+ * The parameters are shared by every call, so calls from several threads
+ * are serialized.  Each one still runs its strips in parallel.
+ */
+class GreedyDispJIT {
+    private:
+        Halide::ImageParam leftImg, rightImg;
+
+        Halide::Param<int> minDispParam, maxDispParam;
+
+        Halide::Param<float> omegaParam;
+
+        vector<Halide::Func> pipelines;
+
+        vector<bool> compiled;
+
+        /**
+         * Guards the parameters, the compiled flags and the pipelines.
+         */
+        mutex jitMutex;
+
+        void compileLocked(
+                int variant);
+
+    public:
+        GreedyDispJIT();
+
+        /**
+         * Compiles the given variant if it has not been compiled yet.
+         */
+        void compile(
+                int variant);
+
+        void compute(
+                const CImg<int16_t>& left,
+                const CImg<int16_t>& right,
+                int minDisp,
+                int maxDisp,
+                float omega,
+                CImg<float>& disp,
+                int variant = -1);
+};
+
+/**
+ * Runs the AOT-compiled pipeline.  Returns false if the AOT libraries were
+ * not linked in (ADAPTBP_COST_AOT undefined) or the pipeline failed.
+ *
+ * variant = -1 chooses the variant by image size.
+ */
+bool computeGreedyDispAOT(
+        const CImg<int16_t>& left,
+        const CImg<int16_t>& right,
+        int minDisp,
+        int maxDisp,
+        float omega,
+        CImg<float>& disp,
+        int variant = -1);
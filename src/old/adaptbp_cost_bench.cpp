@@ -0,0 +1,98 @@
+#include "adaptbp_cost.h"
+
+#include <chrono>
+
+/**
+ * Compares the JIT and AOT builds of the greedy disparity pipeline on a
+ * synthetic random-dot pair:
+ *
+ *   adaptbp_cost_bench [width height [runs]]
+ *
+ * For every schedule variant, prints the one-off JIT compile time and the
+ * mean time per frame of both paths, and checks that they agree.
+ */
+
+static double elapsedMs(
+        chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(
+            chrono::steady_clock::now() - start).count();
+}
+
+static void createRandomDotPair(
+        int width,
+        int height,
+        int shift,
+        CImg<int16_t>& left,
+        CImg<int16_t>& right) {
+    left.assign(width, height, 1, 3);
+    left.rand(0, 255);
+
+    // Shift the whole image so that the true disparity is constant
+    right.assign(width, height, 1, 3);
+
+    cimg_forXYC(right, x, y, c) {
+        right(x, y, 0, c) = left(max(0, min(width - 1, x - shift)), y, 0, c);
+    }
+}
+
+int main(
+        int argc,
+        char** argv) {
+    int width = argc > 2 ? atoi(argv[1]) : 640;
+    int height = argc > 2 ? atoi(argv[2]) : 480;
+    int runs = argc > 3 ? atoi(argv[3]) : 10;
+
+    int minDisp = -32;
+    int maxDisp = 0;
+    float omega = 0.5f;
+
+    CImg<int16_t> left, right;
+
+    createRandomDotPair(width, height, 8, left, right);
+
+    printf("%dx%d, %d runs, chosen variant: %s\n", width, height, runs,
+            greedyDispSchedules[chooseGreedyDispSchedule(width, height)].name);
+
+    GreedyDispJIT jit;
+
+    for (int variant = 0; variant < numGreedyDispSchedules; variant++) {
+        auto start = chrono::steady_clock::now();
+
+        jit.compile(variant);
+
+        double compileMs = elapsedMs(start);
+
+        CImg<float> jitDisp, aotDisp;
+
+        start = chrono::steady_clock::now();
+
+        for (int i = 0; i < runs; i++) {
+            jit.compute(left, right, minDisp, maxDisp, omega, jitDisp, variant);
+        }
+
+        double jitMs = elapsedMs(start) / runs;
+
+        printf("%-20s JIT: compile %8.1f ms, run %8.2f ms",
+                greedyDispSchedules[variant].name, compileMs, jitMs);
+
+        start = chrono::steady_clock::now();
+
+        bool aot = true;
+
+        for (int i = 0; i < runs && aot; i++) {
+            aot = computeGreedyDispAOT(left, right, minDisp, maxDisp, omega,
+                    aotDisp, variant);
+        }
+
+        if (aot) {
+            double aotMs = elapsedMs(start) / runs;
+
+            printf(" | AOT: run %8.2f ms%s\n", aotMs,
+                    (jitDisp == aotDisp) ? "" : " (MISMATCH)");
+        } else {
+            printf(" | AOT: not available\n");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include "adaptbp_cost.h"
+
+/**
+ * Generator for the ahead-of-time compiled greedy disparity pipeline, built
+ * with Halide's tools/GenGen.cpp.  One function is emitted per schedule
+ * variant, e.g.:
+ *
+ *   adaptbp_cost_gen -g adaptbp_cost -f adaptbp_cost_small -o build/halide \
+ *       target=host variant=0
+ *
+ * The argument order of the generated functions is the declaration order
+ * below, followed by the output buffer.
+ */
+class AdaptBPCostGenerator : public Halide::Generator<AdaptBPCostGenerator> {
+    public:
+        Halide::GeneratorParam<int> variant{"variant", 0, 0,
+            numGreedyDispSchedules - 1};
+
+        Halide::ImageParam leftImg{Halide::Int(16), 4, "leftImg"};
+
+        Halide::ImageParam rightImg{Halide::Int(16), 4, "rightImg"};
+
+        Halide::Param<int> minDispParam{"minDisp"};
+
+        Halide::Param<int> maxDispParam{"maxDisp"};
+
+        Halide::Param<float> omegaParam{"omega"};
+
+        Halide::Func build() {
+            return defineGreedyDisp(leftImg, rightImg,
+                    minDispParam, maxDispParam, omegaParam,
+                    greedyDispSchedules[variant]);
+        }
+};
+
+Halide::RegisterGenerator<AdaptBPCostGenerator> registerAdaptBPCost{"adaptbp_cost"};
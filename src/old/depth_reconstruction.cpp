@@ -5,6 +5,8 @@
 
 #include "cvutil/cvutil.h"
 
+#include "instrument/instrument.h"
+
 void ReconstructUtil::computeCanonicalPose(
         const Eigen::Matrix3d& E,
         array<Eigen::Matrix<double, 3, 4>, 4>& candidates) {
@@ -68,6 +70,8 @@ void DepthReconstruction::init(
 }
 
 void DepthReconstruction::solveSloppy() {
+    INSTRUMENT_SCOPE("DepthReconstruction::solveSloppy");
+
     resetSolutionState();
 
     const size_t minInliers = 200;
@@ -80,16 +84,12 @@ void DepthReconstruction::solveSloppy() {
     fill(cameraInlierMask.begin(), cameraInlierMask.end(), false);
 
     for (size_t cameraI = 0; cameraI < cameras.size(); cameraI++) {
-        cout << "Estimating F for camera " << cameraI << endl;
+        INSTRUMENT_SCOPE("estimateCamera");
 
-        size_t fInlierCount = estimateFUsingObs(cameraI);
-
-        cout << "Inliers after computing F = " << fInlierCount << endl;
+        estimateFUsingObs(cameraI);
 
         size_t poseInlierCount = estimatePoseUsingF(cameraI);
 
-        cout << "Inliers after computing Pose = " << poseInlierCount << endl;
-
         // If the pose estimated from F results in many more outliers,
         // due to negatively-facing points, it's probably a bad fit.
         float inlierRatio = poseInlierCount; // / fInlierCount;
@@ -105,6 +105,8 @@ void DepthReconstruction::solveSloppy() {
 }
 
 void DepthReconstruction::solve() {
+    INSTRUMENT_SCOPE("DepthReconstruction::solve");
+
     resetSolutionState();
 
     const size_t minInliers = 100;
@@ -115,16 +117,12 @@ void DepthReconstruction::solve() {
     vector<tuple<float, size_t>> camInlierCount;
     
     for (size_t cameraI = 0; cameraI < cameras.size(); cameraI++) {
-        cout << "Estimating camera " << cameraI << endl;
-
-        size_t fInlierCount = estimateFUsingObs(cameraI);
+        INSTRUMENT_SCOPE("estimateCamera");
 
-        cout << "Inliers after computing F = " << fInlierCount << endl;
+        estimateFUsingObs(cameraI);
 
         size_t poseInlierCount = estimatePoseUsingF(cameraI);
 
-        cout << "Inliers after computing Pose = " << poseInlierCount << endl;
-
         // If the pose estimated from F results in many more outliers,
         // due to negatively-facing points, it's probably a bad fit.
         float inlierRatio = poseInlierCount; // / fInlierCount;
@@ -139,9 +137,7 @@ void DepthReconstruction::solve() {
 
     size_t bestCameraI = get<1>(camInlierCount[0]);
 
-    size_t triCount = triangulateDepthUsingPose(bestCameraI);
-
-    cout << "Triangulation count = " << triCount << endl;
+    triangulateDepthUsingPose(bestCameraI);
 
     cameraInlierMask.resize(cameras.size());
 
@@ -156,23 +152,17 @@ void DepthReconstruction::solve() {
     for (int i = 1; i < maxImagesToUse; i++) {
         size_t cameraI = get<1>(camInlierCount[i]);
 
-        // resetInlierMask(cameraI);
+        INSTRUMENT_SCOPE("addCamera");
 
-        size_t inlierC = estimatePoseUsingDepth(cameraI, inlierThreshold);
+        // resetInlierMask(cameraI);
 
-        // printf("Depth-based pose estimation inliers = %d\n", inlierC);
+        estimatePoseUsingDepth(cameraI, inlierThreshold);
 
-        size_t triCount = triangulateDepthUsingPose(cameraI);
+        triangulateDepthUsingPose(cameraI);
 
         cameraInlierMask[cameraI] = true;
 
         refineCamerasAndDepth(cameraInlierMask);
-
-        cout << "Camera after bundle adjustment: " <<
-            cameras[cameraI].rotation << endl <<
-            "norm = " << cameras[cameraI].rotation.norm() << endl <<
-            cameras[cameraI].translation.transpose() << endl <<
-            "norm = " << cameras[cameraI].translation.norm() << endl;
     }
 
     // Refine camera pose estimates using bundle-adjusted depth
@@ -203,22 +193,18 @@ void DepthReconstruction::solve() {
 
         // printf("Depth-based pose estimation inliers = %d\n", inlierC);
 
-        size_t triCount = triangulateDepthUsingPose(cameraI);
+        INSTRUMENT_SCOPE("triangulateCamera");
 
-        cameraInlierMask[cameraI] = true;
+        triangulateDepthUsingPose(cameraI);
 
-        cout << "Camera after bundle adjustment: " <<
-            cameras[cameraI].rotation << endl <<
-            "norm = " << cameras[cameraI].rotation.norm() << endl <<
-            cameras[cameraI].translation.transpose() << endl <<
-            "norm = " << cameras[cameraI].translation.norm() << endl;
+        cameraInlierMask[cameraI] = true;
     }
 
-    printf("Final bundle adjustment on *all* points...\n");
-
-    refineCamerasAndDepth(cameraInlierMask);
+    {
+        INSTRUMENT_SCOPE("finalBundleAdjustment");
 
-    printf("Done\n");
+        refineCamerasAndDepth(cameraInlierMask);
+    }
 
     // Set inlierCount to tally the total number of inlier observations
     // used in determining each depth value.
@@ -1,5 +1,16 @@
 #include "dpstereo.h"
 
+#include "instrument/instrument.h"
+
+#include <algorithm>
+
+static const int16_t COST_MAX = numeric_limits<int16_t>::max();
+
+static inline int16_t saturate(
+        int cost) {
+    return (int16_t) min(cost, (int) COST_MAX);
+}
+
 DPStereo::DPStereo(
         const Segmentation* _segmentation,
         int _smallDisp,
@@ -13,8 +24,8 @@ DPStereo::DPStereo(
 
 void DPStereo::computeStereo(
         StereoProblem& problem) {
-    const CImg<uint16_t>& left = problem.left;
-    const CImg<uint16_t>& right = problem.right;
+    const CImg<int16_t>& left = problem.left;
+    const CImg<int16_t>& right = problem.right;
     CImg<float>& disp = problem.disp;
 
     int minX = max(0, 0 - problem.minDisp);
@@ -81,7 +92,7 @@ void DPStereo::computeStereo(
                 // This is *really* slow!
                 for (int dI = 0; dI < numD; dI++) {
                     int minDI = max(0, dI - smallDisp);
-                    int maxDI = max(numD - 1, dI + smallDisp);
+                    int maxDI = min(numD - 1, dI + smallDisp);
 
                     int16_t curUnaryCost = costVol(dI);
 
@@ -89,7 +100,7 @@ void DPStereo::computeStereo(
                     dpMinCost(dI, xI) = curUnaryCost +
                         dpMinCost(optimalDI, xI - 1);
 
-                    if (!isSegmentEdge) {
+                    if (isSegmentEdge) {
                         dpMinCost(dI, xI) += costLargeDispSegEdge;
                     } else {
                         dpMinCost(dI, xI) += costLargeDisp;
@@ -144,3 +155,152 @@ void DPStereo::computeStereo(
 
     disp.display();
 }
+
+void DPStereo::computeRowFast(
+        StereoProblem& problem,
+        int y,
+        RowTables& tables) const {
+    const CImg<int16_t>& left = problem.left;
+    const CImg<int16_t>& right = problem.right;
+    CImg<float>& disp = problem.disp;
+
+    int minDisp = problem.minDisp;
+    int numD = problem.maxDisp - problem.minDisp + 1;
+
+    int minX = max(0, 0 - problem.minDisp);
+    int maxX = min(left.width() - 1, left.width() - 1 - problem.maxDisp);
+
+    int numX = maxX - minX + 1;
+
+    int16_t jumpCost = saturate((int) (costLargeDisp + 0.5f));
+    int16_t jumpCostSegEdge = saturate((int) (costLargeDispSegEdge + 0.5f));
+
+    int16_t* unary = tables.unary.data();
+    int16_t* prev = tables.prev.data() + smallDisp;
+    int16_t* cur = tables.cur.data();
+
+    int prevMinDI = 0;
+
+    for (int xI = 0; xI < numX; xI++) {
+        int x = xI + minX;
+
+        // Absolute differences summed over channels.  For fixed x, the
+        // right image pixels x + d are contiguous in d.
+        fill(unary, unary + numD, 0);
+
+        cimg_forC(left, c) {
+            int16_t l = left(x, y, 0, c);
+
+            const int16_t* r = right.data(x + minDisp, y, 0, c);
+
+            #pragma omp simd
+            for (int dI = 0; dI < numD; dI++) {
+                unary[dI] = saturate(unary[dI] + abs(l - r[dI]));
+            }
+        }
+
+        int16_t* pred = tables.pred.data() + xI * numD;
+
+        if (xI == 0) {
+            copy(unary, unary + numD, cur);
+            fill(pred, pred + numD, 0);
+        } else {
+            bool isSegmentEdge = segmentation != nullptr &&
+                (*segmentation)(x, y) != (*segmentation)(x - 1, y);
+
+            // prev is normalized, so its minimum is 0
+            int16_t jump = isSegmentEdge ? jumpCostSegEdge : jumpCost;
+
+            #pragma omp simd
+            for (int dI = 0; dI < numD; dI++) {
+                cur[dI] = jump;
+                pred[dI] = prevMinDI;
+            }
+
+            // Min-plus over the diagonals dI - dpI = k.  The padding of
+            // prev keeps the reads in bounds and never wins.
+            for (int k = -smallDisp; k <= smallDisp; k++) {
+                int16_t slope = abs(k);
+
+                const int16_t* src = prev + k;
+
+                #pragma omp simd
+                for (int dI = 0; dI < numD; dI++) {
+                    int16_t cost = saturate(src[dI] + slope);
+
+                    bool better = cost < cur[dI];
+
+                    cur[dI] = better ? cost : cur[dI];
+                    pred[dI] = better ? dI + k : pred[dI];
+                }
+            }
+
+            #pragma omp simd
+            for (int dI = 0; dI < numD; dI++) {
+                cur[dI] = saturate(cur[dI] + unary[dI]);
+            }
+        }
+
+        // Renormalize so that the minimum is 0
+        int16_t* curMin = min_element(cur, cur + numD);
+
+        int16_t minCost = *curMin;
+
+        prevMinDI = curMin - cur;
+
+        #pragma omp simd
+        for (int dI = 0; dI < numD; dI++) {
+            prev[dI] = cur[dI] - minCost;
+        }
+    }
+
+    // Read off the dp solution, starting from the best disparity of the
+    // right-most column
+    int curDI = prevMinDI;
+
+    float* dispRow = disp.data(0, y);
+
+    fill(dispRow, dispRow + disp.width(), numeric_limits<float>::max());
+
+    for (int xI = numX - 1; xI >= 0; xI--) {
+        dispRow[xI + minX] = (float) (curDI + minDisp);
+
+        curDI = tables.pred[xI * numD + curDI];
+    }
+}
+
+void DPStereo::computeStereoFast(
+        StereoProblem& problem) {
+    INSTRUMENT_SCOPE("DPStereo::computeStereoFast");
+
+    const CImg<int16_t>& left = problem.left;
+
+    int minX = max(0, 0 - problem.minDisp);
+    int maxX = min(left.width() - 1, left.width() - 1 - problem.maxDisp);
+
+    int numX = maxX - minX + 1;
+    int numD = problem.maxDisp - problem.minDisp + 1;
+
+    problem.disp.assign(left.width(), left.height());
+
+    if (numX <= 0 || numD <= 0) {
+        problem.disp.fill(numeric_limits<float>::max());
+
+        return;
+    }
+
+    #pragma omp parallel
+    {
+        RowTables tables;
+
+        tables.unary.resize(numD);
+        tables.prev.assign(numD + 2 * smallDisp, COST_MAX);
+        tables.cur.resize(numD);
+        tables.pred.resize(numX * numD);
+
+        #pragma omp for schedule(dynamic, 4)
+        for (int y = 0; y < left.height(); y++) {
+            computeRowFast(problem, y, tables);
+        }
+    }
+}
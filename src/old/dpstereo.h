@@ -14,6 +14,32 @@ class DPStereo {
 
         float costLargeDisp;
 
+        /**
+         * Per-thread buffers for computeStereoFast(), sized once and
+         * reused for every row.
+         */
+        struct RowTables {
+            vector<int16_t> unary;
+
+            /**
+             * Accumulated cost of the previous column, padded with
+             * smallDisp saturated entries on each side.
+             */
+            vector<int16_t> prev;
+
+            vector<int16_t> cur;
+
+            /**
+             * Predecessor disparity index of each (x, d).
+             */
+            vector<int16_t> pred;
+        };
+
+        void computeRowFast(
+                StereoProblem& problem,
+                int y,
+                RowTables& tables) const;
+
     public:
         DPStereo(
                 const Segmentation* _segmentation,
@@ -24,6 +50,26 @@ class DPStereo {
         void computeStereoGreedy(
                 StereoProblem& problem);
 
+        /**
+         * Reference implementation, which processes one row at a time and
+         * displays the result.
+         */
         void computeStereo(
                 StereoProblem& problem);
+
+        /**
+         * Production implementation of computeStereo(), which runs
+         * headless.  Rows are solved in parallel, with one set of DP tables
+         * per thread.  Costs are int16 and saturate rather than overflow;
+         * they are renormalized at every column so they stay small.  The
+         * small-jump transition is a vectorized min-plus over the
+         * 2 * smallDisp + 1 diagonals, and large jumps go through the
+         * minimum of the previous column.
+         *
+         * Columns whose matches fall outside the right image for some
+         * disparity in range are set to FLT_MAX.  The segmentation may be
+         * null, in which case every large jump costs costLargeDisp.
+         */
+        void computeStereoFast(
+                StereoProblem& problem);
 };
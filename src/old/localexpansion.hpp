@@ -1,36 +1,28 @@
 #pragma once
 
-// OpenGM and Halide MUST be included before CImg, which includes
-// X11 headers with conflicting/stupid definitions (i.e. `#define BOOL`).
-#include "opengm/graphicalmodel/graphicalmodel.hxx"
-#include "opengm/graphicalmodel/space/simplediscretespace.hxx"
-#include "opengm/functions/explicit_function.hxx"
-#include "opengm/functions/potts.hxx"
-#include "opengm/functions/sparsemarray.hxx"
-#include "opengm/inference/messagepassing/messagepassing.hxx"
-#include "opengm/inference/messagepassing/messagepassing_bp.hxx"
-#include "opengm/inference/messagepassing/messagepassing_trbp.hxx"
-#include "opengm/operations/adder.hxx"
-#include "opengm/operations/minimizer.hxx"
-#include "opengm/inference/mqpbo.hxx"
-#include "opengm/inference/graphcut.hxx"
-#include "opengm/inference/alphaexpansion.hxx"
-#include "opengm/inference/alphabetaswap.hxx"
-#include "opengm/inference/auxiliary/minstcutboost.hxx"
+// QPBO solver (src/qpbo, header-only).  Like OpenGM and Halide, include it
+// before CImg, which includes X11 headers with conflicting definitions.
+#include "QPBO.h"
 
 #include "common.h"
 
+#include "instrument/instrument.h"
+
 #include <vector>
-#include <map>
-#include <set>
 
 using namespace std;
 
 /**
  * Performs iterated graph-cuts over subsets of a graph.
  *
+ * A single QPBO graph, sized for maxNodesPerExpansion nodes, is allocated
+ * up front and reset between moves.  Energies are written straight into it
+ * and nodes are mapped to their position within the current move through
+ * a dense index, so a move performs no allocation once the scratch buffers
+ * have grown to their working size.
+ *
  * Type parameters:
- *  N - node type
+ *  N - node type, which must be usable as an index into the labeling
  *  L - label type
  *  UC - Unary cost class with function: float operator()(node_t, label_t)
  *  BC - Binary cost class with function: float operator()(node_t, node_t, label_t, label_t)
@@ -43,19 +35,11 @@ class LocalExpansion {
         typedef UC unary_cost_t;
         typedef BC binary_cost_t;
 
-        typedef opengm::SimpleDiscreteSpace<size_t, size_t> Space;
-        typedef opengm::ExplicitFunction<float, size_t, size_t> ExplicitFunction;
-
-        typedef opengm::GraphicalModel<float, opengm::Adder, ExplicitFunction,
-                Space> GModel;
-
-        typedef opengm::external::QPBO<GModel> QPBO;
+        typedef QPBO<float> Graph;
 
         size_t maxNodesPerExpansion;
 
-        GModel model;
-
-        unique_ptr<QPBO> qpbo;
+        unique_ptr<Graph> graph;
 
         vector<label_t>* labeling;
 
@@ -89,28 +73,64 @@ class LocalExpansion {
          */
         function<void(node_t, vector<node_t>&)> neighborGenerator;
 
+        /**
+         * Position of each node within the current move, or -1 for nodes
+         * which are not part of it.  Sized to the labeling.
+         */
+        vector<int> localIndex;
+
+        /**
+         * The candidate label of each node in the current move.
+         */
+        vector<label_t> candidateLabels;
+
+        vector<node_t> neighbors;
+
+        vector<pair<node_t, label_t>> pendingChanges;
+
+        struct ConstantLabelFunc {
+            label_t label;
+
+            label_t operator()(node_t node) const {
+                return this->label;
+            }
+        };
+
+        static inline float clampEnergy(
+                float e) {
+            return fmin(e, maxEnergy);
+        }
+
         /**
          * CandidateLabelFunc = function<label_t(node_t)>
          */
         template<class CandidateLabelFunc>
         void createExpandModel(
-                const set<node_t>& nodes,
+                const vector<node_t>& nodes,
                 const CandidateLabelFunc& labelFunc) {
-            Space space(maxNodesPerExpansion, 2);
+            graph->Reset();
 
-            model = GModel(space);
+            graph->AddNode(nodes.size());
 
-            int nodeIndex = 0;
-            map<node_t, int> nodeMap;
+            if (localIndex.size() < labeling->size()) {
+                localIndex.resize(labeling->size(), -1);
+            }
+
+            candidateLabels.resize(nodes.size());
 
-            vector<node_t> neighbors;
+            for (size_t i = 0; i < nodes.size(); i++) {
+                localIndex[nodes[i]] = i;
 
-            for (const node_t& node : nodes) {
-                nodeMap[node] = nodeIndex;
+                candidateLabels[i] = labelFunc(nodes[i]);
+            }
 
-                label_t newLabel = labelFunc(node);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                const node_t& node = nodes[i];
 
-                float costSame = unaryCost(node, (*labeling)[node]);
+                label_t oldLabel = (*labeling)[node];
+                label_t newLabel = candidateLabels[i];
+
+                float costSame = unaryCost(node, oldLabel);
                 float costDiff = unaryCost(node, newLabel);
 
                 neighbors.clear();
@@ -122,82 +142,52 @@ class LocalExpansion {
                         continue;
                     }
 
-                    label_t newNLabel = labelFunc(neighbor);
-
-                    // If this neighbor is in the sub-graph to be modified
-                    if (nodes.count(neighbor) > 0) {
-                        // Only process pairs once (and only after both nodes
-                        // have been added to nodeMap)
-                        if (neighbor < node) {
-                            size_t shape[] = {2, 2};
-
-                            ExplicitFunction func(begin(shape), end(shape));
-
-                            label_t oldLabel = (*labeling)[node];
-                            label_t oldNLabel = (*labeling)[neighbor];
-
-                            func(0, 0) = binaryCost(node, neighbor,
-                                    oldLabel, oldNLabel);
+                    int j = localIndex[neighbor];
 
-                            func(0, 1) = binaryCost(node, neighbor,
-                                    oldLabel, newNLabel);
+                    label_t oldNLabel = (*labeling)[neighbor];
 
-                            func(1, 0) = binaryCost(node, neighbor,
-                                    newLabel, oldNLabel);
-
-                            func(1, 1) = binaryCost(node, neighbor,
-                                    newLabel, newNLabel);
-
-                            GModel::FunctionIdentifier fid = model.addFunction(func);
-
-                            size_t vars[] = {
-                                (size_t) nodeMap[neighbor],
-                                (size_t) nodeMap[node]};
-
-                            model.addFactor(fid, begin(vars), end(vars));
+                    // If this neighbor is in the sub-graph to be modified
+                    if (j >= 0) {
+                        // Only process pairs once (and only after both
+                        // nodes have been indexed)
+                        if (j < (int) i) {
+                            label_t newNLabel = candidateLabels[j];
+
+                            graph->AddPairwiseTerm(i, j,
+                                    clampEnergy(binaryCost(node, neighbor,
+                                            oldLabel, oldNLabel)),
+                                    clampEnergy(binaryCost(node, neighbor,
+                                            oldLabel, newNLabel)),
+                                    clampEnergy(binaryCost(node, neighbor,
+                                            newLabel, oldNLabel)),
+                                    clampEnergy(binaryCost(node, neighbor,
+                                            newLabel, newNLabel)));
                         }
                     } else {
                         // If this neighbor is static, we have to account
                         // for the added cost resulting from the pairwise
                         // potential by adding it to the current node's
                         // unary term.
+                        costSame += binaryCost(node, neighbor,
+                                oldLabel, oldNLabel);
 
-                        float sameLabelSameNeighborCost = binaryCost(node, neighbor,
-                                (*labeling)[node], (*labeling)[neighbor]);
-
-                        float sameLabelDiffNeighborCost = binaryCost(node, neighbor,
-                                (*labeling)[node], newNLabel);
-
-                        costSame += sameLabelSameNeighborCost;// min(sameLabelSameNeighborCost, sameLabelDiffNeighborCost);
-
-                        float diffLabelSameNeighborCost = binaryCost(node, neighbor,
-                                newLabel, (*labeling)[neighbor]);
-
-                        float diffLabelDiffNeighborCost = binaryCost(node, neighbor,
-                                newLabel, newNLabel);
-
-                        costDiff += diffLabelSameNeighborCost; // min(diffLabelSameNeighborCost, diffLabelDiffNeighborCost);
+                        costDiff += binaryCost(node, neighbor,
+                                newLabel, oldNLabel);
                     }
                 }
 
-                size_t shape[] = {(size_t) 2};
-
-                ExplicitFunction dataTerm(begin(shape), end(shape));
-
-                dataTerm(0) = costSame;
-                dataTerm(1) = costDiff;
-
-                GModel::FunctionIdentifier fid = model.addFunction(dataTerm);
-
-                size_t vars[] = {(size_t) nodeMap[node]};
-
-                model.addFactor(fid, begin(vars), end(vars));
-
-                nodeIndex++;
+                graph->AddUnaryTerm(i, clampEnergy(costSame),
+                        clampEnergy(costDiff));
             }
         }
 
     public:
+        /**
+         * Energies are clamped to this value so that "infinite" costs
+         * (std::numeric_limits<float>::max()) cannot overflow max-flow.
+         */
+        constexpr static const float maxEnergy = 1e6f;
+
         LocalExpansion(
                 size_t _maxNodesPerExpansion,
                 vector<label_t>* _labeling,
@@ -209,55 +199,86 @@ class LocalExpansion {
                     unaryCost(_unaryCost),
                     binaryCost(_binaryCost),
                     neighborGenerator(_neighborGenerator) {
+            // Edge storage is an estimate; QPBO grows it if needed
+            graph = unique_ptr<Graph>(new Graph(maxNodesPerExpansion,
+                        maxNodesPerExpansion * 8));
+
+            localIndex.resize(labeling->size(), -1);
+
+            candidateLabels.reserve(maxNodesPerExpansion);
         }
 
+        /**
+         * Solves the move of each node in `nodes` (which must be distinct)
+         * to the label given by candidateGenerator, without modifying the
+         * labeling.  The nodes which should change, and their new labels,
+         * are appended to `changes`.
+         *
+         * Only the labels of `nodes` and their neighbors are read, so
+         * moves whose nodes and neighborhoods do not overlap may be
+         * proposed concurrently by different instances.
+         */
         template<class CandidateLabelFunc>
-        int tryExpand(
-                const set<node_t>& nodes,
-                CandidateLabelFunc& candidateGenerator) {
+        void proposeExpand(
+                const vector<node_t>& nodes,
+                CandidateLabelFunc& candidateGenerator,
+                vector<pair<node_t, label_t>>& changes) {
             createExpandModel(nodes, candidateGenerator);
 
-            qpbo = unique_ptr<QPBO>(new QPBO(model));
-            qpbo->infer();
+            graph->Solve();
 
-            vector<bool> optimalVariables;
-            vector<size_t> labels;
+            graph->ComputeWeakPersistencies();
 
-            qpbo->partialOptimality(optimalVariables);
+            size_t numChangesBefore = changes.size();
 
-            qpbo->arg(labels);
-            
-            int nodeIndex = 0;
+            for (size_t i = 0; i < nodes.size(); i++) {
+                // Unlabeled nodes (negative labels) keep their label
+                if (graph->GetLabel(i) == 1) {
+                    changes.push_back(make_pair(nodes[i], candidateLabels[i]));
+                }
 
-            int numChanged = 0;
+                localIndex[nodes[i]] = -1;
+            }
 
-            for (const node_t& node : nodes) {
-                if (optimalVariables[nodeIndex] && labels[nodeIndex] == 1) {
-                    (*labeling)[node] = candidateGenerator(node);
+            INSTRUMENT_COUNT(InstrumentCounter::QPBO_MOVES, 1);
+            INSTRUMENT_COUNT(InstrumentCounter::QPBO_CHANGES,
+                    changes.size() - numChangesBefore);
+        }
 
-                    numChanged++;
-                }
+        void proposeExpand(
+                const vector<node_t>& nodes,
+                label_t label,
+                vector<pair<node_t, label_t>>& changes) {
+            ConstantLabelFunc func = {label};
 
-                nodeIndex++;
+            proposeExpand(nodes, func, changes);
+        }
+
+        /**
+         * Tries to move each node in `nodes` (which must be distinct) to
+         * the label given by candidateGenerator.  Returns the number of
+         * nodes whose label changed.
+         */
+        template<class CandidateLabelFunc>
+        int tryExpand(
+                const vector<node_t>& nodes,
+                CandidateLabelFunc& candidateGenerator) {
+            pendingChanges.clear();
+
+            proposeExpand(nodes, candidateGenerator, pendingChanges);
+
+            for (const auto& change : pendingChanges) {
+                (*labeling)[change.first] = change.second;
             }
 
-            return numChanged;
+            return pendingChanges.size();
         }
 
         int tryExpand(
-                const set<node_t>& nodes,
+                const vector<node_t>& nodes,
                 label_t label) {
-            struct LabelFunc {
-                label_t label;
-
-                label_t operator()(node_t node) const {
-                    return this->label;
-                }
-            };
-
-            LabelFunc func = {label};
+            ConstantLabelFunc func = {label};
 
             return tryExpand(nodes, func);
         }
 };
-
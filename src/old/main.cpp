@@ -15,6 +15,8 @@
 
 #include "depth_reconstruction.h"
 
+#include "instrument/instrument.h"
+
 #include <Eigen/Dense>
 
 int main(int argc, char** argv) {
@@ -55,7 +57,11 @@ int main(int argc, char** argv) {
     float minDistance = min(workingWidth, workingHeight) * 1.0 / sqrt((float) numPoints);
     minDistance = max(5.0f, minDistance);
 
-    klt.init(initImgGray, numPoints, minDistance);
+    {
+        INSTRUMENT_SCOPE("detectFeatures");
+
+        klt.init(initImgGray, numPoints, minDistance);
+    }
 
     const int numGoodPoints = klt.sortFeatures(min(workingWidth, workingHeight) * 1.0 / sqrt(numMainPoints));
 
@@ -94,9 +100,11 @@ int main(int argc, char** argv) {
         assert(curImg.width() == originalWidth);
         assert(curImg.height() == originalHeight);
 
-        printf("Computing KLT\n");
-        klt.compute(curImgGray);
-        printf("Done\n");
+        {
+            INSTRUMENT_SCOPE("KLT");
+
+            klt.compute(curImgGray);
+        }
 
         for (int pointI = 0; pointI < klt.featureCount(); pointI++) {
             Eigen::Vector2f match0;
@@ -112,7 +120,11 @@ int main(int argc, char** argv) {
         }
     }
 
-    reconstruct.solve();
+    {
+        INSTRUMENT_SCOPE("DepthReconstruction::solve");
+
+        reconstruct.solve();
+    }
 
     // Visualize the result
     if (true) {
@@ -147,9 +159,11 @@ int main(int argc, char** argv) {
             }
         }
 
-        printf("initializing qpbo\n");
-        qpbo.init();
-        printf("done\n");
+        {
+            INSTRUMENT_SCOPE("TriQPBO::init");
+
+            qpbo.init();
+        }
         
         CImg<float> colorVis(workingWidth, workingHeight, 1, 3);
         colorVis.fill(0);
@@ -176,7 +190,11 @@ int main(int argc, char** argv) {
         // unaryCostFactor << cin;
 
         // qpbo.solveAlphaExpansion(minDepth, maxDepth, 32, 2, unaryCostFactor);
-        qpbo.solve(2, unaryCostFactor);
+        {
+            INSTRUMENT_SCOPE("TriQPBO::solve");
+
+            qpbo.solve(2, unaryCostFactor);
+        }
 
         {
             CImg<double> depthVis(workingWidth, workingHeight);
@@ -190,6 +208,8 @@ int main(int argc, char** argv) {
         // (initImg, depthVis).display();
 
         for (int i = 0; i < 1; i++) {
+            INSTRUMENT_SCOPE("TriQPBO::smoothAvg");
+
             qpbo.smoothAvg();
         }
 
@@ -634,9 +654,11 @@ int main(int argc, char** argv) {
             // Resize to a workable size and adjust the fundamental matrix
             // accordingly.
 
-            printf("Initializing rectification...\n");
-            polarR.init(curDown.width(), curDown.height(), polarF);
-            printf("Done\n");
+            {
+                INSTRUMENT_SCOPE("PolarRectification::init");
+
+                polarR.init(curDown.width(), curDown.height(), polarF);
+            }
 
             // Multiple scales, downsampling by 0.75 each time
             CImg<uint8_t> rectified0;
@@ -656,6 +678,8 @@ int main(int argc, char** argv) {
     }
 #endif
 
+    instrumentReportFromEnvironment();
+
     return 0;
 }
 
@@ -0,0 +1,306 @@
+#include "planefit.h"
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <numeric>
+
+SegmentPlaneFitter::SegmentPlaneFitter(
+        const Segmentation* _segmentation,
+        int _maxSlantPairs) :
+    segmentation(_segmentation),
+    maxSlantPairs(_maxSlantPairs),
+    ransac(false),
+    ransacIterations(64),
+    ransacInlierThresh(1.0f) {
+}
+
+bool SegmentPlaneFitter::estimateSlant(
+        Arena& arena,
+        const vector<float>& t,
+        const vector<float>& line,
+        const vector<unsigned int>& order,
+        minstd_rand& rng,
+        float& result) const {
+    const vector<float>& ds = arena.ds;
+
+    arena.lineStart.clear();
+    arena.lineEnd.clear();
+    arena.linePairs.clear();
+
+    uint64_t totalPairs = 0;
+
+    size_t n = order.size();
+
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+
+        while (j < n && line[order[j]] == line[order[i]]) {
+            j++;
+        }
+
+        uint64_t len = j - i;
+
+        if (len > 1) {
+            totalPairs += len * (len - 1) / 2;
+
+            arena.lineStart.push_back(i);
+            arena.lineEnd.push_back(j);
+            arena.linePairs.push_back(totalPairs);
+        }
+
+        i = j;
+    }
+
+    if (totalPairs < 1) {
+        return false;
+    }
+
+    vector<float>& dt = arena.values;
+
+    dt.clear();
+
+    if (totalPairs <= (uint64_t) maxSlantPairs) {
+        // Few enough pairs to use all of them
+        for (size_t lineI = 0; lineI < arena.lineStart.size(); lineI++) {
+            for (unsigned int i = arena.lineStart[lineI];
+                    i < arena.lineEnd[lineI]; i++) {
+                for (unsigned int j = i + 1; j < arena.lineEnd[lineI]; j++) {
+                    unsigned int a = order[i];
+                    unsigned int b = order[j];
+
+                    dt.push_back((ds[b] - ds[a]) / (t[b] - t[a]));
+                }
+            }
+        }
+    } else {
+        // Draw pairs uniformly: pick a line in proportion to the number
+        // of pairs it holds, then two distinct samples within it.
+        uniform_int_distribution<uint64_t> pickPair(0, totalPairs - 1);
+
+        for (int k = 0; k < maxSlantPairs; k++) {
+            uint64_t pairI = pickPair(rng);
+
+            size_t lineI = upper_bound(arena.linePairs.begin(),
+                    arena.linePairs.end(), pairI) - arena.linePairs.begin();
+
+            unsigned int start = arena.lineStart[lineI];
+            unsigned int len = arena.lineEnd[lineI] - start;
+
+            unsigned int i = start + rng() % len;
+            unsigned int j = start + rng() % (len - 1);
+
+            if (j >= i) {
+                j++;
+            }
+
+            unsigned int a = order[i];
+            unsigned int b = order[j];
+
+            dt.push_back((ds[b] - ds[a]) / (t[b] - t[a]));
+        }
+    }
+
+    nth_element(dt.begin(), dt.begin() + dt.size() / 2, dt.end());
+
+    result = dt[dt.size() / 2];
+
+    return true;
+}
+
+void SegmentPlaneFitter::fitRansac(
+        Arena& arena,
+        minstd_rand& rng,
+        Plane& plane) const {
+    const vector<float>& xs = arena.xs;
+    const vector<float>& ys = arena.ys;
+    const vector<float>& ds = arena.ds;
+
+    size_t n = ds.size();
+
+    if (n < 3) {
+        return;
+    }
+
+    auto countInliers = [&](const Plane& p) {
+        int count = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            count += fabs(ds[i] - p.dispAt(xs[i], ys[i])) <= ransacInlierThresh;
+        }
+
+        return count;
+    };
+
+    Plane best = plane;
+
+    int bestInliers = countInliers(plane);
+
+    uniform_int_distribution<unsigned int> pick(0, n - 1);
+
+    for (int iter = 0; iter < ransacIterations; iter++) {
+        unsigned int i = pick(rng);
+        unsigned int j = pick(rng);
+        unsigned int k = pick(rng);
+
+        if (i == j || j == k || i == k) {
+            continue;
+        }
+
+        Eigen::Matrix3f a;
+
+        a << xs[i], ys[i], 1.0f,
+             xs[j], ys[j], 1.0f,
+             xs[k], ys[k], 1.0f;
+
+        // Skip (nearly) collinear triples
+        if (fabs(a.determinant()) < 1e-3f) {
+            continue;
+        }
+
+        Eigen::Vector3f p = a.partialPivLu().solve(
+                Eigen::Vector3f(ds[i], ds[j], ds[k]));
+
+        Plane hypothesis(p(0), p(1), p(2));
+
+        int inliers = countInliers(hypothesis);
+
+        if (inliers > bestInliers) {
+            best = hypothesis;
+            bestInliers = inliers;
+        }
+    }
+
+    // Least-squares refinement over the inliers of the best hypothesis
+    Eigen::Matrix3d ata = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d atd = Eigen::Vector3d::Zero();
+
+    for (size_t i = 0; i < n; i++) {
+        if (fabs(ds[i] - best.dispAt(xs[i], ys[i])) <= ransacInlierThresh) {
+            Eigen::Vector3d row(xs[i], ys[i], 1.0);
+
+            ata += row * row.transpose();
+            atd += row * ds[i];
+        }
+    }
+
+    plane = best;
+
+    if (bestInliers >= 3 && fabs(ata.determinant()) > 1e-9) {
+        Eigen::Vector3d p = ata.ldlt().solve(atd);
+
+        if (p.allFinite()) {
+            plane = Plane(p(0), p(1), p(2));
+        }
+    }
+}
+
+bool SegmentPlaneFitter::fitSegment(
+        Arena& arena,
+        segmentH_t segH,
+        const CImg<float>& disp,
+        float minDisp,
+        float maxDisp,
+        Plane& plane) const {
+    arena.xs.clear();
+    arena.ys.clear();
+    arena.ds.clear();
+
+    // Runs are in raster order, so samples come out sorted by row
+    for (const SegmentRun& run : segmentation->getRuns(segH)) {
+        const float* row = disp.data(0, run.y);
+
+        for (int x = run.x0; x < run.x1; x++) {
+            float d = row[x];
+
+            if (d >= minDisp && d <= maxDisp) {
+                arena.xs.push_back(x);
+                arena.ys.push_back(run.y);
+                arena.ds.push_back(d);
+            }
+        }
+    }
+
+    size_t n = arena.ds.size();
+
+    if (n < 2) {
+        return false;
+    }
+
+    arena.byRow.resize(n);
+
+    iota(arena.byRow.begin(), arena.byRow.end(), 0);
+
+    // Counting sort by column, which keeps each column sorted by row
+    int minX, minY, maxX, maxY;
+
+    (*segmentation)[segH].getBounds(minX, minY, maxX, maxY);
+
+    arena.columnCounts.assign(maxX - minX + 2, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        arena.columnCounts[(int) arena.xs[i] - minX + 1]++;
+    }
+
+    partial_sum(arena.columnCounts.begin(), arena.columnCounts.end(),
+            arena.columnCounts.begin());
+
+    arena.byColumn.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+        arena.byColumn[arena.columnCounts[(int) arena.xs[i] - minX]++] = i;
+    }
+
+    // Seed per segment so results do not depend on the thread schedule
+    minstd_rand rng(segH + 1);
+
+    float cx, cy;
+
+    if (!estimateSlant(arena, arena.xs, arena.ys, arena.byRow, rng, cx)) {
+        return false;
+    }
+
+    if (!estimateSlant(arena, arena.ys, arena.xs, arena.byColumn, rng, cy)) {
+        return false;
+    }
+
+    vector<float>& cSamples = arena.values;
+
+    cSamples.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+        cSamples[i] = arena.ds[i] - (cx * arena.xs[i] + cy * arena.ys[i]);
+    }
+
+    nth_element(cSamples.begin(), cSamples.begin() + n / 2, cSamples.end());
+
+    plane = Plane(cx, cy, cSamples[n / 2]);
+
+    if (ransac) {
+        fitRansac(arena, rng, plane);
+    }
+
+    return true;
+}
+
+void SegmentPlaneFitter::fit(
+        const CImg<float>& disp,
+        float minDisp,
+        float maxDisp,
+        vector<Plane>& planes) const {
+    planes.assign(segmentation->size(), Plane());
+
+    #pragma omp parallel
+    {
+        Arena arena;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int segH = 0; segH < (int) segmentation->size(); segH++) {
+            Plane plane;
+
+            if (fitSegment(arena, segH, disp, minDisp, maxDisp, plane)) {
+                planes[segH] = plane;
+            }
+        }
+    }
+}
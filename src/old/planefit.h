@@ -0,0 +1,122 @@
+#pragma once
+
+#include "common.h"
+
+#include "segment.h"
+
+#include <random>
+
+/**
+ * Fits a disparity plane to every segment of a segmentation, following the
+ * decomposed estimate of Klaus et al.: the horizontal and vertical slants
+ * are the medians of finite differences between valid disparities on the
+ * same scanline (resp. column), and the offset is the median of the
+ * residuals after removing the slant.
+ *
+ * Segments are fitted in parallel.  Each thread owns an Arena of sample
+ * buffers which is reused from one segment to the next, so fitting does
+ * not allocate once the buffers have grown to the largest segment.
+ * Medians are found with nth_element() rather than full sorts.
+ */
+class SegmentPlaneFitter {
+    private:
+        /**
+         * Per-thread scratch space.
+         */
+        struct Arena {
+            vector<float> xs, ys, ds;
+
+            /**
+             * Samples of the current segment in row-major and
+             * column-major order, as indices into xs, ys and ds.
+             */
+            vector<unsigned int> byRow, byColumn;
+
+            vector<unsigned int> columnCounts;
+
+            /**
+             * Range and cumulative pair count of each line holding at
+             * least two samples.
+             */
+            vector<unsigned int> lineStart, lineEnd;
+
+            vector<uint64_t> linePairs;
+
+            vector<float> values;
+        };
+
+        const Segmentation* segmentation;
+
+        int maxSlantPairs;
+
+        bool ransac;
+
+        int ransacIterations;
+
+        float ransacInlierThresh;
+
+        /**
+         * Estimates the slant dD/dt from the samples visited in `order`.
+         * Consecutive samples with the same `line` coordinate form a line,
+         * and only pairs within a line contribute finite differences.
+         *
+         * Returns false if no line holds two samples.
+         */
+        bool estimateSlant(
+                Arena& arena,
+                const vector<float>& t,
+                const vector<float>& line,
+                const vector<unsigned int>& order,
+                minstd_rand& rng,
+                float& result) const;
+
+        bool fitSegment(
+                Arena& arena,
+                segmentH_t segH,
+                const CImg<float>& disp,
+                float minDisp,
+                float maxDisp,
+                Plane& plane) const;
+
+        void fitRansac(
+                Arena& arena,
+                minstd_rand& rng,
+                Plane& plane) const;
+
+    public:
+        /**
+         * \param maxSlantPairs Upper bound on the number of finite
+         *                      differences used to estimate each slant.
+         *                      Segments with more sample pairs than this
+         *                      use a uniform random subset of them.
+         */
+        SegmentPlaneFitter(
+                const Segmentation* _segmentation,
+                int _maxSlantPairs = 4096);
+
+        /**
+         * Refines each median plane with RANSAC over the segment's
+         * samples, followed by a least-squares fit to the inliers.  The
+         * median plane is always among the hypotheses, so the result is
+         * never supported by fewer inliers.
+         */
+        inline void setRansac(
+                bool enable,
+                int iterations = 64,
+                float inlierThresh = 1.0f) {
+            ransac = enable;
+            ransacIterations = iterations;
+            ransacInlierThresh = inlierThresh;
+        }
+
+        /**
+         * Fits a plane to each segment using disparities in
+         * [minDisp, maxDisp].  planes[i] is the plane of segment i, or an
+         * invalid Plane if segment i did not have enough valid samples.
+         */
+        void fit(
+                const CImg<float>& disp,
+                float minDisp,
+                float maxDisp,
+                vector<Plane>& planes) const;
+};
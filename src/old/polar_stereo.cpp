@@ -2,14 +2,18 @@
 
 #include "cvutil/cvutil.h"
 
+#include "instrument/instrument.h"
+
 bool PolarFundamentalMatrix::init(
         const Eigen::Matrix3d& _F,
         const array<Eigen::Vector2d, 2>& _match) {
     F = _F;
     match = _match;
 
-    auto Fkern = F.fullPivLu().kernel();
-    auto FTkern = F.transpose().fullPivLu().kernel();
+    // Evaluate the kernels eagerly: `auto` would keep expressions referring
+    // to the destroyed temporary decompositions.
+    Eigen::MatrixXd Fkern = F.fullPivLu().kernel();
+    Eigen::MatrixXd FTkern = F.transpose().fullPivLu().kernel();
 
     if (Fkern.cols() < 1 ||
             FTkern.cols() < 1) {
@@ -183,6 +187,48 @@ bool PolarRectification::init(
     return true;
 }
 
+bool PolarRectification::initDecimated(
+        const PolarRectification& full,
+        int _width,
+        int _height,
+        const PolarFundamentalMatrix& _F) {
+    imgWidth = _width;
+    imgHeight = _height;
+    F = _F;
+
+    double scaleX = imgWidth / (double) full.imgWidth;
+    double scaleY = imgHeight / (double) full.imgHeight;
+
+    // Lines of `full` are about one pixel apart along the image borders
+    int step = max(1, (int) round(2.0 / (scaleX + scaleY)));
+
+    epipoleLines.clear();
+    epipoleLines.reserve(full.epipoleLines.size() / step + 1);
+
+    for (size_t eI = 0; eI < full.epipoleLines.size(); eI += step) {
+        const EpipolarLineSample& fullSample = full.epipoleLines[eI];
+
+        EpipolarLineSample sample;
+
+        for (int imgId = 0; imgId < 2; imgId++) {
+            Eigen::Vector2d dir(
+                    fullSample.direction[imgId].x() * scaleX,
+                    fullSample.direction[imgId].y() * scaleY);
+
+            // Distances along the line scale with its direction
+            double rScale = dir.norm();
+
+            sample.direction[imgId] = dir / rScale;
+            sample.minRadius[imgId] = fullSample.minRadius[imgId] * rScale;
+            sample.maxRadius[imgId] = fullSample.maxRadius[imgId] * rScale;
+        }
+
+        epipoleLines.push_back(sample);
+    }
+
+    return true;
+}
+
 void PolarRectification::rectify(
         int imgId,
         const CImg<uint8_t>& original,
@@ -197,41 +243,167 @@ void PolarRectification::rectify(
     maximalRectificationRange(maximumPixelCount, startRow, numRows,
             maximumWidth, disparityFactor, disparityOffset);
 
-    rectified.resize(maximumWidth, numRows, 1, original.spectrum());
+    RemapTable remap;
 
-    reverseMap.resize(maximumWidth, numRows, 2);
+    createRemap(imgId, startRow, numRows, remap);
 
-    struct {
-        const CImg<uint8_t>& original;
-        CImg<uint8_t>& rectified;
-        CImg<float>& reverseMap;
-        int channel;
+    rectified.resize(maximumWidth, numRows, 1, original.spectrum(), -1);
 
-        void operator()(
-                const Eigen::Vector2i& rCoord,
-                const Eigen::Vector2d& polar,
-                const Eigen::Vector2d& oCoord) {
-            if (rCoord.x() >= reverseMap.width()) {
-                printf("rCoord OUT OF BOUNDS = %d\n", rCoord.x());
-            }
-            assert(rCoord.x() < reverseMap.width());
-            assert(rCoord.y() < reverseMap.height());
+    rectified = (uint8_t) 0;
+
+    remap.apply(original, rectified);
 
-            reverseMap(rCoord.x(), rCoord.y(), 0) =
-                oCoord.x();
-            reverseMap(rCoord.x(), rCoord.y(), 1) =
-                oCoord.y();
+    reverseMap.resize(maximumWidth, numRows, 2, 1, -1);
+
+    reverseMap = 0.0f;
+
+    for (int y = 0; y < remap.height; y++) {
+        copy(remap.mapX.begin() + y * remap.width,
+                remap.mapX.begin() + (y + 1) * remap.width,
+                reverseMap.data(0, y, 0));
+        copy(remap.mapY.begin() + y * remap.width,
+                remap.mapY.begin() + (y + 1) * remap.width,
+                reverseMap.data(0, y, 1));
+    }
+}
+
+void PolarRectification::getRadiusMapping(
+        int imgId,
+        int startRow,
+        int numRows,
+        double& minR,
+        double& maxR,
+        int& rFactor,
+        double& rStart) const {
+    minR = std::numeric_limits<double>::max();
+    maxR = std::numeric_limits<double>::min();
+
+    for (int eI = 0; eI < numRows; eI++) {
+        const auto& sample = epipoleLines[startRow + eI];
+
+        minR = min(minR, sample.minRadius[imgId]);
+        maxR = max(maxR, sample.maxRadius[imgId]);
+    }
 
-            float col = 0;
+    rFactor = 1;
+    rStart = minR;
 
-            rectified(rCoord.x(), rCoord.y(), 0, channel) =
-                original.linear_atXY(oCoord.x(), oCoord.y(), 0, channel, col);
+    if (F.areEpipolesReflected() && imgId == 1) {
+        rFactor = -1;
+        rStart = maxR;
+    }
+}
+
+void PolarRectification::createRemap(
+        int imgId,
+        int startRow,
+        int numRows,
+        RemapTable& remap) const {
+    double minR, maxR, rStart;
+    int rFactor;
+
+    getRadiusMapping(imgId, startRow, numRows, minR, maxR, rFactor, rStart);
+
+    // The same columns as evaluateRectificationTransform():
+    // r < (maxR - minR) + 0.5
+    int width = (int) ceil((maxR - minR) + 0.5);
+
+    remap.resize(width, numRows);
+
+    const Eigen::Vector2d& e = F.getEpipole(imgId);
+
+    #pragma omp parallel for schedule(dynamic, 8)
+    for (int eI = 0; eI < numRows; eI++) {
+        const Eigen::Vector2d& dir = epipoleLines[startRow + eI].direction[imgId];
+
+        float* mx = remap.mapX.data() + eI * width;
+        float* my = remap.mapY.data() + eI * width;
+
+        for (int r = 0; r < width; r++) {
+            double rValue = r * rFactor + rStart;
+
+            mx[r] = e.x() + dir.x() * rValue;
+            my[r] = e.y() + dir.y() * rValue;
         }
-    } rectCallback = {original, rectified, reverseMap, 0};
+    }
+}
 
-    for (int c = 0; c < original.spectrum(); c++) {
-        rectCallback.channel = c;
-        evaluateRectificationTransform(imgId, startRow, numRows, rectCallback);
+void PolarRectification::createInverseRemap(
+        int imgId,
+        int startRow,
+        int numRows,
+        RemapTable& remap) const {
+    double minR, maxR, rStart;
+    int rFactor;
+
+    getRadiusMapping(imgId, startRow, numRows, minR, maxR, rFactor, rStart);
+
+    remap.resize(imgWidth, imgHeight);
+
+    const Eigen::Vector2d& e = F.getEpipole(imgId);
+
+    const Eigen::Vector2d& d0 = epipoleLines[startRow].direction[imgId];
+
+    // Angle of a direction relative to the first row, in [0, 2 pi), and
+    // oriented so that it increases with the row index (rows sweep
+    // clockwise in image 1 when the epipoles are reflected).
+    double orientation = 1.0;
+
+    if (numRows > 1) {
+        const Eigen::Vector2d& d1 = epipoleLines[startRow + 1].direction[imgId];
+
+        orientation = (d0.x() * d1.y() - d0.y() * d1.x() < 0) ? -1.0 : 1.0;
+    }
+
+    auto relativeAngle = [&](double x, double y) {
+        double angle = orientation * atan2(d0.x() * y - d0.y() * x,
+                d0.x() * x + d0.y() * y);
+
+        return (angle < 0) ? angle + 2.0 * M_PI : angle;
+    };
+
+    vector<double> angles(numRows);
+
+    for (int eI = 0; eI < numRows; eI++) {
+        const Eigen::Vector2d& dir = epipoleLines[startRow + eI].direction[imgId];
+
+        angles[eI] = (eI == 0) ? 0.0 : relativeAngle(dir.x(), dir.y());
+    }
+
+    // Rectified coordinates outside of the band
+    const float outside = -2.0f;
+
+    #pragma omp parallel for schedule(dynamic, 8)
+    for (int y = 0; y < imgHeight; y++) {
+        float* mx = remap.mapX.data() + y * imgWidth;
+        float* my = remap.mapY.data() + y * imgWidth;
+
+        for (int x = 0; x < imgWidth; x++) {
+            double vx = x - e.x();
+            double vy = y - e.y();
+
+            double angle = relativeAngle(vx, vy);
+
+            if (angle > angles.back()) {
+                mx[x] = outside;
+                my[x] = outside;
+                continue;
+            }
+
+            int row = upper_bound(angles.begin(), angles.end(), angle) -
+                angles.begin() - 1;
+
+            double rowF = row;
+
+            if (row + 1 < numRows) {
+                rowF += (angle - angles[row]) / (angles[row + 1] - angles[row]);
+            }
+
+            double radius = sqrt(vx * vx + vy * vy);
+
+            mx[x] = (radius - rStart) * rFactor;
+            my[x] = rowF;
+        }
     }
 }
 
@@ -252,30 +424,37 @@ void PolarRectification::maximalRectificationRange(
 
     maximumWidth = 0;
 
-    for (numRows = 0; numRows < epipoleLines.size() - startRow; numRows++) {
+    int totalRows = epipoleLines.size();
+
+    // Grow the span one row at a time, and stop before the row which would
+    // exceed the budget.  The span always holds at least one row.
+    for (numRows = 0; startRow + numRows < totalRows; numRows++) {
+        const EpipolarLineSample& sample = epipoleLines[startRow + numRows];
+
+        double newMinR[2];
+        double newMaxR[2];
+
+        int newMaximumWidth = maximumWidth;
+
         for (int i = 0; i < 2; i++) {
-            // Compute this before we clobber minR and maxR with values from
-            // a row which may not be in the maximal span.
-            if (F.areEpipolesReflected()) {
-                disparityFactor = -1;
-                disparityOffset = minR[0] - maxR[1];
-            } else {
-                disparityFactor = 1;
-                disparityOffset = minR[0] - minR[1];
-            }
+            newMinR[i] = min(minR[i], sample.minRadius[i]);
+            newMaxR[i] = max(maxR[i], sample.maxRadius[i]);
 
-            minR[i] = min(minR[i], epipoleLines[startRow + numRows].minRadius[i]);
-            maxR[i] = max(maxR[i], epipoleLines[startRow + numRows].maxRadius[i]);
+            newMaximumWidth = max(newMaximumWidth,
+                    (int) (newMaxR[i] - newMinR[i]) + 2);
+        }
 
-            int newMaximumWidth = (maxR[i] - minR[i]) + 2;
+        if (numRows > 0 &&
+                (int64_t) newMaximumWidth * (numRows + 1) > maximumPixelCount) {
+            break;
+        }
 
-            if (newMaximumWidth * (numRows + 1) > maximumPixelCount) {
-                numRows++;
-                break;
-            } else {
-                maximumWidth = max(maximumWidth, newMaximumWidth);
-            }
+        for (int i = 0; i < 2; i++) {
+            minR[i] = newMinR[i];
+            maxR[i] = newMaxR[i];
         }
+
+        maximumWidth = newMaximumWidth;
     }
 
     if (F.areEpipolesReflected()) {
@@ -528,17 +707,14 @@ void PolarRectification::createRectificationMap() {
 
     if (imgBounds.contains(F.getEpipole(0)) &&
             imgBounds.contains(F.getEpipole(1))) {
-        printf("Epipoles inside image 0 & image 1\n");
         // If both the epipole passes through both images, the start and end
         // direction should be the same.  We can arbitrarily choose one.
         startDir = Eigen::Vector2d(1, 0);
         endDir = Eigen::Vector2d(1, 0);
     } else if (imgBounds.contains(F.getEpipole(1))) {
-        printf("Epipoles inside image 1\n");
         startDir = start0Dir;
         endDir = end0Dir;
     } else if (imgBounds.contains(F.getEpipole(0))) {
-        printf("Epipoles inside image 0\n");
         startDir = start1Dir;
         endDir = end1Dir;
     } else {
@@ -559,74 +735,60 @@ void PolarRectification::createRectificationMap() {
         endDir = (endCross > 0) ? end0Dir : end1Dir;
     }
 
-    // The direction of the current epipolar line
-    // To begin, this should be along the direction of the first clipping-plane
-    Eigen::Vector2d curLineVec = startDir;
-
-    int maxSteps = 2 * (imgWidth * 2 + imgHeight * 2);
-
-    for (int counter = 0; counter < maxSteps; counter++) {
-        EpipolarLineSample curSample;
+    // Split the lines into sectors of equal angle, traced in parallel.
+    // The angle swept from startDir to endDir is a full turn when they
+    // coincide.
+    double span = atan2(
+            startDir.x() * endDir.y() - startDir.y() * endDir.x(),
+            startDir.dot(endDir));
 
-        curSample.direction[0] = curLineVec;
+    if (span <= 0) {
+        span += 2.0 * M_PI;
+    }
 
-        // Compute the intersection of the current epipolar line in image 0 with a
-        // relevant edge by casting a ray from the epipole.
-        Eigen::ParametrizedLine<double, 2> curLine0(F.getEpipole(0), curLineVec);
+    const int numSectors = 16;
 
-        getEpipoleDistanceRange(0, curLineVec, curSample.minRadius[0],
-                curSample.maxRadius[0]);
+    vector<Eigen::Vector2d> sectorDirs(numSectors + 1);
 
-        Eigen::Vector2d curLineEndpointImg0 = curLine0.pointAt(curSample.maxRadius[0]);
+    for (int k = 0; k < numSectors; k++) {
+        double angle = span * k / numSectors;
 
-        // Compute the intersection of the current epipolar line in image 1 with a
-        // relevant edge by casting a ray from the epipole.
-        Eigen::Vector2d curLineVec1;
+        sectorDirs[k] = Eigen::Rotation2Dd(angle) * startDir;
+    }
 
-        F.getEpipolarLine(0, curLineEndpointImg0, curLineVec1);
+    sectorDirs[numSectors] = endDir;
 
-        curSample.direction[1] = curLineVec1;
+    vector<vector<EpipolarLineSample>> sectorLines(numSectors);
 
-        Eigen::ParametrizedLine<double, 2> curLine1(F.getEpipole(1), curLineVec1);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < numSectors; k++) {
+        createSectorLines(sectorDirs[k], sectorDirs[k + 1], sectorLines[k]);
+    }
 
-        getEpipoleDistanceRange(1, curLineVec1, curSample.minRadius[1],
-                curSample.maxRadius[1]);
+    for (const auto& lines : sectorLines) {
+        epipoleLines.insert(epipoleLines.end(), lines.begin(), lines.end());
+    }
+}
 
-        Eigen::Vector2d curLineEndpointImg1 = curLine1.pointAt(curSample.maxRadius[1]);
+void PolarRectification::createSectorLines(
+        const Eigen::Vector2d& startDir,
+        const Eigen::Vector2d& endDir,
+        vector<EpipolarLineSample>& lines) const {
+    // The direction of the current epipolar line
+    // To begin, this should be along the direction of the first clipping-plane
+    Eigen::Vector2d curLineVec = startDir;
 
-        // Push the current epipolar line
-        epipoleLines.push_back(curSample);
+    int maxSteps = 2 * (imgWidth * 2 + imgHeight * 2);
 
-        // Compute the next epipolar line by considering those resulting from moving
-        // one unit along the edge of image 0 and image 1 from the current epipolar
-        // line.
+    for (int counter = 0; counter < maxSteps; counter++) {
+        EpipolarLineSample curSample;
 
-        // A point on next epipolar line, using image 0, in image 0
-        Eigen::Vector2d nextLine0Pt0 = curLineEndpointImg0 + curLineVec.unitOrthogonal();
-        Eigen::Vector2d nextLine0Dir0 = (nextLine0Pt0 - F.getEpipole(0)).normalized();
-        
-        // Map nextLine0 into image 1
-        Eigen::Vector2d nextLine0Dir1;
-        F.getEpipolarLine(0, nextLine0Pt0, nextLine0Dir1);
-       
-        // A point on next epipolar line, using image 1, in image 1...
-        
-        // First, we must compute the direction to move in image 1
-        Eigen::Vector2d arcDirImg1 = 
-            (nextLine0Dir1 -
-                (nextLine0Dir1.dot(curLineVec1) * curLineVec1)).normalized();
+        Eigen::Vector2d next;
 
-        Eigen::Vector2d nextLine1Pt1 = curLineEndpointImg1 + arcDirImg1;
-        
-        // Map nextLine1 into image 0
-        Eigen::Vector2d nextLine1Dir0;
-        F.getEpipolarLine(1, nextLine1Pt1, nextLine1Dir0);
+        createLineSample(curLineVec, curSample, next);
 
-        // Use the next epipolar line which is closest
-        double dist0 = (nextLine0Dir0 - curLineVec).squaredNorm();
-        double dist1 = (nextLine1Dir0 - curLineVec).squaredNorm();
-
-        Eigen::Vector2d& next = (dist0 <= dist1) ? nextLine0Dir0 : nextLine1Dir0;
+        // Push the current epipolar line
+        lines.push_back(curSample);
 
         // If the vector crosses over the end direction, then stop iterating.
         if (Eigen::Vector3d(curLineVec.x(), curLineVec.y(), 0).cross(
@@ -640,6 +802,68 @@ void PolarRectification::createRectificationMap() {
     }
 }
 
+void PolarRectification::createLineSample(
+        const Eigen::Vector2d& curLineVec,
+        EpipolarLineSample& curSample,
+        Eigen::Vector2d& next) const {
+    curSample.direction[0] = curLineVec;
+
+    // Compute the intersection of the current epipolar line in image 0 with a
+    // relevant edge by casting a ray from the epipole.
+    Eigen::ParametrizedLine<double, 2> curLine0(F.getEpipole(0), curLineVec);
+
+    getEpipoleDistanceRange(0, curLineVec, curSample.minRadius[0],
+            curSample.maxRadius[0]);
+
+    Eigen::Vector2d curLineEndpointImg0 = curLine0.pointAt(curSample.maxRadius[0]);
+
+    // Compute the intersection of the current epipolar line in image 1 with a
+    // relevant edge by casting a ray from the epipole.
+    Eigen::Vector2d curLineVec1;
+
+    F.getEpipolarLine(0, curLineEndpointImg0, curLineVec1);
+
+    curSample.direction[1] = curLineVec1;
+
+    Eigen::ParametrizedLine<double, 2> curLine1(F.getEpipole(1), curLineVec1);
+
+    getEpipoleDistanceRange(1, curLineVec1, curSample.minRadius[1],
+            curSample.maxRadius[1]);
+
+    Eigen::Vector2d curLineEndpointImg1 = curLine1.pointAt(curSample.maxRadius[1]);
+
+    // Compute the next epipolar line by considering those resulting from moving
+    // one unit along the edge of image 0 and image 1 from the current epipolar
+    // line.
+
+    // A point on next epipolar line, using image 0, in image 0
+    Eigen::Vector2d nextLine0Pt0 = curLineEndpointImg0 + curLineVec.unitOrthogonal();
+    Eigen::Vector2d nextLine0Dir0 = (nextLine0Pt0 - F.getEpipole(0)).normalized();
+    
+    // Map nextLine0 into image 1
+    Eigen::Vector2d nextLine0Dir1;
+    F.getEpipolarLine(0, nextLine0Pt0, nextLine0Dir1);
+   
+    // A point on next epipolar line, using image 1, in image 1...
+    
+    // First, we must compute the direction to move in image 1
+    Eigen::Vector2d arcDirImg1 = 
+        (nextLine0Dir1 -
+            (nextLine0Dir1.dot(curLineVec1) * curLineVec1)).normalized();
+
+    Eigen::Vector2d nextLine1Pt1 = curLineEndpointImg1 + arcDirImg1;
+    
+    // Map nextLine1 into image 0
+    Eigen::Vector2d nextLine1Dir0;
+    F.getEpipolarLine(1, nextLine1Pt1, nextLine1Dir0);
+
+    // Use the next epipolar line which is closest
+    double dist0 = (nextLine0Dir0 - curLineVec).squaredNorm();
+    double dist1 = (nextLine1Dir0 - curLineVec).squaredNorm();
+
+    next = (dist0 <= dist1) ? nextLine0Dir0 : nextLine1Dir0;
+}
+
 void PolarRectification::getEpipolarDistanceRanges(
         int imgId,
         double& rmin,
@@ -690,12 +914,286 @@ void PolarRectification::getEpipolarDistanceRanges(
     }
 }
 
+PolarStereo::PolarStereo() :
+    scaleStep(1.0f),
+    maximumBandPixels(std::numeric_limits<int>::max()),
+    bandOverlap(16),
+    coarseToFine(false),
+    disparityMargin(4.0f) {
+}
+
+bool PolarStereo::hasScaleMaps(
+        int numScales,
+        float scaleStep,
+        const PolarFundamentalMatrix& F,
+        int imgWidth,
+        int imgHeight) const {
+    return (int) scaleMaps.size() == numScales &&
+        mapsScaleStep == scaleStep &&
+        mapsWidth == imgWidth &&
+        mapsHeight == imgHeight &&
+        mapsMaximumBandPixels == maximumBandPixels &&
+        mapsBandOverlap == bandOverlap &&
+        mapsF == F.getMatrix();
+}
+
+void PolarStereo::createBands(
+        ScaleMaps& maps) const {
+    int totalRows = maps.rectifier.getRectifiedSpanCount();
+
+    // The padded rectified images are 3 times as wide as a band (see
+    // computeStereo())
+    int bandPixels = maximumBandPixels / 3;
+
+    maps.bands.clear();
+
+    int startRow = 0;
+
+    while (startRow < totalRows) {
+        Band band;
+
+        band.startRow = startRow;
+
+        maps.rectifier.maximalRectificationRange(bandPixels,
+                band.startRow, band.numRows, band.maximumWidth,
+                band.disparityFactor, band.disparityOffset);
+
+        double minR, maxR;
+        int rFactor;
+
+        maps.rectifier.getRadiusMapping(0, band.startRow, band.numRows,
+                minR, maxR, rFactor, band.radiusStart);
+
+        int endRow = band.startRow + band.numRows;
+
+        if (maps.bands.empty()) {
+            band.ownBegin = 0;
+        } else {
+            band.ownBegin = maps.bands.back().ownEnd;
+        }
+
+        if (endRow <= band.ownBegin) {
+            // The budget only fits lines already owned by the previous
+            // band, so start over at its end without the overlap
+            startRow = band.ownBegin;
+            continue;
+        }
+
+        if (endRow >= totalRows) {
+            band.ownEnd = totalRows;
+
+            startRow = totalRows;
+        } else {
+            // Shrink the overlap of small bands so that every band
+            // advances by at least one row
+            int overlap = min(bandOverlap, (band.numRows - 1) / 2);
+
+            // Every band owns at least one new line, even when it started
+            // a full overlap back and only fits a few
+            band.ownEnd = max(endRow - overlap / 2, band.ownBegin + 1);
+
+            startRow = endRow - overlap;
+        }
+
+        assert(band.ownBegin >= band.startRow);
+        assert(band.ownEnd > band.ownBegin);
+        assert(band.ownEnd <= endRow);
+
+        maps.bands.push_back(band);
+    }
+}
+
+void PolarStereo::computeBandSearchRange(
+        const Band& band,
+        const RemapTable& leftMap,
+        const CImg<float>& coarseRadial,
+        float coarseRatio,
+        int rectifiedPadding,
+        int& minDisparity,
+        int& numDisparities) const {
+    minDisparity = -rectifiedPadding;
+    numDisparities = rectifiedPadding * 2;
+
+    float minRadial = std::numeric_limits<float>::max();
+    float maxRadial = -std::numeric_limits<float>::max();
+
+    // Every other sample is plenty to bound the range
+    for (int y = 0; y < leftMap.height; y += 2) {
+        const float* mx = leftMap.mapX.data() + y * leftMap.width;
+        const float* my = leftMap.mapY.data() + y * leftMap.width;
+
+        for (int x = 0; x < leftMap.width; x += 2) {
+            int cx = (int) (mx[x] / coarseRatio + 0.5f);
+            int cy = (int) (my[x] / coarseRatio + 0.5f);
+
+            if (cx < 0 || cy < 0 ||
+                    cx >= coarseRadial.width() || cy >= coarseRadial.height()) {
+                continue;
+            }
+
+            float r = coarseRadial(cx, cy);
+
+            if (r == std::numeric_limits<float>::max()) {
+                continue;
+            }
+
+            minRadial = min(minRadial, r);
+            maxRadial = max(maxRadial, r);
+        }
+    }
+
+    if (minRadial > maxRadial) {
+        // Nothing was matched here at the coarser scale
+        return;
+    }
+
+    minRadial = minRadial * coarseRatio - disparityMargin;
+    maxRadial = maxRadial * coarseRatio + disparityMargin;
+
+    // Invert epipolar_distance = disparityFactor * disparity + disparityOffset
+    double d0 = (minRadial - band.disparityOffset) / band.disparityFactor;
+    double d1 = (maxRadial - band.disparityOffset) / band.disparityFactor;
+
+    int dMin = max((int) floor(min(d0, d1)), -rectifiedPadding);
+    int dMax = min((int) ceil(max(d0, d1)), rectifiedPadding - 1);
+
+    if (dMin > dMax) {
+        return;
+    }
+
+    // CVStereo requires a multiple of 16, which fits since the padding is
+    // a multiple of 8
+    numDisparities = ((dMax - dMin + 16) / 16) * 16;
+
+    minDisparity = max(min(dMin, rectifiedPadding - numDisparities),
+            -rectifiedPadding);
+}
+
+void PolarStereo::derectifyBand(
+        const ScaleMaps& maps,
+        const Band& band,
+        const RemapTable& leftMap,
+        const CImg<int16_t>& disparity,
+        int rectifiedPadding,
+        int minDisparity,
+        float scale,
+        CImg<float>& dispOut,
+        CImg<float>& radial) const {
+    const RemapTable& inverse = maps.inverse;
+
+    // Bound the pixels covered by the owned lines, including the interval
+    // between the last owned line and the one after it
+    int endRow = min(band.ownEnd + 1, band.startRow + band.numRows);
+
+    float minX = std::numeric_limits<float>::max();
+    float minY = std::numeric_limits<float>::max();
+    float maxX = -std::numeric_limits<float>::max();
+    float maxY = -std::numeric_limits<float>::max();
+
+    for (int row = band.ownBegin; row < endRow; row++) {
+        int y = row - band.startRow;
+
+        const float* mx = leftMap.mapX.data() + y * leftMap.width;
+        const float* my = leftMap.mapY.data() + y * leftMap.width;
+
+        for (int x = 0; x < leftMap.width; x++) {
+            minX = min(minX, mx[x]);
+            maxX = max(maxX, mx[x]);
+            minY = min(minY, my[x]);
+            maxY = max(maxY, my[x]);
+        }
+    }
+
+    if (minX > maxX) {
+        return;
+    }
+
+    int x0 = max((int) floor(minX), 0);
+    int y0 = max((int) floor(minY), 0);
+    int x1 = min((int) ceil(maxX), inverse.width - 1);
+    int y1 = min((int) ceil(maxY), inverse.height - 1);
+
+    // Rectified columns of this band are relative to its own first radius
+    float columnOffset = maps.inverseRadiusStart - band.radiusStart;
+
+    int maxColumn = leftMap.width - 1;
+    int maxRow = band.numRows - 1;
+
+    int16_t minValid = minDisparity * 16;
+
+    #pragma omp parallel for schedule(dynamic, 8)
+    for (int y = y0; y <= y1; y++) {
+        const float* ix = inverse.mapX.data() + y * inverse.width;
+        const float* iy = inverse.mapY.data() + y * inverse.width;
+
+        for (int x = x0; x <= x1; x++) {
+            float line = iy[x];
+
+            if (line < band.ownBegin || line >= band.ownEnd) {
+                continue;
+            }
+
+            float col = ix[x] + columnOffset;
+            float row = line - band.startRow;
+
+            if (col < 0.0f || col > maxColumn) {
+                continue;
+            }
+
+            int c0 = (int) col;
+            int r0 = (int) row;
+            int c1 = min(c0 + 1, maxColumn);
+            int r1 = min(r0 + 1, maxRow);
+
+            float ac = col - c0;
+            float ar = row - r0;
+
+            const float weights[4] = {
+                (1.0f - ac) * (1.0f - ar),
+                ac * (1.0f - ar),
+                (1.0f - ac) * ar,
+                ac * ar
+            };
+
+            const int16_t samples[4] = {
+                disparity(rectifiedPadding + c0, r0),
+                disparity(rectifiedPadding + c1, r0),
+                disparity(rectifiedPadding + c0, r1),
+                disparity(rectifiedPadding + c1, r1)
+            };
+
+            float sum = 0.0f;
+            float weight = 0.0f;
+
+            for (int k = 0; k < 4; k++) {
+                if (samples[k] >= minValid) {
+                    sum += weights[k] * samples[k];
+                    weight += weights[k];
+                }
+            }
+
+            if (weight <= 0.0f) {
+                continue;
+            }
+
+            float d = sum / (weight * 16.0f);
+
+            dispOut(x, y) = d * band.disparityFactor * scale +
+                band.disparityOffset;
+
+            radial(x, y) = d * band.disparityFactor + band.disparityOffset;
+        }
+    }
+}
+
 void PolarStereo::computeStereo(
         int numScales,
         float scaleStep,
         const PolarFundamentalMatrix& F,
         const CImg<uint8_t>& leftGray,
         const CImg<uint8_t>& rightGray) {
+    INSTRUMENT_SCOPE("PolarStereo::computeStereo");
+
     assert(leftGray.is_sameXYZC(rightGray));
     assert(leftGray.depth() == 1);
     assert(leftGray.spectrum() == 1);
@@ -704,150 +1202,208 @@ void PolarStereo::computeStereo(
     int imgHeight = leftGray.height();
     int imgSpectrum = leftGray.spectrum();
 
-    // Allocate space for the resulting pyramid of disparity images
-    disparityPyramid.reserve(numScales);
+    this->scaleStep = scaleStep;
+
+    // Rectification maps depend only on the geometry, so frames sharing F
+    // reuse them
+    bool reuseMaps = hasScaleMaps(numScales, scaleStep, F, imgWidth, imgHeight);
+
+    if (!reuseMaps) {
+        INSTRUMENT_SCOPE("rectificationMaps");
+
+        scaleMaps.clear();
+        scaleMaps.resize(numScales);
+
+        mapsF = F.getMatrix();
+        mapsWidth = imgWidth;
+        mapsHeight = imgHeight;
+        mapsScaleStep = scaleStep;
+        mapsMaximumBandPixels = maximumBandPixels;
+        mapsBandOverlap = bandOverlap;
+
+        for (int i = 0; i < numScales; i++) {
+            float scale = pow(scaleStep, i);
+            int curImgWidth = imgWidth * scale;
+            int curImgHeight = imgHeight * scale;
+
+            ScaleMaps& maps = scaleMaps[i];
+
+            PolarFundamentalMatrix curF = F;
+            curF.scale(imgWidth, imgHeight, curImgWidth, curImgHeight);
+
+            // Only the original resolution traces epipolar lines; coarser
+            // scales keep a subset of them
+            if (i == 0) {
+                maps.rectifier.init(curImgWidth, curImgHeight, curF);
+            } else {
+                maps.rectifier.initDecimated(scaleMaps[0].rectifier,
+                        curImgWidth, curImgHeight, curF);
+            }
+
+            createBands(maps);
+
+            int totalRows = maps.rectifier.getRectifiedSpanCount();
+
+            double minR, maxR;
+            int rFactor;
 
-    int curImgWidth = imgWidth;
-    int curImgHeight = imgHeight;
+            maps.rectifier.getRadiusMapping(0, 0, totalRows, minR, maxR,
+                    rFactor, maps.inverseRadiusStart);
 
-    PolarFundamentalMatrix curF;
+            maps.rectifier.createInverseRemap(0, 0, totalRows, maps.inverse);
 
-    array<CImg<uint8_t>, 2> imgScaledGray;
-    imgScaledGray[0] = leftGray;
-    imgScaledGray[1] = rightGray;
+            // A single band is small enough to keep its maps
+            if (maps.bands.size() == 1) {
+                Band& band = maps.bands[0];
 
-    array<CImg<uint8_t>, 2> rectified;
+                for (int imgId = 0; imgId < 2; imgId++) {
+                    maps.rectifier.createRemap(imgId, band.startRow,
+                            band.numRows, band.forward[imgId]);
+                }
+            }
+        }
+    }
+
+    // Build the Gaussian pyramids, blurring each level enough to remove
+    // the frequencies which the next level cannot represent
+    float sigma = 0.5f * sqrt(max(1.0f / (scaleStep * scaleStep) - 1.0f, 0.0f));
 
-    CImg<int16_t> disparity;
+    array<vector<CImg<uint8_t>>, 2> imgPyramid;
+
+    for (int imgId = 0; imgId < 2; imgId++) {
+        imgPyramid[imgId].resize(numScales);
+
+        imgPyramid[imgId][0] = (imgId == 0) ? leftGray : rightGray;
+
+        for (int i = 1; i < numScales; i++) {
+            float scale = pow(scaleStep, i);
+
+            // 3 indicates linear interpolation
+            imgPyramid[imgId][i] = imgPyramid[imgId][i - 1]
+                .get_blur(sigma)
+                .resize(imgWidth * scale, imgHeight * scale, 1, imgSpectrum, 3);
+        }
+    }
 
     disparityPyramid.resize(numScales);
 
-    for (int i = 0; i < numScales; i++) {
+    // Radial disparity (the difference of distances to the epipoles) of
+    // each pixel at the current and the previous (coarser) scale, or
+    // FLT_MAX where nothing was matched
+    CImg<float> radial;
+    CImg<float> coarseRadial;
+
+    for (int i = numScales - 1; i >= 0; i--) {
+        INSTRUMENT_SCOPE("scale");
+
         float scale = pow(scaleStep, i);
-        curImgWidth = imgWidth * scale;
-        curImgHeight = imgHeight * scale;
 
-        disparityPyramid[i].resize(curImgWidth, curImgHeight, 1, 1, -1);
+        int curImgWidth = imgPyramid[0][i].width();
+        int curImgHeight = imgPyramid[0][i].height();
 
-        for (CImg<uint8_t>& scaledImg : imgScaledGray) {
-            // 3 indicates nearest-neighbor resampling
-            scaledImg.resize(curImgWidth, curImgHeight, 1, imgSpectrum, 3);
-        }
+        // How many times larger this scale is than the previous one
+        float coarseRatio = coarseRadial.is_empty() ? 1.0f :
+            curImgWidth / (float) coarseRadial.width();
 
-        curF = F;
-        curF.scale(imgWidth, imgHeight, curImgWidth, curImgHeight);
+        // Pixels which no band matches stay FLT_MAX
+        disparityPyramid[i].assign(curImgWidth, curImgHeight, 1, 1,
+                std::numeric_limits<float>::max());
 
-        rectifier.init(curImgWidth, curImgHeight, F);
+        radial.assign(curImgWidth, curImgHeight, 1, 1,
+                std::numeric_limits<float>::max());
 
-        int startRow = 0;
-        int numRows;
-        int maximumWidth;
-        double disparityFactor, disparityOffset;
+        ScaleMaps& maps = scaleMaps[i];
 
-        rectifier.maximalRectificationRange(std::numeric_limits<int>::max(),
-                startRow, numRows, maximumWidth, disparityFactor,
-                disparityOffset);
+        int numBands = maps.bands.size();
 
+        // Each band has its own maps, images and matcher, and writes only
+        // the pixels of the lines it owns, so bands are independent.  A
+        // single band parallelizes internally instead.
+        #pragma omp parallel for schedule(dynamic) if (numBands > 1)
+        for (int bandI = 0; bandI < numBands; bandI++) {
+            INSTRUMENT_SCOPE("band");
 
-        // Round up to the next multiple of 8 since CVStereo requires
-        // a disparity range which is a multiple of 16, and the entire
-        // disparity range will be [-rectifiedPadding, rectifiedPadding]
-        int rectifiedPadding = ((maximumWidth + 7) / 8) * 8;
+            const Band& band = maps.bands[bandI];
 
-        int paddedWidth = maximumWidth + rectifiedPadding * 2;
-        
-        // Allocate a width 3 times as much is necessary since OpenCV's stereo
-        // refuses to compute along the image border.
-        for (auto& rectImg : rectified) {
-            rectImg.resize(paddedWidth, numRows, 1, 1, -1);
+            array<RemapTable, 2> bandForward;
 
-            rectImg = (uint8_t) 0;
-        }
+            const array<RemapTable, 2>* forward = &band.forward;
 
-        disparity.resize(paddedWidth, numRows, 1, 1, -1);
+            if (band.forward[0].width == 0) {
+                for (int imgId = 0; imgId < 2; imgId++) {
+                    maps.rectifier.createRemap(imgId, band.startRow,
+                            band.numRows, bandForward[imgId]);
+                }
 
-        disparity = -rectifiedPadding * 16;
+                forward = &bandForward;
+            }
 
-        // Rectify...
-        
-        struct {
-            int rectifiedPadding;
-            const CImg<uint8_t>* original;
-            CImg<uint8_t>* rectified;
-
-            void operator()(
-                    const Eigen::Vector2i& r,
-                    const Eigen::Vector2d& p,
-                    const Eigen::Vector2d& o) {
-                float col = 0;
-
-                (*rectified)(rectifiedPadding + r.x(), r.y()) =
-                    original->linear_atXY(o.x(), o.y(), 0, 0, col);
+            int numRows = band.numRows;
+            int maximumWidth = band.maximumWidth;
+
+            // Round up to the next multiple of 8 since CVStereo requires
+            // a disparity range which is a multiple of 16, and the entire
+            // disparity range will be [-rectifiedPadding, rectifiedPadding]
+            int rectifiedPadding = ((maximumWidth + 7) / 8) * 8;
+
+            int paddedWidth = maximumWidth + rectifiedPadding * 2;
+
+            int minDisparity = -rectifiedPadding;
+            int numDisparities = rectifiedPadding * 2;
+
+            if (coarseToFine && !coarseRadial.is_empty()) {
+                computeBandSearchRange(band, (*forward)[0], coarseRadial,
+                        coarseRatio, rectifiedPadding, minDisparity,
+                        numDisparities);
             }
-        } rectCallback = {rectifiedPadding,
-            nullptr, nullptr};
 
-        for (int imgId = 0; imgId < 2; imgId++) {
-            rectCallback.original = &(imgScaledGray[imgId]);
+            array<CImg<uint8_t>, 2> rectified;
 
-            rectCallback.rectified = &(rectified[imgId]);
+            // Allocate a width 3 times as much is necessary since OpenCV's
+            // stereo refuses to compute along the image border.
+            for (auto& rectImg : rectified) {
+                rectImg.resize(paddedWidth, numRows, 1, 1, -1);
 
-            rectifier.evaluateRectificationTransform(
-                    imgId, startRow, numRows, rectCallback);
-        }
+                rectImg = (uint8_t) 0;
+            }
+
+            CImg<int16_t> disparity(paddedWidth, numRows, 1, 1,
+                    -rectifiedPadding * 16);
 
-        // Display the rectified images
-        (rectified[0], rectified[1]).display();
-
-        // Compute stereo
-        CVStereo::stereo(
-                -rectifiedPadding,
-                rectifiedPadding * 2,
-                paddedWidth,
-                numRows,
-                rectified[0].data(),
-                rectified[1].data(),
-                disparity.data());
-
-        // Derectify...
-        struct {
-            int width;
-            int height;
-            int rectifiedPadding;
-
-            double disparityFactor;
-            double disparityOffset;
-
-            const CImg<int16_t>* rectified;
-            CImg<float>* unrectified;
-
-            void operator()(
-                    const Eigen::Vector2i& r,
-                    const Eigen::Vector2d& p,
-                    const Eigen::Vector2d& o) {
-                float disparity = (*rectified)(rectifiedPadding + r.x(), r.y());
-
-                disparity /= 16.0f;
-                disparity = disparity * disparityFactor + disparityOffset;
-
-                int ox = (o.x() + 0.5);
-                int oy = (o.y() + 0.5);
-
-                if (ox < width && oy < height && ox >= 0 && oy >= 0) {
-                    (*unrectified)(ox, oy) = disparity;
+            // Rectify...
+            {
+                INSTRUMENT_SCOPE("rectify");
+
+                for (int imgId = 0; imgId < 2; imgId++) {
+                    (*forward)[imgId].apply(imgPyramid[imgId][i],
+                            rectified[imgId], rectifiedPadding);
                 }
             }
-        } unrectCallback = {curImgWidth, curImgHeight, rectifiedPadding,
-            disparityFactor * scale, disparityOffset,
-            &disparity, &(disparityPyramid[i])};
 
-        disparityPyramid[i] = -rectifiedPadding;
+            // Compute stereo
+            {
+                INSTRUMENT_SCOPE("match");
+
+                CVStereo::stereo(
+                        minDisparity,
+                        numDisparities,
+                        paddedWidth,
+                        numRows,
+                        rectified[0].data(),
+                        rectified[1].data(),
+                        disparity.data());
+            }
+
+            // Derectify...
+            {
+                INSTRUMENT_SCOPE("derectify");
 
-        rectifier.evaluateRectificationTransform(
-                0, startRow, numRows, unrectCallback);
+                derectifyBand(maps, band, (*forward)[0], disparity,
+                        rectifiedPadding, minDisparity, scale,
+                        disparityPyramid[i], radial);
+            }
+        }
 
-        (((disparityPyramid[i] + disparityPyramid[i].min()) * (256.0f * 50.0f / (rectifiedPadding * 2.0f)))
-        % 256).get_map(CImg<float>::cube_LUT256()).display();
+        coarseRadial.swap(radial);
     }
 }
-
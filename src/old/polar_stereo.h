@@ -1,5 +1,7 @@
 #pragma once
 
+#include <type_traits>
+
 #include <Eigen/Dense>
 
 #include "common.h"
@@ -68,6 +70,10 @@ public:
         return epipoles;
     }
 
+    inline const Eigen::Matrix3d& getMatrix() const {
+        return F;
+    }
+
     inline bool areEpipolesReflected() const {
         return epipolesReflected;
     }
@@ -105,6 +111,131 @@ private:
     bool epipolesReflected;
 };
 
+/**
+ * A precomputed coordinate map between two images.  Pixel (x, y) of the
+ * destination samples the source at (mapX[i], mapY[i]), where
+ * i = y * width + x.  Samples are bilinear, and source pixels outside the
+ * image read as 0, like CImg::linear_atXY() with an out-value of 0.
+ *
+ * Maps depend only on the geometry, so they are built once and applied to
+ * every frame which shares it.
+ */
+class RemapTable {
+    public:
+        int width;
+
+        int height;
+
+        vector<float> mapX;
+
+        vector<float> mapY;
+
+        RemapTable() : width(0), height(0) {
+        }
+
+        inline void resize(
+                int _width,
+                int _height) {
+            width = _width;
+            height = _height;
+
+            mapX.resize(width * height);
+            mapY.resize(width * height);
+        }
+
+        /**
+         * Resamples src into columns [dstX, dstX + width) of dst, which must
+         * be large enough.  Tiles of the destination are processed in
+         * parallel, and each tile row is a vectorized bilinear gather.
+         */
+        template<class T>
+        void apply(
+                const CImg<T>& src,
+                CImg<T>& dst,
+                int dstX = 0) const {
+            assert(dst.width() >= dstX + width);
+            assert(dst.height() >= height);
+            assert(dst.spectrum() == src.spectrum());
+
+            const int tileWidth = 256;
+            const int tileHeight = 16;
+
+            int tilesX = (width + tileWidth - 1) / tileWidth;
+            int tilesY = (height + tileHeight - 1) / tileHeight;
+
+            int srcWidth = src.width();
+            int srcHeight = src.height();
+
+            // Coordinates are clamped to just outside the image before
+            // rounding, so that far-away samples cannot overflow an int.
+            float minX = -2.0f;
+            float maxX = srcWidth + 1.0f;
+            float minY = -2.0f;
+            float maxY = srcHeight + 1.0f;
+
+            #pragma omp parallel for collapse(2) schedule(dynamic)
+            for (int tileY = 0; tileY < tilesY; tileY++) {
+                for (int tileX = 0; tileX < tilesX; tileX++) {
+                    int x0 = tileX * tileWidth;
+                    int x1 = min(width, x0 + tileWidth);
+                    int y0 = tileY * tileHeight;
+                    int y1 = min(height, y0 + tileHeight);
+
+                    cimg_forC(src, c) {
+                        const T* in = src.data(0, 0, 0, c);
+
+                        for (int y = y0; y < y1; y++) {
+                            const float* mx = mapX.data() + y * width;
+                            const float* my = mapY.data() + y * width;
+
+                            T* out = dst.data(dstX, y, 0, c);
+
+                            #pragma omp simd
+                            for (int x = x0; x < x1; x++) {
+                                float fx = fmin(fmax(mx[x], minX), maxX);
+                                float fy = fmin(fmax(my[x], minY), maxY);
+
+                                float flX = floor(fx);
+                                float flY = floor(fy);
+
+                                float ax = fx - flX;
+                                float ay = fy - flY;
+
+                                int ix = (int) flX;
+                                int iy = (int) flY;
+
+                                bool inX0 = ix >= 0 && ix < srcWidth;
+                                bool inX1 = ix + 1 >= 0 && ix + 1 < srcWidth;
+                                bool inY0 = iy >= 0 && iy < srcHeight;
+                                bool inY1 = iy + 1 >= 0 && iy + 1 < srcHeight;
+
+                                int cx0 = min(max(ix, 0), srcWidth - 1);
+                                int cx1 = min(max(ix + 1, 0), srcWidth - 1);
+                                int cy0 = min(max(iy, 0), srcHeight - 1);
+                                int cy1 = min(max(iy + 1, 0), srcHeight - 1);
+
+                                float p00 = (inX0 && inY0) ? (float) in[cy0 * srcWidth + cx0] : 0.0f;
+                                float p10 = (inX1 && inY0) ? (float) in[cy0 * srcWidth + cx1] : 0.0f;
+                                float p01 = (inX0 && inY1) ? (float) in[cy1 * srcWidth + cx0] : 0.0f;
+                                float p11 = (inX1 && inY1) ? (float) in[cy1 * srcWidth + cx1] : 0.0f;
+
+                                float top = p00 + (p10 - p00) * ax;
+                                float bottom = p01 + (p11 - p01) * ax;
+
+                                float v = top + (bottom - top) * ay;
+
+                                // Integer samples are rounded, as truncating
+                                // would bias them down by half a level.
+                                out[x] = (T) (is_integral<T>::value ?
+                                        floor(v + 0.5f) : v);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+};
+
 class PolarRectification {
     public:
         /**
@@ -120,6 +251,22 @@ class PolarRectification {
                 int _height,
                 const PolarFundamentalMatrix& _F);
 
+        /**
+         * Initializes the rectification of a downscaled copy of the images
+         * rectified by `full`, without tracing epipolar lines again.
+         * Scaling preserves the epipolar lines, so every step-th line of
+         * `full` is kept, with step chosen so that lines stay about one
+         * pixel apart, and its directions and radii are scaled.
+         *
+         * _F must be the fundamental matrix of `full`, scaled to the new
+         * size.
+         */
+        bool initDecimated(
+                const PolarRectification& full,
+                int _width,
+                int _height,
+                const PolarFundamentalMatrix& _F);
+
         /**
          * Rectifies an entire image.  Note that the result may be very large
          * and include arbitrary radial offsets.  Therefore, other methods
@@ -144,7 +291,8 @@ class PolarRectification {
          * of pixels in both the left and the right images, so double
          * the memory will be required to store both rectified images.
          *
-         * `endSpan` is exclusive.
+         * The region holds at least one row, even if that row alone
+         * exceeds maximumPixelCount.
          *
          * disparity[Factor|Offset] defines the linear function of disparity
          * values from horizontal offsets in the rectified images to
@@ -160,6 +308,45 @@ class PolarRectification {
                 double& disparityFactor,
                 double& disparityOffset) const;
 
+        /**
+         * Builds the forward map of image imgId for the rows
+         * [startRow, startRow + numRows): rectified pixel (r, eI) maps to
+         * the point of the original image sampled by
+         * evaluateRectificationTransform().  Rows are built in parallel.
+         */
+        void createRemap(
+                int imgId,
+                int startRow,
+                int numRows,
+                RemapTable& remap) const;
+
+        /**
+         * Builds the inverse of createRemap(): each pixel of original image
+         * imgId maps to its (fractional) rectified coordinate, with rows
+         * interpolated between the neighboring epipolar lines.  Pixels
+         * outside the angular range of the rows map outside the rectified
+         * image.
+         */
+        void createInverseRemap(
+                int imgId,
+                int startRow,
+                int numRows,
+                RemapTable& remap) const;
+
+        /**
+         * Returns the radius range of image imgId over the given rows, and
+         * the mapping from rectified column r to radius:
+         *   radius = r * rFactor + rStart
+         */
+        void getRadiusMapping(
+                int imgId,
+                int startRow,
+                int numRows,
+                double& minR,
+                double& maxR,
+                int& rFactor,
+                double& rStart) const;
+
         /**
          * Evaluates the rectification transform at each sample in the 
          * relevant rectangular region of the co-domain specified by
@@ -171,29 +358,18 @@ class PolarRectification {
                 int startRow,
                 int numRows,
                 Callback callback) const {
-            double minR = std::numeric_limits<double>::max();
-            double maxR = std::numeric_limits<double>::min();
-
-            for (int eI = 0; eI < numRows; eI++) {
-                const auto& sample = epipoleLines[startRow + eI];
-
-                minR = min(minR, sample.minRadius[imgId]);
-                maxR = max(maxR, sample.maxRadius[imgId]);
-            }
-
-            int rFactor = 1;
-            double rStart = minR;
+            double minR, maxR, rStart;
+            int rFactor;
 
-            if (F.areEpipolesReflected() && imgId == 1) {
-                rFactor = -1;
-                rStart = maxR;
-            }
+            getRadiusMapping(imgId, startRow, numRows, minR, maxR, rFactor,
+                    rStart);
 
             const Eigen::Vector2d& e = F.getEpipole(imgId);
 
-            // TODO These loops could be blocked for greater performance
+            // See createRemap() for a precomputed, parallel equivalent
             for (int eI = 0; eI < numRows; eI++) {
-                const Eigen::Vector2d& eLineDir = epipoleLines[eI].direction[imgId];
+                const Eigen::Vector2d& eLineDir =
+                    epipoleLines[startRow + eI].direction[imgId];
 
                 Eigen::ParametrizedLine<double, 2> eLine(e, eLineDir);
 
@@ -264,10 +440,32 @@ class PolarRectification {
                 double& rmax) const;
 
         /**
-         * Initializes `epipoleLines`.
+         * Initializes `epipoleLines`.  The angular range of the lines is
+         * split into a fixed number of sectors which are traced in
+         * parallel and concatenated, so the result does not depend on the
+         * number of threads.
          */
         void createRectificationMap();
 
+        /**
+         * Samples the epipolar line with direction dir in image 0, and
+         * returns the direction of the next line, which is one pixel
+         * further along the border of either image.
+         */
+        void createLineSample(
+                const Eigen::Vector2d& dir,
+                EpipolarLineSample& sample,
+                Eigen::Vector2d& nextDir) const;
+
+        /**
+         * Appends the lines from startDir counter-clockwise up to the last
+         * one before endDir.
+         */
+        void createSectorLines(
+                const Eigen::Vector2d& startDir,
+                const Eigen::Vector2d& endDir,
+                vector<EpipolarLineSample>& lines) const;
+
         /**
          * Returns the minimum and maximum distance from the epipole to
          * the valid region of the specified image.
@@ -298,6 +496,47 @@ class PolarRectification {
 
 class PolarStereo {
     public:
+        PolarStereo();
+
+        /**
+         * Bounds the rectified images matched at once.  Each scale is split
+         * into bands of consecutive epipolar lines whose padded rectified
+         * images hold at most this many pixels; bands are matched in
+         * parallel and only the maps of the band being processed are kept.
+         * Unbounded by default, which rectifies each scale as a single band.
+         */
+        inline void setMaximumBandPixels(
+                int _maximumBandPixels) {
+            maximumBandPixels = _maximumBandPixels;
+        }
+
+        /**
+         * Number of epipolar lines shared by neighboring bands.  Each band
+         * keeps the disparities of its own rows, so the matcher sees
+         * context across band boundaries and seams are not visible.
+         */
+        inline void setBandOverlap(
+                int _bandOverlap) {
+            bandOverlap = _bandOverlap;
+        }
+
+        /**
+         * In coarse-to-fine mode, each band of a scale only searches the
+         * disparities found for it at the next coarser scale, widened by
+         * disparityMargin pixels on either side.  Bands without coarser
+         * matches, and the coarsest scale, search the full range.
+         */
+        inline void setCoarseToFine(
+                bool _coarseToFine,
+                float _disparityMargin = 4.0f) {
+            coarseToFine = _coarseToFine;
+            disparityMargin = _disparityMargin;
+        }
+
+        /**
+         * Matches a Gaussian pyramid of the pair, from the coarsest scale
+         * (scaleStep^(numScales - 1)) down to the original resolution.
+         */
         void computeStereo(
                 int numScales,
                 float scaleStep,
@@ -309,6 +548,10 @@ class PolarStereo {
             return disparityPyramid.size();
         }
 
+        /**
+         * Pixels without a match, or outside the rectified region, are
+         * FLT_MAX.
+         */
         inline const CImg<float>& getDisparityAtScale(
                 int scale) {
             return disparityPyramid[scale];
@@ -326,10 +569,141 @@ class PolarStereo {
         }
         
     private:
+        /**
+         * A range of consecutive epipolar lines which is rectified and
+         * matched on its own.
+         */
+        struct Band {
+            int startRow;
+
+            int numRows;
+
+            /**
+             * The disparities of rows [ownBegin, ownEnd) come from this
+             * band.  The other rows only provide context for matching, and
+             * belong to a neighboring band.
+             */
+            int ownBegin;
+
+            int ownEnd;
+
+            int maximumWidth;
+
+            double disparityFactor;
+
+            double disparityOffset;
+
+            /**
+             * Radius of the first rectified column of the left image.
+             */
+            double radiusStart;
+
+            /**
+             * Forward maps of the left and right images.  They are only
+             * kept when the scale is a single band; bounded bands rebuild
+             * them while they are being matched.
+             */
+            array<RemapTable, 2> forward;
+        };
+
+        /**
+         * Rectification of one scale of the pyramid.  It depends only on F
+         * and the image size, so it is kept for later frames sharing them.
+         */
+        struct ScaleMaps {
+            PolarRectification rectifier;
+
+            vector<Band> bands;
+
+            /**
+             * Inverse map of the left image over every epipolar line: the
+             * fractional line index of each pixel, and its radius relative
+             * to inverseRadiusStart.  It is the size of the scaled image,
+             * so it is kept even when bands are bounded.
+             */
+            RemapTable inverse;
+
+            double inverseRadiusStart;
+        };
+
+        /**
+         * Splits the epipolar lines of maps.rectifier into bands which
+         * respect maximumBandPixels and bandOverlap.
+         */
+        void createBands(
+                ScaleMaps& maps) const;
+
+        /**
+         * Computes the range of rectified disparities [minDisparity,
+         * minDisparity + numDisparities) to search in a band, from the
+         * radial disparities found at the next coarser scale, which is
+         * coarseRatio times smaller.  numDisparities is a multiple of 16,
+         * and the range is clamped to [-rectifiedPadding, rectifiedPadding].
+         */
+        void computeBandSearchRange(
+                const Band& band,
+                const RemapTable& leftMap,
+                const CImg<float>& coarseRadial,
+                float coarseRatio,
+                int rectifiedPadding,
+                int& minDisparity,
+                int& numDisparities) const;
+
+        /**
+         * Writes the disparities of the rows owned by a band to the pixels
+         * of the left image which they cover.  Each pixel is looked up in
+         * the inverse map and bilinearly samples the rectified disparity,
+         * so the output has no holes, and bands never write the same
+         * pixel.  Samples SGBM left unmatched are ignored.
+         *
+         * disparity is the band's SGBM output, with the left image at
+         * column rectifiedPadding.  dispOut receives disparities in the
+         * units of the disparity pyramid, and radial the radial disparity.
+         */
+        void derectifyBand(
+                const ScaleMaps& maps,
+                const Band& band,
+                const RemapTable& leftMap,
+                const CImg<int16_t>& disparity,
+                int rectifiedPadding,
+                int minDisparity,
+                float scale,
+                CImg<float>& dispOut,
+                CImg<float>& radial) const;
+
+        /**
+         * Returns true if the cached maps were built for this geometry.
+         */
+        bool hasScaleMaps(
+                int numScales,
+                float scaleStep,
+                const PolarFundamentalMatrix& F,
+                int imgWidth,
+                int imgHeight) const;
+
         float scaleStep;
 
+        int maximumBandPixels;
+
+        int bandOverlap;
+
+        bool coarseToFine;
+
+        float disparityMargin;
+
         vector<CImg<float>> disparityPyramid;
 
-        PolarRectification rectifier;
-};
+        vector<ScaleMaps> scaleMaps;
+
+        Eigen::Matrix3d mapsF;
+
+        int mapsWidth;
+
+        int mapsHeight;
 
+        float mapsScaleStep;
+
+        int mapsMaximumBandPixels;
+
+        int mapsBandOverlap;
+};
@@ -2,10 +2,13 @@
 
 #include "cvutil/cvutil.h"
 
+#include "instrument/instrument.h"
+
 #include "localexpansion.hpp"
 
-#include <queue>
-#include <set>
+#include "planefit.h"
+
+#include <omp.h>
 
 Segment::Segment() {
     minX = std::numeric_limits<imageI_t>::max();
@@ -13,43 +16,66 @@ Segment::Segment() {
 
     maxX = std::numeric_limits<imageI_t>::min();
     maxY = std::numeric_limits<imageI_t>::min();
-}
 
-void Connectivity::increment(
-        segmentH_t a,
-        segmentH_t b) {
-    connectivity[a][b]++;
-    connectivity[b][a]++;
+    runBegin = 0;
+    runEnd = 0;
+
+    numPixels = 0;
 }
 
-int Connectivity::getConnectivity(
-        segmentH_t a,
-        segmentH_t b) const {
-    auto foundA = connectivity.find(a);
+void Connectivity::cacheColorDistances(
+        const Segmentation& segmentation) {
+    edgeColorDist.resize(neighbors.size());
 
-    if (foundA == connectivity.end()) {
-        return 0;
-    } else {
-        const auto& foundB = (*foundA).second.find(b);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int segH = 0; segH < (int) size(); segH++) {
+        const array<float, 3>& labA = segmentation.medLab(segH);
 
-        if (foundB == (*foundA).second.end()) {
-            return 0;
-        } else {
-            return foundB->second;
+        for (unsigned int e = offsets[segH]; e < offsets[segH + 1]; e++) {
+            const array<float, 3>& labB = segmentation.medLab(neighbors[e]);
+
+            float dist = 0.0f;
+
+            for (int c = 0; c < 3; c++) {
+                dist += fabs(labA[c] - labB[c]);
+            }
+
+            edgeColorDist[e] = dist;
         }
     }
 }
 
 void Segmentation::recomputeSegmentMap() {
-    for (segmentH_t superpixelI = 0; superpixelI < superpixels.size();
-            superpixelI++) {
-        const auto& pixels = superpixels[superpixelI].getPixels();
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int segH = 0; segH < (int) superpixels.size(); segH++) {
+        for (const SegmentRun& run : getRuns(segH)) {
+            segmentH_t* row = segmentMap.data(0, run.y);
+
+            fill(row + run.x0, row + run.x1, (segmentH_t) segH);
+        }
+    }
+}
+
+void Segmentation::computeRunLabStats(
+        const CImg<float>& lab) {
+    assert(lab.is_sameXY(segmentMap));
+
+    runLabSum.resize(runs.size());
+
+    #pragma omp parallel for
+    for (size_t runI = 0; runI < runs.size(); runI++) {
+        const SegmentRun& run = runs[runI];
+
+        for (int c = 0; c < 3; c++) {
+            const float* row = lab.data(0, run.y, 0, c);
+
+            float sum = 0.0f;
 
-        for (const auto& p : pixels) {
-            imageI_t x = get<0>(p);
-            imageI_t y = get<1>(p);
+            for (int x = run.x0; x < run.x1; x++) {
+                sum += row[x];
+            }
 
-            segmentMap(x, y) = superpixelI;
+            runLabSum[runI][c] = sum;
         }
     }
 }
@@ -60,267 +86,334 @@ void Segmentation::createSlicSuperpixels(
         int nc) {
     assert(lab.spectrum() == 3);
 
-    slicSuperpixels(lab, numSegments, nc, segmentMap);
+    slic = unique_ptr<SlicSuperpixels>(new SlicSuperpixels(numSegments, nc));
 
-    superpixels = vector<Segment>(numSegments);
+    // SLIC writes contiguous, non-empty labels straight into segmentMap,
+    // so segment handles are the cluster labels themselves.
+    slic->compute(lab, segmentMap);
 
-    // slicSuperpixels() results in degenerate segments without any
-    // pixels.  To eliminate these, we need a mapping from
-    // original handles to a contiguous set of handles to
-    // valid segments.
-    map<segmentH_t, segmentH_t> validSegmentHandles;
-
-    segmentH_t curHandle = 0;
+    createSegmentsFromMap(lab);
+}
 
-    cimg_forXY(segmentMap, x, y) {
-        if (validSegmentHandles.count(segmentMap(x, y)) == 0) {
-            validSegmentHandles[segmentMap(x, y)] = curHandle;
+void Segmentation::updateSlicSuperpixels(
+        const CImg<float>& lab,
+        int iterations,
+        CVDenseOpticalFlow* flow) {
+    assert(lab.spectrum() == 3);
+    assert(slic);
 
-            curHandle++;
-        }
+    function<void(float, float, float&, float&)> advect;
 
-        superpixels[validSegmentHandles[segmentMap(x, y)]].addPixel(x, y);
+    if (flow != nullptr) {
+        advect = [flow](float x, float y, float& dx, float& dy) {
+            flow->getRelativeFlow((int) (x + 0.5f), (int) (y + 0.5f), dx, dy);
+        };
     }
 
-    superpixels.resize(curHandle);
+    slic->computeIncremental(lab, segmentMap, iterations, advect);
+
+    createSegmentsFromMap(lab);
+}
+
+void Segmentation::createRunsFromMap() {
+    assert(segmentMap.width() <= numeric_limits<uint16_t>::max());
+    assert(segmentMap.height() <= numeric_limits<uint16_t>::max());
 
-    recomputeSegmentMap();
+    int width = segmentMap.width();
 
-    for (Segment& s : superpixels) {
-        s.compress();
+    for (Segment& seg : superpixels) {
+        seg = Segment();
     }
 
-    // Compute median Lab for each superpixel
-    medianLab = vector<array<float, 3>>(superpixels.size());
+    // First pass: count the runs of each segment and accumulate bounds
+    cimg_forY(segmentMap, y) {
+        const segmentH_t* row = segmentMap.data(0, y);
 
-    vector<float> l, a, b;
-    
-    for (segmentH_t segH = 0; segH < superpixels.size(); segH++) {
-        Segment& seg = superpixels[segH];
+        int x = 0;
+
+        while (x < width) {
+            segmentH_t segH = row[x];
+
+            int x0 = x;
 
-        l.clear();
-        a.clear();
-        b.clear();
+            while (x < width && row[x] == segH) {
+                x++;
+            }
+
+            Segment& seg = superpixels[segH];
+
+            seg.minX = min(seg.minX, (imageI_t) x0);
+            seg.maxX = max(seg.maxX, (imageI_t) (x - 1));
+            seg.minY = min(seg.minY, (imageI_t) y);
+            seg.maxY = max(seg.maxY, (imageI_t) y);
 
-        for (const auto& p : seg.getPixels()) {
-            size_t x = get<0>(p);
-            size_t y = get<1>(p);
+            seg.numPixels += x - x0;
 
-            l.push_back(lab(x, y, 0, 0));
-            a.push_back(lab(x, y, 0, 1));
-            b.push_back(lab(x, y, 0, 2));
+            // Used as a run counter until offsets are assigned below
+            seg.runEnd++;
         }
+    }
+
+    unsigned int numRuns = 0;
 
-        nth_element(&(l[0]), &(l[l.size() / 2]), &(l[l.size()]));
-        nth_element(&(a[0]), &(a[a.size() / 2]), &(a[a.size()]));
-        nth_element(&(b[0]), &(b[b.size() / 2]), &(b[b.size()]));
+    for (Segment& seg : superpixels) {
+        seg.runBegin = numRuns;
 
-        medianLab[segH][0] = l[l.size() / 2];
-        medianLab[segH][1] = a[a.size() / 2];
-        medianLab[segH][2] = b[b.size() / 2];
+        numRuns += seg.runEnd;
+
+        seg.runEnd = seg.runBegin;
     }
-}
 
-void Segmentation::renderVisualization(
-        CImg<float>& result) const {
-    result.resize(segmentMap.width(), segmentMap.height(), 1, 3, -1);
+    runs.resize(numRuns);
+    runs.shrink_to_fit();
 
-    for (segmentH_t segH = 0; segH < superpixels.size(); segH++) {
-        const Segment& sp = superpixels[segH];
+    runSegment.resize(numRuns);
+    runSegment.shrink_to_fit();
 
-        const array<float, 3>& lab = medLab(segH);
+    rowRuns.resize(numRuns);
+    rowRuns.shrink_to_fit();
 
-        cimg_forC(result, c) {
-            for (const auto& coord : sp.getPixels()) {
-                imageI_t x = get<0>(coord);
-                imageI_t y = get<1>(coord);
+    rowRunOffsets.resize(segmentMap.height() + 1);
+
+    // Any previously computed statistics no longer match the runs
+    runLabSum.clear();
+
+    unsigned int rowRunI = 0;
 
-                result(x, y, 0, c) = lab[c];
+    // Second pass: scatter runs into place.  Scanning in raster order
+    // leaves each segment's runs sorted by y, then x0, and produces the
+    // row index as a by-product.
+    cimg_forY(segmentMap, y) {
+        const segmentH_t* row = segmentMap.data(0, y);
+
+        rowRunOffsets[y] = rowRunI;
+
+        int x = 0;
+
+        while (x < width) {
+            segmentH_t segH = row[x];
+
+            int x0 = x;
+
+            while (x < width && row[x] == segH) {
+                x++;
             }
-        }
-    }
 
-    result.LabtoRGB();
-}
+            unsigned int runI = superpixels[segH].runEnd++;
 
-void Segmentation::getConnectivity(
-        Connectivity& c) const {
-    c = Connectivity();
+            SegmentRun& run = runs[runI];
 
-    for (int y = 1; y < segmentMap.height(); y++) {
-        for (int x = 1; x < segmentMap.width(); x++) {
-            segmentH_t segCur = segmentMap(x, y);
-            segmentH_t segLeft = segmentMap(x - 1, y);
-            segmentH_t segTop = segmentMap(x, y - 1);
+            run.y = y;
+            run.x0 = x0;
+            run.x1 = x;
 
-            c.increment(segCur, segLeft);
+            runSegment[runI] = segH;
 
-            c.increment(segCur, segTop);
+            rowRuns[rowRunI++] = runI;
         }
     }
+
+    rowRunOffsets[segmentMap.height()] = rowRunI;
 }
 
-StereoProblem::StereoProblem(
-        CImg<int16_t> _left, 
-        CImg<int16_t> _right, 
-        int _minDisp,
-        int _maxDisp) :
-    left(_left), right(_right),
-    minDisp(_minDisp), maxDisp(_maxDisp) {
-    assert(left.is_sameXYZC(right));
+void Segmentation::createSegmentsFromMap(
+        const CImg<float>& lab) {
+    superpixels = vector<Segment>(slic->getClusterCount());
 
-    leftLab = left.get_RGBtoLab();
-    rightLab = right.get_RGBtoLab();
+    createRunsFromMap();
 
-    disp = CImg<float>(left.width(), left.height());
-}
+    // Compute median Lab for each superpixel.  Segments left empty by a
+    // temporal update keep their previous value.
+    medianLab.resize(superpixels.size());
 
-bool PlanarDepth::tabulateSlantSamples(
-        const map<imageI_t, vector<tuple<imageI_t, float>>>& dSamples,
-        CImg<float>& dtSamples) const {
-    int totalSamplePairs = 0;
+    #pragma omp parallel
+    {
+        array<vector<float>, 3> values;
 
-    for (const auto& samples : dSamples) {
-        int n = samples.second.size() - 1;
-        totalSamplePairs += n * (n + 1) / 2;
-    }
+        #pragma omp for schedule(dynamic, 16)
+        for (int segH = 0; segH < (int) superpixels.size(); segH++) {
+            const Segment& seg = superpixels[segH];
 
-    if (totalSamplePairs < 1) {
-        return false;
-    }
+            if (seg.size() == 0) {
+                continue;
+            }
 
-    // Store all possible samples of dt, each consisting of a finite difference
-    // between elements in the same scanline, as given by dSamples.
-    dtSamples.resize(totalSamplePairs, 1, 1, 1, -1);
+            for (int c = 0; c < 3; c++) {
+                vector<float>& v = values[c];
 
-    // Index into dtSamples at which to insert new samples
-    int dtSamplesI = 0;
+                v.clear();
 
-    for (const auto& samplesPair: dSamples) {
-        const vector<tuple<imageI_t, float>>& samples = samplesPair.second;
+                for (const SegmentRun& run : getRuns(segH)) {
+                    const float* row = lab.data(0, run.y, 0, c);
 
-        for (int i = 0; i < samples.size(); i++) {
-            for (int j = i + 1; j < samples.size(); j++) {
-                assert(dtSamplesI < dtSamples.width());
-                dtSamples(dtSamplesI) = 
-                    ((float) get<1>(samples[j]) - get<1>(samples[i])) /
-                    ((float) get<0>(samples[j]) - get<0>(samples[i]));
-                dtSamplesI++;
+                    v.insert(v.end(), row + run.x0, row + run.x1);
+                }
+
+                nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+
+                medianLab[segH][c] = v[v.size() / 2];
             }
         }
     }
+}
 
-    dtSamples.sort();
+void Segmentation::renderVisualization(
+        CImg<float>& result) const {
+    result.resize(segmentMap.width(), segmentMap.height(), 1, 3, -1);
 
-    return true;
-}
+    for (segmentH_t segH = 0; segH < superpixels.size(); segH++) {
+        const array<float, 3>& lab = medLab(segH);
 
-/**
- * Estimates slant (dD/dt) from a set of samples of (D, t)
- * samples for which all non-t dimensions are constant.
- *
- * For example, if dSamples contains a set of (D, x) samples
- * from the same horizontal scan-line (fixed y-coordinate),
- * it will estimate dD/dx.
- *
- * Returns true upon success, false if not enough samples were provided.
- */
-inline bool PlanarDepth::estimateSlant(
-        const map<imageI_t, vector<tuple<imageI_t, float>>>& dSamples,
-        float& result) const {
-    CImg<float> dtSamples;
+        cimg_forC(result, c) {
+            for (const SegmentRun& run : getRuns(segH)) {
+                float* row = result.data(0, run.y, 0, c);
 
-    if (!tabulateSlantSamples(dSamples, dtSamples)) {
-        return false;
+                fill(row + run.x0, row + run.x1, lab[c]);
+            }
+        }
     }
 
-    // TODO The paper doesn't specify blur kernel size!
-    // dtSamples.blur(min(1.0f, dtSamples.size() / 16.0f));
+    result.LabtoRGB();
+}
 
-    result = dtSamples(dtSamples.size() / 2);
+void Segmentation::getConnectivity(
+        Connectivity& c) const {
+    int width = segmentMap.width();
+    int height = segmentMap.height();
 
-    return true;
-}
+    // Edges are packed as (a << 16) | b, so sorting the keys groups them
+    // by segment and then by neighbor.  Each entry holds a key and the
+    // number of pixel pairs along that border.
+    vector<pair<uint32_t, unsigned int>> edges;
 
-void PlanarDepth::fitPlanesMedian() {
-    planes.clear();
+    #pragma omp parallel
+    {
+        vector<uint32_t> keys;
 
-    // Allocate an invalid plane at 0
-    planes.push_back(Plane());
+        #pragma omp for schedule(static) nowait
+        for (int y = 0; y < height; y++) {
+            const segmentH_t* row = segmentMap.data(0, y);
+            const segmentH_t* below = (y + 1 < height) ?
+                segmentMap.data(0, y + 1) : nullptr;
 
-    // A map from y-index to (x, disparity) tuples to store
-    // valid disparities for each scan-line in a superpixel.
-    map<imageI_t, vector<tuple<imageI_t, float>>> xDSamples;
-    
-    // A map from x-index to (y, disparity) tuples to store
-    // valid disparities for each vertical-line in a superpixel.
-    map<imageI_t, vector<tuple<imageI_t, float>>> yDSamples;
+            for (int x = 0; x < width; x++) {
+                uint32_t a = row[x];
 
-    for (int superpixelI = 0; superpixelI < segmentation->size(); superpixelI++) {
-        // By default, all planes are mapped to the invalid plane at 0
-        segmentPlaneMap[superpixelI] = 0;
+                if (x + 1 < width && row[x + 1] != a) {
+                    uint32_t b = row[x + 1];
 
-        const auto& superpixel = (*segmentation)[superpixelI];
+                    keys.push_back((a << 16) | b);
+                    keys.push_back((b << 16) | a);
+                }
 
-        xDSamples.clear();
-        yDSamples.clear();
+                if (below != nullptr && below[x] != a) {
+                    uint32_t b = below[x];
 
-        int numValidD = 0;
+                    keys.push_back((a << 16) | b);
+                    keys.push_back((b << 16) | a);
+                }
+            }
+        }
 
-        // Iterate over all pixels within the superpixel
-        for (const auto& p : superpixel.getPixels()) {
-            imageI_t x = get<0>(p);
-            imageI_t y = get<1>(p);
+        sort(keys.begin(), keys.end());
 
-            // If this pixel has a valid disparity, add it
-            if (stereo->isValidDisp(x, y)) {
-                xDSamples[y].push_back(make_tuple(x, stereo->disp(x, y)));
-                yDSamples[x].push_back(make_tuple(y, stereo->disp(x, y)));
+        // Collapse duplicate keys before merging with other threads
+        vector<pair<uint32_t, unsigned int>> localEdges;
 
-                numValidD++;
+        for (uint32_t key : keys) {
+            if (!localEdges.empty() && localEdges.back().first == key) {
+                localEdges.back().second++;
+            } else {
+                localEdges.push_back(make_pair(key, 1));
             }
         }
-        
-        float cx, cy;
 
-        if (!estimateSlant(xDSamples, cx)) {
-            continue;
+        #pragma omp critical
+        {
+            edges.insert(edges.end(), localEdges.begin(), localEdges.end());
         }
+    }
 
-        if (!estimateSlant(yDSamples, cy)) {
-            continue;
-        }
+    sort(edges.begin(), edges.end());
 
-        CImg<float> cSamples(numValidD);
+    c = Connectivity();
 
-        int cSamplesI = 0;
+    c.offsets.assign(superpixels.size() + 1, 0);
 
-        // Iterate again, collecting samples with which to estimate
-        // the 'c' value for the plane
-        for (const auto& p : superpixel.getPixels()) {
-            imageI_t x = get<0>(p);
-            imageI_t y = get<1>(p);
+    c.neighbors.reserve(edges.size());
+    c.borderLengths.reserve(edges.size());
 
-            if (stereo->isValidDisp(x, y)) {
-                float c = stereo->disp(x, y) - (cx * x + cy * y);
+    uint32_t lastKey = numeric_limits<uint32_t>::max();
 
-                cSamples(cSamplesI) = c;
-                cSamplesI++;
-            }
+    for (const auto& edge : edges) {
+        if (edge.first == lastKey) {
+            c.borderLengths.back() += edge.second;
+        } else {
+            c.neighbors.push_back(edge.first & 0xFFFF);
+            c.borderLengths.push_back(edge.second);
+
+            c.offsets[(edge.first >> 16) + 1]++;
+
+            lastKey = edge.first;
         }
+    }
 
-        cSamples.sort();
-        
-        // TODO Paper doesn't specify how much to blur
-        // cSamples.blur(min(1.0f, cSamples.width() / 16.0f));
+    for (size_t i = 1; i < c.offsets.size(); i++) {
+        c.offsets[i] += c.offsets[i - 1];
+    }
+}
+
+StereoProblem::StereoProblem(
+        CImg<int16_t> _left, 
+        CImg<int16_t> _right, 
+        int _minDisp,
+        int _maxDisp) :
+    left(_left), right(_right),
+    minDisp(_minDisp), maxDisp(_maxDisp) {
+    assert(left.is_sameXYZC(right));
 
-        float c = cSamples(cSamples.width() / 2);
+    leftLab = left.get_RGBtoLab();
+    rightLab = right.get_RGBtoLab();
+
+    disp = CImg<float>(left.width(), left.height());
+}
 
-        planes.push_back(Plane(cx, cy, c));
-        segmentPlaneMap[superpixelI] = planes.size() - 1;
+void PlanarDepth::fitPlanes(
+        const SegmentPlaneFitter& fitter) {
+    vector<Plane> segmentPlanes;
+
+    fitter.fit(stereo->disp, stereo->minDisp, stereo->maxDisp, segmentPlanes);
+
+    planes.clear();
+
+    // Allocate an invalid plane at 0
+    planes.push_back(Plane());
+
+    for (segmentH_t segH = 0; segH < segmentPlanes.size(); segH++) {
+        // By default, all segments are mapped to the invalid plane at 0
+        segmentPlaneMap[segH] = 0;
+
+        if (segmentPlanes[segH].isValid()) {
+            planes.push_back(segmentPlanes[segH]);
+            segmentPlaneMap[segH] = planes.size() - 1;
+        }
     }
 
     planes.shrink_to_fit();
+
+    planesVersion++;
+}
+
+void PlanarDepth::fitPlanesMedian() {
+    fitPlanes(SegmentPlaneFitter(segmentation));
+}
+
+void PlanarDepth::fitPlanesRansac() {
+    SegmentPlaneFitter fitter(segmentation);
+
+    fitter.setRansac(true);
+
+    fitPlanes(fitter);
 }
 
 void PlanarDepth::getPlaneCostL1(
@@ -338,30 +431,35 @@ void PlanarDepth::getPlaneCostL1(
 
     cost = 0.0f;
 
-    const Segment& superpixel = (*segmentation)[segment];
+    int maxRX = stereo->rightLab.width() - 1;
 
-    for (const auto& p : superpixel.getPixels()) {
-        int lx = get<0>(p);
-        int ly = get<1>(p);
+    for (const SegmentRun& run : segmentation->getRuns(segment)) {
+        int ly = run.y;
 
-        int rx = (int) (lx - plane.dispAt((float) lx, (float) ly) + 0.5f);
-        int ry = ly;
+        // Disparity is affine along the run, so the right image
+        // coordinates of both ends bound those of the whole run.
+        int rx0 = (int) (run.x0 - plane.dispAt(run.x0, ly) + 0.5f);
+        int rx1 = (int) (run.x1 - 1 - plane.dispAt(run.x1 - 1, ly) + 0.5f);
 
-        if (rx < 0 || rx > stereo->rightLab.width() - 1) {
+        if (min(rx0, rx1) < 0 || max(rx0, rx1) > maxRX) {
             cost = std::numeric_limits<float>::max();
 
             return;
         }
 
         for (int c = 0; c < 3; c++) {
-            float lVal = stereo->leftLab(lx, ly, 0, c);
-            float rVal = stereo->rightLab(rx, ry, 0, c);
+            const int16_t* lRow = stereo->leftLab.data(0, ly, 0, c);
+            const int16_t* rRow = stereo->rightLab.data(0, ly, 0, c);
+
+            for (int lx = run.x0; lx < run.x1; lx++) {
+                int rx = (int) (lx - plane.dispAt((float) lx, (float) ly) + 0.5f);
 
-            cost += fabs(lVal - rVal);
+                cost += abs(lRow[lx] - rRow[rx]);
+            }
         }
     }
 
-    samples = superpixel.getPixels().size() * 3;
+    samples = (*segmentation)[segment].size() * 3;
 
     cost /= (float) samples;
 }
@@ -369,7 +467,7 @@ void PlanarDepth::getPlaneCostL1(
 PlanarDepth::PlanarDepth(
         const StereoProblem* _stereo,
         const Segmentation* _segmentation)
-    : stereo(_stereo), segmentation(_segmentation) {
+    : stereo(_stereo), segmentation(_segmentation), planesVersion(1) {
     planes = vector<Plane>(1);
     segmentPlaneMap = vector<planeH_t>(segmentation->size());
 }
@@ -383,90 +481,107 @@ void PlanarDepth::getDisparity(
     for (segmentH_t superpixelI = 0;
             superpixelI < segmentation->size();
             superpixelI++) {
-        const auto& superpixel = (*segmentation)[superpixelI];
-
         const Plane& plane = getPlane(superpixelI);
 
         if (plane.isValid()) {
-            for (const auto& p : superpixel.getPixels()) {
-                imageI_t x = get<0>(p);
-                imageI_t y = get<1>(p);
+            for (const SegmentRun& run : segmentation->getRuns(superpixelI)) {
+                float* row = disp.data(0, run.y);
 
-                disp(x, y) = plane.dispAt(x, y);
+                for (int x = run.x0; x < run.x1; x++) {
+                    row[x] = plane.dispAt(x, run.y);
+                }
             }
         }
     }
 }
 
-void PlanarDepth::renderInterpolated(
-        float t,
-        CImg<float>& result) {
-    vector<segmentH_t> segmentIndices(segmentation->size());
+void PlanarDepth::createRunWarps(
+        vector<RunWarp>& warps,
+        vector<unsigned int>& rowOffsets) const {
+    int height = stereo->left.height();
 
-    for (segmentH_t i = 0; i < segmentation->size(); i++) {
-        segmentIndices[i] = i;
-    }
+    warps.clear();
+    warps.reserve(segmentation->getAllRuns().size());
 
-    // Sort segments (by index) according to depth at center
-    // for back-to-front rendering (Painter's Algo.)
-    std::sort(segmentIndices.begin(), segmentIndices.end(),
-            [&](segmentH_t a, segmentH_t b) {
-                int aX, aY, bX, bY;
-                (*segmentation)[a].getCenter(aX, aY);
-                (*segmentation)[b].getCenter(bX, bY);
-                return getPlane(a).dispAt(aX, aY) < getPlane(b).dispAt(bX, bY);
-            });
+    rowOffsets.resize(height + 1);
 
-    // Add an alpha channel to the result
-    result.resize(stereo->left.width(), stereo->left.height(), 1,
-            stereo->left.spectrum(), -1);
+    for (int y = 0; y < height; y++) {
+        rowOffsets[y] = warps.size();
 
-    result = 0.0f;
-    
-    for (segmentH_t segI : segmentIndices) {
-        const Segment& superpixel = (*segmentation)[segI];
+        segmentation->forEachRunInRow(y,
+                [&](const SegmentRun& run, segmentH_t segH) {
+                    const Plane& plane = getPlane(segH);
 
-        const Plane& plane = getPlane(segI);
+                    if (plane.isValid()) {
+                        RunWarp warp;
 
-        if (plane.isValid()) {
-            int minX, minY, maxX, maxY;
+                        warp.x0 = run.x0;
+                        warp.x1 = run.x1;
+                        warp.cx = plane.cx;
+                        warp.d0 = plane.c + plane.cy * y;
+
+                        warps.push_back(warp);
+                    }
+                });
+    }
+
+    rowOffsets[height] = warps.size();
+}
 
-            superpixel.getBounds(minX, minY, maxX, maxY);
+void PlanarDepth::renderViews(
+        const vector<RunWarp>& warps,
+        const vector<unsigned int>& rowOffsets,
+        const float* ts,
+        int numViews,
+        CImg<float>* results) const {
+    const CImg<int16_t>& left = stereo->left;
 
-            cimg_forC(stereo->left, c) {
-                for (int y = minY; y <= maxY; y++) {
-                    int minXD = (int) (minX + plane.dispAt(minX, y) * t);
-                    int maxXD = (int) (maxX + plane.dispAt(maxX, y) * t + 0.5f);
+    int width = left.width();
+    int height = left.height();
 
-                    minXD = max(0, minXD);
-                    maxXD = min(result.width() - 1, maxXD);
-                    
-                    for (int dx = minXD; dx <= maxXD; dx++) {
-                        float sx = (dx - t * (plane.c + plane.cy * y)) /
-                            (1.0f + plane.cx * t);
+    // Every output pixel is written below, so no clearing is needed
+    for (int viewI = 0; viewI < numViews; viewI++) {
+        results[viewI].resize(width, height, 1, left.spectrum(), -1);
+    }
 
-                        sx = fmin(stereo->left.width() - 1, sx);
-                        sx = fmax(0.0f, sx);
-                        
-                        int sxiL = (int) sx;
-                        int sxiR = (int) (sx + 0.5f);
+    // Rows are independent since disparity is purely horizontal, so each
+    // thread renders whole rows against its own z-buffer.
+    #pragma omp parallel
+    {
+        // The largest (nearest) disparity rendered so far at each output
+        // pixel, and the source x-coordinate it was sampled from.
+        vector<float> zRow(width);
+        vector<float> srcRow(width);
+
+        #pragma omp for collapse(2) schedule(dynamic, 8)
+        for (int viewI = 0; viewI < numViews; viewI++) {
+            for (int y = 0; y < height; y++) {
+                float t = ts[viewI];
+
+                fill(zRow.begin(), zRow.end(), -numeric_limits<float>::max());
+                fill(srcRow.begin(), srcRow.end(), -1.0f);
+
+                for (unsigned int i = rowOffsets[y]; i < rowOffsets[y + 1]; i++) {
+                    rasterizeRun(warps[i], t, width, zRow.data(), srcRow.data());
+                }
 
-                        float sxiLweight = 1.0f - (sx - ((float) sxiL));
-                        float sxiRweight = 1.0f - (((float) sxiR) - sx);
+                cimg_forC(left, c) {
+                    const int16_t* src = left.data(0, y, 0, c);
 
-                        sxiLweight *= (*segmentation)(sxiL, y) == segI;
-                        sxiRweight *= (*segmentation)(sxiR, y) == segI;
+                    float* dst = results[viewI].data(0, y, 0, c);
 
-                        float totWeight = sxiLweight + sxiRweight;
+                    #pragma omp simd
+                    for (int x = 0; x < width; x++) {
+                        float sx = srcRow[x];
 
-                        if (totWeight > 0) {
-                            sxiLweight /= totWeight;
-                            sxiRweight /= totWeight;
+                        int sxi = max(0, (int) sx);
+                        int sxi1 = min(sxi + 1, width - 1);
 
-                            result(dx, y, 0, c) = 
-                                stereo->left(sxiL, y, 0, c) * sxiLweight +
-                                stereo->left(sxiR, y, 0, c) * sxiRweight;
-                        }
+                        float w = sx - sxi;
+
+                        float v = src[sxi] * (1.0f - w) + src[sxi1] * w;
+
+                        dst[x] = (sx >= 0.0f) ? v : 0.0f;
                     }
                 }
             }
@@ -474,6 +589,55 @@ void PlanarDepth::renderInterpolated(
     }
 }
 
+void PlanarDepth::renderInterpolated(
+        float t,
+        CImg<float>& result) {
+    vector<RunWarp> warps;
+    vector<unsigned int> rowOffsets;
+
+    createRunWarps(warps, rowOffsets);
+
+    renderViews(warps, rowOffsets, &t, 1, &result);
+}
+
+void PlanarDepth::renderInterpolatedSequence(
+        const vector<float>& ts,
+        vector<CImg<float>>& results) const {
+    vector<RunWarp> warps;
+    vector<unsigned int> rowOffsets;
+
+    createRunWarps(warps, rowOffsets);
+
+    results.resize(ts.size());
+
+    renderViews(warps, rowOffsets, ts.data(), ts.size(), results.data());
+}
+
+void PlanarDepth::renderInterpolatedSequence(
+        const vector<float>& ts,
+        function<void(int, const CImg<float>&)> sink,
+        int batchSize) const {
+    assert(batchSize > 0);
+
+    vector<RunWarp> warps;
+    vector<unsigned int> rowOffsets;
+
+    createRunWarps(warps, rowOffsets);
+
+    vector<CImg<float>> batch(min((size_t) batchSize, ts.size()));
+
+    for (size_t first = 0; first < ts.size(); first += batchSize) {
+        int numViews = min((size_t) batchSize, ts.size() - first);
+
+        renderViews(warps, rowOffsets, ts.data() + first, numViews,
+                batch.data());
+
+        for (int i = 0; i < numViews; i++) {
+            sink(first + i, batch[i]);
+        }
+    }
+}
+
 PlanarDepthSmoothingProblem::PlanarDepthSmoothingProblem(
         PlanarDepth* _depth,
         const StereoProblem* _stereo,
@@ -482,7 +646,8 @@ PlanarDepthSmoothingProblem::PlanarDepthSmoothingProblem(
     stereo(_stereo),
     depth(_depth),
     segmentation(_segmentation),
-    connectivity(_connectivity) {
+    connectivity(_connectivity),
+    parallelMoves(true) {
 
     createModel();
     
@@ -495,6 +660,9 @@ PlanarDepthSmoothingProblem::PlanarDepthSmoothingProblem(
     maxDisp = std::numeric_limits<float>::max();
 }
 
+PlanarDepthSmoothingProblem::~PlanarDepthSmoothingProblem() {
+}
+
 float PlanarDepthSmoothingProblem::UnaryCost::operator()(
         segmentH_t segH,
         planeH_t planeH) {
@@ -537,18 +705,57 @@ float PlanarDepthSmoothingProblem::BinaryCost::operator()(
         segmentH_t segB,
         planeH_t planeA,
         planeH_t planeB) {
-    if (!self->colorConnected(segA, segB)) {
+    int edgeI = self->edgeCache.empty() ? -1 :
+        self->connectivity->findEdge(segA, segB);
+
+    // Non-adjacent segments, or no cache yet: compute from scratch
+    if (edgeI < 0) {
+        if (!self->colorConnected(segA, segB)) {
+            return 0;
+        }
+
+        return self->smoothnessCoeff *
+            self->pairwiseL1PlaneDist(segA, segB, planeA, planeB);
+    }
+
+    const EdgeCache& edge = self->edgeCache[edgeI];
+
+    if (!edge.colorConnected) {
         return 0;
     }
 
-    float depthDiscontinuity = self->pairwiseL1PlaneDist(segA, segB, planeA, planeB);
+    unsigned int version = self->depth->getPlanesVersion();
+
+    if (memoVersion != version) {
+        MemoEntry empty = {-1, 0, 0, 0.0f};
+
+        memo.assign(memoSize, empty);
+
+        memoVersion = version;
+    }
+
+    uint32_t hash = (uint32_t) edgeI * 0x9E3779B1u ^
+        (((uint32_t) planeA << 16) | planeB) * 0x85EBCA6Bu;
+
+    MemoEntry& entry = memo[(hash >> 20) & (memoSize - 1)];
+
+    if (entry.edge != edgeI || entry.planeA != planeA || entry.planeB != planeB) {
+        const Plane& p1 = self->depth->getPlanes()[planeA];
+        const Plane& p2 = self->depth->getPlanes()[planeB];
+
+        entry.edge = edgeI;
+        entry.planeA = planeA;
+        entry.planeB = planeB;
+        entry.dist = fabs(p1.dispAt(edge.midX, edge.midY) -
+                p2.dispAt(edge.midX, edge.midY));
+    }
 
     // depthDiscontinuity = fmin(depthDiscontinuity, self->binaryC0InlierThresh * 3.0f);
 
     // int conn = self->connectivity->getConnectivity(segA, segB);
 
     // FIXME this needs to be improved
-    return self->smoothnessCoeff * depthDiscontinuity;
+    return self->smoothnessCoeff * entry.dist;
 }
 
 void PlanarDepthSmoothingProblem::neighborhoodGenerator(
@@ -625,9 +832,13 @@ void PlanarDepthSmoothingProblem::computePairwiseCostStats() {
 
         neighbors.clear();
 
-        connectivity->forEachNeighbor(segI,
-                [&](segmentH_t nI, int conn) {
-                    float dist = pairwiseColorDist(segI, nI);
+        bool cached = connectivity->hasColorDistances();
+
+        connectivity->forEachEdge(segI,
+                [&](segmentH_t nI, int conn, unsigned int edgeI) {
+                    float dist = cached ?
+                        connectivity->getColorDistance(edgeI) :
+                        pairwiseColorDist(segI, nI);
 
                     neighbors.push_back(make_tuple(dist, nI, conn));
                 });
@@ -643,9 +854,41 @@ void PlanarDepthSmoothingProblem::computePairwiseCostStats() {
     }
 }
 
+void PlanarDepthSmoothingProblem::createEdgeCache() {
+    edgeCache.resize(connectivity->numEdges());
+
+    bool cached = connectivity->hasColorDistances();
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int segA = 0; segA < (int) segmentation->size(); segA++) {
+        int cX1, cY1;
+
+        (*segmentation)[segA].getCenter(cX1, cY1);
+
+        connectivity->forEachEdge(segA,
+                [&](segmentH_t segB, int conn, unsigned int edgeI) {
+                    int cX2, cY2;
+
+                    (*segmentation)[segB].getCenter(cX2, cY2);
+
+                    EdgeCache& edge = edgeCache[edgeI];
+
+                    edge.midX = (cX1 + cX2) / 2.0f;
+                    edge.midY = (cY1 + cY2) / 2.0f;
+
+                    float colorDiff = cached ?
+                        connectivity->getColorDistance(edgeI) :
+                        pairwiseColorDist(segA, segB);
+
+                    edge.colorConnected = colorDiff <
+                        max(medianColorDiff[segA], medianColorDiff[segB]);
+                });
+    }
+}
+
 void PlanarDepthSmoothingProblem::createModel() {
     UnaryCost uCost = {this};
-    BinaryCost bCost = {this};
+    BinaryCost bCost = {this, {}, 0};
 
     function<void(segmentH_t, vector<planeH_t>&)> neighborGen =
         bind(&PlanarDepthSmoothingProblem::neighborhoodGenerator,
@@ -653,66 +896,265 @@ void PlanarDepthSmoothingProblem::createModel() {
                 std::placeholders::_1,
                 std::placeholders::_2);
 
-    model = unique_ptr<Solver>(new Solver(
-                numSegmentsPerExpansion,
-                &(depth->getSegmentPlaneMap()),
-                uCost,
-                bCost,
-                neighborGen));
+    solvers.clear();
+
+    for (int i = 0; i < omp_get_max_threads(); i++) {
+        solvers.push_back(unique_ptr<Solver>(new Solver(
+                        numSegmentsPerExpansion,
+                        &(depth->getSegmentPlaneMap()),
+                        uCost,
+                        bCost,
+                        neighborGen)));
+    }
 }
 
 void PlanarDepthSmoothingProblem::computeInlierStats() {
     computeUnaryCostStats();
 
     computePairwiseCostStats();
-}
 
-void PlanarDepthSmoothingProblem::solve() {
-    set<segmentH_t> visited;
+    createEdgeCache();
+}
 
-    queue<segmentH_t> toVisit;
+void PlanarDepthSmoothingProblem::createExpansionGroups(
+        vector<segmentH_t>& seeds,
+        vector<unsigned int>& groupOffsets,
+        vector<segmentH_t>& groups,
+        vector<unsigned int>& footprintOffsets,
+        vector<segmentH_t>& footprints) {
+    seeds.clear();
+    groups.clear();
+    footprints.clear();
 
-    set<segmentH_t> expandNodes;
+    groupOffsets.assign(1, 0);
+    footprintOffsets.assign(1, 0);
 
-    int numFlips = 0;
+    // visitedBy[s] is the seed of the last traversal which reached s
+    vector<int> visitedBy(segmentation->size(), -1);
 
-    // Loop over all segments and try to expand the plane
-    // at that segment to adjacent nodes (by breadth-first traversal)
     for (size_t segI = 0; segI < segmentation->size(); segI++) {
         if (!depth->getPlane(segI).isValid()) {
             continue;
         }
 
-        toVisit = queue<segmentH_t>();
-        
-        visited.clear();
+        seeds.push_back(segI);
 
-        toVisit.push(segI);
+        // The group itself serves as the breadth-first queue
+        size_t groupStart = groups.size();
+        size_t head = groupStart;
 
-        expandNodes.clear();
+        groups.push_back(segI);
 
-        while (expandNodes.size() < numSegmentsPerExpansion) {
-            // Pop off the index of the next segment to visit
-            segmentH_t curSeg = toVisit.front();
+        visitedBy[segI] = segI;
 
-            toVisit.pop();
-
-            expandNodes.insert(curSeg);
+        // The traversal can run out of segments on small connected
+        // components.
+        while (head < groups.size() &&
+                groups.size() - groupStart < numSegmentsPerExpansion) {
+            segmentH_t curSeg = groups[head++];
 
             connectivity->forEachNeighbor(curSeg,
                     [&](segmentH_t nI, int conn) {
-                        if (visited.count(nI) == 0) {
-                            visited.insert(nI);
+                        if (visitedBy[nI] != (int) segI &&
+                                groups.size() - groupStart < numSegmentsPerExpansion) {
+                            visitedBy[nI] = segI;
 
-                            toVisit.push(nI);
+                            groups.push_back(nI);
                         }
                     });
         }
 
-        numFlips += model->tryExpand(expandNodes, depth->getSegmentPlaneMap()[segI]);
+        groupOffsets.push_back(groups.size());
+
+        // The footprint adds the neighbors whose labels the move reads
+        footprints.insert(footprints.end(), groups.begin() + groupStart,
+                groups.end());
+
+        for (size_t i = groupStart; i < groups.size(); i++) {
+            connectivity->forEachNeighbor(groups[i],
+                    [&](segmentH_t nI, int conn) {
+                        if (visitedBy[nI] != (int) segI) {
+                            visitedBy[nI] = segI;
+
+                            footprints.push_back(nI);
+                        }
+                    });
+        }
+
+        footprintOffsets.push_back(footprints.size());
+    }
+}
+
+void PlanarDepthSmoothingProblem::solve() {
+    INSTRUMENT_SCOPE("PlanarDepthSmoothingProblem::solve");
+
+    vector<segmentH_t> seeds;
+    vector<unsigned int> groupOffsets, footprintOffsets;
+    vector<segmentH_t> groups, footprints;
+
+    createExpansionGroups(seeds, groupOffsets, groups, footprintOffsets,
+            footprints);
+
+    vector<planeH_t>& labeling = depth->getSegmentPlaneMap();
+
+    if (!parallelMoves) {
+        // Reference path: solve and apply every move in seed order.
+        Solver& solver = *solvers[0];
+
+        vector<segmentH_t> nodes;
+        vector<pair<segmentH_t, planeH_t>> proposal;
+
+        for (size_t moveI = 0; moveI < seeds.size(); moveI++) {
+            nodes.assign(groups.begin() + groupOffsets[moveI],
+                    groups.begin() + groupOffsets[moveI + 1]);
+
+            proposal.clear();
+
+            solver.proposeExpand(nodes, labeling[seeds[moveI]], proposal);
+
+            for (const auto& change : proposal) {
+                labeling[change.first] = change.second;
+            }
+        }
+
+        return;
+    }
+
+    int numSegs = segmentation->size();
+
+    // Stamps marking the segments written (group) and read (footprint) by
+    // moves already in the current batch, and those modified when
+    // applying it.
+    vector<int> writtenBy(numSegs, -1);
+    vector<int> readBy(numSegs, -1);
+    vector<int> modifiedIn(numSegs, -1);
+
+    vector<int> pending(seeds.size());
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i] = i;
+    }
+
+    vector<int> batch;
+    vector<int> deferred;
+
+    vector<vector<pair<segmentH_t, planeH_t>>> proposals;
+
+    int numBatches = 0;
+
+    while (!pending.empty()) {
+        int batchI = numBatches++;
+
+        batch.clear();
+        deferred.clear();
+
+        // Greedily color moves: a move joins the batch unless it writes a
+        // segment read by the batch, or reads one written by it.
+        for (int moveI : pending) {
+            bool independent = true;
+
+            for (unsigned int i = groupOffsets[moveI];
+                    independent && i < groupOffsets[moveI + 1]; i++) {
+                independent = readBy[groups[i]] != batchI;
+            }
+
+            for (unsigned int i = footprintOffsets[moveI];
+                    independent && i < footprintOffsets[moveI + 1]; i++) {
+                independent = writtenBy[footprints[i]] != batchI;
+            }
+
+            if (!independent) {
+                deferred.push_back(moveI);
+                continue;
+            }
+
+            for (unsigned int i = groupOffsets[moveI]; i < groupOffsets[moveI + 1]; i++) {
+                writtenBy[groups[i]] = batchI;
+            }
+
+            for (unsigned int i = footprintOffsets[moveI]; i < footprintOffsets[moveI + 1]; i++) {
+                readBy[footprints[i]] = batchI;
+            }
+
+            batch.push_back(moveI);
+        }
+
+        proposals.resize(batch.size());
+
+        // Moves in a batch read disjoint parts of the labeling from those
+        // written by the others, so they can be solved concurrently.
+        #pragma omp parallel
+        {
+            Solver& solver = *solvers[omp_get_thread_num()];
+
+            vector<segmentH_t> nodes;
+
+            #pragma omp for schedule(dynamic, 1)
+            for (int k = 0; k < (int) batch.size(); k++) {
+                int moveI = batch[k];
+
+                nodes.assign(groups.begin() + groupOffsets[moveI],
+                        groups.begin() + groupOffsets[moveI + 1]);
+
+                proposals[k].clear();
+
+                solver.proposeExpand(nodes, labeling[seeds[moveI]],
+                        proposals[k]);
+            }
+        }
+
+        // Apply in seed order.  As a safeguard, a move whose footprint was
+        // modified by an earlier move of this batch is retried later.
+        for (size_t k = 0; k < batch.size(); k++) {
+            int moveI = batch[k];
+
+            bool conflict = false;
+
+            for (unsigned int i = footprintOffsets[moveI];
+                    !conflict && i < footprintOffsets[moveI + 1]; i++) {
+                conflict = modifiedIn[footprints[i]] == batchI;
+            }
+
+            if (conflict) {
+                deferred.push_back(moveI);
+                continue;
+            }
+
+            for (const auto& change : proposals[k]) {
+                labeling[change.first] = change.second;
+
+                modifiedIn[change.first] = batchI;
+            }
+        }
+
+        sort(deferred.begin(), deferred.end());
+
+        pending.swap(deferred);
+    }
+}
+
+double PlanarDepthSmoothingProblem::computeEnergy() {
+    UnaryCost uCost = {this};
+    BinaryCost bCost = {this, {}, 0};
+
+    const vector<planeH_t>& labeling = depth->getSegmentPlaneMap();
+
+    double energy = 0.0;
+
+    for (segmentH_t segA = 0; segA < segmentation->size(); segA++) {
+        energy += fmin(uCost(segA, labeling[segA]), Solver::maxEnergy);
+
+        connectivity->forEachNeighbor(segA,
+                [&](segmentH_t segB, int conn) {
+                    // Count each edge once
+                    if (segB > segA) {
+                        energy += fmin(bCost(segA, segB, labeling[segA],
+                                    labeling[segB]), Solver::maxEnergy);
+                    }
+                });
     }
 
-    printf("Flips = %d\n", numFlips);
+    return energy;
 }
 
 void PlanarDepthSmoothingProblem::visualizeUnaryCost(
@@ -728,11 +1170,10 @@ void PlanarDepthSmoothingProblem::visualizeUnaryCost(
             cost = -1.0f;
         }
 
-        for (const auto& pixel : (*segmentation)[segH].getPixels()) {
-            int x = get<0>(pixel);
-            int y = get<1>(pixel);
+        for (const SegmentRun& run : segmentation->getRuns(segH)) {
+            float* row = vis.data(0, run.y);
 
-            vis(x, y) = cost;
+            fill(row + run.x0, row + run.x1, cost);
         }
     }
 }
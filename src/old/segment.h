@@ -2,14 +2,19 @@
 
 #include "common.h"
 
-#include "localexpansion.hpp"
-
 #include "cvutil/cvutil.h"
 
+#include "superpixel/superpixel.h"
+
 class Segment;
 class Connectivity;
 class Segmentation;
 class PlanarDepth;
+class SegmentPlaneFitter;
+
+// Defined in localexpansion.hpp, which only segment.cpp needs
+template<class N, class L, class UC, class BC>
+class LocalExpansion;
 
 typedef unsigned int imageI_t;
 
@@ -19,38 +24,81 @@ typedef uint16_t segmentH_t;
 // A handle to a plane
 typedef uint16_t planeH_t;
 
+/**
+ * A horizontal run of pixels [x0, x1) on scanline y belonging to a single
+ * segment.  16-bit coordinates keep a run at 6 bytes, which limits images
+ * to 65535 pixels in either dimension (as segmentH_t already limits the
+ * number of segments).
+ */
+struct SegmentRun {
+    uint16_t y;
+
+    uint16_t x0, x1;
+
+    inline unsigned int size() const {
+        return x1 - x0;
+    }
+};
+
+/**
+ * A view of the runs belonging to a single segment, ordered by y and then
+ * by x0.
+ */
+class RunRange {
+    private:
+        const SegmentRun* first;
+
+        const SegmentRun* last;
+
+    public:
+        RunRange(
+                const SegmentRun* _first,
+                const SegmentRun* _last) : first(_first), last(_last) {
+        }
+
+        inline const SegmentRun* begin() const {
+            return first;
+        }
+
+        inline const SegmentRun* end() const {
+            return last;
+        }
+
+        inline size_t size() const {
+            return last - first;
+        }
+};
+
+/**
+ * Per-segment summary.  The pixels of a segment are not stored here but as
+ * a contiguous range of runs within the owning Segmentation (see
+ * Segmentation::getRuns()).
+ */
 class Segment {
+    friend Segmentation;
+
     private:
         imageI_t minX, maxX;
 
         imageI_t minY, maxY;
 
-        vector<tuple<imageI_t, imageI_t>> pixels;
+        /**
+         * Range [runBegin, runEnd) of this segment's runs in the
+         * Segmentation's run array.
+         */
+        unsigned int runBegin, runEnd;
+
+        unsigned int numPixels;
 
     public:
         Segment();
 
-        inline void addPixel(
-                imageI_t x,
-                imageI_t y) {
-            minX = min(minX, x);
-            maxX = max(maxX, x);
-            minY = min(minY, y);
-            maxY = max(maxY, y);
-
-            pixels.push_back(make_tuple(x, y));
-        }
-        
-        inline void compress() {
-            pixels.shrink_to_fit();
-        }
-
         inline unsigned int size() const {
-            return pixels.size();
+            return numPixels;
         }
 
-        inline const vector<tuple<imageI_t, imageI_t>>& getPixels() const {
-            return pixels;
+        inline unsigned int numRuns() const {
+            return runEnd - runBegin;
         }
 
         inline void getBounds(
@@ -72,32 +120,117 @@ class Segment {
         }
 };
 
+/**
+ * Region adjacency graph of a segmentation in CSR layout.
+ *
+ * The neighbors of segment s are neighbors[offsets[s], offsets[s + 1]),
+ * sorted by handle, and borderLengths holds the number of 4-connected
+ * pixel pairs shared with each of them.  Every edge is stored once in
+ * each direction; self-edges are not stored.
+ */
 class Connectivity {
     friend Segmentation;
     
     private:
-        map<segmentH_t, map<segmentH_t, int>> connectivity;
+        vector<unsigned int> offsets;
 
-        void increment(
-                segmentH_t a,
-                segmentH_t b);
+        vector<segmentH_t> neighbors;
+
+        vector<unsigned int> borderLengths;
+
+        /**
+         * Optional per-edge L1 distance between the median Lab colors of
+         * the two segments, parallel to neighbors.  Empty unless
+         * cacheColorDistances() has been called.
+         */
+        vector<float> edgeColorDist;
 
     public:
-        int getConnectivity(
+        inline unsigned int size() const {
+            return offsets.empty() ? 0 : offsets.size() - 1;
+        }
+
+        inline unsigned int numEdges() const {
+            return neighbors.size();
+        }
+
+        /**
+         * Returns the index of edge (a, b), or -1 if a and b are not
+         * adjacent.
+         */
+        inline int findEdge(
                 segmentH_t a,
-                segmentH_t b) const;
+                segmentH_t b) const {
+            if (a >= size()) {
+                return -1;
+            }
+
+            const segmentH_t* first = neighbors.data() + offsets[a];
+            const segmentH_t* last = neighbors.data() + offsets[a + 1];
+
+            const segmentH_t* found = lower_bound(first, last, b);
+
+            if (found == last || *found != b) {
+                return -1;
+            }
+
+            return found - neighbors.data();
+        }
 
+        inline int getConnectivity(
+                segmentH_t a,
+                segmentH_t b) const {
+            int edgeI = findEdge(a, b);
+
+            return edgeI < 0 ? 0 : borderLengths[edgeI];
+        }
+
+        inline bool hasColorDistances() const {
+            return !neighbors.empty() &&
+                edgeColorDist.size() == neighbors.size();
+        }
+
+        inline float getColorDistance(
+                unsigned int edgeI) const {
+            return edgeColorDist[edgeI];
+        }
+
+        /**
+         * Computes the median Lab color distance of every edge.
+         */
+        void cacheColorDistances(
+                const Segmentation& segmentation);
+
+        /**
+         * Calls fun(neighbor, borderLength) for every neighbor of s.
+         */
+        template<class F>
         inline void forEachNeighbor(
-                segmentH_t  s,
-                function<void(segmentH_t, int)> fun) const {
-            const auto& foundS = connectivity.find(s);
-
-            if (foundS != connectivity.end()) {
-                for (const auto& edge : (*foundS).second) {
-                    if (edge.second > 0) {
-                        fun(edge.first, edge.second);
-                    }
-                }
+                segmentH_t s,
+                F fun) const {
+            if (s >= size()) {
+                return;
+            }
+
+            for (unsigned int e = offsets[s]; e < offsets[s + 1]; e++) {
+                fun(neighbors[e], (int) borderLengths[e]);
+            }
+        }
+
+        /**
+         * Like forEachNeighbor(), but also passes the edge index, for use
+         * with per-edge attributes: fun(neighbor, borderLength, edgeI).
+         */
+        template<class F>
+        inline void forEachEdge(
+                segmentH_t s,
+                F fun) const {
+            if (s >= size()) {
+                return;
+            }
+
+            for (unsigned int e = offsets[s]; e < offsets[s + 1]; e++) {
+                fun(neighbors[e], (int) borderLengths[e], e);
             }
         }
 };
@@ -106,10 +239,51 @@ class Segmentation {
     private:
         vector<Segment> superpixels;
 
+        /**
+         * Runs of all segments in CSR layout: the runs of segment i are
+         * runs[superpixels[i].runBegin, superpixels[i].runEnd).
+         */
+        vector<SegmentRun> runs;
+
+        /**
+         * The segment owning each run, parallel to runs.
+         */
+        vector<segmentH_t> runSegment;
+
+        /**
+         * Index of the runs on each scanline, ordered by x0, in CSR
+         * layout: the runs on row y are
+         * runs[rowRuns[rowRunOffsets[y], rowRunOffsets[y + 1])].
+         */
+        vector<unsigned int> rowRunOffsets;
+
+        vector<unsigned int> rowRuns;
+
+        /**
+         * Optional sum of Lab values over each run, parallel to runs.
+         * Empty unless computeRunLabStats() has been called.
+         */
+        vector<array<float, 3>> runLabSum;
+
         CImg<segmentH_t> segmentMap;
 
         vector<array<float, 3>> medianLab;
 
+        /**
+         * Retained between frames so that temporal updates can warm-start
+         * from the previous clusters.
+         */
+        unique_ptr<SlicSuperpixels> slic;
+
+        /**
+         * Rebuilds the segments and their runs from segmentMap, then
+         * computes the median Lab color of each segment.
+         */
+        void createSegmentsFromMap(
+                const CImg<float>& lab);
+
+        void createRunsFromMap();
+
     public:
         inline const vector<Segment>& getSegments() const {
             return superpixels;
@@ -128,6 +302,45 @@ class Segmentation {
             return superpixels[index];
         }
 
+        inline RunRange getRuns(
+                segmentH_t index) const {
+            const Segment& seg = superpixels[index];
+
+            return RunRange(runs.data() + seg.runBegin,
+                    runs.data() + seg.runEnd);
+        }
+
+        inline const vector<SegmentRun>& getAllRuns() const {
+            return runs;
+        }
+
+        /**
+         * Calls fun(run, segment) for every run on row y, in order of x0.
+         */
+        template<class F>
+        inline void forEachRunInRow(
+                int y,
+                F fun) const {
+            for (unsigned int i = rowRunOffsets[y]; i < rowRunOffsets[y + 1]; i++) {
+                unsigned int runI = rowRuns[i];
+
+                fun(runs[runI], runSegment[runI]);
+            }
+        }
+
+        inline bool hasRunLabStats() const {
+            return runLabSum.size() == runs.size() && !runs.empty();
+        }
+
+        /**
+         * Sum of Lab values over the given run, which must belong to this
+         * segmentation.  Requires computeRunLabStats().
+         */
+        inline const array<float, 3>& getRunLabSum(
+                const SegmentRun& run) const {
+            return runLabSum[&run - runs.data()];
+        }
+
         inline segmentH_t& operator()(
                 imageI_t x,
                 imageI_t y) {
@@ -152,11 +365,33 @@ class Segmentation {
 
         void recomputeSegmentMap();
 
+        void computeRunLabStats(
+                const CImg<float>& lab);
+
         void createSlicSuperpixels(
                 const CImg<float>& lab,
                 int numSegments,
                 int nc);
 
+        /**
+         * Re-segments the next frame of a video, starting from the
+         * superpixels of the previous call to createSlicSuperpixels() or
+         * updateSlicSuperpixels() instead of a regular grid.
+         *
+         * Segment handles are stable: segment i covers the same region
+         * (moved and refined) as segment i of the previous frame, and
+         * size() does not change.  Per-segment state such as the
+         * segment-plane map of PlanarDepth therefore remains valid.
+         * Segments which disappear are left empty.
+         *
+         * If flow is given, it must map the previous frame to this one and
+         * is used to advect the previous cluster centers.
+         */
+        void updateSlicSuperpixels(
+                const CImg<float>& lab,
+                int iterations = 2,
+                CVDenseOpticalFlow* flow = nullptr);
+
         void renderVisualization(
                 CImg<float>& result) const;
 
@@ -225,14 +460,93 @@ class PlanarDepth {
 
         vector<planeH_t> segmentPlaneMap;
 
+        /**
+         * Incremented whenever the set of planes changes, so that caches
+         * keyed by plane handles can be invalidated.
+         */
+        unsigned int planesVersion;
+
     private:
-        bool tabulateSlantSamples(
-                const map<imageI_t, vector<tuple<imageI_t, float>>>& dSamples,
-                CImg<float>& dtSamples) const;
+        void fitPlanes(
+                const SegmentPlaneFitter& fitter);
+
+        /**
+         * A run together with the coefficients of its warp.  Along the
+         * run, disparity is d(x) = d0 + cx * x, so the view at position t
+         * maps x to x + t * d(x), which is linear in both x and t.
+         */
+        struct RunWarp {
+            float x0, x1;
+
+            float cx, d0;
+        };
+
+        /**
+         * Collects the warps of all runs with valid planes, grouped by
+         * row in CSR layout (rowOffsets has one entry per row plus one).
+         * These do not depend on t, so they are shared by every view.
+         */
+        void createRunWarps(
+                vector<RunWarp>& warps,
+                vector<unsigned int>& rowOffsets) const;
+
+        /**
+         * Renders the views at ts[0, numViews) into results, in a single
+         * parallel pass over all (view, row) pairs.
+         */
+        void renderViews(
+                const vector<RunWarp>& warps,
+                const vector<unsigned int>& rowOffsets,
+                const float* ts,
+                int numViews,
+                CImg<float>* results) const;
+
+        /**
+         * Forward-maps a run into the view at position t.  Wherever the
+         * run's disparity is nearer than zRow, the output pixel takes the
+         * run's disparity and records its source x-coordinate in srcRow.
+         */
+        static inline void rasterizeRun(
+                const RunWarp& warp,
+                float t,
+                int width,
+                float* zRow,
+                float* srcRow) {
+            // Output x-coordinate of source pixel x is scale * x + offset
+            float scale = 1.0f + warp.cx * t;
+
+            // The plane folds over itself at this t
+            if (scale <= 0.0f) {
+                return;
+            }
+
+            float offset = t * warp.d0;
+
+            // Each source pixel covers [x - 0.5, x + 0.5), so adjacent runs
+            // on the same plane tile the output without gaps or overlap.
+            float first = scale * (warp.x0 - 0.5f) + offset;
+            float last = scale * (warp.x1 - 0.5f) + offset;
+
+            int lo = (int) ceil(fmax(first, 0.0f));
+            int hi = (int) ceil(fmin(last, (float) width));
+
+            float invScale = 1.0f / scale;
+
+            float minSX = warp.x0;
+            float maxSX = warp.x1 - 1.0f;
+
+            #pragma omp simd
+            for (int dx = lo; dx < hi; dx++) {
+                float sx = fmin(fmax((dx - offset) * invScale, minSX), maxSX);
+
+                float z = warp.d0 + warp.cx * sx;
 
-        bool estimateSlant(
-                const map<imageI_t, vector<tuple<imageI_t, float>>>& dSamples,
-                float& result) const;
+                if (z > zRow[dx]) {
+                    zRow[dx] = z;
+                    srcRow[dx] = sx;
+                }
+            }
+        }
 
     public:
         PlanarDepth(
@@ -243,6 +557,10 @@ class PlanarDepth {
             return planes;
         }
 
+        inline unsigned int getPlanesVersion() const {
+            return planesVersion;
+        }
+
         inline const Plane& getPlane(
                 segmentH_t segI) const {
             return planes[segmentPlaneMap[segI]];
@@ -258,6 +576,12 @@ class PlanarDepth {
 
         void fitPlanesMedian();
 
+        /**
+         * Like fitPlanesMedian(), but refines each plane with RANSAC,
+         * which is more robust to outliers in the input disparity.
+         */
+        void fitPlanesRansac();
+
         void getPlaneCostL1(
                 segmentH_t segment,
                 const Plane& plane,
@@ -267,10 +591,37 @@ class PlanarDepth {
         void getDisparity(
                 CImg<float>& disp) const;
 
+        /**
+         * Renders the left view shifted by t times the planar disparity.
+         * Visibility is resolved per pixel with a disparity z-buffer, so
+         * the nearest surface wins even where segments interleave in
+         * depth.  Pixels which nothing maps to are left at 0.
+         */
         void renderInterpolated(
                 float t,
                 CImg<float>& result);
 
+        /**
+         * Renders the views at every position in ts, as
+         * renderInterpolated() would, into results[i].  Per-run warp
+         * coefficients are computed once for the whole sequence.
+         */
+        void renderInterpolatedSequence(
+                const vector<float>& ts,
+                vector<CImg<float>>& results) const;
+
+        /**
+         * Streaming variant of renderInterpolatedSequence().  Views are
+         * rendered batchSize at a time, and sink(i, view) is called on
+         * the calling thread for each finished view in order of i, so at
+         * most batchSize frames are held in memory.  The frame passed to
+         * the sink is reused once it returns.
+         */
+        void renderInterpolatedSequence(
+                const vector<float>& ts,
+                function<void(int, const CImg<float>&)> sink,
+                int batchSize = 8) const;
+
         inline bool isInBounds(
                 segmentH_t segH,
                 const Plane& plane) const {
@@ -318,6 +669,24 @@ class PlanarDepthSmoothingProblem {
         struct BinaryCost {
             PlanarDepthSmoothingProblem* self;
 
+            struct MemoEntry {
+                int edge;
+
+                planeH_t planeA, planeB;
+
+                float dist;
+            };
+
+            /**
+             * Direct-mapped memo of plane distances at edge midpoints,
+             * keyed by (edge, planeA, planeB).  Every solver holds its own
+             * copy of the cost, so the memo needs no locking.  It is
+             * cleared whenever the planes of the PlanarDepth change.
+             */
+            vector<MemoEntry> memo;
+
+            unsigned int memoVersion;
+
             float operator()(
                 segmentH_t a,
                 segmentH_t b,
@@ -325,6 +694,20 @@ class PlanarDepthSmoothingProblem {
                 planeH_t b_label);
         };
 
+        /**
+         * Plane-independent attributes of each edge of the connectivity
+         * graph, indexed as in Connectivity.
+         */
+        struct EdgeCache {
+            /**
+             * Midpoint of the centers of the two segments, a crude
+             * approximation of a point on their shared border.
+             */
+            float midX, midY;
+
+            bool colorConnected;
+        };
+
         typedef LocalExpansion<segmentH_t, planeH_t, UnaryCost, BinaryCost> Solver;
 
         // typedef GMM<6> GMM6;
@@ -342,7 +725,16 @@ class PlanarDepthSmoothingProblem {
 
         // unique_ptr<GMM6> edgeModel;
         
-        unique_ptr<Solver> model;
+        /**
+         * One solver per thread, so that independent moves can be solved
+         * concurrently.
+         */
+        vector<unique_ptr<Solver>> solvers;
+
+        /**
+         * If false, moves are applied one at a time in seed order.
+         */
+        bool parallelMoves;
 
         float smoothnessCoeff;
 
@@ -360,6 +752,10 @@ class PlanarDepthSmoothingProblem {
 
         vector<float> medianColorDiff;
 
+        vector<EdgeCache> edgeCache;
+
+        static const int memoSize = 4096;
+
     private:
         inline float pairwiseL1PlaneDist(
                 segmentH_t segA,
@@ -422,24 +818,56 @@ class PlanarDepthSmoothingProblem {
 
         void computePairwiseCostStats();
 
+        /**
+         * Fills edgeCache.  Requires medianColorDiff.
+         */
+        void createEdgeCache();
+
         void createModel();
 
+        /**
+         * Collects the segments of the move seeded at each segment with a
+         * valid plane, by breadth-first traversal, along with the move's
+         * footprint: its segments and all of their neighbors.  Both are
+         * stored in CSR layout, indexed by move.
+         */
+        void createExpansionGroups(
+                vector<segmentH_t>& seeds,
+                vector<unsigned int>& groupOffsets,
+                vector<segmentH_t>& groups,
+                vector<unsigned int>& footprintOffsets,
+                vector<segmentH_t>& footprints);
+
     public:
         inline void setSmoothness(
                 float s) {
             smoothnessCoeff = s;
         }
 
+        inline void setParallelMoves(
+                bool enable) {
+            parallelMoves = enable;
+        }
+
         PlanarDepthSmoothingProblem(
                 PlanarDepth* _depth,
                 const StereoProblem* _stereo,
                 const Segmentation* _segmentation,
                 const Connectivity* _connectivity);
 
+        ~PlanarDepthSmoothingProblem();
+
         void computeInlierStats();
 
         void solve();
 
+        /**
+         * The energy minimized by solve(): the unary cost of every segment
+         * plus the binary cost of every edge, for the current labeling.
+         * Each term is clamped as it is within a move.
+         */
+        double computeEnergy();
+
         void visualizeUnaryCost(
                 CImg<float>& vis);
 };
@@ -0,0 +1,267 @@
+#include "segmentbp.h"
+
+#include <algorithm>
+
+SegmentPlaneBP::SegmentPlaneBP(
+        const Connectivity* _connectivity) :
+    connectivity(_connectivity),
+    maxIterations(50),
+    damping(0.5f),
+    tolerance(1e-3f) {
+    unsigned int numNodes = connectivity->size();
+
+    edgeWeights.assign(connectivity->numEdges(), 0.0f);
+
+    reverseEdge.resize(connectivity->numEdges());
+
+    for (unsigned int s = 0; s < numNodes; s++) {
+        connectivity->forEachEdge(s,
+                [&](segmentH_t t, int, unsigned int edgeI) {
+            int rev = connectivity->findEdge(t, s);
+
+            assert(rev >= 0);
+
+            reverseEdge[edgeI] = rev;
+        });
+    }
+
+    labelOffsets.assign(numNodes + 1, 0);
+
+    colorNodesGreedy();
+}
+
+void SegmentPlaneBP::colorNodesGreedy() {
+    unsigned int numNodes = connectivity->size();
+
+    vector<int> color(numNodes, -1);
+
+    // usedBy[k] == s marks color k as taken by a neighbor of s
+    vector<int> usedBy;
+
+    int numColors = 0;
+
+    for (unsigned int s = 0; s < numNodes; s++) {
+        connectivity->forEachNeighbor(s, [&](segmentH_t t, int) {
+            if (color[t] >= 0) {
+                usedBy[color[t]] = s;
+            }
+        });
+
+        int k = 0;
+
+        while (k < numColors && usedBy[k] == (int) s) {
+            k++;
+        }
+
+        if (k == numColors) {
+            numColors++;
+            usedBy.push_back(-1);
+        }
+
+        color[s] = k;
+    }
+
+    colorOffsets.assign(numColors + 1, 0);
+
+    for (unsigned int s = 0; s < numNodes; s++) {
+        colorOffsets[color[s] + 1]++;
+    }
+
+    for (int k = 0; k < numColors; k++) {
+        colorOffsets[k + 1] += colorOffsets[k];
+    }
+
+    colorNodes.resize(numNodes);
+
+    vector<unsigned int> next(colorOffsets.begin(), colorOffsets.end() - 1);
+
+    for (unsigned int s = 0; s < numNodes; s++) {
+        colorNodes[next[color[s]]++] = s;
+    }
+}
+
+void SegmentPlaneBP::setUnaries(
+        const vector<unsigned int>& _labelOffsets,
+        const vector<int>& _labels,
+        const vector<float>& _unaries) {
+    assert(_labelOffsets.size() == connectivity->size() + 1);
+    assert(_labels.size() == _unaries.size());
+
+    labelOffsets = _labelOffsets;
+    labels = _labels;
+    unaries = _unaries;
+
+    // Edge (s -> t) carries a message over the candidates of t
+    messageOffsets.assign(connectivity->numEdges() + 1, 0);
+
+    for (unsigned int s = 0; s < connectivity->size(); s++) {
+        connectivity->forEachEdge(s,
+                [&](segmentH_t t, int, unsigned int edgeI) {
+            messageOffsets[edgeI + 1] = labelOffsets[t + 1] - labelOffsets[t];
+        });
+    }
+
+    for (unsigned int e = 0; e < connectivity->numEdges(); e++) {
+        messageOffsets[e + 1] += messageOffsets[e];
+    }
+}
+
+void SegmentPlaneBP::computeBelief(
+        segmentH_t s,
+        float* belief) const {
+    unsigned int lBegin = labelOffsets[s];
+    unsigned int n = labelOffsets[s + 1] - lBegin;
+
+    copy(unaries.begin() + lBegin, unaries.begin() + lBegin + n, belief);
+
+    connectivity->forEachEdge(s,
+            [&](segmentH_t, int, unsigned int edgeI) {
+        const float* in = messages.data() + messageOffsets[reverseEdge[edgeI]];
+
+        #pragma omp simd
+        for (unsigned int k = 0; k < n; k++) {
+            belief[k] += in[k];
+        }
+    });
+}
+
+float SegmentPlaneBP::updateNode(
+        segmentH_t s,
+        vector<float>& belief,
+        vector<float>& outgoing) {
+    unsigned int lBegin = labelOffsets[s];
+    unsigned int n = labelOffsets[s + 1] - lBegin;
+
+    const int* sLabels = labels.data() + lBegin;
+
+    belief.resize(n);
+
+    computeBelief(s, belief.data());
+
+    float maxDelta = 0.0f;
+
+    connectivity->forEachEdge(s,
+            [&](segmentH_t t, int, unsigned int edgeI) {
+        const float* in = messages.data() + messageOffsets[reverseEdge[edgeI]];
+
+        float* out = messages.data() + messageOffsets[edgeI];
+
+        unsigned int tBegin = labelOffsets[t];
+        unsigned int m = labelOffsets[t + 1] - tBegin;
+
+        const int* tLabels = labels.data() + tBegin;
+
+        if (n == 0) {
+            // Nothing is known about s, so it sends no information
+            fill(out, out + m, 0.0f);
+            return;
+        }
+
+        // h(l) = belief(l) - m_{t->s}(l), excluding what t sent to s
+        float hMin = numeric_limits<float>::max();
+
+        for (unsigned int k = 0; k < n; k++) {
+            hMin = min(hMin, belief[k] - in[k]);
+        }
+
+        float jump = hMin + edgeWeights[edgeI];
+
+        outgoing.resize(m);
+
+        // Both label lists are sorted, so matching labels are found by
+        // merging them
+        unsigned int k = 0;
+
+        float outMin = numeric_limits<float>::max();
+
+        for (unsigned int j = 0; j < m; j++) {
+            while (k < n && sLabels[k] < tLabels[j]) {
+                k++;
+            }
+
+            float v = jump;
+
+            if (k < n && sLabels[k] == tLabels[j]) {
+                v = min(v, belief[k] - in[k]);
+            }
+
+            outgoing[j] = v;
+            outMin = min(outMin, v);
+        }
+
+        // Normalize so messages stay bounded, then damp
+        for (unsigned int j = 0; j < m; j++) {
+            float v = (1.0f - damping) * (outgoing[j] - outMin) +
+                damping * out[j];
+
+            maxDelta = max(maxDelta, fabs(v - out[j]));
+
+            out[j] = v;
+        }
+    });
+
+    return maxDelta;
+}
+
+int SegmentPlaneBP::solve(
+        vector<size_t>& labeling) {
+    unsigned int numNodes = connectivity->size();
+
+    messages.assign(messageOffsets.back(), 0.0f);
+
+    int iter = 0;
+
+    while (iter < maxIterations) {
+        iter++;
+
+        float maxDelta = 0.0f;
+
+        for (size_t k = 0; k + 1 < colorOffsets.size(); k++) {
+            int first = colorOffsets[k];
+            int last = colorOffsets[k + 1];
+
+            #pragma omp parallel reduction(max: maxDelta)
+            {
+                vector<float> belief, outgoing;
+
+                #pragma omp for schedule(dynamic, 32)
+                for (int i = first; i < last; i++) {
+                    maxDelta = max(maxDelta,
+                            updateNode(colorNodes[i], belief, outgoing));
+                }
+            }
+        }
+
+        if (maxDelta <= tolerance) {
+            break;
+        }
+    }
+
+    labeling.assign(numNodes, 0);
+
+    #pragma omp parallel
+    {
+        vector<float> belief;
+
+        #pragma omp for schedule(dynamic, 64)
+        for (int s = 0; s < (int) numNodes; s++) {
+            unsigned int lBegin = labelOffsets[s];
+            unsigned int n = labelOffsets[s + 1] - lBegin;
+
+            if (n == 0) {
+                continue;
+            }
+
+            belief.resize(n);
+
+            computeBelief(s, belief.data());
+
+            unsigned int best = min_element(belief.begin(), belief.end()) -
+                belief.begin();
+
+            labeling[s] = labels[lBegin + best];
+        }
+    }
+
+    return iter;
+}
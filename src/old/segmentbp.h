@@ -0,0 +1,124 @@
+#pragma once
+
+#include "common.h"
+
+#include "segment.h"
+
+/**
+ * Min-sum belief propagation over the region adjacency graph of a
+ * segmentation, with a sparse set of candidate planes per segment and a
+ * Potts smoothness term on each edge.
+ *
+ * Everything is stored in flat arrays indexed like the Connectivity:
+ *  - the candidate labels of segment s are labels[labelOffsets[s],
+ *    labelOffsets[s + 1]), sorted, with their costs in unaries
+ *  - the message along edge e = (s -> t) covers the candidate labels of t
+ *    and lives at messages[messageOffsets[e], messageOffsets[e + 1])
+ *
+ * A label which is not a candidate of the sending segment has infinite
+ * cost there, so the Potts message to it is the constant min + weight.
+ * Messages therefore cost O(|L_s| + |L_t|) each, independent of the total
+ * number of planes.
+ *
+ * Segments are greedily colored so that no two neighbors share a color.
+ * A sweep updates one color at a time, with the segments of a color in
+ * parallel: each writes only its own outgoing messages and reads only
+ * messages sent by other colors.  Messages are damped, and iteration
+ * stops once no message changes by more than the tolerance.
+ */
+class SegmentPlaneBP {
+    private:
+        const Connectivity* connectivity;
+
+        vector<unsigned int> labelOffsets;
+
+        vector<int> labels;
+
+        vector<float> unaries;
+
+        /**
+         * Potts penalty of each edge, indexed like the Connectivity.
+         */
+        vector<float> edgeWeights;
+
+        /**
+         * Index of edge (t -> s) for each edge (s -> t).
+         */
+        vector<unsigned int> reverseEdge;
+
+        vector<unsigned int> messageOffsets;
+
+        vector<float> messages;
+
+        /**
+         * Segments of color k are colorNodes[colorOffsets[k],
+         * colorOffsets[k + 1]).
+         */
+        vector<unsigned int> colorOffsets;
+
+        vector<segmentH_t> colorNodes;
+
+        int maxIterations;
+
+        float damping;
+
+        float tolerance;
+
+        void colorNodesGreedy();
+
+        /**
+         * Computes the belief of s over its candidates: its unary cost
+         * plus every incoming message.
+         */
+        void computeBelief(
+                segmentH_t s,
+                float* belief) const;
+
+        /**
+         * Sends all messages out of s and returns the largest change.
+         */
+        float updateNode(
+                segmentH_t s,
+                vector<float>& belief,
+                vector<float>& outgoing);
+
+    public:
+        SegmentPlaneBP(
+                const Connectivity* _connectivity);
+
+        /**
+         * \param damping   Weight of the previous message in each update
+         * \param tolerance Stop once no message changes by more than this
+         */
+        inline void setParameters(
+                int _maxIterations,
+                float _damping = 0.5f,
+                float _tolerance = 1e-3f) {
+            maxIterations = _maxIterations;
+            damping = _damping;
+            tolerance = _tolerance;
+        }
+
+        /**
+         * Sets the candidate labels of every segment, as described above.
+         * The labels of each segment must be sorted and distinct.
+         */
+        void setUnaries(
+                const vector<unsigned int>& _labelOffsets,
+                const vector<int>& _labels,
+                const vector<float>& _unaries);
+
+        inline void setEdgeWeight(
+                unsigned int edgeI,
+                float weight) {
+            edgeWeights[edgeI] = weight;
+        }
+
+        /**
+         * Runs BP and writes the minimum-belief label of each segment to
+         * labeling.  Segments without candidates get label 0.  Returns the
+         * number of sweeps performed.
+         */
+        int solve(
+                vector<size_t>& labeling);
+};
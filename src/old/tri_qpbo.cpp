@@ -1,5 +1,7 @@
 #include "tri_qpbo.h"
 
+#include "instrument/instrument.h"
+
 #include <random>
 
 #include "ceres/ceres.h"
@@ -751,14 +753,18 @@ size_t TriQPBO::mergeCandidateValues(
     
     // Perform QPBO...
 
-    printf("Creating QPBO...\n");
-    gModelData->qpbo = unique_ptr<GModelData::QPBO>(
-            new GModelData::QPBO(gModelData->model));
-    printf("Done\n");
+    {
+        INSTRUMENT_SCOPE("TriQPBO::createQPBO");
+
+        gModelData->qpbo = unique_ptr<GModelData::QPBO>(
+                new GModelData::QPBO(gModelData->model));
+    }
+
+    {
+        INSTRUMENT_SCOPE("TriQPBO::infer");
 
-    printf("Performing inference...\n");
-    gModelData->qpbo->infer();
-    printf("Done\n");
+        gModelData->qpbo->infer();
+    }
 
     vector<bool> optimalVariables;
     vector<size_t> labels;
@@ -782,10 +788,9 @@ size_t TriQPBO::mergeCandidateValues(
         }
     }
 
-    float error = gModelData->model.evaluate(labels);
-
-    printf("RESIDUAL = %f\n", error);
-    printf("Num optimal = %d of %d\n", numOptimal, triangles.size());
+    INSTRUMENT_COUNT(InstrumentCounter::QPBO_MOVES, 1);
+    INSTRUMENT_COUNT(InstrumentCounter::QPBO_CHANGES, numChanged);
+    INSTRUMENT_COUNT(InstrumentCounter::QPBO_LABELED, numOptimal);
 
     return numChanged;
 }
@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#include "instrument/instrument.h"
+
 /**
  * Implementation of generalized PatchMatch.
  *
@@ -46,7 +48,8 @@ inline void patchMatch(
     assert(totCost.spectrum() == 1);
     assert(fieldSorted.spectrum() == 1);
 
-#pragma omp parallel
+    // Propagation reads the values just written by the previous pixel, so
+    // the sweep is sequential
     {
         int xStart = 0;
         int yStart = 0;
@@ -57,22 +60,11 @@ inline void patchMatch(
             inc = -1 * increment;
         }
 
-        // FIXME this probably fails if inc isn't of magnitude 1
-        // FIXME FIXME FIXME FIXME
-        // FIXME FIXME FIXME FIXME
-        // FIXME FIXME FIXME FIXME
-        // FIXME FIXME FIXME FIXME
-        int numThreads = 0;// omp_get_num_threads();
-        int stride = (field.height() + numThreads - 1) / numThreads;
-        int yLimit = 0;// yStart + inc * (omp_get_thread_num() + 1) * stride;
-        yStart += inc * 0;//omp_get_thread_num() * stride;
-
-#pragma omp critical
-        {
-        // cout << "Thread #" << omp_get_thread_num() << " yStart = " << yStart
-            // << " yLimit = " << yLimit << " stride = " << stride << endl;
-        }
-        for (int y = yStart; y >= 0 && y < field.height() && y != yLimit; y += inc) {
+        // Counted locally and added to the shared counters once per sweep
+        uint64_t numEvaluated = 0;
+        uint64_t numAccepted = 0;
+
+        for (int y = yStart; y >= 0 && y < field.height(); y += inc) {
             for (int x = xStart; x >= 0 && x < field.width(); x += inc) {
                 // Space to store the candidate field value
                 float cVal[valSize];
@@ -86,6 +78,8 @@ inline void patchMatch(
 
                     float totalCost = unaryCost(x, y, cVal);
 
+                    numEvaluated++;
+
                     // Find the index of the first particle with a greater cost
                     // in the sorted list.
                     int index = -1;
@@ -99,7 +93,7 @@ inline void patchMatch(
                     // If this new particle is good, insert it into our list of
                     // optimal particles.
                     if (index != -1 ) {
-                        // numSearchWinners[pNum]++;
+                        numAccepted++;
 
                         // The "raw index" is the index into field, totCost, ...
                         // which will store this particle.
@@ -128,9 +122,142 @@ inline void patchMatch(
                 }
             }
         }
+
+        INSTRUMENT_COUNT(InstrumentCounter::CANDIDATES_EVALUATED, numEvaluated);
+        INSTRUMENT_COUNT(InstrumentCounter::CANDIDATES_ACCEPTED, numAccepted);
     }
 }
 
+/**
+ * Creates the unary cost of translational disparities: a bilateral-weighted
+ * SSD over a wndSize square window.  Windows which leave either image cost
+ * infinity.
+ */
+inline function<float(int, int, float[])> translationalPatchDist(
+        const CImg<float>& lab1,
+        const CImg<float>& lab2,
+        const CImg<float>& grad1,
+        const CImg<float>& grad2,
+        int wndSize,
+        float colorSigma = 10.0f,
+        float maxDist = 10.0f,
+        float maxGradDist = 2.0f) {
+    auto dist = [=] (int sx, int sy, float* value) -> float {
+            int dx = sx + (int) value[0];
+            int dy = sy;
+
+            if ( 
+                    sx - wndSize / 2 < 0 || sx + wndSize / 2 >= lab1.width() ||
+                    sy - wndSize / 2 < 0 || sy + wndSize / 2 >= lab1.height()||
+                    dx - wndSize / 2 < 0 || dx + wndSize / 2 >= lab2.width() ||
+                    dy - wndSize / 2 < 0 || dy + wndSize / 2 >= lab2.height()) {
+                return numeric_limits<float>::infinity();
+            }
+
+            int minX = -wndSize / 2;
+            int maxX =  wndSize / 2;
+            int minY = -wndSize / 2;
+            int maxY =  wndSize / 2;
+
+            float totalWeight = 0.0f;
+            float ssd = 0.0f;
+            for (int y = minY; y <= maxY; y++) {
+                for (int x = minX; x <= maxX; x++) {
+                    // Weight pixels with a bilateral-esque filter
+                    float lab1Diff = 0.0f;
+
+                    cimg_forZC(lab1, z, c) {
+                        float lDiff = lab1(x + sx, y + sy, z, c) -
+                            lab1(sx, sy, z, c);
+                        lab1Diff += abs(lDiff);
+                    }
+
+                    float weight = exp(-lab1Diff / colorSigma);
+
+                    cimg_forZC(lab1, z, c) {
+
+                        // diff = min(diff, maxDist);
+
+                        // float gradDiff = abs(grad1(x + sx, y + sy, z, c) -
+                            // grad2(x + dx, y + dy, z, c));
+
+                        // gradDiff = min(gradDiff, maxGradDist);
+
+                        float diff = lab1(x + sx, y + sy, z, c) -
+                            lab2(x + dx, y + dy, z, c);
+
+                        totalWeight += weight;
+
+                        ssd += diff * diff * weight;// (diff * 0.1f + gradDiff * 0.9f) * weight;
+                    }
+                }
+            }
+
+            return ssd / totalWeight;
+        };
+    return dist;
+}
+
+/**
+ * Creates the unary cost of affine disparities (value[0] + value[1] * x +
+ * value[2] * y): a bilateral-weighted, truncated SAD over a wndSize square
+ * window.
+ */
+inline function<float(int, int, float[])> affinePatchDist(
+        const CImg<float>& lab1,
+        const CImg<float>& lab2,
+        int wndSize,
+        float colorSigma = 10.0f,
+        float maxDist = 10.0f) {
+    auto dist = [&lab1, &lab2, wndSize, colorSigma, maxDist]
+        (int sx, int sy, float* value) -> float {
+            float ssd = 0.0f;
+            float totalWeight = 0.0f;
+
+            for (int y = -wndSize / 2; y <= wndSize / 2; y++) {
+                for (int x = -wndSize / 2; x <= wndSize / 2; x++) {
+                    int srcX = x + sx;
+                    int srcY = y + sy;
+
+                    if (srcX >= 0 && srcX < lab1.width() &&
+                            srcY >= 0 && srcY < lab1.height()) {
+
+                        float dstX = srcX +
+                            value[0] + value[1] * srcX + value[2] * srcY;
+                        float dstY = srcY;
+
+                        float lab1Diff = 0.0f;
+                        cimg_forZC(lab1, z, c) {
+                            float lDiff = lab1(srcX, srcY, z, c) -
+                                lab1(sx, sy, z, c);
+                            lab1Diff += abs(lDiff);
+                        }
+                        float weight = exp(-(lab1Diff) / colorSigma);
+
+                        if (dstX >= 0 && dstX < lab2.width() &&
+                                dstY >= 0 && dstY < lab2.height()) {
+                            cimg_forZC(lab1, z, c) {
+                                float diff = lab1(srcX, srcY, z, c) -
+                                    lab2.linear_atXYZC(dstX, dstY, z, c);
+
+                                diff = min(diff, maxDist);
+
+                                ssd += abs(diff) * weight;
+                                totalWeight += weight;
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (totalWeight == 0.0f) {
+                return std::numeric_limits<float>::max();
+            }
+
+            return ssd / totalWeight;
+        };
+    return dist;
+}
 
 void patchMatchTranslationalCorrespondence(
         const CImg<float>& lab1,
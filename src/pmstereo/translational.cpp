@@ -2,71 +2,6 @@
 
 #include "pmstereo.h"
 
-inline function<float(int, int, float[])> translationalPatchDist(
-        const CImg<float>& lab1,
-        const CImg<float>& lab2,
-        const CImg<float>& grad1,
-        const CImg<float>& grad2,
-        int wndSize,
-        float colorSigma = 10.0f,
-        float maxDist = 10.0f,
-        float maxGradDist = 2.0f) {
-    auto dist = [=] (int sx, int sy, float* value) -> float {
-            int dx = sx + (int) value[0];
-            int dy = sy;
-
-            if ( 
-                    sx - wndSize / 2 < 0 || sx + wndSize / 2 >= lab1.width() ||
-                    sy - wndSize / 2 < 0 || sy + wndSize / 2 >= lab1.height()||
-                    dx - wndSize / 2 < 0 || dx + wndSize / 2 >= lab2.width() ||
-                    dy - wndSize / 2 < 0 || dy + wndSize / 2 >= lab2.height()) {
-                return numeric_limits<float>::infinity();
-            }
-
-            int minX = -wndSize / 2;
-            int maxX =  wndSize / 2;
-            int minY = -wndSize / 2;
-            int maxY =  wndSize / 2;
-
-            float totalWeight = 0.0f;
-            float ssd = 0.0f;
-            for (int y = minY; y <= maxY; y++) {
-                for (int x = minX; x <= maxX; x++) {
-                    // Weight pixels with a bilateral-esque filter
-                    float lab1Diff = 0.0f;
-
-                    cimg_forZC(lab1, z, c) {
-                        float lDiff = lab1(x + sx, y + sy, z, c) -
-                            lab1(sx, sy, z, c);
-                        lab1Diff += abs(lDiff);
-                    }
-
-                    float weight = exp(-lab1Diff / colorSigma);
-
-                    cimg_forZC(lab1, z, c) {
-
-                        // diff = min(diff, maxDist);
-
-                        // float gradDiff = abs(grad1(x + sx, y + sy, z, c) -
-                            // grad2(x + dx, y + dy, z, c));
-
-                        // gradDiff = min(gradDiff, maxGradDist);
-
-                        float diff = lab1(x + sx, y + sy, z, c) -
-                            lab2(x + dx, y + dy, z, c);
-
-                        totalWeight += weight;
-
-                        ssd += diff * diff * weight;// (diff * 0.1f + gradDiff * 0.9f) * weight;
-                    }
-                }
-            }
-
-            return ssd / totalWeight;
-        };
-    return dist;
-}
-
 /**
  * Creates a function for generating candidate translational disparities.
  */
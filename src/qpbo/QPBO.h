@@ -0,0 +1,646 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+/**
+ * Quadratic pseudo-boolean optimization (QPBO), after Kolmogorov and Rother,
+ * "Minimizing non-submodular functions with graph cuts - a review" (PAMI
+ * 2007).
+ *
+ * Minimizes energies with unary and pairwise terms over binary variables,
+ * whether or not the pairwise terms are submodular.  Every variable p gets
+ * a mirror node standing for (1 - x_p), each term is added once to each
+ * copy of the graph, and a maximum flow is computed over the doubled graph.
+ * Variables whose two nodes fall on opposite sides of the cut are labeled;
+ * the others are left unlabeled (-1).  Any labeled subset is part of an
+ * optimal solution, and fixing it can never increase the energy of any
+ * other labeling.
+ *
+ * This implements the subset of the interface of Kolmogorov's library
+ * used by LocalExpansion (Reset, AddNode, AddUnaryTerm, AddPairwiseTerm,
+ * Solve, ComputeWeakPersistencies and GetLabel), so that the solver is
+ * header-only and needs no external build.  Storage is kept across
+ * Reset(), so a graph reused for many small problems stops allocating
+ * once it has reached its working size.
+ */
+template<typename REAL>
+class QPBO {
+    public:
+        typedef int NodeId;
+
+        typedef int EdgeId;
+
+    private:
+        /**
+         * Capacities and flows are accumulated in double precision even for
+         * float energies, so that max-flow saturation tests stay reliable.
+         */
+        typedef double cap_t;
+
+        struct Term {
+            NodeId i, j;
+
+            /**
+             * Cost of (x_i = 0, x_j = 1) once the rest of the term has been
+             * moved into the unary terms.
+             */
+            cap_t lambda;
+        };
+
+        int numNodes;
+
+        /**
+         * Cost of labels 0 and 1 of each variable.
+         */
+        std::vector<cap_t> unary0, unary1;
+
+        std::vector<Term> terms;
+
+        /**
+         * Residual graph.  Vertices [0, n) are the variables, [n, 2n) their
+         * mirrors, then the source and the sink.  Arcs are stored in groups
+         * of four: an arc, its reverse, its mirror and the mirror's
+         * reverse, so that arc e is paired with e ^ 1 and mirrored by e ^ 2.
+         */
+        std::vector<int> arcHead;
+
+        std::vector<int> arcNext;
+
+        std::vector<cap_t> arcCap;
+
+        std::vector<cap_t> arcOrigCap;
+
+        std::vector<int> firstArc;
+
+        std::vector<int> level;
+
+        std::vector<int> currentArc;
+
+        std::vector<int> queue;
+
+        std::vector<int> path;
+
+        /**
+         * Residual capacities at or below this are treated as saturated.
+         */
+        cap_t epsilon;
+
+        std::vector<char> reachable;
+
+        std::vector<int> labels;
+
+        /**
+         * Scratch space of ComputeWeakPersistencies(), kept as members so
+         * that repeated calls do not allocate.
+         */
+        std::vector<int> component;
+
+        std::vector<int> tarjanIndex;
+
+        std::vector<int> lowLink;
+
+        std::vector<char> onStack;
+
+        std::vector<int> tarjanStack;
+
+        std::vector<std::pair<int, int>> callStack;
+
+        std::vector<int> componentOrder;
+
+        std::vector<int> componentStart;
+
+        std::vector<char> componentInSource;
+
+        std::vector<char> inSource;
+
+        inline int source() const {
+            return 2 * numNodes;
+        }
+
+        inline int sink() const {
+            return 2 * numNodes + 1;
+        }
+
+        inline int mirror(
+                int v) const {
+            if (v < numNodes) {
+                return v + numNodes;
+            } else if (v < 2 * numNodes) {
+                return v - numNodes;
+            } else {
+                return (v == source()) ? sink() : source();
+            }
+        }
+
+        inline void addHalfArc(
+                int from,
+                int to,
+                cap_t cap) {
+            int e = arcHead.size();
+
+            arcHead.push_back(to);
+            arcCap.push_back(cap);
+            arcOrigCap.push_back(cap);
+            arcNext.push_back(firstArc[from]);
+
+            firstArc[from] = e;
+        }
+
+        /**
+         * Adds from -> to and its mirror, mirror(to) -> mirror(from), both
+         * with capacity cap.
+         */
+        void addArcPair(
+                int from,
+                int to,
+                cap_t cap) {
+            if (cap <= 0) {
+                return;
+            }
+
+            addHalfArc(from, to, cap);
+            addHalfArc(to, from, 0);
+            addHalfArc(mirror(to), mirror(from), cap);
+            addHalfArc(mirror(from), mirror(to), 0);
+        }
+
+        void buildGraph() {
+            int numVertices = 2 * numNodes + 2;
+
+            arcHead.clear();
+            arcNext.clear();
+            arcCap.clear();
+            arcOrigCap.clear();
+
+            firstArc.assign(numVertices, -1);
+
+            cap_t maxCap = 0;
+
+            for (NodeId p = 0; p < numNodes; p++) {
+                cap_t m = std::min(unary0[p], unary1[p]);
+
+                cap_t e0 = unary0[p] - m;
+                cap_t e1 = unary1[p] - m;
+
+                // p on the source side means x_p = 0
+                addArcPair(p, sink(), e0);
+                addArcPair(source(), p, e1);
+
+                maxCap = std::max(maxCap, std::max(e0, e1));
+            }
+
+            for (const Term& term : terms) {
+                if (term.lambda >= 0) {
+                    // Cut when x_i = 0 and x_j = 1
+                    addArcPair(term.i, term.j, term.lambda);
+                } else {
+                    // Cut when x_i = 0 and x_j = 0, with cost -lambda
+                    addArcPair(term.i, mirror(term.j), -term.lambda);
+                }
+
+                maxCap = std::max(maxCap, std::fabs(term.lambda));
+            }
+
+            epsilon = maxCap * 1e-12;
+        }
+
+        bool buildLevels() {
+            level.assign(firstArc.size(), -1);
+
+            queue.clear();
+            queue.push_back(source());
+
+            level[source()] = 0;
+
+            for (size_t head = 0; head < queue.size(); head++) {
+                int u = queue[head];
+
+                for (int e = firstArc[u]; e >= 0; e = arcNext[e]) {
+                    int v = arcHead[e];
+
+                    if (level[v] < 0 && arcCap[e] > epsilon) {
+                        level[v] = level[u] + 1;
+
+                        queue.push_back(v);
+                    }
+                }
+            }
+
+            return level[sink()] >= 0;
+        }
+
+        /**
+         * Saturates every shortest augmenting path (Dinic's algorithm).
+         */
+        void augmentLevels() {
+            currentArc = firstArc;
+
+            path.clear();
+
+            int u = source();
+
+            while (true) {
+                if (u == sink()) {
+                    cap_t bottleneck = std::numeric_limits<cap_t>::max();
+
+                    for (int e : path) {
+                        bottleneck = std::min(bottleneck, arcCap[e]);
+                    }
+
+                    size_t firstSaturated = path.size();
+
+                    for (size_t k = 0; k < path.size(); k++) {
+                        arcCap[path[k]] -= bottleneck;
+                        arcCap[path[k] ^ 1] += bottleneck;
+
+                        if (arcCap[path[k]] <= epsilon &&
+                                firstSaturated == path.size()) {
+                            firstSaturated = k;
+                        }
+                    }
+
+                    // Resume from the tail of the first saturated arc
+                    u = arcHead[path[firstSaturated] ^ 1];
+
+                    path.resize(firstSaturated);
+
+                    continue;
+                }
+
+                int& e = currentArc[u];
+
+                while (e >= 0 && (arcCap[e] <= epsilon ||
+                            level[arcHead[e]] != level[u] + 1)) {
+                    e = arcNext[e];
+                }
+
+                if (e >= 0) {
+                    path.push_back(e);
+
+                    u = arcHead[e];
+                } else {
+                    // Dead end: nothing more goes through u in this phase
+                    level[u] = -1;
+
+                    if (path.empty()) {
+                        break;
+                    }
+
+                    int back = path.back();
+
+                    path.pop_back();
+
+                    u = arcHead[back ^ 1];
+
+                    currentArc[u] = arcNext[currentArc[u]];
+                }
+            }
+        }
+
+        /**
+         * Replaces the flow by the average of itself and its mirror, which
+         * is also a maximum flow.  The residual graph then contains an arc
+         * exactly when it contains the mirrored arc.
+         */
+        void symmetrizeFlow() {
+            for (size_t e = 0; e < arcHead.size(); e += 4) {
+                cap_t flow = ((arcOrigCap[e] - arcCap[e]) +
+                        (arcOrigCap[e + 2] - arcCap[e + 2])) / 2;
+
+                arcCap[e] = arcOrigCap[e] - flow;
+                arcCap[e + 1] = flow;
+                arcCap[e + 2] = arcOrigCap[e + 2] - flow;
+                arcCap[e + 3] = flow;
+            }
+        }
+
+        void markReachable() {
+            reachable.assign(firstArc.size(), 0);
+
+            queue.clear();
+            queue.push_back(source());
+
+            reachable[source()] = 1;
+
+            for (size_t head = 0; head < queue.size(); head++) {
+                int u = queue[head];
+
+                for (int e = firstArc[u]; e >= 0; e = arcNext[e]) {
+                    int v = arcHead[e];
+
+                    if (!reachable[v] && arcCap[e] > epsilon) {
+                        reachable[v] = 1;
+
+                        queue.push_back(v);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Labels every variable whose node and mirror lie on opposite
+         * sides of the cut given by inSource.
+         */
+        void labelFromCut(
+                const std::vector<char>& inSource) {
+            for (NodeId p = 0; p < numNodes; p++) {
+                if (inSource[p] && !inSource[mirror(p)]) {
+                    labels[p] = 0;
+                } else if (!inSource[p] && inSource[mirror(p)]) {
+                    labels[p] = 1;
+                } else {
+                    labels[p] = -1;
+                }
+            }
+        }
+
+    public:
+        /**
+         * nodeNumMax and edgeNumMax only reserve storage; both grow as
+         * needed.  errorFunction is accepted for compatibility and unused.
+         */
+        QPBO(
+                int nodeNumMax,
+                int edgeNumMax,
+                void (*errorFunction)(const char*) = nullptr) :
+            numNodes(0),
+            epsilon(0) {
+            unary0.reserve(nodeNumMax);
+            unary1.reserve(nodeNumMax);
+            labels.reserve(nodeNumMax);
+
+            terms.reserve(edgeNumMax);
+
+            // Each unary and pairwise term adds at most one group of four
+            // arcs
+            size_t numArcsMax = 4 * ((size_t) 2 * nodeNumMax + edgeNumMax);
+
+            arcHead.reserve(numArcsMax);
+            arcNext.reserve(numArcsMax);
+            arcCap.reserve(numArcsMax);
+            arcOrigCap.reserve(numArcsMax);
+
+            size_t numVerticesMax = 2 * (size_t) nodeNumMax + 2;
+
+            for (std::vector<int>* v : {&firstArc, &level, &currentArc,
+                    &queue, &path, &component, &tarjanIndex, &lowLink,
+                    &tarjanStack, &componentOrder, &componentStart}) {
+                v->reserve(numVerticesMax + 1);
+            }
+
+            reachable.reserve(numVerticesMax);
+            onStack.reserve(numVerticesMax);
+            componentInSource.reserve(numVerticesMax);
+            inSource.reserve(numVerticesMax);
+            callStack.reserve(numVerticesMax);
+        }
+
+        /**
+         * Removes all nodes and terms, keeping the allocated storage.
+         */
+        void Reset() {
+            numNodes = 0;
+
+            unary0.clear();
+            unary1.clear();
+            terms.clear();
+            labels.clear();
+        }
+
+        /**
+         * Adds num variables and returns the id of the first.
+         */
+        NodeId AddNode(
+                int num = 1) {
+            NodeId first = numNodes;
+
+            numNodes += num;
+
+            unary0.resize(numNodes, 0);
+            unary1.resize(numNodes, 0);
+            labels.resize(numNodes, -1);
+
+            return first;
+        }
+
+        /**
+         * Adds E0 to the cost of x_i = 0 and E1 to the cost of x_i = 1.
+         */
+        void AddUnaryTerm(
+                NodeId i,
+                REAL E0,
+                REAL E1) {
+            unary0[i] += E0;
+            unary1[i] += E1;
+        }
+
+        /**
+         * Adds the term E(x_i, x_j), with E00 = E(0, 0), E01 = E(0, 1) and
+         * so on.  i and j must differ.
+         */
+        EdgeId AddPairwiseTerm(
+                NodeId i,
+                NodeId j,
+                REAL E00,
+                REAL E01,
+                REAL E10,
+                REAL E11) {
+            // E = E00 + (E10 - E00) x_i + (E11 - E10) x_j
+            //     + lambda [x_i = 0, x_j = 1]
+            unary1[i] += (cap_t) E10 - E00;
+            unary1[j] += (cap_t) E11 - E10;
+
+            Term term;
+
+            term.i = i;
+            term.j = j;
+            term.lambda = (cap_t) E01 + E10 - E00 - E11;
+
+            if (term.lambda < 0) {
+                // lambda [x_i = 0, x_j = 1]
+                //     = lambda [x_i = 0] - lambda [x_i = 0, x_j = 0]
+                unary0[i] += term.lambda;
+            }
+
+            terms.push_back(term);
+
+            return terms.size() - 1;
+        }
+
+        /**
+         * Computes the maximum flow and labels the variables fixed by
+         * every minimum cut (strong persistencies).
+         */
+        void Solve() {
+            buildGraph();
+
+            while (buildLevels()) {
+                augmentLevels();
+            }
+
+            symmetrizeFlow();
+
+            markReachable();
+
+            labelFromCut(reachable);
+        }
+
+        /**
+         * After Solve(), labels more variables by choosing, among the
+         * minimum cuts, one which separates as many node/mirror pairs as
+         * possible (weak persistencies).
+         *
+         * Strongly connected components of the residual graph are visited
+         * in reverse topological order.  A component joins the source
+         * side when all of its successors have, and its mirror has not.
+         */
+        void ComputeWeakPersistencies() {
+            int numVertices = firstArc.size();
+
+            // Iterative Tarjan
+            component.assign(numVertices, -1);
+            tarjanIndex.assign(numVertices, -1);
+            lowLink.assign(numVertices, 0);
+            onStack.assign(numVertices, 0);
+
+            tarjanStack.clear();
+            callStack.clear();
+
+            componentOrder.clear();
+            componentStart.clear();
+
+            int nextIndex = 0;
+
+            for (int root = 0; root < numVertices; root++) {
+                if (tarjanIndex[root] >= 0) {
+                    continue;
+                }
+
+                callStack.push_back(std::make_pair(root, firstArc[root]));
+
+                tarjanIndex[root] = lowLink[root] = nextIndex++;
+
+                tarjanStack.push_back(root);
+                onStack[root] = 1;
+
+                while (!callStack.empty()) {
+                    int u = callStack.back().first;
+                    int& e = callStack.back().second;
+
+                    if (e >= 0) {
+                        int v = arcHead[e];
+
+                        bool residual = arcCap[e] > epsilon;
+
+                        e = arcNext[e];
+
+                        if (!residual) {
+                            continue;
+                        }
+
+                        if (tarjanIndex[v] < 0) {
+                            tarjanIndex[v] = lowLink[v] = nextIndex++;
+
+                            tarjanStack.push_back(v);
+                            onStack[v] = 1;
+
+                            callStack.push_back(std::make_pair(v,
+                                        firstArc[v]));
+                        } else if (onStack[v]) {
+                            lowLink[u] = std::min(lowLink[u], tarjanIndex[v]);
+                        }
+
+                        continue;
+                    }
+
+                    if (lowLink[u] == tarjanIndex[u]) {
+                        int c = componentStart.size();
+
+                        componentStart.push_back(componentOrder.size());
+
+                        int w;
+
+                        do {
+                            w = tarjanStack.back();
+                            tarjanStack.pop_back();
+
+                            onStack[w] = 0;
+                            component[w] = c;
+
+                            componentOrder.push_back(w);
+                        } while (w != u);
+                    }
+
+                    callStack.pop_back();
+
+                    if (!callStack.empty()) {
+                        int parent = callStack.back().first;
+
+                        lowLink[parent] = std::min(lowLink[parent],
+                                lowLink[u]);
+                    }
+                }
+            }
+
+            int numComponents = componentStart.size();
+
+            componentStart.push_back(componentOrder.size());
+
+            // Components are numbered in reverse topological order
+            componentInSource.assign(numComponents, 0);
+
+            for (int c = 0; c < numComponents; c++) {
+                int first = componentOrder[componentStart[c]];
+
+                if (reachable[first]) {
+                    componentInSource[c] = 1;
+                    continue;
+                }
+
+                int mirrorC = component[mirror(first)];
+
+                if (mirrorC == c || componentInSource[mirrorC] ||
+                        component[sink()] == c) {
+                    continue;
+                }
+
+                bool closed = true;
+
+                for (int k = componentStart[c];
+                        closed && k < componentStart[c + 1]; k++) {
+                    int u = componentOrder[k];
+
+                    for (int e = firstArc[u]; closed && e >= 0;
+                            e = arcNext[e]) {
+                        if (arcCap[e] > epsilon) {
+                            int succ = component[arcHead[e]];
+
+                            closed = succ == c || componentInSource[succ];
+                        }
+                    }
+                }
+
+                componentInSource[c] = closed;
+            }
+
+            inSource.resize(numVertices);
+
+            for (int v = 0; v < numVertices; v++) {
+                inSource[v] = componentInSource[component[v]];
+            }
+
+            labelFromCut(inSource);
+        }
+
+        /**
+         * Returns 0 or 1, or -1 if the variable is unlabeled.
+         */
+        int GetLabel(
+                NodeId i) const {
+            return labels[i];
+        }
+};
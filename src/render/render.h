@@ -0,0 +1,114 @@
+#pragma once
+
+#include "common.h"
+
+/**
+ * Renders intermediate views of a rectified stereo pair by forward-warping
+ * both images with dense, per-pixel disparity.  No segmentation or plane
+ * fitting is required, so any dense disparity (PatchMatch, CVStereo,
+ * DPStereo...) can be rendered directly.
+ *
+ * The view at t = 0 is the left image and the view at t = 1 is the right
+ * image.  Disparities are positive and follow the usual convention: the
+ * left pixel x matches the right pixel x - dispLeft(x), and the right pixel
+ * x matches the left pixel x + dispRight(x).  Hence a left pixel moves to
+ * x - t * dispLeft(x) and a right pixel moves to x + (1 - t) * dispRight(x).
+ * Larger disparities are nearer, and win the per-pixel z-test.  Pixels
+ * without a match (FLT_MAX, as produced by StereoMatcher, or any
+ * non-finite value) are not warped, and are left to hole filling.
+ *
+ * Rows are warped independently, so work is split over bands of rows.
+ *
+ * T is the pixel type of the input images.
+ */
+template<class T>
+class DenseWarpRenderer {
+    private:
+        /**
+         * Per-thread buffers holding one warped row of a view.
+         */
+        struct RowBuffer {
+            vector<float> color;
+
+            vector<float> z;
+        };
+
+        const CImg<T>* left;
+
+        const CImg<T>* right;
+
+        const CImg<float>* dispLeft;
+
+        const CImg<float>* dispRight;
+
+        float surfaceThresh;
+
+        float blendThresh;
+
+        bool holeFilling;
+
+        /**
+         * Splats row y of img into buf, moving pixel x to
+         * x + scale * disp(x, y).
+         */
+        void splatRow(
+                const CImg<T>& img,
+                const CImg<float>& disp,
+                int y,
+                float scale,
+                RowBuffer& buf) const;
+
+        /**
+         * Fills each horizontal hole in row y of result with the color of
+         * whichever neighbor across the hole is farther away, since holes
+         * are disocclusions of the background.  zOut holds the disparity
+         * of every covered pixel and -inf at holes.
+         *
+         * Returns false if the whole row is a hole.
+         */
+        bool fillRowHoles(
+                int y,
+                float* zOut,
+                CImg<float>& result) const;
+
+    public:
+        /**
+         * dispRight may be empty, in which case only the left view is
+         * warped.
+         */
+        DenseWarpRenderer(
+                const CImg<T>* _left,
+                const CImg<T>* _right,
+                const CImg<float>* _dispLeft,
+                const CImg<float>* _dispRight);
+
+        /**
+         * Neighboring source pixels whose disparities differ by less than
+         * this are considered part of one surface, and the gap between
+         * their warped positions is filled by interpolation.  Larger jumps
+         * are treated as depth edges and leave a hole.
+         */
+        inline void setSurfaceThresh(
+                float thresh) {
+            surfaceThresh = thresh;
+        }
+
+        /**
+         * Where both views cover a pixel with disparities that differ by
+         * less than this, their colors are blended according to t.
+         * Otherwise the nearer one is kept.
+         */
+        inline void setBlendThresh(
+                float thresh) {
+            blendThresh = thresh;
+        }
+
+        inline void setHoleFilling(
+                bool enable) {
+            holeFilling = enable;
+        }
+
+        void render(
+                float t,
+                CImg<float>& result) const;
+};
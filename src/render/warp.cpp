@@ -0,0 +1,270 @@
+#include "render.h"
+
+#include <algorithm>
+
+/**
+ * Marks pixels which no source pixel has been warped to.
+ */
+static const float NO_DEPTH = -numeric_limits<float>::max();
+
+/**
+ * Matchers mark pixels without a match with FLT_MAX.  The comparison is
+ * also false for infinities and NaN.
+ */
+static inline bool isValidDisparity(
+        float d) {
+    return fabs(d) < numeric_limits<float>::max();
+}
+
+template<class T>
+DenseWarpRenderer<T>::DenseWarpRenderer(
+        const CImg<T>* _left,
+        const CImg<T>* _right,
+        const CImg<float>* _dispLeft,
+        const CImg<float>* _dispRight) :
+    left(_left),
+    right(_right),
+    dispLeft(_dispLeft),
+    dispRight(_dispRight),
+    surfaceThresh(1.5f),
+    blendThresh(1.0f),
+    holeFilling(true) {
+    assert(left->is_sameXYZC(*right));
+    assert(left->is_sameXY(*dispLeft));
+    assert(dispRight->is_empty() || right->is_sameXY(*dispRight));
+}
+
+template<class T>
+void DenseWarpRenderer<T>::splatRow(
+        const CImg<T>& img,
+        const CImg<float>& disp,
+        int y,
+        float scale,
+        RowBuffer& buf) const {
+    int width = img.width();
+    int spectrum = img.spectrum();
+
+    fill(buf.z.begin(), buf.z.end(), NO_DEPTH);
+
+    const float* d = disp.data(0, y);
+
+    for (int x = 0; x < width; x++) {
+        if (!isValidDisparity(d[x])) {
+            continue;
+        }
+
+        // Source pixel x covers [x - 0.5, x + 0.5).  If pixel x + 1 lies on
+        // the same surface, the span between their warped centers is
+        // interpolated; otherwise x is splatted at unit width.  Spans never
+        // join across a pixel without a disparity.
+        bool joined = x + 1 < width && isValidDisparity(d[x + 1]) &&
+            fabs(d[x + 1] - d[x]) < surfaceThresh;
+
+        float p0 = x + scale * d[x];
+        float p1 = joined ? x + 1 + scale * d[x + 1] : p0 + 1.0f;
+
+        float lo = fmin(p0, p1);
+        float hi = fmax(p0, p1);
+
+        if (!joined) {
+            lo -= 0.5f;
+            hi -= 0.5f;
+        }
+
+        // Clamp before converting, so that far-off spans cannot overflow
+        int dxStart = (int) ceil(fmax(lo, 0.0f));
+        int dxEnd = (int) ceil(fmin(hi, (float) width));
+
+        float invSpan = (p1 != p0) ? 1.0f / (p1 - p0) : 0.0f;
+
+        int x1 = joined ? x + 1 : x;
+
+        for (int dx = dxStart; dx < dxEnd; dx++) {
+            float u = joined ? fmin(fmax((dx - p0) * invSpan, 0.0f), 1.0f) : 0.0f;
+
+            float z = d[x] + (d[x1] - d[x]) * u;
+
+            if (z > buf.z[dx]) {
+                buf.z[dx] = z;
+
+                for (int c = 0; c < spectrum; c++) {
+                    const T* src = img.data(0, y, 0, c);
+
+                    buf.color[c * width + dx] = src[x] + (src[x1] - (float) src[x]) * u;
+                }
+            }
+        }
+    }
+}
+
+template<class T>
+bool DenseWarpRenderer<T>::fillRowHoles(
+        int y,
+        float* zOut,
+        CImg<float>& result) const {
+    int width = result.width();
+
+    int x = 0;
+
+    while (x < width) {
+        if (zOut[x] != NO_DEPTH) {
+            x++;
+            continue;
+        }
+
+        int holeStart = x;
+
+        while (x < width && zOut[x] == NO_DEPTH) {
+            x++;
+        }
+
+        int before = holeStart - 1;
+        int after = x;
+
+        int source;
+
+        if (before < 0 && after >= width) {
+            return false;
+        } else if (before < 0) {
+            source = after;
+        } else if (after >= width) {
+            source = before;
+        } else {
+            source = (zOut[before] < zOut[after]) ? before : after;
+        }
+
+        cimg_forC(result, c) {
+            float* row = result.data(0, y, 0, c);
+
+            fill(row + holeStart, row + x, row[source]);
+        }
+    }
+
+    return true;
+}
+
+template<class T>
+void DenseWarpRenderer<T>::render(
+        float t,
+        CImg<float>& result) const {
+    int width = left->width();
+    int height = left->height();
+    int spectrum = left->spectrum();
+
+    bool useRight = !dispRight->is_empty();
+
+    result.resize(width, height, 1, spectrum, -1);
+
+    // Rows left entirely empty, to be filled vertically afterwards
+    vector<unsigned char> emptyRow(height, 0);
+
+    #pragma omp parallel
+    {
+        RowBuffer bufL, bufR;
+
+        bufL.color.resize(width * spectrum);
+        bufL.z.resize(width);
+
+        if (useRight) {
+            bufR.color.resize(width * spectrum);
+            bufR.z.resize(width);
+        }
+
+        vector<float> zOut(width);
+
+        #pragma omp for schedule(dynamic, 8)
+        for (int y = 0; y < height; y++) {
+            splatRow(*left, *dispLeft, y, -t, bufL);
+
+            if (useRight) {
+                splatRow(*right, *dispRight, y, 1.0f - t, bufR);
+            }
+
+            float wL = useRight ? 1.0f - t : 1.0f;
+            float wR = useRight ? t : 0.0f;
+
+            const float* zL = bufL.z.data();
+            const float* zR = useRight ? bufR.z.data() : bufL.z.data();
+
+            // Weight given to the left view at each pixel: blend where both
+            // views see the same surface, otherwise keep the nearer one.
+            for (int c = 0; c < spectrum; c++) {
+                const float* colL = bufL.color.data() + c * width;
+                const float* colR = useRight ? bufR.color.data() + c * width : colL;
+
+                float* dst = result.data(0, y, 0, c);
+
+                #pragma omp simd
+                for (int x = 0; x < width; x++) {
+                    bool hasL = zL[x] != NO_DEPTH;
+                    bool hasR = useRight && zR[x] != NO_DEPTH;
+
+                    float a;
+
+                    if (hasL && hasR) {
+                        if (zL[x] > zR[x] + blendThresh) {
+                            a = 1.0f;
+                        } else if (zR[x] > zL[x] + blendThresh) {
+                            a = 0.0f;
+                        } else {
+                            a = wL / (wL + wR);
+                        }
+                    } else {
+                        a = hasL ? 1.0f : 0.0f;
+                    }
+
+                    dst[x] = (hasL || hasR) ? colL[x] * a + colR[x] * (1.0f - a) : 0.0f;
+                }
+            }
+
+            #pragma omp simd
+            for (int x = 0; x < width; x++) {
+                zOut[x] = fmax(zL[x], zR[x]);
+            }
+
+            if (holeFilling && !fillRowHoles(y, zOut.data(), result)) {
+                emptyRow[y] = 1;
+            }
+        }
+    }
+
+    if (!holeFilling) {
+        return;
+    }
+
+    // Vertical pass: copy the nearest non-empty row into empty rows,
+    // first downwards and then upwards for any empty rows at the top.
+    int lastFull = -1;
+
+    for (int y = 0; y < height; y++) {
+        if (!emptyRow[y]) {
+            lastFull = y;
+        } else if (lastFull >= 0) {
+            cimg_forC(result, c) {
+                copy(result.data(0, lastFull, 0, c),
+                        result.data(0, lastFull, 0, c) + width,
+                        result.data(0, y, 0, c));
+            }
+
+            emptyRow[y] = 0;
+        }
+    }
+
+    lastFull = -1;
+
+    for (int y = height - 1; y >= 0; y--) {
+        if (!emptyRow[y]) {
+            lastFull = y;
+        } else if (lastFull >= 0) {
+            cimg_forC(result, c) {
+                copy(result.data(0, lastFull, 0, c),
+                        result.data(0, lastFull, 0, c) + width,
+                        result.data(0, y, 0, c));
+            }
+        }
+    }
+}
+
+template class DenseWarpRenderer<float>;
+template class DenseWarpRenderer<uint8_t>;
+template class DenseWarpRenderer<int16_t>;
@@ -0,0 +1,552 @@
+#include "common.h"
+
+#include "superpixel.h"
+
+#include <algorithm>
+#include <numeric>
+
+SlicSuperpixels::SlicSuperpixels(
+        int _numSuperpixels,
+        float _compactness,
+        int _iterations) :
+    numSuperpixels(_numSuperpixels),
+    compactness(_compactness),
+    iterations(_iterations),
+    step(1),
+    tileHeight(1) {
+}
+
+void SlicSuperpixels::compute(
+        const CImg<float>& lab,
+        CImg<uint16_t>& labels) {
+    assert(lab.spectrum() == 3);
+
+    labels.assign(lab.width(), lab.height(), 1, 1);
+
+    labels.fill(0);
+
+    distances.resize(lab.width() * lab.height());
+
+    initGrid(lab);
+
+    for (int iter = 0; iter < iterations; iter++) {
+        assignPixels(lab, labels);
+
+        updateCenters(lab, labels);
+    }
+
+    enforceConnectivity(labels);
+
+    // Recompute centers so that they are indexed by the final labels
+    updateCenters(lab, labels);
+}
+
+void SlicSuperpixels::computeIncremental(
+        const CImg<float>& lab,
+        CImg<uint16_t>& labels,
+        int refineIterations,
+        function<void(float, float, float&, float&)> flow) {
+    assert(lab.spectrum() == 3);
+
+    if (centerL.empty() || !labels.is_sameXY(lab)) {
+        compute(lab, labels);
+
+        return;
+    }
+
+    int width = lab.width();
+    int height = lab.height();
+
+    if (flow) {
+        for (int k = 0; k < getClusterCount(); k++) {
+            if (clusterSize[k] == 0) {
+                continue;
+            }
+
+            float dx = 0.0f;
+            float dy = 0.0f;
+
+            flow(centerX[k], centerY[k], dx, dy);
+
+            centerX[k] = fmin(fmax(centerX[k] + dx, 0.0f), width - 1);
+            centerY[k] = fmin(fmax(centerY[k] + dy, 0.0f), height - 1);
+        }
+    }
+
+    distances.resize(width * height);
+
+    // Pixels outside of every search window keep the previous frame's
+    // label, which is a better guess than any default.
+    for (int iter = 0; iter < refineIterations; iter++) {
+        assignPixels(lab, labels);
+
+        updateCenters(lab, labels);
+    }
+
+    enforceConnectivityStable(labels);
+
+    updateCenters(lab, labels);
+}
+
+void SlicSuperpixels::initGrid(
+        const CImg<float>& lab) {
+    int width = lab.width();
+    int height = lab.height();
+
+    step = (int) (sqrt((width * height) / (double) numSuperpixels) + 0.5);
+    step = max(1, step);
+
+    tileHeight = step;
+
+    centerL.clear();
+    centerA.clear();
+    centerB.clear();
+    centerX.clear();
+    centerY.clear();
+
+    for (int y = step / 2; y < height; y += step) {
+        for (int x = step / 2; x < width; x += step) {
+            int bestX = x;
+            int bestY = y;
+
+            // Move each seed to the lowest-gradient position in its 3x3
+            // neighborhood so that seeds are not placed on edges.
+            if (width > 2 && height > 2) {
+                float bestGrad = std::numeric_limits<float>::max();
+
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = min(max(x + dx, 1), width - 2);
+                        int ny = min(max(y + dy, 1), height - 2);
+
+                        float grad = 0.0f;
+
+                        cimg_forC(lab, c) {
+                            grad += sqr(lab(nx + 1, ny, 0, c) - lab(nx - 1, ny, 0, c));
+                            grad += sqr(lab(nx, ny + 1, 0, c) - lab(nx, ny - 1, 0, c));
+                        }
+
+                        if (grad < bestGrad) {
+                            bestGrad = grad;
+                            bestX = nx;
+                            bestY = ny;
+                        }
+                    }
+                }
+            }
+
+            centerL.push_back(lab(bestX, bestY, 0, 0));
+            centerA.push_back(lab(bestX, bestY, 0, 1));
+            centerB.push_back(lab(bestX, bestY, 0, 2));
+            centerX.push_back(bestX);
+            centerY.push_back(bestY);
+        }
+    }
+
+    // Labels are stored as 16-bit handles
+    assert(centerL.size() <= std::numeric_limits<uint16_t>::max());
+}
+
+void SlicSuperpixels::assignPixels(
+        const CImg<float>& lab,
+        CImg<uint16_t>& labels) {
+    int width = lab.width();
+    int height = lab.height();
+
+    const float* planeL = lab.data(0, 0, 0, 0);
+    const float* planeA = lab.data(0, 0, 0, 1);
+    const float* planeB = lab.data(0, 0, 0, 2);
+
+    uint16_t* labelData = labels.data();
+
+    float* distData = distances.data();
+
+    // Spatial distance is normalized by the seed spacing
+    float spatialWeight = sqr(compactness / step);
+
+    int numClusters = centerL.size();
+
+    // Clusters sorted by the row of their center, such that each tile
+    // only visits clusters whose search window overlaps it.
+    vector<int> byRow(numClusters);
+
+    iota(byRow.begin(), byRow.end(), 0);
+
+    std::sort(byRow.begin(), byRow.end(),
+            [&](int a, int b) {
+                return centerY[a] < centerY[b];
+            });
+
+    std::fill(distances.begin(), distances.end(),
+            std::numeric_limits<float>::max());
+
+    int numTiles = (height + tileHeight - 1) / tileHeight;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < numTiles; tile++) {
+        int tileMinY = tile * tileHeight;
+        int tileMaxY = min(height, tileMinY + tileHeight);
+
+        auto first = std::lower_bound(byRow.begin(), byRow.end(),
+                (float) (tileMinY - step - 1),
+                [&](int k, float y) {
+                    return centerY[k] < y;
+                });
+
+        for (auto it = first; it != byRow.end() &&
+                centerY[*it] <= tileMaxY + step + 1; it++) {
+            int k = *it;
+
+            int cx = (int) (centerX[k] + 0.5f);
+            int cy = (int) (centerY[k] + 0.5f);
+
+            int minY = max(tileMinY, cy - step);
+            int maxY = min(tileMaxY, cy + step + 1);
+            int minX = max(0, cx - step);
+            int maxX = min(width, cx + step + 1);
+
+            float l = centerL[k];
+            float a = centerA[k];
+            float b = centerB[k];
+            float kx = centerX[k];
+            float ky = centerY[k];
+
+            for (int y = minY; y < maxY; y++) {
+                size_t row = (size_t) y * width;
+
+                float dy2 = sqr(y - ky);
+
+                for (int x = minX; x < maxX; x++) {
+                    size_t i = row + x;
+
+                    float dc =
+                        sqr(planeL[i] - l) +
+                        sqr(planeA[i] - a) +
+                        sqr(planeB[i] - b);
+
+                    float ds = sqr(x - kx) + dy2;
+
+                    float d = dc + ds * spatialWeight;
+
+                    if (d < distData[i]) {
+                        distData[i] = d;
+                        labelData[i] = k;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SlicSuperpixels::updateCenters(
+        const CImg<float>& lab,
+        const CImg<uint16_t>& labels) {
+    int width = lab.width();
+    int height = lab.height();
+
+    const float* planeL = lab.data(0, 0, 0, 0);
+    const float* planeA = lab.data(0, 0, 0, 1);
+    const float* planeB = lab.data(0, 0, 0, 2);
+
+    const uint16_t* labelData = labels.data();
+
+    int numClusters = centerL.size();
+
+    // Per-cluster sums of L, a, b, x, y and the pixel count
+    const int numSums = 6;
+
+    vector<double> sums(numClusters * numSums, 0.0);
+
+    int numTiles = (height + tileHeight - 1) / tileHeight;
+
+#pragma omp parallel
+    {
+        vector<double> localSums(numClusters * numSums, 0.0);
+
+#pragma omp for schedule(static) nowait
+        for (int tile = 0; tile < numTiles; tile++) {
+            int tileMinY = tile * tileHeight;
+            int tileMaxY = min(height, tileMinY + tileHeight);
+
+            for (int y = tileMinY; y < tileMaxY; y++) {
+                size_t row = (size_t) y * width;
+
+                for (int x = 0; x < width; x++) {
+                    size_t i = row + x;
+
+                    double* s = &(localSums[labelData[i] * numSums]);
+
+                    s[0] += planeL[i];
+                    s[1] += planeA[i];
+                    s[2] += planeB[i];
+                    s[3] += x;
+                    s[4] += y;
+                    s[5] += 1.0;
+                }
+            }
+        }
+
+#pragma omp critical
+        {
+            for (size_t i = 0; i < sums.size(); i++) {
+                sums[i] += localSums[i];
+            }
+        }
+    }
+
+    for (int k = 0; k < numClusters; k++) {
+        const double* s = &(sums[k * numSums]);
+
+        // Empty clusters keep their previous center
+        if (s[5] > 0.0) {
+            centerL[k] = s[0] / s[5];
+            centerA[k] = s[1] / s[5];
+            centerB[k] = s[2] / s[5];
+            centerX[k] = s[3] / s[5];
+            centerY[k] = s[4] / s[5];
+        }
+    }
+}
+
+void SlicSuperpixels::labelComponents(
+        const CImg<uint16_t>& labels,
+        vector<int>& componentOf,
+        vector<Component>& components) {
+    int width = labels.width();
+    int height = labels.height();
+
+    size_t numPixels = (size_t) width * height;
+
+    const uint16_t* labelData = labels.data();
+
+    componentOf.assign(numPixels, -1);
+
+    components.clear();
+
+    // Pixel indices of the component currently being flood-filled.
+    // This doubles as the BFS queue.
+    vector<size_t> queue;
+    queue.reserve(step * step * 4);
+
+    for (size_t start = 0; start < numPixels; start++) {
+        if (componentOf[start] >= 0) {
+            continue;
+        }
+
+        int startX = start % width;
+
+        Component comp;
+
+        comp.cluster = labelData[start];
+
+        // In scanline order, the pixels to the left and above belong to
+        // components which have already been found.
+        comp.adjacent = -1;
+
+        if (startX > 0) {
+            comp.adjacent = componentOf[start - 1];
+        } else if (start >= (size_t) width) {
+            comp.adjacent = componentOf[start - width];
+        }
+
+        int compI = components.size();
+
+        queue.clear();
+        queue.push_back(start);
+
+        componentOf[start] = compI;
+
+        for (size_t head = 0; head < queue.size(); head++) {
+            size_t p = queue[head];
+
+            int px = p % width;
+            int py = p / width;
+
+            size_t neighbors[4];
+            int numNeighbors = 0;
+
+            if (px > 0) {
+                neighbors[numNeighbors++] = p - 1;
+            }
+
+            if (px < width - 1) {
+                neighbors[numNeighbors++] = p + 1;
+            }
+
+            if (py > 0) {
+                neighbors[numNeighbors++] = p - width;
+            }
+
+            if (py < height - 1) {
+                neighbors[numNeighbors++] = p + width;
+            }
+
+            for (int n = 0; n < numNeighbors; n++) {
+                size_t q = neighbors[n];
+
+                if (componentOf[q] < 0 && labelData[q] == comp.cluster) {
+                    componentOf[q] = compI;
+
+                    queue.push_back(q);
+                }
+            }
+        }
+
+        comp.size = queue.size();
+
+        components.push_back(comp);
+    }
+}
+
+void SlicSuperpixels::enforceConnectivity(
+        CImg<uint16_t>& labels) {
+    unsigned int minSize = max(1, (step * step) / 4);
+
+    vector<int> componentOf;
+    vector<Component> components;
+
+    labelComponents(labels, componentOf, components);
+
+    // Adjacent components always have a lower index, so their final
+    // label is known by the time it is needed.
+    vector<int> finalLabel(components.size());
+
+    clusterSize.clear();
+
+    for (size_t compI = 0; compI < components.size(); compI++) {
+        const Component& comp = components[compI];
+
+        if (comp.size < minSize && comp.adjacent >= 0) {
+            finalLabel[compI] = finalLabel[comp.adjacent];
+
+            clusterSize[finalLabel[compI]] += comp.size;
+        } else {
+            finalLabel[compI] = clusterSize.size();
+
+            clusterSize.push_back(comp.size);
+        }
+    }
+
+    int numLabels = clusterSize.size();
+
+    assert(numLabels <= std::numeric_limits<uint16_t>::max());
+
+    uint16_t* labelData = labels.data();
+
+    for (size_t i = 0; i < componentOf.size(); i++) {
+        labelData[i] = finalLabel[componentOf[i]];
+    }
+
+    // Centers are re-estimated by the caller for the new labels
+    centerL.resize(numLabels);
+    centerA.resize(numLabels);
+    centerB.resize(numLabels);
+    centerX.resize(numLabels);
+    centerY.resize(numLabels);
+}
+
+void SlicSuperpixels::enforceConnectivityStable(
+        CImg<uint16_t>& labels) {
+    int numClusters = centerL.size();
+
+    vector<int> componentOf;
+    vector<Component> components;
+
+    labelComponents(labels, componentOf, components);
+
+    // Each cluster keeps its handle for its largest component
+    vector<int> largest(numClusters, -1);
+
+    for (size_t compI = 0; compI < components.size(); compI++) {
+        int cluster = components[compI].cluster;
+
+        if (largest[cluster] < 0 ||
+                components[compI].size > components[largest[cluster]].size) {
+            largest[cluster] = compI;
+        }
+    }
+
+    // All other fragments are absorbed by an adjacent component.  Following
+    // the adjacent links ends either at a kept component or at component 0,
+    // the only one without an earlier neighbor.
+    vector<int> root(components.size());
+
+    for (size_t compI = 0; compI < components.size(); compI++) {
+        const Component& comp = components[compI];
+
+        if (largest[comp.cluster] == (int) compI || comp.adjacent < 0) {
+            root[compI] = compI;
+        } else {
+            root[compI] = root[comp.adjacent];
+        }
+    }
+
+    // If component 0 is itself a fragment, everything rooted at it joins
+    // a kept component found along the border of that region.  One always
+    // exists since the cluster's largest component lies outside it.
+    int width = labels.width();
+    int height = labels.height();
+
+    int orphanLabel = -1;
+
+    if (!components.empty() && largest[components[0].cluster] != 0) {
+        for (size_t p = 0; p < componentOf.size() && orphanLabel < 0; p++) {
+            if (root[componentOf[p]] != 0) {
+                continue;
+            }
+
+            int px = p % width;
+            int py = p / width;
+
+            size_t neighbors[4];
+            int numNeighbors = 0;
+
+            if (px > 0) {
+                neighbors[numNeighbors++] = p - 1;
+            }
+
+            if (px < width - 1) {
+                neighbors[numNeighbors++] = p + 1;
+            }
+
+            if (py > 0) {
+                neighbors[numNeighbors++] = p - width;
+            }
+
+            if (py < height - 1) {
+                neighbors[numNeighbors++] = p + width;
+            }
+
+            for (int n = 0; n < numNeighbors; n++) {
+                int other = root[componentOf[neighbors[n]]];
+
+                if (other != 0) {
+                    orphanLabel = components[other].cluster;
+                    break;
+                }
+            }
+        }
+
+        assert(orphanLabel >= 0);
+    }
+
+    vector<uint16_t> finalLabel(components.size());
+
+    for (size_t compI = 0; compI < components.size(); compI++) {
+        if (root[compI] == 0 && orphanLabel >= 0) {
+            finalLabel[compI] = orphanLabel;
+        } else {
+            finalLabel[compI] = components[root[compI]].cluster;
+        }
+    }
+
+    clusterSize.assign(numClusters, 0);
+
+    uint16_t* labelData = labels.data();
+
+    for (size_t i = 0; i < componentOf.size(); i++) {
+        labelData[i] = finalLabel[componentOf[i]];
+
+        clusterSize[labelData[i]]++;
+    }
+}
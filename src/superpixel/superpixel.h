@@ -0,0 +1,167 @@
+#pragma once
+
+#include "common.h"
+
+/**
+ * SLIC superpixels (Achanta et al., 2012) computed directly on a planar
+ * Lab CImg.
+ *
+ * CImg already stores each channel as a contiguous plane, so the image is
+ * read as L, a and b planes without any conversion.  Cluster centers are
+ * kept as a structure-of-arrays (L, a, b, x, y) which keeps the inner
+ * distance loop free of gathers.
+ *
+ * Both the assignment and the update steps are split over horizontal
+ * tiles, each of which is owned by a single thread, so no pixel is ever
+ * written by two threads.
+ */
+class SlicSuperpixels {
+    public:
+        /**
+         * \param numSuperpixels The desired number of superpixels.  The
+         *                       actual number may differ slightly since
+         *                       seeds are placed on a regular grid.
+         * \param compactness Relative weight of spatial distance versus
+         *                    color distance ("m" in the paper).
+         * \param iterations Number of assignment/update iterations.
+         */
+        SlicSuperpixels(
+                int numSuperpixels,
+                float compactness,
+                int iterations = 10);
+
+        /**
+         * Segments the given Lab image, writing labels into `labels`, which
+         * is resized to match the input.
+         *
+         * Upon return, labels are contiguous in [0, getClusterCount()) and
+         * every cluster contains at least one pixel.
+         */
+        void compute(
+                const CImg<float>& lab,
+                CImg<uint16_t>& labels);
+
+        /**
+         * Segments the next frame of a sequence, warm-starting from the
+         * clusters of the previous call to compute() or
+         * computeIncremental().  `labels` must still hold the previous
+         * frame's result.
+         *
+         * Cluster handles are stable across frames: a label refers to the
+         * same cluster as in the previous frame.  Clusters which vanish
+         * keep their handle but have no pixels, so labels are not
+         * necessarily contiguous.
+         *
+         * \param refineIterations Number of assignment/update iterations.
+         *                         One or two usually suffice since the
+         *                         centers start close to convergence.
+         * \param flow Optional motion from the previous frame to this one.
+         *             Given (x, y) in the previous frame, it returns
+         *             (dx, dy), which is used to advect cluster centers.
+         */
+        void computeIncremental(
+                const CImg<float>& lab,
+                CImg<uint16_t>& labels,
+                int refineIterations = 2,
+                function<void(float, float, float&, float&)> flow = nullptr);
+
+        inline int getClusterCount() const {
+            return clusterSize.size();
+        }
+
+        /**
+         * The number of pixels in each cluster after connectivity has been
+         * enforced.
+         */
+        inline unsigned int getClusterSize(
+                int cluster) const {
+            return clusterSize[cluster];
+        }
+
+        inline void getClusterCenter(
+                int cluster,
+                float& x,
+                float& y) const {
+            x = centerX[cluster];
+            y = centerY[cluster];
+        }
+
+    private:
+        /**
+         * A 4-connected region of pixels sharing a cluster label.
+         */
+        struct Component {
+            uint16_t cluster;
+
+            unsigned int size;
+
+            /**
+             * A component touching this one which was found earlier in
+             * scanline order, or -1 if there is none.
+             */
+            int adjacent;
+        };
+
+        void initGrid(
+                const CImg<float>& lab);
+
+        void assignPixels(
+                const CImg<float>& lab,
+                CImg<uint16_t>& labels);
+
+        void updateCenters(
+                const CImg<float>& lab,
+                const CImg<uint16_t>& labels);
+
+        /**
+         * Relabels connected components in a single linear-time pass.
+         * Components smaller than a quarter of the nominal superpixel area
+         * are merged into a neighboring component.
+         */
+        void enforceConnectivity(
+                CImg<uint16_t>& labels);
+
+        /**
+         * Like enforceConnectivity(), but preserves cluster handles.  The
+         * largest component of each cluster keeps its handle and all other
+         * fragments are merged into a neighboring component.
+         */
+        void enforceConnectivityStable(
+                CImg<uint16_t>& labels);
+
+        /**
+         * Finds the connected components of `labels` in a single
+         * linear-time flood-fill pass.
+         */
+        void labelComponents(
+                const CImg<uint16_t>& labels,
+                vector<int>& componentOf,
+                vector<Component>& components);
+
+        int numSuperpixels;
+
+        float compactness;
+
+        int iterations;
+
+        /**
+         * Nominal spacing between seeds ("S" in the paper).
+         */
+        int step;
+
+        /**
+         * Height of the horizontal tiles over which work is distributed.
+         */
+        int tileHeight;
+
+        vector<float> centerL, centerA, centerB;
+
+        vector<float> centerX, centerY;
+
+        vector<unsigned int> clusterSize;
+
+        /**
+         * Distance from each pixel to its currently assigned center.
+         */
+        vector<float> distances;
+};